@@ -0,0 +1,349 @@
+
+// bench.c
+// By Ben Anderson
+// December 2018
+
+// Microbenchmarks for the lexer, parser, interpreter and JIT compiler, built
+// as the `hydrogen-bench` target:
+//
+//     hydrogen-bench [--filter <substring>] [--min-time <seconds>]
+//
+// Each benchmark is repeated, doubling the number of iterations, until it's
+// run for at least `--min-time` seconds. The interpreter benchmarks are run
+// both with the JIT compiler turned off and on.
+//
+// The results are written to the standard output as JSON, in the same format
+// as Google Benchmark, so that its tools (e.g. `compare.py`) can track them
+// over time. Times are per iteration, in nanoseconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vm.h"
+#include "value.h"
+#include "lexer.h"
+#include "parser.h"
+#include "util.h"
+#include "jit/arch.h"
+#include "jit/compiler.h"
+
+#if HY_OS == HY_OS_WINDOWS
+#include <windows.h>
+#endif
+
+// The default minimum time to run each benchmark for, in seconds.
+#define DEFAULT_MIN_TIME 0.5
+
+// The number of lines in the generated source for the lexer and parser
+// benchmarks.
+#define SOURCE_LINES 20000
+
+// The number of iterations of the loops in the interpreter benchmarks.
+#define LOOP_ITERATIONS 1000000
+
+// Returns the time elapsed since some fixed point, in seconds.
+static double wall_time() {
+#if HY_OS == HY_OS_WINDOWS
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double) count.QuadPart / (double) frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+#endif
+}
+
+// Returns the CPU time used by the process so far, in seconds.
+static double cpu_time() {
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+
+// ---- Benchmarks ------------------------------------------------------------
+
+// A benchmark runs its workload `iterations` times, and returns the number of
+// items (tokens, lines, loop iterations or traces) it processed in total. It
+// can also set the number of bytes it processed.
+typedef uint64_t (*BenchFn)(int iterations, uint64_t *bytes);
+
+// Generated source code for the lexer and parser benchmarks, with a mix of
+// declarations, arithmetic, function definitions and control flow.
+static char *source = NULL;
+static size_t source_length = 0;
+
+// Generates the source code for the lexer and parser benchmarks. Functions
+// can only have so many locals, so the code keeps re-using the same few.
+static void generate_source() {
+	size_t capacity = SOURCE_LINES * 64;
+	source = malloc(capacity);
+	size_t length = 0;
+	length += (size_t) snprintf(&source[length], capacity - length,
+		"let a = 0\nlet f = 0\n");
+	for (int i = 2; i < SOURCE_LINES; i++) {
+		char *line;
+		switch (i % 5) {
+		case 0: line = "if a < %d {\n"; break;
+		case 1: line = "  let v = a * 2.5 + 3 - a / 7\n"; break;
+		case 2: line = "  a = (a + v) * 0.%d\n"; break;
+		case 3: line = "} else { f = fn(x, y) { return x + y + %d } }\n"; break;
+		default: line = "if a < %d { a = a + 1 } else { a = a - 1 }\n"; break;
+		}
+		int group = i - i % 5;
+		if (group < 2 || group + 5 > SOURCE_LINES) {
+			// Don't leave an unfinished `if` at the start or end
+			line = "a = a + %d\n";
+		}
+		length += (size_t) snprintf(&source[length], capacity - length, line,
+			i);
+	}
+	source_length = length;
+}
+
+// Lexes the generated source.
+static uint64_t bench_lex(int iterations, uint64_t *bytes) {
+	uint64_t tokens = 0;
+	for (int i = 0; i < iterations; i++) {
+		VM vm = vm_new();
+		Lexer lxr = lex_new(&vm, NULL, source);
+		do {
+			lex_next(&lxr);
+			tokens++;
+		} while (lxr.tk.type != TK_EOF);
+		vm_free(&vm);
+	}
+	*bytes = (uint64_t) iterations * source_length;
+	return tokens;
+}
+
+// Parses the generated source into a new VM.
+static uint64_t bench_parse(int iterations, uint64_t *bytes) {
+	for (int i = 0; i < iterations; i++) {
+		VM vm = vm_new();
+		int pkg = vm_new_pkg(&vm, hash_string("bench", 5));
+		Err *err = parse(&vm, pkg, NULL, source);
+		if (err != NULL) {
+			err_print(err, false);
+			exit(EXIT_FAILURE);
+		}
+		vm_free(&vm);
+	}
+	*bytes = (uint64_t) iterations * source_length;
+	return (uint64_t) iterations * SOURCE_LINES;
+}
+
+// A loop doing nothing but arithmetic.
+static char ARITH_LOOP[] =
+	"let a = 0\n"
+	"let i = 0\n"
+	"while i < 1000000 {\n"
+	"  a = a + i * 2 - 1\n"
+	"  i += 1\n"
+	"}\n";
+
+// A loop that takes a different branch every iteration.
+static char BRANCH_LOOP[] =
+	"let a = 0\n"
+	"let t = 0\n"
+	"let i = 0\n"
+	"while i < 1000000 {\n"
+	"  if t == 0 {\n"
+	"    t = 1\n"
+	"    a = a + 1\n"
+	"  } else {\n"
+	"    t = 0\n"
+	"    a = a + 2\n"
+	"  }\n"
+	"  i += 1\n"
+	"}\n";
+
+// Runs a loop on a new VM, with or without the JIT compiler.
+static uint64_t bench_loop(int iterations, char *code, bool jit) {
+	for (int i = 0; i < iterations; i++) {
+		VM vm = vm_new();
+		vm.jit = jit;
+		int pkg = vm_new_pkg(&vm, hash_string("bench", 5));
+		Err *err = vm_run_string(&vm, pkg, code);
+		if (err != NULL) {
+			err_print(err, false);
+			exit(EXIT_FAILURE);
+		}
+		vm_free(&vm);
+	}
+	return (uint64_t) iterations * LOOP_ITERATIONS;
+}
+
+static uint64_t bench_arith_interpreter(int iterations, uint64_t *bytes) {
+	return bench_loop(iterations, ARITH_LOOP, false);
+}
+
+static uint64_t bench_arith_jit(int iterations, uint64_t *bytes) {
+	return bench_loop(iterations, ARITH_LOOP, true);
+}
+
+static uint64_t bench_branch_interpreter(int iterations, uint64_t *bytes) {
+	return bench_loop(iterations, BRANCH_LOOP, false);
+}
+
+static uint64_t bench_branch_jit(int iterations, uint64_t *bytes) {
+	return bench_loop(iterations, BRANCH_LOOP, true);
+}
+
+// The number of arithmetic instructions in the trace compiled by the JIT
+// compiler benchmark.
+#define TRACE_LENGTH 64
+
+// Records, optimises and assembles a trace for a loop of arithmetic (but
+// doesn't install it, so we don't run out of executable memory).
+static uint64_t bench_compile(int iterations, uint64_t *bytes) {
+	VM vm = vm_new();
+	memset(vm.stack, 0, sizeof(Value) * vm.stack_size);
+	int k = vm_add_num(&vm, 1.5);
+	BcIns body[TRACE_LENGTH + 1];
+	for (int i = 0; i < TRACE_LENGTH; i++) {
+		uint8_t slot = (uint8_t) (i % 8);
+		switch (i % 3) {
+		case 0: body[i] = bc_new3(BC_ADD_LN, slot, slot, (uint8_t) k); break;
+		case 1: body[i] = bc_new3(BC_MUL_LL, slot + 1, slot, slot); break;
+		default: body[i] = bc_new3(BC_SUB_LL, slot, slot + 1, slot); break;
+		}
+	}
+	body[TRACE_LENGTH] = bc_new1(BC_LOOP, 0);
+
+	for (int i = 0; i < iterations; i++) {
+		Trace *trace = jit_trace_new(&vm);
+		trace->loop = &body[TRACE_LENGTH];
+		for (int j = 0; j < TRACE_LENGTH; j++) {
+			trace->pc = &body[j];
+			switch (bc_op(body[j])) {
+			case BC_ADD_LN: jit_rec_ADD_LN(trace, body[j]); break;
+			case BC_MUL_LL: jit_rec_MUL_LL(trace, body[j]); break;
+			default: jit_rec_SUB_LL(trace, body[j]); break;
+			}
+		}
+		if (!jit_rec_optimise(trace)) {
+			fprintf(stderr, "failed to compile benchmark trace\n");
+			exit(EXIT_FAILURE);
+		}
+		jit_rec_assemble(trace);
+		jit_trace_free(trace);
+	}
+	vm_free(&vm);
+	return (uint64_t) iterations;
+}
+
+// Every benchmark, along with its name.
+typedef struct {
+	char *name;
+	BenchFn fn;
+} Bench;
+
+static Bench BENCHMARKS[] = {
+	{ "lex/generated", bench_lex },
+	{ "parse/generated", bench_parse },
+	{ "vm_run/arith/interpreter", bench_arith_interpreter },
+	{ "vm_run/arith/jit", bench_arith_jit },
+	{ "vm_run/branch/interpreter", bench_branch_interpreter },
+	{ "vm_run/branch/jit", bench_branch_jit },
+	{ "jit/compile", bench_compile },
+};
+
+
+// ---- Harness ---------------------------------------------------------------
+
+// Runs a benchmark until it's taken at least `min_time` seconds, and prints
+// its results as a JSON object.
+static void run_bench(Bench *bench, double min_time, bool first) {
+	int iterations = 1;
+	double wall, cpu;
+	uint64_t items, bytes;
+	while (true) {
+		bytes = 0;
+		double wall_start = wall_time();
+		double cpu_start = cpu_time();
+		items = bench->fn(iterations, &bytes);
+		wall = wall_time() - wall_start;
+		cpu = cpu_time() - cpu_start;
+		if (wall >= min_time || iterations >= (1 << 30)) {
+			break;
+		}
+
+		// Guess how many iterations we need, without more than doubling
+		int needed = (int) (min_time / (wall > 0.0 ? wall : 1e-9) *
+			iterations * 1.2);
+		iterations = needed > iterations * 2 || needed <= iterations ?
+			iterations * 2 : needed;
+	}
+
+	printf("%s    {\n", first ? "" : ",\n");
+	printf("      \"name\": \"%s\",\n", bench->name);
+	printf("      \"run_name\": \"%s\",\n", bench->name);
+	printf("      \"run_type\": \"iteration\",\n");
+	printf("      \"iterations\": %d,\n", iterations);
+	printf("      \"real_time\": %.4f,\n", wall * 1e9 / iterations);
+	printf("      \"cpu_time\": %.4f,\n", cpu * 1e9 / iterations);
+	printf("      \"time_unit\": \"ns\",\n");
+	if (bytes > 0) {
+		printf("      \"bytes_per_second\": %.4f,\n", (double) bytes / wall);
+	}
+	printf("      \"items_per_second\": %.4f\n", (double) items / wall);
+	printf("    }");
+	fflush(stdout);
+}
+
+// Prints a usage message.
+static void print_usage() {
+	fprintf(stderr,
+		"Usage:\n"
+		"  hydrogen-bench [--filter <substring>] [--min-time <seconds>]\n"
+		"\n"
+		"Options:\n"
+		"  --filter     Only run benchmarks whose name contains a substring\n"
+		"  --min-time   Minimum time to run each benchmark for (default %g)\n",
+		DEFAULT_MIN_TIME);
+}
+
+int main(int argc, char *argv[]) {
+	char *filter = NULL;
+	double min_time = DEFAULT_MIN_TIME;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+			filter = argv[++i];
+		} else if (strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+			min_time = atof(argv[++i]);
+		} else {
+			print_usage();
+			return EXIT_FAILURE;
+		}
+	}
+	generate_source();
+
+	char date[64];
+	time_t now = time(NULL);
+	strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", localtime(&now));
+	printf("{\n");
+	printf("  \"context\": {\n");
+	printf("    \"date\": \"%s\",\n", date);
+	printf("    \"executable\": \"%s\",\n", argv[0]);
+#ifdef NDEBUG
+	printf("    \"library_build_type\": \"release\"\n");
+#else
+	printf("    \"library_build_type\": \"debug\"\n");
+#endif
+	printf("  },\n");
+	printf("  \"benchmarks\": [\n");
+	bool first = true;
+	for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+		if (filter == NULL || strstr(BENCHMARKS[i].name, filter) != NULL) {
+			run_bench(&BENCHMARKS[i], min_time, first);
+			first = false;
+		}
+	}
+	printf("\n  ]\n");
+	printf("}\n");
+	free(source);
+	return EXIT_SUCCESS;
+}
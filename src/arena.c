@@ -0,0 +1,113 @@
+
+// arena.c
+// By Ben Anderson
+// December 2018
+
+#include "arena.h"
+
+#include <string.h>
+#include <stdint.h>
+
+// The size of a block's header, padded so its contents are aligned.
+#define ARENA_HEADER \
+	((sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1))
+
+// Rounds a size up to the allocation alignment.
+static inline size_t arena_round(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+// Returns a pointer to the contents of a block.
+static inline uint8_t * arena_data(ArenaBlock *block) {
+	return (uint8_t *) block + ARENA_HEADER;
+}
+
+// Creates a new, empty arena. No memory is allocated until it's used.
+Arena arena_new() {
+	Arena arena;
+	arena.first = NULL;
+	arena.current = NULL;
+	arena.used = 0;
+	arena.last = NULL;
+	return arena;
+}
+
+// Frees every block in an arena, invalidating all of its allocations.
+void arena_free(Arena *arena) {
+	ArenaBlock *block = arena->first;
+	while (block != NULL) {
+		ArenaBlock *next = block->next;
+		free(block);
+		block = next;
+	}
+	*arena = arena_new();
+}
+
+// Invalidates all allocations in an arena, but keeps its blocks so they can be
+// re-used.
+void arena_reset(Arena *arena) {
+	arena->current = arena->first;
+	arena->used = 0;
+	arena->last = NULL;
+}
+
+// Allocates memory from an arena.
+void * arena_alloc(Arena *arena, size_t size) {
+	size = arena_round(size);
+
+	// Move on to the next block until we find one with enough room, adding
+	// a new block to the end of the list if we run out
+	while (arena->current == NULL || arena->used + size > arena->current->size) {
+		if (arena->current != NULL && arena->current->next != NULL) {
+			arena->current = arena->current->next;
+		} else {
+			size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+			ArenaBlock *block = malloc(ARENA_HEADER + block_size);
+			block->next = NULL;
+			block->size = block_size;
+			if (arena->current == NULL) {
+				arena->first = block;
+			} else {
+				arena->current->next = block;
+			}
+			arena->current = block;
+		}
+		arena->used = 0;
+	}
+
+	void *ptr = arena_data(arena->current) + arena->used;
+	arena->used += size;
+	arena->last = ptr;
+	return ptr;
+}
+
+// Allocates zeroed memory for an array from an arena.
+void * arena_calloc(Arena *arena, size_t count, size_t size) {
+	void *ptr = arena_alloc(arena, count * size);
+	memset(ptr, 0, count * size);
+	return ptr;
+}
+
+// Resizes an allocation from an arena, which might move it. The most recent
+// allocation is grown in place if there's room; anything else is copied, and
+// the old memory isn't reclaimed until the arena is reset.
+void * arena_realloc(Arena *arena, void *ptr, size_t old_size,
+		size_t new_size) {
+	if (ptr == NULL) {
+		return arena_alloc(arena, new_size);
+	}
+
+	// Grow the most recent allocation in place
+	if (ptr == arena->last) {
+		size_t offset = (size_t) ((uint8_t *) ptr -
+			arena_data(arena->current));
+		if (offset + arena_round(new_size) <= arena->current->size) {
+			arena->used = offset + arena_round(new_size);
+			return ptr;
+		}
+	}
+
+	void *copy = arena_alloc(arena, new_size);
+	memcpy(copy, ptr, old_size < new_size ? old_size : new_size);
+	return copy;
+}
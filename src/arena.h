@@ -0,0 +1,68 @@
+
+// arena.h
+// By Ben Anderson
+// December 2018
+
+// An arena is a bump allocator for memory that all dies at the same time. The
+// parser and the JIT compiler each have their own arena on the VM, which is
+// reset after every call to `parse` and every trace compiled, respectively.
+//
+// Allocations are carved out of a list of large blocks. Resetting an arena
+// keeps its blocks around, so once it's warmed up, parsing some code or
+// compiling a trace doesn't touch the general purpose heap at all. Freeing an
+// arena frees every block at once.
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stdlib.h>
+
+// The default size of each block in an arena, in bytes. Larger allocations
+// get a block to themselves.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Every allocation in an arena is aligned to this many bytes.
+#define ARENA_ALIGN 16
+
+// A block of memory in an arena, followed directly by its contents.
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size;
+} ArenaBlock;
+
+// A bump allocator.
+typedef struct {
+	// Linked list of every block in the arena, and the block we're currently
+	// allocating from. Blocks after the current one are empty.
+	ArenaBlock *first, *current;
+
+	// The number of bytes used in the current block.
+	size_t used;
+
+	// The most recent allocation, which can be grown in place.
+	void *last;
+} Arena;
+
+// Creates a new, empty arena. No memory is allocated until it's used.
+Arena arena_new();
+
+// Frees every block in an arena, invalidating all of its allocations.
+void arena_free(Arena *arena);
+
+// Invalidates all allocations in an arena, but keeps its blocks so they can be
+// re-used.
+void arena_reset(Arena *arena);
+
+// Allocates memory from an arena.
+void * arena_alloc(Arena *arena, size_t size);
+
+// Allocates zeroed memory for an array from an arena.
+void * arena_calloc(Arena *arena, size_t count, size_t size);
+
+// Resizes an allocation from an arena, which might move it. The most recent
+// allocation is grown in place if there's room; anything else is copied, and
+// the old memory isn't reclaimed until the arena is reset.
+void * arena_realloc(Arena *arena, void *ptr, size_t old_size,
+	size_t new_size);
+
+#endif
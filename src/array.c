@@ -0,0 +1,188 @@
+
+// array.c
+// By Ben Anderson
+// December 2018
+
+#include "array.h"
+#include "gc.h"
+#include "jit/arch.h"
+
+// Allocates a new array with `length` elements, which the caller has to fill
+// in. `top` is the end of the current function's stack frame, since creating
+// the array might run the garbage collector. Returns NULL if we run out of
+// memory.
+Array * array_new(VM *vm, uint64_t length, Value *top) {
+	size_t size = sizeof(Array) + sizeof(double) * (size_t) length;
+	Array *array = (Array *) gc_alloc(vm, size, top);
+	if (array == NULL) {
+		return NULL;
+	}
+	array->shape = SHAPE_ARRAY;
+	array->length = length;
+	return array;
+}
+
+// Returns the error for indexing an array with a value that isn't a valid
+// index into it.
+Err * array_index_err(Value index) {
+	if (!val_is_num(index)) {
+		return err_new("invalid array index");
+	}
+	double num = v2n(index);
+	if (num >= 0.0 && num == (double) (uint64_t) num) {
+		return err_new("array index out of bounds");
+	}
+	return err_new("invalid array index");
+}
+
+
+// ---- Vectorised Kernels ----------------------------------------------------
+
+// Each kernel works through its arrays a whole vector of elements at a time,
+// and then finishes off the few elements left over at the end one at a time.
+// Arrays are only 8 byte aligned, so every load and store is unaligned. The
+// scalar versions below are used when there are no vector instructions, which
+// still lets the compiler vectorise the loops itself if it can.
+
+#if HY_ARCH_FP == HY_AVX
+#include <immintrin.h>
+
+#define VEC_WIDTH 4
+
+typedef __m256d Vec;
+#define vec_load(ptr)     _mm256_loadu_pd(ptr)
+#define vec_store(ptr, v) _mm256_storeu_pd((ptr), (v))
+#define vec_set(num)      _mm256_set1_pd(num)
+#define vec_zero()        _mm256_setzero_pd()
+#define vec_add(a, b)     _mm256_add_pd((a), (b))
+#define vec_mul(a, b)     _mm256_mul_pd((a), (b))
+
+// Adds up the lanes of a vector.
+static inline double vec_total(Vec v) {
+	__m128d half = _mm_add_pd(_mm256_castpd256_pd128(v),
+		_mm256_extractf128_pd(v, 1));
+	return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+#elif HY_ARCH_FP == HY_SSE2
+#include <emmintrin.h>
+
+#define VEC_WIDTH 2
+
+typedef __m128d Vec;
+#define vec_load(ptr)     _mm_loadu_pd(ptr)
+#define vec_store(ptr, v) _mm_storeu_pd((ptr), (v))
+#define vec_set(num)      _mm_set1_pd(num)
+#define vec_zero()        _mm_setzero_pd()
+#define vec_add(a, b)     _mm_add_pd((a), (b))
+#define vec_mul(a, b)     _mm_mul_pd((a), (b))
+
+// Adds up the lanes of a vector.
+static inline double vec_total(Vec v) {
+	return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+}
+
+#else
+
+#define VEC_WIDTH 1
+
+typedef double Vec;
+#define vec_load(ptr)     (*(ptr))
+#define vec_store(ptr, v) (*(ptr) = (v))
+#define vec_set(num)      (num)
+#define vec_zero()        0.0
+#define vec_add(a, b)     ((a) + (b))
+#define vec_mul(a, b)     ((a) * (b))
+#define vec_total(v)      (v)
+
+#endif
+
+// Sums use this many accumulators, so each addition doesn't have to wait for
+// the one before it to finish.
+#define VEC_ACCS 4
+
+// Sets each element of `dest` to the sum of the corresponding elements of `a`
+// and `b`. Any of the three can be the same array.
+void array_add(double *dest, double *a, double *b, uint64_t length) {
+	uint64_t i = 0;
+	for (; i + VEC_WIDTH <= length; i += VEC_WIDTH) {
+		vec_store(&dest[i], vec_add(vec_load(&a[i]), vec_load(&b[i])));
+	}
+	for (; i < length; i++) {
+		dest[i] = a[i] + b[i];
+	}
+}
+
+// Sets each element of `dest` to the product of the corresponding elements of
+// `a` and `b`. Any of the three can be the same array.
+void array_mul(double *dest, double *a, double *b, uint64_t length) {
+	uint64_t i = 0;
+	for (; i + VEC_WIDTH <= length; i += VEC_WIDTH) {
+		vec_store(&dest[i], vec_mul(vec_load(&a[i]), vec_load(&b[i])));
+	}
+	for (; i < length; i++) {
+		dest[i] = a[i] * b[i];
+	}
+}
+
+// Sets each element of `dest` to the corresponding element of `a` multiplied
+// by `k`.
+void array_scale(double *dest, double *a, double k, uint64_t length) {
+	Vec factor = vec_set(k);
+	uint64_t i = 0;
+	for (; i + VEC_WIDTH <= length; i += VEC_WIDTH) {
+		vec_store(&dest[i], vec_mul(vec_load(&a[i]), factor));
+	}
+	for (; i < length; i++) {
+		dest[i] = a[i] * k;
+	}
+}
+
+// Returns the sum of the elements of `a`.
+double array_sum(double *a, uint64_t length) {
+	Vec acc[VEC_ACCS];
+	for (int j = 0; j < VEC_ACCS; j++) {
+		acc[j] = vec_zero();
+	}
+	uint64_t i = 0;
+	for (; i + VEC_ACCS * VEC_WIDTH <= length; i += VEC_ACCS * VEC_WIDTH) {
+		for (int j = 0; j < VEC_ACCS; j++) {
+			acc[j] = vec_add(acc[j], vec_load(&a[i + j * VEC_WIDTH]));
+		}
+	}
+	Vec total = vec_add(vec_add(acc[0], acc[1]), vec_add(acc[2], acc[3]));
+	for (; i + VEC_WIDTH <= length; i += VEC_WIDTH) {
+		total = vec_add(total, vec_load(&a[i]));
+	}
+	double result = vec_total(total);
+	for (; i < length; i++) {
+		result += a[i];
+	}
+	return result;
+}
+
+// Returns the sum of the products of the corresponding elements of `a` and
+// `b`.
+double array_dot(double *a, double *b, uint64_t length) {
+	Vec acc[VEC_ACCS];
+	for (int j = 0; j < VEC_ACCS; j++) {
+		acc[j] = vec_zero();
+	}
+	uint64_t i = 0;
+	for (; i + VEC_ACCS * VEC_WIDTH <= length; i += VEC_ACCS * VEC_WIDTH) {
+		for (int j = 0; j < VEC_ACCS; j++) {
+			uint64_t at = i + j * VEC_WIDTH;
+			acc[j] = vec_add(acc[j], vec_mul(vec_load(&a[at]),
+				vec_load(&b[at])));
+		}
+	}
+	Vec total = vec_add(vec_add(acc[0], acc[1]), vec_add(acc[2], acc[3]));
+	for (; i + VEC_WIDTH <= length; i += VEC_WIDTH) {
+		total = vec_add(total, vec_mul(vec_load(&a[i]), vec_load(&b[i])));
+	}
+	double result = vec_total(total);
+	for (; i < length; i++) {
+		result += a[i] * b[i];
+	}
+	return result;
+}
@@ -0,0 +1,83 @@
+
+// array.h
+// By Ben Anderson
+// December 2018
+
+// Arrays are fixed length lists of numbers, created and operated on by the
+// built-in native functions (see `native.h`):
+//
+//   let a = array(1000)
+//   a[0] = 3.5
+//   let b = scale(add(a, a), 0.5)
+//   let total = sum(b)
+//
+// Elements are stored unboxed, one double after the other, so an array never
+// points to anything else on the heap, and each element is just a load at an
+// offset computed from the index. The bulk operations (`add`, `mul`, `scale`,
+// `sum` and `dot`) each run over the whole array in a single vectorised loop,
+// rather than dispatching one bytecode instruction per element.
+//
+// Sums are calculated across several vectors in parallel, which means they're
+// added up in a different order to a left to right loop, so the result can
+// differ from one in its last few bits.
+
+#ifndef ARRAY_H
+#define ARRAY_H
+
+#include "vm.h"
+#include "object.h"
+
+// The most elements an array can have.
+#define ARRAY_MAX_LENGTH UINT32_MAX
+
+// An array of numbers.
+typedef struct {
+	OBJ_HEADER
+
+	// The number of elements in the array. This is a full 64 bit integer so
+	// that compiled traces can compare an index against it directly.
+	uint64_t length;
+
+	// The array's elements.
+	double elements[];
+} Array;
+
+// Allocates a new array with `length` elements, which the caller has to fill
+// in. `top` is the end of the current function's stack frame, since creating
+// the array might run the garbage collector. Returns NULL if we run out of
+// memory.
+Array * array_new(VM *vm, uint64_t length, Value *top);
+
+// Returns true if a value is a valid index into an array (an integer at least
+// 0 and less than the array's length).
+static inline bool array_in_bounds(Array *array, Value index) {
+	if (!val_is_num(index)) {
+		return false;
+	}
+	// Compare as a double first, so NaN and huge values never get converted
+	double num = v2n(index);
+	return num >= 0.0 && num < (double) array->length &&
+		num == (double) (uint64_t) num;
+}
+
+// Returns the error for indexing an array with a value that isn't a valid
+// index into it.
+Err * array_index_err(Value index);
+
+// Sets each element of `dest` to the sum (or product) of the corresponding
+// elements of `a` and `b`. Any of the three can be the same array.
+void array_add(double *dest, double *a, double *b, uint64_t length);
+void array_mul(double *dest, double *a, double *b, uint64_t length);
+
+// Sets each element of `dest` to the corresponding element of `a` multiplied
+// by `k`.
+void array_scale(double *dest, double *a, double k, uint64_t length);
+
+// Returns the sum of the elements of `a`.
+double array_sum(double *a, uint64_t length);
+
+// Returns the sum of the products of the corresponding elements of `a` and
+// `b`.
+double array_dot(double *a, double *b, uint64_t length);
+
+#endif
@@ -19,6 +19,11 @@
 //   `src/vm/vm.asm` for more information about the bias
 // * Jmp has its jump offset relative to the instruction AFTER the Jmp
 //   instruction, due to a quirk in instruction parsing in the interpreter
+// * Call takes the slot holding the function, the slot of the first argument,
+//   and the number of arguments. The callee's stack frame starts at the first
+//   argument's slot, and the return value is left in that slot
+// * Call native is the same, except it takes the index of a native function
+//   (see `native.h`) instead of a slot
 //
 // Because bytecode instructions have to fit stack slot indices into 8 bits,
 // we're limited to 256 (2^8) available stack slots within each function scope.
@@ -35,12 +40,14 @@
 // * N = number
 // * P = primitive (false, true, nil)
 // * F = function
+// * S = string
 typedef enum {
 	// Stores
 	BC_MOV,
 	BC_SET_N,
 	BC_SET_P,
 	BC_SET_F,
+	BC_SET_S,
 
 	// Arithmetic operators
 	BC_ADD_LL,
@@ -55,6 +62,9 @@ typedef enum {
 	BC_DIV_NL,
 	BC_NEG,
 
+	// Strings
+	BC_CONCAT, // Args: destination slot, left operand slot, right operand slot
+
 	// Relational operators
 	BC_EQ_LL,  // Equality
 	BC_EQ_LN,
@@ -71,30 +81,87 @@ typedef enum {
 	BC_GE_LL,  // Greater than or equal to
 	BC_GE_LN,
 
+	// Structs
+	BC_NEW,       // Args: destination slot, shape (16 bit); the fields'
+	              // values are taken from the slots after the destination
+	BC_GET_FIELD, // Args: destination slot, object slot, inline cache
+	BC_SET_FIELD, // Args: object slot, value slot, inline cache
+
+	// Arrays
+	BC_GET_INDEX, // Args: destination slot, array slot, index slot
+	BC_SET_INDEX, // Args: array slot, index slot, value slot
+
 	// Control flow
 	BC_JMP,
-	BC_LOOP, // Identical to the JMP instruction, but does hot loop detection
-	         // for the JIT compiler
-	BC_CALL, // Args: function slot, first argument slot, argument count
-	BC_RET,
+	BC_LOOP,        // Identical to the JMP instruction, but does hot loop
+	                // detection for the JIT compiler
+	BC_CALL,        // Args: function slot, first argument slot, argument count
+	BC_CALL_NATIVE, // Args: native function (index into NATIVES), first
+	                // argument slot, argument count
+	BC_RET,         // Args: return value slot, 1 if there's a return value
+	                // (else nil)
+
+	// Superinstructions, created by `fn_fuse` after parsing. Each one replaces
+	// the opcode of the first instruction in a pair, and leaves the second
+	// instruction where it is (so jump offsets and jump targets stay valid).
+	// The interpreter executes both instructions with a single dispatch.
+	//
+	// A relational operator fused with its following JMP, in the same order as
+	// the relational operators above
+	BC_EQ_LL_JMP,
+	BC_EQ_LN_JMP,
+	BC_EQ_LP_JMP,
+	BC_NEQ_LL_JMP,
+	BC_NEQ_LN_JMP,
+	BC_NEQ_LP_JMP,
+	BC_LT_LL_JMP,
+	BC_LT_LN_JMP,
+	BC_LE_LL_JMP,
+	BC_LE_LN_JMP,
+	BC_GT_LL_JMP,
+	BC_GT_LN_JMP,
+	BC_GE_LL_JMP,
+	BC_GE_LN_JMP,
+
+	// An ADD_LN fused with the following LOOP, which is what the increment at
+	// the end of most loops compiles to
+	BC_ADD_LN_LOOP,
 } BcOp;
 
+// The number of opcodes.
+#define BC_OPS_COUNT (BC_ADD_LN_LOOP + 1)
+
 // String representation of each opcode.
 static char * BCOP_NAMES[] = {
 	// Stores
-	"MOV", "SETN", "SETP", "SETF",
+	"MOV", "SETN", "SETP", "SETF", "SETS",
 
 	// Arithmetic operators
 	"ADDLL", "ADDLN", "SUBLL", "SUBLN", "SUBNL",
 	"MULLL", "MULLN", "DIVLL", "DIVLN", "DIVNL", "NEG",
 
+	// Strings
+	"CONCAT",
+
 	// Relational operators
 	"EQLL", "EQLN", "EQLP", "NEQLL", "NEQLN", "NEQLP",
 	"LTLL", "LTLN", "LELL", "LELN", "GTLL", "GTLN",
 	"GELL", "GELN",
 
+	// Structs
+	"NEW", "GETFIELD", "SETFIELD",
+
+	// Arrays
+	"GETINDEX", "SETINDEX",
+
 	// Control flow
-	"JMP", "LOOP", "CALL", "RET",
+	"JMP", "LOOP", "CALL", "CALLNATIVE", "RET",
+
+	// Superinstructions
+	"EQLLJMP", "EQLNJMP", "EQLPJMP", "NEQLLJMP", "NEQLNJMP", "NEQLPJMP",
+	"LTLLJMP", "LTLNJMP", "LELLJMP", "LELNJMP", "GTLLJMP", "GTLNJMP",
+	"GELLJMP", "GELNJMP",
+	"ADDLNLOOP",
 };
 
 // A bytecode instruction is a 32 bit integer, containing 4 8-bit parts. The
@@ -0,0 +1,340 @@
+
+// gc.c
+// By Ben Anderson
+// December 2018
+
+#include "gc.h"
+#include "str.h"
+
+#include <string.h>
+
+// Creates a new, empty heap.
+Heap * gc_new() {
+	Heap *heap = malloc(sizeof(Heap));
+	memset(heap, 0, sizeof(Heap));
+	heap->nursery = malloc(GC_NURSERY_SIZE);
+	heap->nursery_top = heap->nursery;
+	heap->threshold = GC_MIN_THRESHOLD;
+	heap->phase = GC_IDLE;
+	return heap;
+}
+
+// Frees a heap and every object on it.
+void gc_free(Heap *heap) {
+	if (heap == NULL) {
+		return;
+	}
+	Object *obj = heap->old;
+	while (obj != NULL) {
+		Object *next = obj->next;
+		free(obj);
+		obj = next;
+	}
+	free(heap->nursery);
+	free(heap->strs.buckets);
+	free(heap->remembered.objs);
+	free(heap->promoted.objs);
+	free(heap->gray.objs);
+	free(heap);
+}
+
+// Adds an object to a list.
+static void list_push(ObjList *list, Object *obj) {
+	if (list->count >= list->capacity) {
+		list->capacity = list->capacity == 0 ? 64 : list->capacity * 2;
+		list->objs = realloc(list->objs, sizeof(Object *) * list->capacity);
+	}
+	list->objs[list->count++] = obj;
+}
+
+// Adds an object that's just been allocated (or promoted) to the old
+// generation. It's marked straight away, since it's reachable; if we're in
+// the middle of marking, it might point to objects that haven't been marked
+// yet, so it's put on the gray list to be scanned.
+static void gc_add_old(Heap *heap, Object *obj, size_t size) {
+	obj->gc = GC_OLD | GC_BARRIER;
+	obj->mark = heap->mark;
+	obj->next = heap->old;
+	heap->old = obj;
+	heap->old_bytes += size;
+	if (heap->phase == GC_MARK) {
+		list_push(&heap->gray, obj);
+	}
+}
+
+// Adds an old object to the remembered set. Called by `gc_barrier`.
+void gc_remember(Heap *heap, Object *obj) {
+	obj->gc &= ~GC_BARRIER;
+	list_push(&heap->remembered, obj);
+}
+
+
+// ---- Minor Collections -----------------------------------------------------
+
+// Copies an object in the nursery into the old generation, if it hasn't been
+// already, returning the value pointing to its new location. The new copy's
+// fields still point into the nursery until it's taken off the promoted list.
+static Value gc_evacuate(VM *vm, Value val) {
+	if (!val_is_obj(val)) {
+		return val;
+	}
+	Object *obj = v2ptr(val);
+	if (obj->gc & GC_OLD) {
+		return val;
+	}
+	if (obj->gc & GC_FORWARDED) {
+		return ptr2v(obj->next);
+	}
+
+	Heap *heap = vm->heap;
+	size_t size = obj_size(vm->prog, obj);
+	Object *copy = malloc(size);
+	memcpy(copy, obj, size);
+	gc_add_old(heap, copy, size);
+	list_push(&heap->promoted, copy);
+	obj->gc |= GC_FORWARDED;
+	obj->next = copy;
+	return ptr2v(copy);
+}
+
+// Evacuates every object pointed to by an object's fields.
+static void gc_evacuate_fields(VM *vm, Object *obj) {
+	int count = obj_refs(vm->prog, obj);
+	for (int i = 0; i < count; i++) {
+		obj->fields[i] = gc_evacuate(vm, obj->fields[i]);
+	}
+}
+
+// Copies everything that's still alive in the nursery into the old
+// generation, and empties it. Returns the number of bytes promoted.
+static size_t gc_minor(VM *vm, Value *top) {
+	Heap *heap = vm->heap;
+	size_t old_bytes = heap->old_bytes;
+
+	// Anything above the current stack frame is dead, and might point to a
+	// nursery object that's about to disappear
+	Value *end = vm->stack + vm->stack_size;
+	for (Value *slot = top; slot < end; slot++) {
+		*slot = VAL_NIL;
+	}
+
+	// The roots are the stack and the remembered set. The remembered objects
+	// go back to needing the barrier, and if we're marking, have to be
+	// scanned again, since they might now point to unmarked objects
+	for (Value *slot = vm->stack; slot < top; slot++) {
+		*slot = gc_evacuate(vm, *slot);
+	}
+	for (int i = 0; i < heap->remembered.count; i++) {
+		Object *obj = heap->remembered.objs[i];
+		obj->gc |= GC_BARRIER;
+		gc_evacuate_fields(vm, obj);
+		if (heap->phase == GC_MARK) {
+			list_push(&heap->gray, obj);
+		}
+	}
+	heap->remembered.count = 0;
+
+	// Follow pointers from the promoted objects until there's nothing left in
+	// the nursery that's reachable
+	while (heap->promoted.count > 0) {
+		Object *obj = heap->promoted.objs[--heap->promoted.count];
+		gc_evacuate_fields(vm, obj);
+	}
+
+	heap->nursery_top = heap->nursery;
+	heap->old_allocated = 0;
+	heap->minor_count++;
+	return heap->old_bytes - old_bytes;
+}
+
+
+// ---- Major Collections -----------------------------------------------------
+
+// Marks an object in the old generation, if it isn't already. String
+// constants are shared with other VMs, so we never touch them.
+static void gc_mark(Heap *heap, Value val) {
+	if (!val_is_obj(val)) {
+		return;
+	}
+	Object *obj = v2ptr(val);
+	if (!(obj->gc & GC_STATIC) && obj->mark != heap->mark) {
+		obj->mark = heap->mark;
+		list_push(&heap->gray, obj);
+	}
+}
+
+// Marks everything on the stack. The nursery's always empty when we mark, so
+// everything on the stack is in the old generation.
+static void gc_mark_stack(VM *vm, Value *top) {
+	for (Value *slot = vm->stack; slot < top; slot++) {
+		gc_mark(vm->heap, *slot);
+	}
+}
+
+// Starts a major collection. Flipping the mark unmarks every object at once.
+static void gc_start_major(VM *vm, Value *top) {
+	Heap *heap = vm->heap;
+	heap->mark ^= 1;
+	heap->phase = GC_MARK;
+	gc_mark_stack(vm, top);
+}
+
+// Scans gray objects until at least `budget` bytes have been scanned, or
+// there's nothing left to scan. Returns the number of bytes left in the
+// budget.
+static size_t gc_mark_step(VM *vm, size_t budget) {
+	Heap *heap = vm->heap;
+	while (heap->gray.count > 0 && budget > 0) {
+		Object *obj = heap->gray.objs[--heap->gray.count];
+		int count = obj_refs(vm->prog, obj);
+		for (int i = 0; i < count; i++) {
+			gc_mark(heap, obj->fields[i]);
+		}
+		size_t size = obj_size(vm->prog, obj);
+		budget = budget > size ? budget - size : 0;
+	}
+	return budget;
+}
+
+// Frees unmarked objects until at least `budget` bytes have been swept, or
+// we reach the end of the old generation. Objects added to the old
+// generation while sweeping are added to the start of the list (behind us),
+// and are marked anyway. Interned strings are removed from the intern table
+// as they're freed. Returns true if we reached the end.
+static bool gc_sweep_step(VM *vm, size_t budget) {
+	Heap *heap = vm->heap;
+	while (*heap->sweep != NULL && budget > 0) {
+		Object *obj = *heap->sweep;
+		size_t size = obj_size(vm->prog, obj);
+		if (obj->mark != heap->mark) {
+			if (obj->shape == SHAPE_STR && ((String *) obj)->interned) {
+				str_table_remove(&heap->strs, (String *) obj);
+			}
+			*heap->sweep = obj->next;
+			heap->old_bytes -= size;
+			free(obj);
+		} else {
+			heap->sweep = &obj->next;
+		}
+		budget = budget > size ? budget - size : 0;
+	}
+	return *heap->sweep == NULL;
+}
+
+// Does `budget` bytes worth of work on the current major collection.
+static void gc_major_step(VM *vm, Value *top, size_t budget) {
+	Heap *heap = vm->heap;
+	if (heap->phase == GC_MARK) {
+		budget = gc_mark_step(vm, budget);
+		if (heap->gray.count > 0) {
+			return;
+		}
+
+		// The stack has changed since we started marking, so mark it again
+		// before we finish (only in one go; this is the only part of a major
+		// collection that isn't incremental)
+		gc_mark_stack(vm, top);
+		gc_mark_step(vm, SIZE_MAX);
+		heap->phase = GC_SWEEP;
+		heap->sweep = &heap->old;
+	}
+
+	if (heap->phase == GC_SWEEP && gc_sweep_step(vm, budget)) {
+		heap->phase = GC_IDLE;
+		heap->threshold = heap->old_bytes * 2;
+		if (heap->threshold < GC_MIN_THRESHOLD) {
+			heap->threshold = GC_MIN_THRESHOLD;
+		}
+		heap->major_count++;
+	}
+}
+
+// Runs a minor collection, and a step of the current major collection (or
+// starts one, if the old generation is big enough).
+void gc_collect(VM *vm, Value *top) {
+	// Objects allocated straight into the old generation count as promoted,
+	// so the major collection keeps up with them too
+	Heap *heap = vm->heap;
+	size_t allocated = heap->old_allocated;
+	size_t promoted = gc_minor(vm, top) + allocated;
+	if (heap->phase == GC_IDLE) {
+		if (heap->old_bytes < heap->threshold) {
+			return;
+		}
+		gc_start_major(vm, top);
+	}
+	gc_major_step(vm, top, GC_STEP_MIN + promoted * GC_STEP_MUL);
+}
+
+// Runs a minor collection, and then the whole of a major collection, freeing
+// everything that's unreachable.
+void gc_full(VM *vm, Value *top) {
+	// Finish any major collection that's already started first, since it
+	// might have marked objects that have died since
+	Heap *heap = vm->heap;
+	gc_minor(vm, top);
+	while (heap->phase != GC_IDLE) {
+		gc_major_step(vm, top, SIZE_MAX);
+	}
+	gc_start_major(vm, top);
+	while (heap->phase != GC_IDLE) {
+		gc_major_step(vm, top, SIZE_MAX);
+	}
+}
+
+// Allocates `size` bytes for a new object, which the caller has to fill in.
+// `top` is the end of the current function's stack frame. This might run a
+// minor collection first, which moves objects in the nursery and updates the
+// stack to point to their new locations. Returns NULL if a large object
+// can't be allocated.
+Object * gc_alloc(VM *vm, size_t size, Value *top) {
+	// Large objects go straight into the old generation. The caller's about
+	// to fill in its fields without the write barrier, so we remember it
+	// now in case any of them point into the nursery. They count towards
+	// filling up the nursery, so that a program that only ever creates large
+	// objects (e.g. arrays) still runs collections
+	Heap *heap = vm->heap;
+	if (size > GC_LARGE_SIZE) {
+		gc_reserve(vm, 0, top);
+		Object *obj = malloc(size);
+		if (obj == NULL) {
+			return NULL;
+		}
+		gc_add_old(heap, obj, size);
+		gc_remember(heap, obj);
+		heap->old_allocated += size;
+		return obj;
+	}
+
+	// Keep every object in the nursery 8 byte aligned
+	size = (size + 7) & ~((size_t) 7);
+	gc_reserve(vm, size, top);
+	Object *obj = (Object *) heap->nursery_top;
+	heap->nursery_top += size;
+	obj->gc = 0;
+	return obj;
+}
+
+// Allocates `size` bytes for a new object straight into the old generation,
+// which the caller has to fill in. Never runs a collection, so it's only used
+// for objects that don't point to anything (i.e. flat strings).
+Object * gc_alloc_old(VM *vm, size_t size) {
+	Heap *heap = vm->heap;
+	Object *obj = malloc(size);
+	gc_add_old(heap, obj, size);
+	heap->old_allocated += size;
+	return obj;
+}
+
+// Runs a minor collection now if the nursery doesn't have room for another
+// `size` bytes, so that allocating them afterwards doesn't. `top` is the same
+// as for `gc_alloc`.
+void gc_reserve(VM *vm, size_t size, Value *top) {
+	Heap *heap = vm->heap;
+	size = (size + 7) & ~((size_t) 7);
+	size_t used = (size_t) (heap->nursery_top - heap->nursery) +
+		heap->old_allocated;
+	if (used + size > GC_NURSERY_SIZE) {
+		gc_collect(vm, top);
+	}
+}
@@ -0,0 +1,182 @@
+
+// gc.h
+// By Ben Anderson
+// December 2018
+
+// Every VM has its own garbage collected heap, which objects are allocated on.
+// The heap is split into two generations:
+//
+// * New objects are allocated in the nursery, a fixed size block of memory,
+//   just by bumping a pointer. Most objects die young, so when the nursery
+//   fills up, we copy the few that are still alive into the old generation
+//   (a "minor" collection) and start again from the bottom of the nursery.
+//   A minor collection only does work for the objects that survive it, and
+//   the nursery is small, so the pause is short.
+//
+// * Objects in the old generation are allocated individually and kept in a
+//   linked list. They're collected by an incremental mark and sweep (a
+//   "major" collection), which starts when the old generation has grown to
+//   twice the size it was after the last one. Rather than stopping the program
+//   until it's done, each minor collection does a bounded step of marking or
+//   sweeping, in proportion to the amount of memory it promoted.
+//
+// The roots are the VM's stack, up to the end of the current function's stack
+// frame. Values are NaN-boxed, so we know exactly which slots hold pointers.
+// Slots above the end of the frame are cleared when we collect, so a slot's
+// stale pointer can never outlive its object. Compiled traces never allocate,
+// so we never collect while one is running; the values held in a trace's
+// registers for its snapshots are always written back to the stack before the
+// interpreter carries on, which is where they're found.
+//
+// Flat strings are the exception (see `str.h`): they're allocated straight
+// into the old generation, so they never move. They still count towards
+// filling up the nursery, so that a program that creates lots of strings
+// still runs collections. String constants aren't on any heap at all. Large
+// objects (e.g. big arrays) are allocated straight into the old generation
+// too, and count towards filling up the nursery in the same way.
+//
+// Both generations need to know when a pointer is stored into an old object:
+// a minor collection has to find old objects that point into the nursery, and
+// marking has to revisit objects it's already scanned. Old objects start with
+// their GC_BARRIER flag set. The first pointer store into one clears the flag
+// and adds the object to the remembered set (see `gc_barrier`); the next minor
+// collection scans the remembered set and sets the flag again. The check is a
+// single test of the flag, so compiled traces emit it inline, leaving the
+// trace to let the interpreter run the barrier when it's needed.
+
+#ifndef GC_H
+#define GC_H
+
+#include "vm.h"
+#include "object.h"
+
+// The size of the nursery, in bytes.
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+// Objects larger than this are allocated straight into the old generation,
+// rather than filling up the nursery.
+#define GC_LARGE_SIZE (GC_NURSERY_SIZE / 8)
+
+// The size the old generation has to grow to (in bytes) before the first
+// major collection starts.
+#define GC_MIN_THRESHOLD (1024 * 1024)
+
+// Each minor collection that happens during a major collection marks or sweeps
+// at least GC_STEP_MIN bytes, plus GC_STEP_MUL bytes for every byte promoted
+// (or allocated straight into the old generation), so the major collection
+// always finishes before the old generation has grown too much.
+#define GC_STEP_MIN (64 * 1024)
+#define GC_STEP_MUL 4
+
+// Flags set on each object.
+#define GC_OLD       0x1 // The object is in the old generation
+#define GC_BARRIER   0x2 // Pointer stores into the object need the barrier
+#define GC_FORWARDED 0x4 // The object's been copied out of the nursery
+#define GC_STATIC    0x8 // The object isn't on any heap, and is never freed
+
+// The phases of a major collection.
+typedef enum {
+	GC_IDLE,
+	GC_MARK,
+	GC_SWEEP,
+} GcPhase;
+
+// A list of objects, used for the remembered set and by marking.
+typedef struct {
+	Object **objs;
+	int count, capacity;
+} ObjList;
+
+// A VM's garbage collected heap.
+typedef struct heap {
+	// The nursery, and the position of the next allocation in it.
+	uint8_t *nursery, *nursery_top;
+
+	// The number of bytes allocated straight into the old generation since
+	// the last minor collection (see `gc_alloc_old`, and large objects in
+	// `gc_alloc`), which count towards filling up the nursery.
+	size_t old_allocated;
+
+	// Linked list of every object in the old generation (via `Object::next`),
+	// and their total size in bytes.
+	Object *old;
+	size_t old_bytes;
+
+	// The size the old generation has to grow to before the next major
+	// collection starts.
+	size_t threshold;
+
+	// Old objects that have had a pointer stored into them since the last
+	// minor collection.
+	ObjList remembered;
+
+	// Every interned string on the heap (see `str.h`). Strings are removed
+	// when they're swept.
+	StrTable strs;
+
+	// Objects copied out of the nursery during a minor collection, whose
+	// fields haven't been copied yet.
+	ObjList promoted;
+
+	// The phase of the current major collection. While marking, objects that
+	// have been marked but whose fields haven't been scanned yet are kept on
+	// the gray list. While sweeping, `sweep` points to the link to the next
+	// object to sweep.
+	GcPhase phase;
+	ObjList gray;
+	Object **sweep;
+
+	// An object is marked if its `Object::mark` matches this, which flips
+	// at the start of every major collection, so we never have to go back and
+	// clear the marks.
+	uint8_t mark;
+
+	// The number of minor and major collections finished so far.
+	uint64_t minor_count, major_count;
+} Heap;
+
+// Creates a new, empty heap.
+Heap * gc_new();
+
+// Frees a heap and every object on it.
+void gc_free(Heap *heap);
+
+// Allocates `size` bytes for a new object, which the caller has to fill in.
+// `top` is the end of the current function's stack frame. This might run a
+// minor collection first, which moves objects in the nursery and updates the
+// stack to point to their new locations. Returns NULL if a large object
+// can't be allocated.
+Object * gc_alloc(VM *vm, size_t size, Value *top);
+
+// Allocates `size` bytes for a new object straight into the old generation,
+// which the caller has to fill in. Never runs a collection, so it's only used
+// for objects that don't point to anything (i.e. flat strings).
+Object * gc_alloc_old(VM *vm, size_t size);
+
+// Runs a minor collection now if the nursery doesn't have room for another
+// `size` bytes, so that allocating them afterwards doesn't. `top` is the same
+// as for `gc_alloc`.
+void gc_reserve(VM *vm, size_t size, Value *top);
+
+// Runs a minor collection, and a step of the current major collection (or
+// starts one, if the old generation is big enough).
+void gc_collect(VM *vm, Value *top);
+
+// Runs a minor collection, and then the whole of a major collection, freeing
+// everything that's unreachable.
+void gc_full(VM *vm, Value *top);
+
+// Adds an old object to the remembered set. Called by `gc_barrier`.
+void gc_remember(Heap *heap, Object *obj);
+
+// The write barrier, which has to be called whenever a value is stored into
+// one of an object's fields.
+static inline void gc_barrier(Heap *heap, Object *obj, Value val) {
+	if ((obj->gc & GC_BARRIER) && val_is_obj(val)) {
+		gc_remember(heap, obj);
+	}
+}
+
+#endif
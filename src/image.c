@@ -0,0 +1,498 @@
+
+// image.c
+// By Ben Anderson
+// December 2018
+
+#include "image.h"
+#include "verify.h"
+#include "str.h"
+#include "jit/arch.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if HY_OS == HY_OS_WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Every image starts with these 4 bytes.
+static const char IMAGE_MAGIC[4] = { 'H', 'Y', 'C', '\0' };
+
+// An image consists of this header, followed by the constants, packages,
+// functions and shapes lists, followed by the names table, followed by the
+// strings table, followed by every function's bytecode. The header and each
+// entry in the lists are a multiple of 8 bytes in size, so everything after
+// the header is suitably aligned.
+//
+// The names table holds the name of every field in every shape (in the order
+// the shapes are listed), followed by the name of the field accessed through
+// every inline cache in every function (in the order the functions are
+// listed).
+//
+// The strings table holds the contents of every string constant, each as a
+// 32 bit length followed by its characters, padded to a multiple of 8 bytes
+// in total (`strs_size`). A string constant is written in the constants list
+// as a pointer to the offset of its contents in the table.
+typedef struct {
+	char magic[4];
+	uint32_t version;
+	uint32_t consts_count, pkgs_count, fns_count, shapes_count, names_count;
+	uint32_t strs_size, padding;
+
+	// The package whose main function is run when the image is loaded.
+	uint32_t entry;
+} ImageHeader;
+
+// A package in an image.
+typedef struct {
+	uint64_t name;
+	uint32_t main_fn;
+	uint32_t padding;
+} ImagePackage;
+
+// A function in an image.
+typedef struct {
+	uint32_t pkg;
+	uint32_t args_count;
+	uint32_t frame_size;
+	uint32_t ins_count;
+
+	// Offset of the function's bytecode from the start of the image, in bytes.
+	uint64_t ins_offset;
+
+	// The number of inline caches the function's field accesses use. Caches
+	// are written empty, and are filled again once the image is loaded.
+	uint32_t caches_count;
+	uint32_t padding;
+} ImageFunction;
+
+// The shape of a struct in an image.
+typedef struct {
+	uint64_t name;
+	uint32_t pkg;
+	uint32_t fields_count;
+} ImageShape;
+
+
+// ---- Writing ---------------------------------------------------------------
+
+// Writes every package, function, struct and constant on the VM to a bytecode
+// image. `entry` is the package whose main function is run when the image is
+// loaded.
+Err * image_write(VM *vm, int entry, char *path) {
+	Program *prog = vm->prog;
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		Err *err = err_new("failed to open file `%s`", path);
+		err_file(err, path);
+		return err;
+	}
+
+	// Header
+	ImageHeader header;
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	header.version = IMAGE_VERSION;
+	header.consts_count = (uint32_t) prog->consts_count;
+	header.pkgs_count = (uint32_t) prog->pkgs_count;
+	header.fns_count = (uint32_t) prog->fns_count;
+	header.shapes_count = (uint32_t) prog->shapes_count;
+	header.names_count = 0;
+	for (int i = 0; i < prog->shapes_count; i++) {
+		header.names_count += (uint32_t) prog->shapes[i].fields_count;
+	}
+	for (int i = 0; i < prog->fns_count; i++) {
+		header.names_count += (uint32_t) prog->fns[i].caches_count;
+	}
+	header.strs_size = 0;
+	for (int i = 0; i < prog->consts_count; i++) {
+		if (val_is_str(prog->consts[i])) {
+			String *str = v2ptr(prog->consts[i]);
+			header.strs_size += (uint32_t) sizeof(uint32_t) + str->length;
+		}
+	}
+	header.strs_size = (header.strs_size + 7) & ~((uint32_t) 7);
+	header.padding = 0;
+	header.entry = (uint32_t) entry;
+	fwrite(&header, sizeof(ImageHeader), 1, f);
+
+	// Constants, with each string replaced by its offset in the strings table
+	uint64_t str_offset = 0;
+	for (int i = 0; i < prog->consts_count; i++) {
+		Value value = prog->consts[i];
+		if (val_is_str(value)) {
+			String *str = v2ptr(value);
+			value = TAG_PTR | str_offset;
+			str_offset += sizeof(uint32_t) + str->length;
+		}
+		fwrite(&value, sizeof(Value), 1, f);
+	}
+
+	// Packages
+	for (int i = 0; i < prog->pkgs_count; i++) {
+		ImagePackage pkg;
+		pkg.name = prog->pkgs[i].name;
+		pkg.main_fn = (uint32_t) prog->pkgs[i].main_fn;
+		pkg.padding = 0;
+		fwrite(&pkg, sizeof(ImagePackage), 1, f);
+	}
+
+	// Functions, whose bytecode comes after the shapes list and the names and
+	// strings tables
+	uint64_t offset = sizeof(ImageHeader) +
+		sizeof(Value) * (uint64_t) prog->consts_count +
+		sizeof(ImagePackage) * (uint64_t) prog->pkgs_count +
+		sizeof(ImageFunction) * (uint64_t) prog->fns_count +
+		sizeof(ImageShape) * (uint64_t) prog->shapes_count +
+		sizeof(uint64_t) * (uint64_t) header.names_count +
+		(uint64_t) header.strs_size;
+	for (int i = 0; i < prog->fns_count; i++) {
+		Function *fn = &prog->fns[i];
+		ImageFunction image_fn;
+		image_fn.pkg = (uint32_t) fn->pkg;
+		image_fn.args_count = (uint32_t) fn->args_count;
+		image_fn.frame_size = (uint32_t) fn->frame_size;
+		image_fn.ins_count = (uint32_t) fn->ins_count;
+		image_fn.ins_offset = offset;
+		image_fn.caches_count = (uint32_t) fn->caches_count;
+		image_fn.padding = 0;
+		fwrite(&image_fn, sizeof(ImageFunction), 1, f);
+		offset += sizeof(BcIns) * (uint64_t) fn->ins_count;
+	}
+
+	// Shapes
+	for (int i = 0; i < prog->shapes_count; i++) {
+		ImageShape shape;
+		shape.name = prog->shapes[i].name;
+		shape.pkg = (uint32_t) prog->shapes[i].pkg;
+		shape.fields_count = (uint32_t) prog->shapes[i].fields_count;
+		fwrite(&shape, sizeof(ImageShape), 1, f);
+	}
+
+	// Names
+	for (int i = 0; i < prog->shapes_count; i++) {
+		fwrite(prog->shapes[i].fields, sizeof(uint64_t),
+			(size_t) prog->shapes[i].fields_count, f);
+	}
+	for (int i = 0; i < prog->fns_count; i++) {
+		Function *fn = &prog->fns[i];
+		for (int j = 0; j < fn->caches_count; j++) {
+			fwrite(&fn->caches[j].field, sizeof(uint64_t), 1, f);
+		}
+	}
+
+	// Strings
+	for (int i = 0; i < prog->consts_count; i++) {
+		if (val_is_str(prog->consts[i])) {
+			String *str = v2ptr(prog->consts[i]);
+			fwrite(&str->length, sizeof(uint32_t), 1, f);
+			fwrite(str->chars, 1, str->length, f);
+		}
+	}
+	static const char zeros[8] = { 0 };
+	fwrite(zeros, 1, (size_t) (header.strs_size - str_offset), f);
+
+	// Bytecode
+	for (int i = 0; i < prog->fns_count; i++) {
+		Function *fn = &prog->fns[i];
+		fwrite(fn->ins, sizeof(BcIns), (size_t) fn->ins_count, f);
+	}
+
+	bool failed = ferror(f) != 0;
+	failed = fclose(f) != 0 || failed;
+	if (failed) {
+		Err *err = err_new("failed to write bytecode image `%s`", path);
+		err_file(err, path);
+		return err;
+	}
+	return NULL;
+}
+
+
+// ---- Loading ---------------------------------------------------------------
+
+// Maps a whole file into memory. The mapping is private, so writes to it
+// aren't carried through to the file. Returns NULL on failure.
+static uint8_t * image_map(char *path, size_t *size) {
+#if HY_OS == HY_OS_WINDOWS
+	// Just read the file into memory on Windows
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) {
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	*size = (size_t) ftell(f);
+	rewind(f);
+	uint8_t *image = malloc(*size > 0 ? *size : 1);
+	if (fread(image, 1, *size, f) != *size) {
+		free(image);
+		image = NULL;
+	}
+	fclose(f);
+	return image;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || info.st_size < (off_t) sizeof(ImageHeader)) {
+		// Too small to be an image (and we can't map an empty file)
+		close(fd);
+		return NULL;
+	}
+	*size = (size_t) info.st_size;
+	void *image = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	return image == MAP_FAILED ? NULL : image;
+#endif
+}
+
+// Releases memory mapped by `image_map`.
+static void image_unmap(uint8_t *image, size_t size) {
+#if HY_OS == HY_OS_WINDOWS
+	free(image);
+#else
+	munmap(image, size);
+#endif
+}
+
+// Returns the size of an image's header, lists and tables (i.e. everything
+// before the bytecode), in bytes.
+static uint64_t image_tables_size(ImageHeader *header) {
+	return sizeof(ImageHeader) +
+		sizeof(Value) * (uint64_t) header->consts_count +
+		sizeof(ImagePackage) * (uint64_t) header->pkgs_count +
+		sizeof(ImageFunction) * (uint64_t) header->fns_count +
+		sizeof(ImageShape) * (uint64_t) header->shapes_count +
+		sizeof(uint64_t) * (uint64_t) header->names_count +
+		(uint64_t) header->strs_size;
+}
+
+// Checks every count and offset in an image lies within the image, so we can
+// safely read it, and that every function's bytecode is valid, so we can
+// safely run it. Returns false if the image is invalid.
+static bool image_validate(uint8_t *image, size_t size) {
+	ImageHeader *header = (ImageHeader *) image;
+	uint64_t tables = image_tables_size(header);
+	if (header->consts_count > MAX_CONSTS || header->fns_count > INT_MAX ||
+			header->pkgs_count > INT_MAX ||
+			header->shapes_count > MAX_STRUCTS ||
+			header->names_count > INT_MAX || tables > size ||
+			header->entry >= header->pkgs_count) {
+		return false;
+	}
+
+	ImagePackage *pkgs = (ImagePackage *) (image + sizeof(ImageHeader) +
+		sizeof(Value) * header->consts_count);
+	for (uint32_t i = 0; i < header->pkgs_count; i++) {
+		if (pkgs[i].main_fn >= header->fns_count) {
+			return false;
+		}
+	}
+
+	// Every string constant has to lie within the strings table
+	Value *consts = (Value *) (image + sizeof(ImageHeader));
+	uint8_t *strs = image + tables - header->strs_size;
+	for (uint32_t i = 0; i < header->consts_count; i++) {
+		if (!val_is_obj(consts[i])) {
+			continue;
+		}
+		uint64_t offset = consts[i] & PTR_MASK;
+		if (offset + sizeof(uint32_t) > header->strs_size) {
+			return false;
+		}
+		uint32_t length;
+		memcpy(&length, strs + offset, sizeof(uint32_t));
+		if (offset + sizeof(uint32_t) + length > header->strs_size ||
+				length > INT_MAX) {
+			return false;
+		}
+	}
+
+	// Every name in the names table has to belong to exactly one shape or
+	// inline cache
+	ImageFunction *fns = (ImageFunction *) &pkgs[header->pkgs_count];
+	ImageShape *image_shapes = (ImageShape *) &fns[header->fns_count];
+	uint64_t names = 0;
+	for (uint32_t i = 0; i < header->fns_count; i++) {
+		if (fns[i].caches_count > MAX_CACHES_IN_FN) {
+			return false;
+		}
+		names += fns[i].caches_count;
+	}
+	for (uint32_t i = 0; i < header->shapes_count; i++) {
+		if (image_shapes[i].pkg >= header->pkgs_count ||
+				image_shapes[i].fields_count > MAX_FIELDS) {
+			return false;
+		}
+		names += image_shapes[i].fields_count;
+	}
+	if (names != header->names_count) {
+		return false;
+	}
+
+	// Only the number of fields in each shape is needed to verify bytecode
+	Shape *shapes = malloc(sizeof(Shape) * (header->shapes_count + 1));
+	for (uint32_t i = 0; i < header->shapes_count; i++) {
+		shapes[i].fields_count = (int) image_shapes[i].fields_count;
+	}
+
+	bool valid = true;
+	for (uint32_t i = 0; i < header->fns_count && valid; i++) {
+		ImageFunction *fn = &fns[i];
+		uint64_t end = fn->ins_offset +
+			sizeof(BcIns) * (uint64_t) fn->ins_count;
+		if (fn->pkg >= header->pkgs_count ||
+				fn->frame_size > MAX_LOCALS_IN_FN ||
+				fn->args_count > fn->frame_size ||
+				fn->ins_count == 0 || fn->ins_count > INT_MAX ||
+				fn->ins_offset < tables || end > size ||
+				fn->ins_offset % sizeof(BcIns) != 0) {
+			valid = false;
+			break;
+		}
+
+		// Only the bytecode, frame size and number of caches are needed to
+		// verify a function
+		Function verify;
+		verify.frame_size = (int) fn->frame_size;
+		verify.ins = (BcIns *) (image + fn->ins_offset);
+		verify.ins_count = (int) fn->ins_count;
+		verify.caches_count = (int) fn->caches_count;
+		valid = valid && fn_verify(&verify, (int) header->consts_count,
+			(int) header->fns_count, shapes, (int) header->shapes_count) < 0;
+	}
+	free(shapes);
+	return valid;
+}
+
+// Loads a bytecode image into an empty VM, setting `entry` to the package whose
+// main function should be run.
+Err * image_load(VM *vm, char *path, int *entry) {
+	Program *prog = vm->prog;
+	if (prog->frozen) {
+		return err_new("can't load code into a frozen program");
+	}
+	if (prog->fns_count > 0 || prog->consts_count > 0) {
+		return err_new("can't load a bytecode image into a VM that already has "
+			"code loaded");
+	}
+
+	size_t size;
+	uint8_t *image = image_map(path, &size);
+	if (image == NULL) {
+		Err *err = err_new("failed to open bytecode image `%s`", path);
+		err_file(err, path);
+		return err;
+	}
+
+	// Check the image is one we can read
+	ImageHeader *header = (ImageHeader *) image;
+	Err *err = NULL;
+	if (size < sizeof(ImageHeader) ||
+			memcmp(header->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0) {
+		err = err_new("`%s` is not a bytecode image", path);
+	} else if (header->version != IMAGE_VERSION) {
+		err = err_new("bytecode image `%s` was compiled by a different "
+			"version of Hydrogen", path);
+	} else if (!image_validate(image, size)) {
+		err = err_new("bytecode image `%s` is corrupt", path);
+	}
+	if (err != NULL) {
+		image_unmap(image, size);
+		err_file(err, path);
+		return err;
+	}
+
+	// Copy the constants, since the JIT adds more constants to the list. Every
+	// constant in an image is unique, so each one should end up at the same
+	// index it had in the image. Strings are created from the strings table,
+	// which comes straight before the bytecode
+	Value *consts = (Value *) (image + sizeof(ImageHeader));
+	uint8_t *strs = image + image_tables_size(header) - header->strs_size;
+	for (uint32_t i = 0; i < header->consts_count; i++) {
+		int idx;
+		if (val_is_obj(consts[i])) {
+			uint8_t *str = strs + (consts[i] & PTR_MASK);
+			uint32_t length;
+			memcpy(&length, str, sizeof(uint32_t));
+			idx = vm_add_str(vm, (char *) (str + sizeof(uint32_t)),
+				(int) length);
+		} else {
+			idx = vm_add_const(vm, consts[i]);
+		}
+		if (idx != (int) i) {
+			prog->consts_count = 0;
+			memset(prog->consts_index, -1,
+				sizeof(int) * prog->consts_index_capacity);
+			image_unmap(image, size);
+			err = err_new("bytecode image `%s` is corrupt", path);
+			err_file(err, path);
+			return err;
+		}
+	}
+
+	// Packages
+	ImagePackage *pkgs = (ImagePackage *) &consts[header->consts_count];
+	if ((int) header->pkgs_count > prog->pkgs_capacity) {
+		prog->pkgs_capacity = (int) header->pkgs_count;
+		prog->pkgs = realloc(prog->pkgs,
+			sizeof(Package) * prog->pkgs_capacity);
+	}
+	for (uint32_t i = 0; i < header->pkgs_count; i++) {
+		Package *pkg = &prog->pkgs[prog->pkgs_count++];
+		pkg->name = pkgs[i].name;
+		pkg->main_fn = (int) pkgs[i].main_fn;
+	}
+
+	// Functions point straight into the image for their bytecode
+	ImageFunction *fns = (ImageFunction *) &pkgs[header->pkgs_count];
+	for (uint32_t i = 0; i < header->fns_count; i++) {
+		Function *fn = &prog->fns[vm_new_fn(vm, (int) fns[i].pkg)];
+		fn->args_count = (int) fns[i].args_count;
+		fn->frame_size = (int) fns[i].frame_size;
+		fn->ins = (BcIns *) (image + fns[i].ins_offset);
+		fn->ins_count = (int) fns[i].ins_count;
+		fn_init_loops(fn);
+	}
+
+	// Shapes, and the fields named by each function's inline caches, are
+	// copied out of the names table
+	ImageShape *shapes = (ImageShape *) &fns[header->fns_count];
+	uint64_t *names = (uint64_t *) &shapes[header->shapes_count];
+	for (uint32_t i = 0; i < header->shapes_count; i++) {
+		// Creating the shape can move the list of shapes
+		int idx = vm_new_shape(vm, (int) shapes[i].pkg, shapes[i].name);
+		Shape *shape = &prog->shapes[idx];
+		shape->fields_count = (int) shapes[i].fields_count;
+		shape->fields_capacity = shape->fields_count;
+		shape->fields = malloc(sizeof(uint64_t) * shape->fields_count);
+		memcpy(shape->fields, names, sizeof(uint64_t) * shape->fields_count);
+		names += shape->fields_count;
+	}
+	for (uint32_t i = 0; i < header->fns_count; i++) {
+		Function *fn = &prog->fns[i];
+		for (uint32_t j = 0; j < fns[i].caches_count; j++) {
+			fn_new_cache(fn, *(names++));
+		}
+	}
+
+	prog->image = image;
+	prog->image_size = size;
+	*entry = (int) header->entry;
+	return NULL;
+}
+
+// Unmaps the bytecode image loaded into a program, if there is one.
+void image_free(Program *prog) {
+	if (prog->image != NULL) {
+		image_unmap(prog->image, prog->image_size);
+		prog->image = NULL;
+		prog->image_size = 0;
+	}
+}
@@ -0,0 +1,44 @@
+
+// image.h
+// By Ben Anderson
+// December 2018
+
+// A bytecode image is a serialised copy of every package, function, struct
+// and constant on a VM, which lets us skip lexing and parsing entirely when
+// starting up. Images are written straight after parsing a file (with
+// `hydrogen --compile`), and have the extension `.hyc`.
+//
+// When an image is loaded, the whole file is mapped into memory and each
+// function's bytecode points directly into the mapping, so cold start-up costs
+// little more than validating the image's header. The mapping is private, so
+// patching the bytecode later on (e.g. to blacklist a hot loop) only copies the
+// page that's modified.
+//
+// Images are stored in the native byte order and aren't portable between
+// machines with different endianness.
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "vm.h"
+
+// The file extension for bytecode images.
+#define IMAGE_EXT ".hyc"
+
+// Bump this whenever the bytecode format changes (e.g. a new opcode is added),
+// so that we refuse to load stale images.
+#define IMAGE_VERSION 4
+
+// Writes every package, function, struct and constant on the VM to a bytecode
+// image. `entry` is the package whose main function is run when the image is
+// loaded.
+Err * image_write(VM *vm, int entry, char *path);
+
+// Loads a bytecode image into an empty VM, setting `entry` to the package whose
+// main function should be run.
+Err * image_load(VM *vm, char *path, int *entry);
+
+// Unmaps the bytecode image loaded into a program, if there is one.
+void image_free(Program *prog);
+
+#endif
@@ -58,4 +58,47 @@
 #error "No target architecture defined"
 #endif
 
+// Possible floating point calculation modes.
+// See:
+// * https://www.cs.uaf.edu/2012/fall/cs301/lecture/11_02_other_float.html
+// * https://en.wikipedia.org/wiki/X86_instruction_listings
+// * https://stackoverflow.com/questions/28939652/how-to-detect-sse-sse2-avx-
+//   avx2-avx-512-avx-128-fma-kcvi-availability-at-compile
+// * https://en.wikipedia.org/wiki/Advanced_Vector_Extensions
+// * https://msdn.microsoft.com/en-us/library/b0084kay.aspx (for Windows)
+#define HY_FPU  0
+#define HY_SSE2 1 // We need SSE2 or greater (not SSE) for doubles.
+#define HY_AVX  2
+
+// Detect which floating point arithmetic instructions to use.
+#if HY_ARCH == HY_ARCH_X86 || HY_ARCH == HY_ARCH_X64
+#if defined(__AVX__) || defined(__AVX2__) || defined(__AVX512F__)
+#define HY_ARCH_FP HY_AVX
+#define HY_ARCH_NUM_REGS 16
+#elif (defined(__SSE2__) || defined(__SSE3__) || defined(__SSE4_1__) || \
+	defined(__SSE4_2__) || (_M_IX86_FP == 2))
+#define HY_ARCH_FP HY_SSE2
+#define HY_ARCH_NUM_REGS 16
+#else
+#define HY_ARCH_FP HY_FPU
+#error "SSE2 or above required"
+#endif
+#endif
+
+// Possible vector instruction sets for the runtime's integer code (e.g. the
+// lexer), which is compiled ahead of time rather than JITed. AVX only has 256
+// bit floating point instructions, so we need AVX2 for 256 bit integers.
+#define HY_SIMD_NONE 0
+#define HY_SIMD_SSE2 1
+#define HY_SIMD_AVX2 2
+
+// Detect which vector instructions to use.
+#if defined(__AVX2__)
+#define HY_ARCH_SIMD HY_SIMD_AVX2
+#elif HY_ARCH_FP >= HY_SSE2
+#define HY_ARCH_SIMD HY_SIMD_SSE2
+#else
+#define HY_ARCH_SIMD HY_SIMD_NONE
+#endif
+
 #endif
@@ -4,39 +4,67 @@
 // November 2018
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <assert.h>
+#include <string.h>
 
 #include "../assembler.h"
+#include "../../object.h"
+#include "../../gc.h"
+#include "../../array.h"
 
 #ifdef ASM_DEBUG
 #include <stdio.h>
 #endif
 
-// Possible floating point calculation modes.
-// See:
-// * https://www.cs.uaf.edu/2012/fall/cs301/lecture/11_02_other_float.html
-// * https://en.wikipedia.org/wiki/X86_instruction_listings
-// * https://stackoverflow.com/questions/28939652/how-to-detect-sse-sse2-avx-
-//   avx2-avx-512-avx-128-fma-kcvi-availability-at-compile
-// * https://en.wikipedia.org/wiki/Advanced_Vector_Extensions
-// * https://msdn.microsoft.com/en-us/library/b0084kay.aspx (for Windows)
-#define HY_FPU  0
-#define HY_SSE2 1 // We need SSE2 or greater (not SSE) for doubles.
-#define HY_AVX  2
-
-// Detect which floating point arithmetic instructions to use.
-#if HY_ARCH == HY_ARCH_X86 || HY_ARCH == HY_ARCH_X64
-#if defined(__AVX__) || defined(__AVX2__) || defined(__AVX512F__)
-#define HY_ARCH_FP HY_AVX
-#define HY_ARCH_NUM_REGS 16
-#elif (defined(__SSE2__) || defined(__SSE3__) || defined(__SSE4_1__) || \
-	defined(__SSE4_2__) || (_M_IX86_FP == 2))
-#define HY_ARCH_FP HY_SSE2
-#define HY_ARCH_NUM_REGS 16
+// Every trace is called as a C function that takes two arguments: a pointer
+// to the stack, and a pointer to the constants list (see `TraceFn`). We keep
+// these in whichever registers the calling convention passes them in.
+#define REG_RAX 0
+#define REG_RCX 1
+#define REG_RDX 2
+#define REG_RSP 4
+#define REG_RBP 5
+#define REG_RSI 6
+#define REG_RDI 7
+#define REG_R11 11
+
+#if HY_OS == HY_OS_WINDOWS
+#define REG_STACK  REG_RCX
+#define REG_CONSTS REG_RDX
 #else
-#define HY_ARCH_FP HY_FPU
-#error "SSE2 or above required"
+#define REG_STACK  REG_RDI
+#define REG_CONSTS REG_RSI
 #endif
+
+// We reserve the last xmm register as a scratch register for instructions that
+// need a temporary (e.g. subtractions where the destination register is the
+// same as the right operand's), and the one before it for reloading values
+// that have been spilled to memory. Neither is ever allocated to an IR
+// instruction. The general purpose registers holding the stack and constants
+// pointers are never touched, and rax and r11 are only used as temporaries
+// (neither holds an argument under either calling convention).
+#define REG_XMM_SCRATCH (HY_ARCH_NUM_REGS - 1)
+#define REG_XMM_SPILL   (HY_ARCH_NUM_REGS - 2)
+#define HY_ARCH_NUM_ALLOC_REGS (HY_ARCH_NUM_REGS - 2)
+
+// Set in the register assigned to an instruction if its result lives in a
+// spill slot on the native stack, rather than in a register. The remaining
+// bits give the index of the spill slot.
+#define REG_SPILLED 0x8000
+
+#ifdef ASM_DEBUG
+// Names of the general purpose registers, for printing assembly code.
+static char * GPR_NAMES[] = {
+	"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+	"r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+
+// Names of the lower 32 bits of the general purpose registers.
+static char * GPR32_NAMES[] = {
+	"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+	"r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
 #endif
 
 
@@ -49,124 +77,1305 @@ static void asm_calculate_live_ranges(Trace *trace, IrRef *live_ranges) {
 	for (IrRef i = trace->ir_count - 1; i >= 1; i--) {
 		IrIns ins = trace->ir[i];
 
-		// Depending on if the instruction has a reference to another 
-		// instruction, which we can determine from its opcode prefix
-		if (ir_op_prefix(ins) == IROP_PREFIX_LOAD) {
-			// No reference to any other instructions
-		} else {
-			// Two references to other instructions
-			IrRef arg1 = ir_arg1(ins);
-			IrRef arg2 = ir_arg2(ins);
-
-			// If the live range of one of these arguments has already been set,
-			// then it was used in a later instruction (since we're iterating
-			// in reverse order). So only update the argument's live range if
-			// it hasn't already been set
-			if (live_ranges[arg1] == IR_NONE) {
-				live_ranges[arg1] = i;
+		// Depending on if the instruction has a reference to another
+		// instruction (loads don't, the first argument to a stack store is a
+		// stack slot, and so on)
+		IrRef arg1 = ir_arg1_is_ref(ins) ? ir_arg1(ins) : IR_NONE;
+		IrRef arg2 = ir_arg2_is_ref(ins) ? ir_arg2(ins) : IR_NONE;
+
+		// If the live range of one of these arguments has already been set,
+		// then it was used in a later instruction (since we're iterating
+		// in reverse order). So only update the argument's live range if
+		// it hasn't already been set
+		if (arg1 != IR_NONE && live_ranges[arg1] == IR_NONE) {
+			live_ranges[arg1] = i;
+		}
+		if (arg2 != IR_NONE && live_ranges[arg2] == IR_NONE) {
+			live_ranges[arg2] = i;
+		}
+	}
+
+	// If a guard fails, its side exit writes the values in its snapshot back
+	// to the stack, so these values have to stay in registers at least until
+	// the guard
+	for (int i = 0; i < trace->snaps_count; i++) {
+		Snapshot *snap = &trace->snaps[i];
+		for (int j = 0; j < snap->entries_count; j++) {
+			IrRef ref = trace->snap_entries[snap->first_entry + j].ref;
+			if (live_ranges[ref] < snap->guard) {
+				live_ranges[ref] = snap->guard;
 			}
-			if (live_ranges[arg2] == IR_NONE) {
-				live_ranges[arg2] = i;
+		}
+	}
+
+	// Values from the peeled iteration that are used in the loop body are
+	// needed again on every iteration, so they have to stay in a register for
+	// the entire loop. This includes the left hand side of every PHI, whose
+	// register carries a value from one iteration to the next
+	if (trace->loop_ref != IR_NONE) {
+		for (IrRef i = 1; i < trace->loop_ref; i++) {
+			if (live_ranges[i] > trace->loop_ref) {
+				live_ranges[i] = trace->ir_count;
 			}
 		}
 	}
 }
 
-// Allocates a register to the results of instructions in the IR.
-static void asm_allocate_registers(Trace *trace) {
-	// Calculate the live range of each instruction. Use calloc because this 
-	// initialises all live ranges to 0, the equivalent of IR_NONE.
-	IrRef *live_ranges = calloc(trace->ir_count, sizeof(IrRef));
-	asm_calculate_live_ranges(trace, live_ranges);
+// Returns true if an instruction produces a result, which needs a register.
+// Stores, guards, loop instructions, and NOPs don't.
+static inline bool asm_has_result(IrIns ins) {
+	int prefix = ir_op_prefix(ins);
+	return prefix == IROP_PREFIX_LOAD || prefix == IROP_PREFIX_ARITH ||
+		prefix == IROP_PREFIX_FIELD;
+}
 
-	// Keep track of when each register is no longer in use
-	IrRef reg_end[HY_ARCH_NUM_REGS] = {IR_NONE};
+// Returns true if a register is actually a spill slot.
+static inline bool asm_is_spilled(uint16_t reg) {
+	return (reg & REG_SPILLED) != 0;
+}
+
+// Returns the index of the spill slot encoded in a register.
+static inline int asm_spill_slot(uint16_t reg) {
+	return reg & ~REG_SPILLED;
+}
+
+// The positions of every use of each instruction's result, in increasing
+// order. The uses of instruction `ref` are `pos[first[ref]]` up to (but not
+// including) `pos[first[ref + 1]]`.
+typedef struct {
+	int *first;
+	IrRef *pos;
+} UseLists;
+
+// Records a use of an instruction's result at position `pos`, or just counts
+// it if `lists->pos` is NULL.
+static void asm_add_use(UseLists *lists, int *next, IrRef ref, IrRef pos) {
+	if (ref == IR_NONE) {
+		return;
+	}
+	if (lists->pos != NULL) {
+		lists->pos[next[ref]++] = pos;
+	} else {
+		next[ref]++;
+	}
+}
 
-	// Iterate over the instructions in order
-	for (IrRef ins_ref = 1; ins_ref < trace->ir_count; ins_ref++) {
-		IrIns *ins = &trace->ir[ins_ref];
+// Builds the lists of uses for each instruction. A value is used by any
+// instruction that references it, by the guard of any snapshot it's in, and at
+// the end of the trace if it's carried around the loop.
+static void asm_find_uses(Trace *trace, IrRef *live_ranges, UseLists *lists,
+		int *next) {
+	for (IrRef i = 1; i < trace->ir_count; i++) {
+		IrIns ins = trace->ir[i];
+		int prefix = ir_op_prefix(ins);
+		if (ir_arg1_is_ref(ins)) {
+			asm_add_use(lists, next, ir_arg1(ins), i);
+		}
+		if (ir_arg2_is_ref(ins)) {
+			asm_add_use(lists, next, ir_arg2(ins), i);
+		}
 
-		// Free any registers that finish being used at this instruction by
-		// iterating over all the registers
-		for (int reg = 0; reg < HY_ARCH_NUM_REGS; reg++) {
-			// If this register's live range ends at this instruction, free it
-			// from being used
-			if (reg_end[reg] == ins_ref) {
-				reg_end[reg] = IR_NONE;
+		// Guards use everything in their snapshot
+		if (prefix == IROP_PREFIX_GUARD) {
+			for (int j = 0; j < trace->snaps_count; j++) {
+				Snapshot *snap = &trace->snaps[j];
+				if (snap->guard != i) {
+					continue;
+				}
+				for (int k = 0; k < snap->entries_count; k++) {
+					SnapshotEntry *entry =
+						&trace->snap_entries[snap->first_entry + k];
+					asm_add_use(lists, next, entry->ref, i);
+				}
 			}
 		}
+	}
+	for (IrRef i = 1; i < trace->ir_count; i++) {
+		if (live_ranges[i] == trace->ir_count) {
+			asm_add_use(lists, next, i, trace->ir_count);
+		}
+	}
+}
 
-		// Find the next register that's not in use
-		bool found_reg = false;
-		for (int reg = 0; reg < HY_ARCH_NUM_REGS; reg++) {
-			// Check to see if this register isn't already in use
-			if (reg_end[reg] == IR_NONE) {
-				found_reg = true;
+// Creates the lists of uses for each instruction.
+static UseLists asm_use_lists_new(Trace *trace, IrRef *live_ranges) {
+	// Count the uses of each instruction first
+	UseLists lists;
+	lists.pos = NULL;
+	lists.first = arena_calloc(trace->arena, trace->ir_count + 1,
+		sizeof(int));
+	int *next = arena_calloc(trace->arena, trace->ir_count + 1, sizeof(int));
+	asm_find_uses(trace, live_ranges, &lists, next);
 
-				// Use this register for the result of this instruction
-				ir_set_reg(ins, reg);
+	// Work out where each instruction's uses start
+	int total = 0;
+	for (int i = 0; i < trace->ir_count; i++) {
+		lists.first[i] = total;
+		total += next[i];
+		next[i] = lists.first[i];
+	}
+	lists.first[trace->ir_count] = total;
 
-				// The use of this register ends when this instruction's live
-				// range ends
-				reg_end[reg] = live_ranges[ins_ref];
-				break;
+	// Fill in the uses. Snapshot uses and uses inside the same instruction
+	// can appear slightly out of order, so sort each list afterwards
+	lists.pos = arena_alloc(trace->arena, sizeof(IrRef) * (total + 1));
+	asm_find_uses(trace, live_ranges, &lists, next);
+	for (int i = 1; i < trace->ir_count; i++) {
+		for (int j = lists.first[i] + 1; j < lists.first[i + 1]; j++) {
+			IrRef pos = lists.pos[j];
+			int k = j - 1;
+			while (k >= lists.first[i] && lists.pos[k] > pos) {
+				lists.pos[k + 1] = lists.pos[k];
+				k--;
 			}
+			lists.pos[k + 1] = pos;
 		}
+	}
+	return lists;
+}
 
-		// If we couldn't find a register to allocate to the result of this
-		// instruction, then spill a register to memory
-		if (!found_reg) {
-			// TODO: register spilling (we assume for now that we have enough
-			// registers to satisfy all instruction live ranges, i.e. no more
-			// than HY_ARCH_NUM_REGS will be in use at any time)
-			assert(false);
+// Returns the position of the next use of an instruction's result at or after
+// `pos`.
+static IrRef asm_next_use(UseLists *lists, IrRef ref, IrRef pos) {
+	for (int i = lists->first[ref]; i < lists->first[ref + 1]; i++) {
+		if (lists->pos[i] >= pos) {
+			return lists->pos[i];
 		}
 	}
+	return pos;
+}
+
+// Assigns a spill slot to every spilled instruction, reusing a slot once the
+// value in it is no longer needed. Returns the number of spill slots used.
+static int asm_assign_spill_slots(Trace *trace, IrRef *live_ranges) {
+	// Keep track of when the value in each spill slot is no longer needed
+	IrRef *slot_end = arena_alloc(trace->arena, sizeof(IrRef) * trace->ir_count);
+	int slots_count = 0;
+	for (IrRef ref = 1; ref < trace->ir_count; ref++) {
+		IrIns *ins = &trace->ir[ref];
+		if (!asm_has_result(*ins) || !asm_is_spilled(ir_reg(*ins))) {
+			continue;
+		}
+
+		int slot = 0;
+		while (slot < slots_count && slot_end[slot] > ref) {
+			slot++;
+		}
+		if (slot == slots_count) {
+			slots_count++;
+		}
+		slot_end[slot] = live_ranges[ref];
+		ir_set_reg(ins, REG_SPILLED | slot);
+	}
+	return slots_count;
+}
+
+// Allocates a register to the result of each instruction in the IR, using
+// linear scan register allocation. Returns the number of spill slots needed
+// on the native stack.
+//
+// We keep a list of the live ranges currently holding registers (the "active"
+// list), sorted by where they end. Before allocating a register at each
+// instruction, we release the registers of any live ranges that have ended.
+// If there's no free register, then whichever value (out of the active ones
+// and the new one) is next used furthest in the future is spilled to memory
+// for its entire live range.
+static int asm_allocate_registers(Trace *trace) {
+	// Calculate the live range of each instruction. Zero the array because
+	// this initialises all live ranges to 0, the equivalent of IR_NONE.
+	IrRef *live_ranges = arena_calloc(trace->arena, trace->ir_count,
+		sizeof(IrRef));
+	asm_calculate_live_ranges(trace, live_ranges);
+
+	// A value that's never used still needs a register for the instruction
+	// that produces it
+	for (IrRef ref = 1; ref < trace->ir_count; ref++) {
+		if (live_ranges[ref] == IR_NONE) {
+			live_ranges[ref] = ref;
+		}
+	}
+	UseLists uses = asm_use_lists_new(trace, live_ranges);
+
+	IrRef active[HY_ARCH_NUM_ALLOC_REGS];
+	int active_count = 0;
+	uint32_t free_regs = (1 << HY_ARCH_NUM_ALLOC_REGS) - 1;
+	for (IrRef ref = 1; ref < trace->ir_count; ref++) {
+		IrIns *ins = &trace->ir[ref];
+
+		// Free the registers of live ranges that end at this instruction
+		int expired = 0;
+		while (expired < active_count &&
+				live_ranges[active[expired]] <= ref) {
+			free_regs |= 1 << ir_reg(trace->ir[active[expired]]);
+			expired++;
+		}
+		active_count -= expired;
+		memmove(active, &active[expired], sizeof(IrRef) * active_count);
+
+		if (!asm_has_result(*ins)) {
+			continue;
+		}
+
+		if (free_regs == 0) {
+			// Find the value that's next used furthest in the future
+			IrRef victim = ref;
+			IrRef victim_use = asm_next_use(&uses, ref, ref + 1);
+			int victim_idx = -1;
+			for (int i = 0; i < active_count; i++) {
+				IrRef use = asm_next_use(&uses, active[i], ref);
+				if (use > victim_use) {
+					victim = active[i];
+					victim_use = use;
+					victim_idx = i;
+				}
+			}
+
+			// Spill it
+			if (victim == ref) {
+				ir_set_reg(ins, REG_SPILLED);
+				continue;
+			}
+			free_regs |= 1 << ir_reg(trace->ir[victim]);
+			ir_set_reg(&trace->ir[victim], REG_SPILLED);
+			active_count--;
+			memmove(&active[victim_idx], &active[victim_idx + 1],
+				sizeof(IrRef) * (active_count - victim_idx));
+		}
+
+		// Use the lowest numbered free register
+		int reg = 0;
+		while ((free_regs & (1 << reg)) == 0) {
+			reg++;
+		}
+		free_regs &= ~(1 << reg);
+		ir_set_reg(ins, reg);
+
+		// Insert this live range into the active list, keeping it sorted
+		int i = active_count;
+		while (i > 0 && live_ranges[active[i - 1]] > live_ranges[ref]) {
+			active[i] = active[i - 1];
+			i--;
+		}
+		active[i] = ref;
+		active_count++;
+	}
+
+	return asm_assign_spill_slots(trace, live_ranges);
+}
+
+
+// ---- Instruction Encoding --------------------------------------------------
+
+// Possible values for the `pp` field of a VEX prefix, which encodes the
+// equivalent of the legacy SSE prefix byte.
+#define VEX_PP_NONE 0x0
+#define VEX_PP_66   0x1
+#define VEX_PP_F3   0x2
+#define VEX_PP_F2   0x3
+
+// Emits a REX prefix if one is required. `reg` is the register placed in the
+// ModR/M reg field and `rm` the register in the ModR/M r/m field (or the base
+// register for a memory operand).
+static void asm_rex(MCodeChunk *chunk, bool w, int reg, int rm) {
+	uint8_t rex = 0x40 | (w << 3) | ((reg & 0x8) >> 1) | ((rm & 0x8) >> 3);
+	if (rex != 0x40) {
+		asm_append_u8(chunk, rex);
+	}
+}
+
+// Emits a ModR/M byte with two register operands.
+static void asm_modrm_reg(MCodeChunk *chunk, int reg, int rm) {
+	asm_append_u8(chunk, 0xc0 | (reg & 0x7) << 3 | (rm & 0x7));
+}
+
+// Emits a ModR/M byte (and SIB byte and displacement, if required) for a
+// `[base + disp]` memory operand.
+static void asm_modrm_mem(MCodeChunk *chunk, int reg, int base, int32_t disp) {
+	// rbp and r13 can't be used as a base without a displacement
+	uint8_t mod;
+	if (disp == 0 && (base & 0x7) != REG_RBP) {
+		mod = 0x0;
+	} else if (disp >= INT8_MIN && disp <= INT8_MAX) {
+		mod = 0x1;
+	} else {
+		mod = 0x2;
+	}
+	asm_append_u8(chunk, mod << 6 | (reg & 0x7) << 3 | (base & 0x7));
+
+	// rsp and r12 as a base require a SIB byte (with no index)
+	if ((base & 0x7) == REG_RSP) {
+		asm_append_u8(chunk, 0x24);
+	}
+
+	if (mod == 0x1) {
+		asm_append_u8(chunk, (uint8_t) (int8_t) disp);
+	} else if (mod == 0x2) {
+		asm_append_u32(chunk, (uint32_t) disp);
+	}
+}
+
+#if HY_ARCH_FP == HY_AVX
+// Emits a VEX prefix for an AVX instruction in the 0x0f opcode map. `vvvv` is
+// the additional source register for 3 operand instructions (0 if unused). We
+// use the shorter 2 byte form of the prefix whenever we can.
+static void asm_vex_prefix(MCodeChunk *chunk, uint8_t pp, bool w, int reg,
+		int vvvv, int rm) {
+	uint8_t r = (~reg & 0x8) << 4;
+	uint8_t v = (~vvvv & 0xf) << 3;
+	if ((rm & 0x8) == 0 && !w) {
+		asm_append_u8(chunk, 0xc5);
+		asm_append_u8(chunk, r | v | pp);
+	} else {
+		uint8_t x = 0x40; // Never any index register
+		uint8_t b = (~rm & 0x8) << 2;
+		asm_append_u8(chunk, 0xc4);
+		asm_append_u8(chunk, r | x | b | 0x01);
+		asm_append_u8(chunk, (w << 7) | v | pp);
+	}
+}
+#else
+// Emits the legacy prefix, REX prefix and 0x0f escape byte for an SSE
+// instruction.
+static void asm_sse_prefix(MCodeChunk *chunk, uint8_t prefix, bool w, int reg,
+		int rm) {
+	asm_append_u8(chunk, prefix);
+	asm_rex(chunk, w, reg, rm);
+	asm_append_u8(chunk, 0x0f);
+}
+#endif
+
+// Emits a scalar double instruction (e.g. `movsd`, `addsd`), with a register
+// destination and memory source, or a memory destination and register source,
+// depending on the opcode.
+static void asm_sd_mem(MCodeChunk *chunk, uint8_t op, int xmm, int base,
+		int32_t disp) {
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_F2, false, xmm, 0, base);
+#else
+	asm_sse_prefix(chunk, 0xf2, false, xmm, base);
+#endif
+	asm_append_u8(chunk, op);
+	asm_modrm_mem(chunk, xmm, base, disp);
+}
+
+// Emits a reg/reg move between two xmm registers. We move the whole register
+// with `movapd` rather than `movsd`, which merges into the destination and
+// creates a false dependency on its previous value.
+static void asm_movapd(MCodeChunk *chunk, int dest, int src) {
+#ifdef ASM_DEBUG
+	printf("movapd xmm%d, xmm%d\n", dest, src);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_66, false, dest, 0, src);
+#else
+	asm_sse_prefix(chunk, 0x66, false, dest, src);
+#endif
+	asm_append_u8(chunk, 0x28);
+	asm_modrm_reg(chunk, dest, src);
+}
+
+#if HY_ARCH_FP == HY_AVX
+// Emits a 3 operand AVX instruction on xmm registers, `dest = src1 op src2`.
+static void asm_vex_reg(MCodeChunk *chunk, uint8_t pp, uint8_t op, int dest,
+		int src1, int src2) {
+	asm_vex_prefix(chunk, pp, false, dest, src1, src2);
+	asm_append_u8(chunk, op);
+	asm_modrm_reg(chunk, dest, src2);
+}
+#else
+// Emits a 2 operand SSE instruction on xmm registers, `dest = dest op src`.
+static void asm_sse_reg(MCodeChunk *chunk, uint8_t prefix, uint8_t op,
+		int dest, int src) {
+	asm_sse_prefix(chunk, prefix, false, dest, src);
+	asm_append_u8(chunk, op);
+	asm_modrm_reg(chunk, dest, src);
+}
+#endif
+
+// Emits `mov r64, imm64`.
+static void asm_mov_imm64(MCodeChunk *chunk, int reg, uint64_t imm) {
+#ifdef ASM_DEBUG
+	printf("mov %s, 0x%llx\n", GPR_NAMES[reg], (unsigned long long) imm);
+#endif
+	asm_rex(chunk, true, 0, reg);
+	asm_append_u8(chunk, 0xb8 + (reg & 0x7));
+	asm_append_u64(chunk, imm);
+}
+
+// Emits `movq xmm, r64`.
+static void asm_movq_from_gpr(MCodeChunk *chunk, int xmm, int reg) {
+#ifdef ASM_DEBUG
+	printf("movq xmm%d, %s\n", xmm, GPR_NAMES[reg]);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_66, true, xmm, 0, reg);
+#else
+	asm_sse_prefix(chunk, 0x66, true, xmm, reg);
+#endif
+	asm_append_u8(chunk, 0x6e);
+	asm_modrm_reg(chunk, xmm, reg);
+}
+
+// Emits `movq r64, xmm`.
+static void asm_movq_to_gpr(MCodeChunk *chunk, int reg, int xmm) {
+#ifdef ASM_DEBUG
+	printf("movq %s, xmm%d\n", GPR_NAMES[reg], xmm);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_66, true, xmm, 0, reg);
+#else
+	asm_sse_prefix(chunk, 0x66, true, xmm, reg);
+#endif
+	asm_append_u8(chunk, 0x7e);
+	asm_modrm_reg(chunk, xmm, reg);
+}
+
+// Emits `ucomisd xmm<a>, xmm<b>`, which sets the flags like an unsigned
+// integer comparison of `a` with `b` (with ZF, PF and CF all set if either
+// operand is NaN).
+static void asm_ucomisd(MCodeChunk *chunk, int a, int b) {
+#ifdef ASM_DEBUG
+	printf("ucomisd xmm%d, xmm%d\n", a, b);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_66, false, a, 0, b);
+#else
+	asm_sse_prefix(chunk, 0x66, false, a, b);
+#endif
+	asm_append_u8(chunk, 0x2e);
+	asm_modrm_reg(chunk, a, b);
+}
+
+// Emits `cvttsd2si r64, xmm`, which truncates a double to a signed 64 bit
+// integer (giving INT64_MIN if it's NaN or out of range).
+static void asm_cvttsd2si(MCodeChunk *chunk, int reg, int xmm) {
+#ifdef ASM_DEBUG
+	printf("cvttsd2si %s, xmm%d\n", GPR_NAMES[reg], xmm);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_F2, true, reg, 0, xmm);
+#else
+	asm_sse_prefix(chunk, 0xf2, true, reg, xmm);
+#endif
+	asm_append_u8(chunk, 0x2c);
+	asm_modrm_reg(chunk, reg, xmm);
+}
+
+// Emits `cvtsi2sd xmm, r64`, which converts a signed 64 bit integer to a
+// double.
+static void asm_cvtsi2sd(MCodeChunk *chunk, int xmm, int reg) {
+#ifdef ASM_DEBUG
+	printf("cvtsi2sd xmm%d, %s\n", xmm, GPR_NAMES[reg]);
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_F2, true, xmm, xmm, reg);
+#else
+	asm_sse_prefix(chunk, 0xf2, true, xmm, reg);
+#endif
+	asm_append_u8(chunk, 0x2a);
+	asm_modrm_reg(chunk, xmm, reg);
+}
+
+// Emits `cmp r64<a>, r64<b>`.
+static void asm_cmp_gpr(MCodeChunk *chunk, int a, int b) {
+#ifdef ASM_DEBUG
+	printf("cmp %s, %s\n", GPR_NAMES[a], GPR_NAMES[b]);
+#endif
+	asm_rex(chunk, true, b, a);
+	asm_append_u8(chunk, 0x39);
+	asm_modrm_reg(chunk, b, a);
+}
+
+// Emits `and r64<a>, r64<b>`.
+static void asm_and_gpr(MCodeChunk *chunk, int a, int b) {
+#ifdef ASM_DEBUG
+	printf("and %s, %s\n", GPR_NAMES[a], GPR_NAMES[b]);
+#endif
+	asm_rex(chunk, true, b, a);
+	asm_append_u8(chunk, 0x21);
+	asm_modrm_reg(chunk, b, a);
+}
+
+// Emits `add r64<a>, r64<b>`.
+static void asm_add_gpr(MCodeChunk *chunk, int a, int b) {
+#ifdef ASM_DEBUG
+	printf("add %s, %s\n", GPR_NAMES[a], GPR_NAMES[b]);
+#endif
+	asm_rex(chunk, true, b, a);
+	asm_append_u8(chunk, 0x01);
+	asm_modrm_reg(chunk, b, a);
+}
+
+// Emits `shl r64, imm8`.
+static void asm_shl_imm8(MCodeChunk *chunk, int reg, uint8_t imm) {
+#ifdef ASM_DEBUG
+	printf("shl %s, %u\n", GPR_NAMES[reg], imm);
+#endif
+	asm_rex(chunk, true, 0, reg);
+	asm_append_u8(chunk, 0xc1);
+	asm_modrm_reg(chunk, 4, reg);
+	asm_append_u8(chunk, imm);
+}
+
+// Emits `add r64, imm32`.
+static void asm_add_imm32(MCodeChunk *chunk, int reg, uint32_t imm) {
+#ifdef ASM_DEBUG
+	printf("add %s, 0x%x\n", GPR_NAMES[reg], imm);
+#endif
+	asm_rex(chunk, true, 0, reg);
+	asm_append_u8(chunk, 0x81);
+	asm_modrm_reg(chunk, 0, reg);
+	asm_append_u32(chunk, imm);
+}
+
+// Emits `cmp dword [base + disp], imm32`.
+static void asm_cmp_mem32_imm32(MCodeChunk *chunk, int base, int32_t disp,
+		uint32_t imm) {
+#ifdef ASM_DEBUG
+	printf("cmp dword [%s + 0x%x], %u\n", GPR_NAMES[base], disp, imm);
+#endif
+	asm_rex(chunk, false, 0, base);
+	asm_append_u8(chunk, 0x81);
+	asm_modrm_mem(chunk, 7, base, disp);
+	asm_append_u32(chunk, imm);
+}
+
+// Emits `cmp r64, qword [base + disp]`.
+static void asm_cmp_gpr_mem64(MCodeChunk *chunk, int reg, int base,
+		int32_t disp) {
+#ifdef ASM_DEBUG
+	printf("cmp %s, qword [%s + 0x%x]\n", GPR_NAMES[reg], GPR_NAMES[base],
+		disp);
+#endif
+	asm_rex(chunk, true, reg, base);
+	asm_append_u8(chunk, 0x3b);
+	asm_modrm_mem(chunk, reg, base, disp);
+}
+
+// Emits `test byte [base + disp], imm8`.
+static void asm_test_mem8_imm8(MCodeChunk *chunk, int base, int32_t disp,
+		uint8_t imm) {
+#ifdef ASM_DEBUG
+	printf("test byte [%s + 0x%x], 0x%x\n", GPR_NAMES[base], disp, imm);
+#endif
+	asm_rex(chunk, false, 0, base);
+	asm_append_u8(chunk, 0xf6);
+	asm_modrm_mem(chunk, 0, base, disp);
+	asm_append_u8(chunk, imm);
+}
+
+// Emits `mov r32, imm32`.
+static void asm_mov_imm32(MCodeChunk *chunk, int reg, uint32_t imm) {
+#ifdef ASM_DEBUG
+	printf("mov %s, %d\n", GPR32_NAMES[reg], (int32_t) imm);
+#endif
+	asm_rex(chunk, false, 0, reg);
+	asm_append_u8(chunk, 0xb8 + (reg & 0x7));
+	asm_append_u32(chunk, imm);
+}
+
+// Condition codes for the `jcc` instruction (the second byte of the 2 byte
+// opcode, with a 32 bit relative offset).
+#define JCC_JB  0x82
+#define JCC_JAE 0x83
+#define JCC_JE  0x84
+#define JCC_JNE 0x85
+#define JCC_JBE 0x86
+#define JCC_JA  0x87
+
+#ifdef ASM_DEBUG
+// Mnemonics for each condition code, indexed by `cc - JCC_JB`.
+static char * JCC_NAMES[] = {"jb", "jae", "je", "jne", "jbe", "ja"};
+#endif
+
+// Emits a conditional jump with a 32 bit relative offset to a side exit, which
+// we don't know the location of yet. Returns the position of the offset in the
+// chunk so it can be patched later.
+static size_t asm_jcc(MCodeChunk *chunk, uint8_t cc, int exit) {
+#ifdef ASM_DEBUG
+	printf("%s ->exit %d\n", JCC_NAMES[cc - JCC_JB], exit);
+#endif
+	asm_append_u8(chunk, 0x0f);
+	asm_append_u8(chunk, cc);
+	size_t offset = chunk->ins_count;
+	asm_append_u32(chunk, 0);
+	return offset;
+}
+
+// Patches the 32 bit relative offset of a jump, emitted at `offset` in the
+// chunk, so that it jumps to `target` (which can be before or after the jump).
+static void asm_patch_rel32(MCodeChunk *chunk, size_t offset, size_t target) {
+	// The offset is relative to the end of the jump instruction
+	int64_t diff = (int64_t) target - (int64_t) (offset + 4);
+	uint32_t rel = (uint32_t) (int32_t) diff;
+#if HY_ARCH_ENDIAN == HY_ENDIAN_LITTLE
+	chunk->ins[offset]     = (uint8_t) rel;
+	chunk->ins[offset + 1] = (uint8_t) (rel >> 8);
+	chunk->ins[offset + 2] = (uint8_t) (rel >> 16);
+	chunk->ins[offset + 3] = (uint8_t) (rel >> 24);
+#else
+	chunk->ins[offset]     = (uint8_t) (rel >> 24);
+	chunk->ins[offset + 1] = (uint8_t) (rel >> 16);
+	chunk->ins[offset + 2] = (uint8_t) (rel >> 8);
+	chunk->ins[offset + 3] = (uint8_t) rel;
+#endif
+}
+
+// Emits `sub rsp, imm32` or `add rsp, imm32`, to allocate or free space on the
+// native stack.
+static void asm_adjust_rsp(MCodeChunk *chunk, bool allocate, uint32_t size) {
+#ifdef ASM_DEBUG
+	printf("%s rsp, 0x%x\n", allocate ? "sub" : "add", size);
+#endif
+	asm_rex(chunk, true, 0, REG_RSP);
+	asm_append_u8(chunk, 0x81);
+	asm_modrm_reg(chunk, allocate ? 5 : 0, REG_RSP);
+	asm_append_u32(chunk, size);
+}
+
+// Emits `jmp rel32`, returning the position of the offset in the chunk so it
+// can be patched later.
+static size_t asm_jmp(MCodeChunk *chunk) {
+	asm_append_u8(chunk, 0xe9);
+	size_t offset = chunk->ins_count;
+	asm_append_u32(chunk, 0);
+	return offset;
+}
+
+// Emits `jmp r64`.
+static void asm_jmp_reg(MCodeChunk *chunk, int reg) {
+#ifdef ASM_DEBUG
+	printf("jmp %s\n", GPR_NAMES[reg]);
+#endif
+	asm_rex(chunk, false, 0, reg);
+	asm_append_u8(chunk, 0xff);
+	asm_modrm_reg(chunk, 4, reg);
+}
+
+// Emits `jmp [r64]`, an indirect jump to the address stored in memory.
+static void asm_jmp_mem(MCodeChunk *chunk, int reg) {
+#ifdef ASM_DEBUG
+	printf("jmp [%s]\n", GPR_NAMES[reg]);
+#endif
+	asm_rex(chunk, false, 0, reg);
+	asm_append_u8(chunk, 0xff);
+	asm_modrm_mem(chunk, 4, reg, 0);
+}
+
+// Emits `ret`.
+static void asm_ret(MCodeChunk *chunk) {
+#ifdef ASM_DEBUG
+	printf("ret\n");
+#endif
+	asm_append_u8(chunk, 0xc3);
 }
 
 
 // ---- Machine Code Generation -----------------------------------------------
 
+// Opcodes for scalar double SSE/AVX instructions.
+#define SD_LOAD  0x10
+#define SD_STORE 0x11
+#define SD_ADD   0x58
+#define SD_MUL   0x59
+#define SD_SUB   0x5c
+#define SD_DIV   0x5e
+#define PD_XOR   0x57
+
+// Emits a load of a value from a spill slot into an xmm register.
+static void asm_spill_load(MCodeChunk *chunk, int xmm, int slot) {
+#ifdef ASM_DEBUG
+	printf("movsd xmm%d, [rsp + 0x%x]\n", xmm, slot * 8);
+#endif
+	asm_sd_mem(chunk, SD_LOAD, xmm, REG_RSP, (int32_t) (slot * sizeof(Value)));
+}
+
+// Emits a store of an xmm register into a spill slot.
+static void asm_spill_store(MCodeChunk *chunk, int slot, int xmm) {
+#ifdef ASM_DEBUG
+	printf("movsd [rsp + 0x%x], xmm%d\n", slot * 8, xmm);
+#endif
+	asm_sd_mem(chunk, SD_STORE, xmm, REG_RSP, (int32_t) (slot * sizeof(Value)));
+}
+
+// Returns the register holding the result of an instruction that we want to
+// use as an operand. If the result has been spilled, then it's reloaded into
+// the `scratch` register first.
+static int asm_use(MCodeChunk *chunk, Trace *trace, IrRef ref, int scratch) {
+	uint16_t reg = ir_reg(trace->ir[ref]);
+	if (asm_is_spilled(reg)) {
+		asm_spill_load(chunk, scratch, asm_spill_slot(reg));
+		return scratch;
+	}
+	return reg;
+}
+
+// Returns the register an instruction should compute its result into. A
+// spilled result is computed into the spill register, and then written to its
+// spill slot by `asm_def`.
+static int asm_dest(IrIns ins) {
+	uint16_t reg = ir_reg(ins);
+	return asm_is_spilled(reg) ? REG_XMM_SPILL : reg;
+}
+
+// Writes an instruction's result to its spill slot, if it's been spilled.
+static void asm_def(MCodeChunk *chunk, IrIns ins, int reg) {
+	if (asm_is_spilled(ir_reg(ins))) {
+		asm_spill_store(chunk, asm_spill_slot(ir_reg(ins)), reg);
+	}
+}
+
 // Assemble a load stack instruction.
 static void asm_load_stack(MCodeChunk *chunk, Trace *trace, IrIns ins) {
 	// movsd xmm<reg>, [<stack> + <offset> * 8]
-	uint16_t dest_reg = ir_reg(ins);
+	int dest_reg = asm_dest(ins);
 	uint32_t stack_slot = ir_arg32(ins);
 #ifdef ASM_DEBUG
 	if (stack_slot == 0) {
-		printf("movsd xmm%d, [rdx]\n", dest_reg);
+		printf("movsd xmm%d, [%s]\n", dest_reg, GPR_NAMES[REG_STACK]);
 	} else {
-		printf("movsd xmm%d, [rdx + 0x%x]\n", dest_reg, stack_slot * 8);
+		printf("movsd xmm%d, [%s + 0x%x]\n", dest_reg, GPR_NAMES[REG_STACK],
+			stack_slot * 8);
 	}
 #endif
-
-	// TODO: instruction encoding
+	asm_sd_mem(chunk, SD_LOAD, dest_reg, REG_STACK,
+		(int32_t) (stack_slot * sizeof(Value)));
+	asm_def(chunk, ins, dest_reg);
 }
 
 // Assemble a load constant instruction.
 static void asm_load_const(MCodeChunk *chunk, Trace *trace, IrIns ins) {
 	// movsd xmm<reg>, [<consts> + <offset> * 8]
-	uint16_t dest_reg = ir_reg(ins);
+	//
+	// We index off the constants pointer that the trace is called with rather
+	// than embedding the constant's absolute address, since the VM's
+	// constants list can move if it needs to grow.
+	int dest_reg = asm_dest(ins);
 	uint32_t const_slot = ir_arg32(ins);
-	size_t offset = (size_t) &trace->vm->consts[const_slot];
 #ifdef ASM_DEBUG
-	printf("movsd xmm%d, [0x%zx]\n", dest_reg, offset);
+	if (const_slot == 0) {
+		printf("movsd xmm%d, [%s]\n", dest_reg, GPR_NAMES[REG_CONSTS]);
+	} else {
+		printf("movsd xmm%d, [%s + 0x%x]\n", dest_reg, GPR_NAMES[REG_CONSTS],
+			const_slot * 8);
+	}
+#endif
+	asm_sd_mem(chunk, SD_LOAD, dest_reg, REG_CONSTS,
+		(int32_t) (const_slot * sizeof(Value)));
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a store stack instruction.
+static void asm_store_stack(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	// movsd [<stack> + <offset> * 8], xmm<reg>
+	uint32_t stack_slot = ir_arg1(ins);
+	int src_reg = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SPILL);
+#ifdef ASM_DEBUG
+	if (stack_slot == 0) {
+		printf("movsd [%s], xmm%d\n", GPR_NAMES[REG_STACK], src_reg);
+	} else {
+		printf("movsd [%s + 0x%x], xmm%d\n", GPR_NAMES[REG_STACK],
+			stack_slot * 8, src_reg);
+	}
 #endif
+	asm_sd_mem(chunk, SD_STORE, src_reg, REG_STACK,
+		(int32_t) (stack_slot * sizeof(Value)));
+}
+
+// Moves the address of the object held in an xmm register into rax, by masking
+// out its NaN-boxing tag.
+//   movq rax, xmm<obj>
+//   mov r11, PTR_MASK
+//   and rax, r11
+static void asm_obj_addr(MCodeChunk *chunk, Trace *trace, IrRef obj) {
+	int obj_reg = asm_use(chunk, trace, obj, REG_XMM_SCRATCH);
+	asm_movq_to_gpr(chunk, REG_RAX, obj_reg);
+	asm_mov_imm64(chunk, REG_R11, PTR_MASK);
+	asm_and_gpr(chunk, REG_RAX, REG_R11);
 }
 
-// Assemble an add instruction.
-static void asm_add(MCodeChunk *chunk, Trace *trace, IrIns ins) {
-	// movsd xmm<dest>, xmm<arg1>
-	// addsd xmm<dest>, xmm<arg2>
-	uint16_t dest_reg = ir_reg(ins);
-	uint16_t arg1_reg = ir_reg(trace->ir[ir_arg1(ins)]);
-	uint16_t arg2_reg = ir_reg(trace->ir[ir_arg2(ins)]);
+// Assemble a field reference, which computes the address of a field in an
+// object
+//   <object address into rax>
+//   add rax, <offset of field>
+//   movq xmm<dest>, rax
+static void asm_fref(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	int dest_reg = asm_dest(ins);
+	uint32_t offset = (uint32_t) (offsetof(Object, fields) +
+		ir_arg2(ins) * sizeof(Value));
+	asm_obj_addr(chunk, trace, ir_arg1(ins));
+	asm_add_imm32(chunk, REG_RAX, offset);
+	asm_movq_from_gpr(chunk, dest_reg, REG_RAX);
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble an array element reference, which computes the address of an
+// element in an array. The index has already been guarded, so it's an integer
+// in bounds
+//   <array address into rax>
+//   cvttsd2si r11, xmm<index>
+//   shl r11, 3
+//   add rax, r11
+//   add rax, <offset of elements>
+//   movq xmm<dest>, rax
+static void asm_aref(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	int dest_reg = asm_dest(ins);
+	asm_obj_addr(chunk, trace, ir_arg1(ins));
+	int index_reg = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SCRATCH);
+	asm_cvttsd2si(chunk, REG_R11, index_reg);
+	asm_shl_imm8(chunk, REG_R11, 3);
+	asm_add_gpr(chunk, REG_RAX, REG_R11);
+	asm_add_imm32(chunk, REG_RAX, (uint32_t) offsetof(Array, elements));
+	asm_movq_from_gpr(chunk, dest_reg, REG_RAX);
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a load field instruction.
+static void asm_load_field(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	// movq rax, xmm<fref>
+	// movsd xmm<dest>, [rax]
+	int fref_reg = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SCRATCH);
+	int dest_reg = asm_dest(ins);
+	asm_movq_to_gpr(chunk, REG_RAX, fref_reg);
+#ifdef ASM_DEBUG
+	printf("movsd xmm%d, [rax]\n", dest_reg);
+#endif
+	asm_sd_mem(chunk, SD_LOAD, dest_reg, REG_RAX, 0);
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a store field instruction.
+static void asm_store_field(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	// movq rax, xmm<fref>
+	// movsd [rax], xmm<src>
+	int fref_reg = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SCRATCH);
+	int src_reg = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SPILL);
+	asm_movq_to_gpr(chunk, REG_RAX, fref_reg);
+#ifdef ASM_DEBUG
+	printf("movsd [rax], xmm%d\n", src_reg);
+#endif
+	asm_sd_mem(chunk, SD_STORE, src_reg, REG_RAX, 0);
+}
+
+// Assemble a binary arithmetic instruction.
+static void asm_arith(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	uint8_t op;
+	bool commutative;
+	switch (ir_op(ins)) {
+		case IR_ADD: op = SD_ADD; commutative = true; break;
+		case IR_SUB: op = SD_SUB; commutative = false; break;
+		case IR_MUL: op = SD_MUL; commutative = true; break;
+		case IR_DIV: op = SD_DIV; commutative = false; break;
+		default: assert(false); return;
+	}
+#ifdef ASM_DEBUG
+	char *mnemonic = op == SD_ADD ? "addsd" : op == SD_SUB ? "subsd" :
+		op == SD_MUL ? "mulsd" : "divsd";
+#endif
+
+	// Spilled operands are reloaded into the spill and scratch registers, so
+	// they never clash with each other or the destination
+	int arg1_reg = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SPILL);
+	int arg2_reg = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SCRATCH);
+	int dest_reg = asm_dest(ins);
+#if HY_ARCH_FP == HY_AVX
+	// v<op>sd xmm<dest>, xmm<arg1>, xmm<arg2>
 #ifdef ASM_DEBUG
+	printf("v%s xmm%d, xmm%d, xmm%d\n", mnemonic, dest_reg, arg1_reg, arg2_reg);
+#endif
+	asm_vex_reg(chunk, VEX_PP_F2, op, dest_reg, arg1_reg, arg2_reg);
+#else
+	// movapd xmm<dest>, xmm<arg1>
+	// <op>sd xmm<dest>, xmm<arg2>
+	//
+	// The register allocator might give the destination the same register as
+	// the right operand, in which case moving the left operand into the
+	// destination would clobber the right operand
+	if (dest_reg == arg2_reg && dest_reg != arg1_reg) {
+		if (commutative) {
+			// Just swap the operands
+			arg2_reg = arg1_reg;
+			arg1_reg = dest_reg;
+		} else {
+			// Move the right operand out of the way first
+			asm_movapd(chunk, REG_XMM_SCRATCH, arg2_reg);
+			arg2_reg = REG_XMM_SCRATCH;
+		}
+	}
 	if (dest_reg != arg1_reg) {
-		printf("movsd xmm%d, xmm%d\n", dest_reg, arg1_reg);
+		asm_movapd(chunk, dest_reg, arg1_reg);
+	}
+#ifdef ASM_DEBUG
+	printf("%s xmm%d, xmm%d\n", mnemonic, dest_reg, arg2_reg);
+#endif
+	asm_sse_reg(chunk, 0xf2, op, dest_reg, arg2_reg);
+#endif
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a negation instruction.
+static void asm_neg(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	// mov rax, <sign bit>
+	// movq xmm<scratch>, rax
+	// xorpd xmm<dest>, xmm<scratch>
+	//
+	// Flipping the sign bit (rather than subtracting from 0) gives the correct
+	// result for 0 and NaN
+	int arg_reg = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SPILL);
+	int dest_reg = asm_dest(ins);
+	asm_mov_imm64(chunk, REG_RAX, SIGN);
+	asm_movq_from_gpr(chunk, REG_XMM_SCRATCH, REG_RAX);
+#if HY_ARCH_FP == HY_AVX
+#ifdef ASM_DEBUG
+	printf("vxorpd xmm%d, xmm%d, xmm%d\n", dest_reg, arg_reg, REG_XMM_SCRATCH);
+#endif
+	asm_vex_reg(chunk, VEX_PP_66, PD_XOR, dest_reg, arg_reg, REG_XMM_SCRATCH);
+#else
+	if (dest_reg != arg_reg) {
+		asm_movapd(chunk, dest_reg, arg_reg);
+	}
+#ifdef ASM_DEBUG
+	printf("xorpd xmm%d, xmm%d\n", dest_reg, REG_XMM_SCRATCH);
+#endif
+	asm_sse_reg(chunk, 0x66, PD_XOR, dest_reg, REG_XMM_SCRATCH);
+#endif
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a load primitive or load function instruction.
+static void asm_load_prim(MCodeChunk *chunk, Trace *trace, IrIns ins) {
+	// mov rax, <tagged primitive or function>
+	// movq xmm<reg>, rax
+	int dest_reg = asm_dest(ins);
+	Value tag = (ir_op(ins) == IR_LOAD_FN) ? TAG_FN : TAG_PRIM;
+	asm_mov_imm64(chunk, REG_RAX, tag | ir_arg32(ins));
+	asm_movq_from_gpr(chunk, dest_reg, REG_RAX);
+	asm_def(chunk, ins, dest_reg);
+}
+
+// Assemble a type guard, which checks the NaN-boxing tag of a value. We mask
+// out the tag bits and compare them against what we expect
+//   movq rax, xmm<a>
+//   mov r11, mask
+//   and rax, r11
+//   mov r11, tag (if it's different from the mask)
+//   cmp rax, r11
+//   jne ->exit
+//
+// Numbers are anything that isn't a quiet NaN with the tag bits set, so for
+// them the jump is inverted (we exit if all the NaN bits are set).
+static size_t asm_type_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	uint64_t mask, tag;
+	switch (ir_op(ins)) {
+		case IR_IS_NUM:  mask = QUIET_NAN;            tag = QUIET_NAN; break;
+		case IR_IS_PRIM: mask = ~((uint64_t) 0xffff); tag = TAG_PRIM;  break;
+		case IR_IS_FN:   mask = ~((uint64_t) 0xffff); tag = TAG_FN;    break;
+		case IR_IS_PTR:  mask = TAG_PTR;              tag = TAG_PTR;   break;
+		default: assert(false); return 0;
+	}
+
+	int a = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SCRATCH);
+	asm_movq_to_gpr(chunk, REG_RAX, a);
+	asm_mov_imm64(chunk, REG_R11, mask);
+	asm_and_gpr(chunk, REG_RAX, REG_R11);
+	if (tag != mask) {
+		asm_mov_imm64(chunk, REG_R11, tag);
+	}
+	asm_cmp_gpr(chunk, REG_RAX, REG_R11);
+	uint8_t cc = (ir_op(ins) == IR_IS_NUM) ? JCC_JE : JCC_JNE;
+	return asm_jcc(chunk, cc, exit);
+}
+
+// Assemble a shape guard, which compares the shape stored in an object's
+// header against the one we expect (SHAPE_ARRAY for an array guard)
+//   <object address into rax>
+//   cmp dword [rax + <shape offset>], <shape>
+//   jne ->exit
+static size_t asm_shape_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	uint32_t shape = (ir_op(ins) == IR_IS_ARRAY) ? SHAPE_ARRAY : ir_arg2(ins);
+	asm_obj_addr(chunk, trace, ir_arg1(ins));
+	asm_cmp_mem32_imm32(chunk, REG_RAX, (int32_t) offsetof(Object, shape),
+		shape);
+	return asm_jcc(chunk, JCC_JNE, exit);
+}
+
+// Assemble an integer guard, which converts a number to an integer and back,
+// and checks it's unchanged. NaN compares as equal to anything here, which is
+// fine since it always fails the bounds check that follows
+//   cvttsd2si r11, xmm<a>
+//   cvtsi2sd xmm<scratch>, r11
+//   ucomisd xmm<a>, xmm<scratch>
+//   jne ->exit
+static size_t asm_int_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	int a = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SPILL);
+	asm_cvttsd2si(chunk, REG_R11, a);
+	asm_cvtsi2sd(chunk, REG_XMM_SCRATCH, REG_R11);
+	asm_ucomisd(chunk, a, REG_XMM_SCRATCH);
+	return asm_jcc(chunk, JCC_JNE, exit);
+}
+
+// Assemble a bounds check, which compares an integer index against the length
+// of an array. The comparison is unsigned, so a negative index (or NaN, which
+// converts to INT64_MIN) is out of bounds too
+//   <array address into rax>
+//   cvttsd2si r11, xmm<index>
+//   cmp r11, qword [rax + <length offset>]
+//   jae ->exit
+static size_t asm_bounds_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	asm_obj_addr(chunk, trace, ir_arg1(ins));
+	int index = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SCRATCH);
+	asm_cvttsd2si(chunk, REG_R11, index);
+	asm_cmp_gpr_mem64(chunk, REG_R11, REG_RAX,
+		(int32_t) offsetof(Array, length));
+	return asm_jcc(chunk, JCC_JAE, exit);
+}
+
+// Assemble a write barrier guard, which leaves the trace if the object has its
+// barrier flag set
+//   <object address into rax>
+//   test byte [rax + <flags offset>], GC_BARRIER
+//   jnz ->exit
+static size_t asm_barrier_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	asm_obj_addr(chunk, trace, ir_arg1(ins));
+	asm_test_mem8_imm8(chunk, REG_RAX, (int32_t) offsetof(Object, gc),
+		GC_BARRIER);
+	return asm_jcc(chunk, JCC_JNE, exit);
+}
+
+// Assemble a guard instruction, which jumps to the side exit `exit` if its
+// condition doesn't hold. Returns the position of the jump's offset in the
+// chunk, to be patched once we know where the side exit is.
+static size_t asm_guard(MCodeChunk *chunk, Trace *trace, IrIns ins,
+		int exit) {
+	if (ir_op(ins) >= IR_IS_NUM && ir_op(ins) <= IR_IS_PTR) {
+		return asm_type_guard(chunk, trace, ins, exit);
+	}
+	if (ir_op(ins) == IR_IS_SHAPE || ir_op(ins) == IR_IS_ARRAY) {
+		return asm_shape_guard(chunk, trace, ins, exit);
+	}
+	if (ir_op(ins) == IR_BARRIER) {
+		return asm_barrier_guard(chunk, trace, ins, exit);
+	}
+	if (ir_op(ins) == IR_IS_INT) {
+		return asm_int_guard(chunk, trace, ins, exit);
+	}
+	if (ir_op(ins) == IR_IN_BOUNDS) {
+		return asm_bounds_guard(chunk, trace, ins, exit);
+	}
+
+	int a = asm_use(chunk, trace, ir_arg1(ins), REG_XMM_SPILL);
+	int b = asm_use(chunk, trace, ir_arg2(ins), REG_XMM_SCRATCH);
+
+	// Equality compares values bit for bit (like the interpreter), so compare
+	// them as integers
+	//   movq rax, xmm<a>
+	//   movq r11, xmm<b>
+	//   cmp rax, r11
+	//   jne/je ->exit
+	if (ir_op(ins) == IR_EQ || ir_op(ins) == IR_NEQ) {
+		asm_movq_to_gpr(chunk, REG_RAX, a);
+		asm_movq_to_gpr(chunk, REG_R11, b);
+		asm_cmp_gpr(chunk, REG_RAX, REG_R11);
+		uint8_t cc = (ir_op(ins) == IR_EQ) ? JCC_JNE : JCC_JE;
+		return asm_jcc(chunk, cc, exit);
+	}
+
+	// Ordered comparisons use `ucomisd`, which only gives us "above" and
+	// "below" conditions, so we swap the operands where necessary. An
+	// unordered result (a NaN operand) sets the flags like "below", so the
+	// ordered guards fail on NaN, and the unordered ones (their negations)
+	// pass
+	//   ucomisd xmm<a>, xmm<b>
+	//   j<cc> ->exit
+	bool swap;
+	uint8_t cc;
+	switch (ir_op(ins)) {
+		case IR_LT:  swap = true;  cc = JCC_JBE; break;
+		case IR_LE:  swap = true;  cc = JCC_JB;  break;
+		case IR_GT:  swap = false; cc = JCC_JBE; break;
+		case IR_GE:  swap = false; cc = JCC_JB;  break;
+		case IR_ULT: swap = false; cc = JCC_JAE; break;
+		case IR_ULE: swap = false; cc = JCC_JA;  break;
+		case IR_UGT: swap = true;  cc = JCC_JAE; break;
+		case IR_UGE: swap = true;  cc = JCC_JA;  break;
+		default: assert(false); return 0;
+	}
+	if (swap) {
+		asm_ucomisd(chunk, b, a);
+	} else {
+		asm_ucomisd(chunk, a, b);
+	}
+	return asm_jcc(chunk, cc, exit);
+}
+
+// Emits a jump to some code that's already been installed in executable
+// memory. The target might not be within 2 GB of the jump, so we go via rax.
+static void asm_jmp_abs(MCodeChunk *chunk, void *target) {
+	asm_mov_imm64(chunk, REG_RAX, (uint64_t) (uintptr_t) target);
+	asm_jmp_reg(chunk, REG_RAX);
+}
+
+#if HY_OS == HY_OS_WINDOWS
+// The Windows calling convention makes xmm6 and above callee saved, so a root
+// trace saves all of them when it's called, and each side exit restores them
+// before returning to the interpreter. We save the whole of each register,
+// since the upper half is preserved too.
+#define WIN64_FIRST_SAVED_XMM 6
+#define WIN64_XMM_SAVE_SIZE (16 * (HY_ARCH_NUM_REGS - WIN64_FIRST_SAVED_XMM))
+
+// Opcodes for moving a whole xmm register to or from memory with `movupd`.
+#define PD_LOAD  0x10
+#define PD_STORE 0x11
+
+// Emits `movupd` with a register destination and memory source, or a memory
+// destination and register source, depending on the opcode.
+static void asm_pd_mem(MCodeChunk *chunk, uint8_t op, int xmm, int base,
+		int32_t disp) {
+#ifdef ASM_DEBUG
+	if (op == PD_LOAD) {
+		printf("movupd xmm%d, [%s + 0x%x]\n", xmm, GPR_NAMES[base], disp);
+	} else {
+		printf("movupd [%s + 0x%x], xmm%d\n", GPR_NAMES[base], disp, xmm);
+	}
+#endif
+#if HY_ARCH_FP == HY_AVX
+	asm_vex_prefix(chunk, VEX_PP_66, false, xmm, 0, base);
+#else
+	asm_sse_prefix(chunk, 0x66, false, xmm, base);
+#endif
+	asm_append_u8(chunk, op);
+	asm_modrm_mem(chunk, xmm, base, disp);
+}
+
+// Saves the callee saved xmm registers onto the native stack.
+static void asm_save_xmm(MCodeChunk *chunk) {
+	asm_adjust_rsp(chunk, true, WIN64_XMM_SAVE_SIZE);
+	for (int i = WIN64_FIRST_SAVED_XMM; i < HY_ARCH_NUM_REGS; i++) {
+		asm_pd_mem(chunk, PD_STORE, i, REG_RSP,
+			16 * (i - WIN64_FIRST_SAVED_XMM));
+	}
+}
+
+// Restores the callee saved xmm registers from the native stack.
+static void asm_restore_xmm(MCodeChunk *chunk) {
+	for (int i = WIN64_FIRST_SAVED_XMM; i < HY_ARCH_NUM_REGS; i++) {
+		asm_pd_mem(chunk, PD_LOAD, i, REG_RSP,
+			16 * (i - WIN64_FIRST_SAVED_XMM));
+	}
+	asm_adjust_rsp(chunk, false, WIN64_XMM_SAVE_SIZE);
+}
+#endif
+
+// Assemble the side exit for a snapshot, which writes the stack slots
+// modified by the trace back to the stack, frees the trace's spill slots, and
+// jumps through the exit's link (see `TraceExit::link`). `first_exit` is the
+// index of the trace's first exit in its root trace's list of exits.
+//
+// Until a side trace is attached to the exit, its link points at the code
+// straight after the jump, which returns the exit's index (restoring any
+// registers the root trace saved when it was called).
+static void asm_exit(MCodeChunk *chunk, Trace *trace, int exit,
+		int first_exit, uint32_t frame_size) {
+#ifdef ASM_DEBUG
+	printf("->exit %d:\n", first_exit + exit);
+#endif
+	Snapshot *snap = &trace->snaps[exit];
+	for (int i = 0; i < snap->entries_count; i++) {
+		SnapshotEntry *entry = &trace->snap_entries[snap->first_entry + i];
+		IrIns store = ir_new2(IR_STORE_STACK, entry->slot, entry->ref);
+		asm_store_stack(chunk, trace, store);
+	}
+	if (frame_size > 0) {
+		asm_adjust_rsp(chunk, false, frame_size);
 	}
-	printf("addsd xmm%d, xmm%d\n", dest_reg, arg2_reg);
+
+	asm_mov_imm64(chunk, REG_RAX, (uint64_t) (uintptr_t) &trace->links[exit]);
+	asm_jmp_mem(chunk, REG_RAX);
+	trace->exit_returns[exit] = chunk->ins_count;
+	asm_mov_imm32(chunk, REG_RAX, (uint32_t) (first_exit + exit));
+#if HY_OS == HY_OS_WINDOWS
+	asm_restore_xmm(chunk);
 #endif
+	asm_ret(chunk);
+}
+
+// Emits a move between two locations, each of which is either a register or a
+// spill slot.
+static void asm_move(MCodeChunk *chunk, uint16_t dest, uint16_t src) {
+	if (!asm_is_spilled(dest) && !asm_is_spilled(src)) {
+		asm_movapd(chunk, dest, src);
+	} else if (!asm_is_spilled(dest)) {
+		asm_spill_load(chunk, dest, asm_spill_slot(src));
+	} else if (!asm_is_spilled(src)) {
+		asm_spill_store(chunk, asm_spill_slot(dest), src);
+	} else {
+		asm_spill_load(chunk, REG_XMM_SPILL, asm_spill_slot(src));
+		asm_spill_store(chunk, asm_spill_slot(dest), REG_XMM_SPILL);
+	}
+}
+
+// Assemble the moves for the PHIs at the end of the loop body, which copy the
+// value of each PHI's right argument into the location (register or spill
+// slot) of its left argument. All the moves conceptually happen at once, so we
+// order them such that we never overwrite a location before it's been read,
+// and break any cycles (e.g. two locals being swapped) using the scratch
+// register.
+static void asm_phis(MCodeChunk *chunk, Trace *trace) {
+	uint16_t *dest = arena_alloc(trace->arena,
+		sizeof(uint16_t) * trace->ir_count);
+	uint16_t *src = arena_alloc(trace->arena,
+		sizeof(uint16_t) * trace->ir_count);
+	int count = 0;
+	for (IrRef i = trace->loop_ref + 1; i < trace->ir_count; i++) {
+		IrIns ins = trace->ir[i];
+		if (ir_op(ins) != IR_PHI) {
+			continue;
+		}
+		uint16_t left = ir_reg(trace->ir[ir_arg1(ins)]);
+		uint16_t right = ir_reg(trace->ir[ir_arg2(ins)]);
+		if (left != right) {
+			dest[count] = left;
+			src[count] = right;
+			count++;
+		}
+	}
+
+	while (count > 0) {
+		// Find a move whose destination isn't needed by any other move
+		int move = -1;
+		for (int i = 0; i < count && move < 0; i++) {
+			move = i;
+			for (int j = 0; j < count; j++) {
+				if (j != i && src[j] == dest[i]) {
+					move = -1;
+					break;
+				}
+			}
+		}
+
+		if (move < 0) {
+			// Every remaining move is part of a cycle, so save the first
+			// move's destination in the scratch register and read it from
+			// there instead
+			asm_move(chunk, REG_XMM_SCRATCH, dest[0]);
+			for (int j = 1; j < count; j++) {
+				if (src[j] == dest[0]) {
+					src[j] = REG_XMM_SCRATCH;
+				}
+			}
+			move = 0;
+		}
+
+		asm_move(chunk, dest[move], src[move]);
+		count--;
+		dest[move] = dest[count];
+		src[move] = src[count];
+	}
 }
 
 // Assemble a single IR instruction.
@@ -175,9 +1384,23 @@ static void asm_ins(MCodeChunk *chunk, Trace *trace, IrIns ins) {
 		// Loads
 	case IR_LOAD_STACK: asm_load_stack(chunk, trace, ins); break;
 	case IR_LOAD_CONST: asm_load_const(chunk, trace, ins); break;
+	case IR_LOAD_PRIM:  asm_load_prim(chunk, trace, ins); break;
+	case IR_LOAD_FN:    asm_load_prim(chunk, trace, ins); break;
 
 		// Arithmetic
-	case IR_ADD: asm_add(chunk, trace, ins); break;
+	case IR_ADD: case IR_SUB: case IR_MUL: case IR_DIV:
+		asm_arith(chunk, trace, ins);
+		break;
+	case IR_NEG: asm_neg(chunk, trace, ins); break;
+
+		// Stores
+	case IR_STORE_STACK: asm_store_stack(chunk, trace, ins); break;
+	case IR_STORE_FIELD: asm_store_field(chunk, trace, ins); break;
+
+		// Fields
+	case IR_FREF:       asm_fref(chunk, trace, ins); break;
+	case IR_LOAD_FIELD: asm_load_field(chunk, trace, ins); break;
+	case IR_AREF:       asm_aref(chunk, trace, ins); break;
 
 		// Other (do nothing)
 	default: break;
@@ -187,15 +1410,82 @@ static void asm_ins(MCodeChunk *chunk, Trace *trace, IrIns ins) {
 // Assembles an IR trace into a chunk of machine code.
 MCodeChunk jit_assemble(Trace *trace) {
 	// Perform register allocation first
-	asm_allocate_registers(trace);
+	int spill_slots = asm_allocate_registers(trace);
 
 	// Create an empty machine code chunk
-	MCodeChunk chunk = asm_new();
+	MCodeChunk chunk = asm_new(trace->arena);
+
+	// A root trace saves any registers the calling convention needs it to
+	// preserve. Side traces jump back into it past this, since the registers
+	// are already saved
+#if HY_OS == HY_OS_WINDOWS
+	if (trace->root == NULL) {
+		asm_save_xmm(&chunk);
+	}
+#endif
+	trace->entry = chunk.ins_count;
+
+	// Reserve space on the native stack for spilled values, keeping the stack
+	// pointer 16 byte aligned
+	uint32_t frame_size = (uint32_t) (spill_slots * sizeof(Value) + 15) & ~15u;
+	if (frame_size > 0) {
+		asm_adjust_rsp(&chunk, true, frame_size);
+	}
+
+	// Keep track of the jump to each side exit, so we can patch them once we
+	// know where the exits are
+	size_t *exit_jumps = arena_alloc(trace->arena,
+		sizeof(size_t) * (trace->snaps_count + 1));
+	int guards_count = 0;
 
 	// Assemble the IR instruction by instruction
-	for (size_t i = 1; i < trace->ir_count; i++) {
-		asm_ins(&chunk, trace, trace->ir[i]);
+	size_t loop_start = 0;
+	for (int i = 1; i < trace->ir_count; i++) {
+		IrIns ins = trace->ir[i];
+		if (ir_op_prefix(ins) == IROP_PREFIX_GUARD) {
+			// Guards appear in the same order as their snapshots
+			assert(guards_count < trace->snaps_count);
+			assert(trace->snaps[guards_count].guard == i);
+			exit_jumps[guards_count] = asm_guard(&chunk, trace, ins,
+				guards_count);
+			guards_count++;
+		} else if (ir_op(ins) == IR_LOOP) {
+#ifdef ASM_DEBUG
+			printf("->loop:\n");
+#endif
+			loop_start = chunk.ins_count;
+		} else {
+			asm_ins(&chunk, trace, ins);
+		}
 	}
 
+	if (trace->root == NULL) {
+		// Jump back to the start of the loop body. We only ever leave the
+		// trace through a side exit
+		asm_phis(&chunk, trace);
+#ifdef ASM_DEBUG
+		printf("jmp ->loop\n");
+#endif
+		size_t loop_jump = asm_jmp(&chunk);
+		asm_patch_rel32(&chunk, loop_jump, loop_start);
+	} else {
+		// A side trace has already written everything back to the stack, so
+		// it frees its spill slots and carries on with the root trace, which
+		// allocates its own
+		if (frame_size > 0) {
+			asm_adjust_rsp(&chunk, false, frame_size);
+		}
+		asm_jmp_abs(&chunk, trace->root->entry);
+	}
+
+	// Side exits are placed after the loop. A side trace's exits are numbered
+	// after all of its root trace's existing exits
+	int first_exit = trace->first_exit;
+	trace->exit_returns = arena_alloc(trace->arena,
+		sizeof(size_t) * (trace->snaps_count + 1));
+	for (int i = 0; i < guards_count; i++) {
+		asm_patch_rel32(&chunk, exit_jumps[i], chunk.ins_count);
+		asm_exit(&chunk, trace, i, first_exit, frame_size);
+	}
 	return chunk;
 }
@@ -5,20 +5,24 @@
 
 #include "assembler.h"
 
-// Allocates a new machine code chunk.
-MCodeChunk asm_new() {
+// Allocates a new machine code chunk from an arena. The chunk is freed when
+// the arena is reset.
+MCodeChunk asm_new(Arena *arena) {
 	MCodeChunk chunk;
+	chunk.arena = arena;
 	chunk.ins_count = 0;
-	chunk.ins_capacity = 64;
-	chunk.ins = malloc(sizeof(uint8_t) * chunk.ins_capacity);
+	chunk.ins_capacity = 1024;
+	chunk.ins = arena_alloc(arena, sizeof(uint8_t) * chunk.ins_capacity);
 	return chunk;
 }
 
 // Appends a byte to the assembly chunk.
 void asm_append_u8(MCodeChunk *chunk, uint8_t arg) {
 	if (chunk->ins_count >= chunk->ins_capacity) {
+		chunk->ins = arena_realloc(chunk->arena, chunk->ins,
+			sizeof(uint8_t) * chunk->ins_capacity,
+			sizeof(uint8_t) * chunk->ins_capacity * 2);
 		chunk->ins_capacity *= 2;
-		chunk->ins = realloc(chunk->ins, sizeof(uint8_t) * chunk->ins_capacity);
 	}
 	chunk->ins[chunk->ins_count++] = arg;
 }
@@ -26,7 +30,7 @@ void asm_append_u8(MCodeChunk *chunk, uint8_t arg) {
 // Appends a uint16_t to the assembly chunk, with the correct byte order
 // depending on the target architecture.
 void asm_append_u16(MCodeChunk *chunk, uint16_t arg) {
-#if ARCH_ENDIAN == ENDIAN_LITTLE
+#if HY_ARCH_ENDIAN == HY_ENDIAN_LITTLE
 	asm_append_u8(chunk, (uint8_t) arg);
 	asm_append_u8(chunk, (uint8_t) (arg >> 8));
 #else
@@ -38,7 +42,7 @@ void asm_append_u16(MCodeChunk *chunk, uint16_t arg) {
 // Appends a uint32_t to the assembly chunk, with the correct byte order
 // depending on the target architecture.
 void asm_append_u32(MCodeChunk *chunk, uint32_t arg) {
-#if ARCH_ENDIAN == ENDIAN_LITTLE
+#if HY_ARCH_ENDIAN == HY_ENDIAN_LITTLE
 	asm_append_u8(chunk, (uint8_t) arg);
 	asm_append_u8(chunk, (uint8_t) (arg >> 8));
 	asm_append_u8(chunk, (uint8_t) (arg >> 16));
@@ -54,7 +58,7 @@ void asm_append_u32(MCodeChunk *chunk, uint32_t arg) {
 // Appends a uint64_t to the assembly chunk, with the correct byte order
 // depending on the target architecture.
 void asm_append_u64(MCodeChunk *chunk, uint64_t arg) {
-#if ARCH_ENDIAN == ENDIAN_LITTLE
+#if HY_ARCH_ENDIAN == HY_ENDIAN_LITTLE
 	asm_append_u8(chunk, (uint8_t) arg);
 	asm_append_u8(chunk, (uint8_t) (arg >> 8));
 	asm_append_u8(chunk, (uint8_t) (arg >> 16));
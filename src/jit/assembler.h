@@ -4,6 +4,7 @@
 // November 2018
 
 #ifndef ASSEMBLER_H
+#define ASSEMBLER_H
 
 #include "arch.h"
 #include "compiler.h"
@@ -18,12 +19,16 @@
 // representation), if we wanted to print the assembly code we're outputting on
 // the fly we'd require an "if" condition at the start of each assembly output
 // function. This would be inefficient in production, so instead we define a
-// compiler flag for debugging, rather than a runtime flag.
-#define ASM_DEBUG // Uncomment to print assembled code
+// compiler flag for debugging, rather than a runtime flag. It's turned on along
+// with the bytecode and IR dumps (configure with `-DDEBUG_DUMP=ON`).
+#ifdef DEBUG_DUMP
+#define ASM_DEBUG
+#endif
 
 // Assembled code is just a sequence of encoded machine instructions, which we
-// store as a byte array.
+// store as a byte array, allocated from the JIT's arena.
 typedef struct {
+	Arena *arena;
 	uint8_t *ins;
 	size_t ins_count, ins_capacity;
 } MCodeChunk;
@@ -31,14 +36,19 @@ typedef struct {
 
 // Interface requiring implementation
 
-// Assembles an IR trace into a chunk of machine code.
+// Assembles an IR trace into a chunk of machine code. A root trace loops
+// forever (until a guard fails), while a side trace jumps back into its root
+// trace once it's done (see `CompiledTrace::entry`). Each side exit jumps
+// through its entry in `trace->links`. Fills in `trace->exit_returns` and
+// `trace->entry`.
 MCodeChunk jit_assemble(Trace *trace);
 
 
 // Common helper functions
 
-// Allocates a new machine code chunk.
-MCodeChunk asm_new();
+// Allocates a new machine code chunk from an arena. The chunk is freed when
+// the arena is reset.
+MCodeChunk asm_new(Arena *arena);
 
 // Appends a byte to the assembly chunk.
 void asm_append_u8(MCodeChunk *chunk, uint8_t byte);
@@ -5,32 +5,235 @@
 
 #include "compiler.h"
 #include "assembler.h"
+#include "worker.h"
+#include "perf.h"
+#include "../parser.h"
+#include "../object.h"
+#include "../array.h"
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
-// Macro for unimplemented functions.
-#define UNIMPLEMENTED() while (1) { assert(false); }
+// Macro for unimplemented recording functions. Rather than crashing, we abort
+// the trace and let the interpreter carry on without it.
+#define UNIMPLEMENTED() trace->aborted = true
+
+
+// ---- Trace Cache -----------------------------------------------------------
+
+// Initial capacity of the trace cache (must be a power of 2).
+#define TRACE_CACHE_INITIAL_CAPACITY 16
+
+// Creates the JIT compiler's state for a new VM.
+JitState * jit_state_new() {
+	JitState *jit = malloc(sizeof(JitState));
+	jit->mcode = NULL;
+	jit->traces_count = 0;
+	jit->traces_capacity = TRACE_CACHE_INITIAL_CAPACITY;
+	jit->traces = calloc(jit->traces_capacity, sizeof(TraceEntry));
+	jit->links = arena_new();
+	jit->retired = NULL;
+	jit->retired_count = 0;
+	jit->retired_capacity = 0;
+	jit->perf_map = NULL;
+	return jit;
+}
+
+// Releases the JIT compiler's state, including all compiled machine code.
+void jit_state_free(JitState *jit) {
+	for (int i = 0; i < jit->traces_capacity; i++) {
+		if (jit->traces[i].loop != NULL) {
+			jit_compiled_free(jit->traces[i].trace);
+		}
+	}
+	mcode_free(jit->mcode);
+	free(jit->traces);
+	arena_free(&jit->links);
+	for (int i = 0; i < jit->retired_count; i++) {
+		free(jit->retired[i]);
+	}
+	free(jit->retired);
+	if (jit->perf_map != NULL) {
+		fclose(jit->perf_map);
+	}
+	free(jit);
+}
+
+// Keeps some memory that's been replaced around until the JIT state is freed,
+// since a VM on another thread could still be reading it.
+static void jit_retire(JitState *jit, void *memory) {
+	if (jit->retired_count >= jit->retired_capacity) {
+		jit->retired_capacity = jit->retired_capacity == 0 ? 8 :
+			jit->retired_capacity * 2;
+		jit->retired = realloc(jit->retired,
+			sizeof(void *) * jit->retired_capacity);
+	}
+	jit->retired[jit->retired_count++] = memory;
+}
+
+// Hashes the address of a BC_LOOP instruction to find its position in a trace
+// cache table with the given capacity.
+static inline int jit_cache_hash(int capacity, BcIns *loop) {
+	// Bytecode instructions are 4 byte aligned, so the lowest 2 bits of the
+	// address carry no information
+	uintptr_t key = ((uintptr_t) loop) >> 2;
+	key ^= key >> 16;
+	return (int) (key & (uintptr_t) (capacity - 1));
+}
+
+// Returns the compiled trace for a loop, or NULL if the loop hasn't been
+// compiled yet.
+//
+// VMs on other threads can add to the cache while we're looking in it. The
+// capacity is loaded before the table: a larger table is always stored
+// before its capacity, so we never index past the end of a table (though we
+// might miss a trace that was only just added, in which case we find it next
+// time).
+CompiledTrace * jit_cache_lookup(JitState *jit, int fn, BcIns *loop) {
+	int capacity = __atomic_load_n(&jit->traces_capacity, __ATOMIC_ACQUIRE);
+	TraceEntry *traces = __atomic_load_n(&jit->traces, __ATOMIC_ACQUIRE);
+
+	// Linear probing until we find the loop or an empty entry
+	int idx = jit_cache_hash(capacity, loop);
+	BcIns *entry_loop;
+	while ((entry_loop = __atomic_load_n(&traces[idx].loop,
+			__ATOMIC_ACQUIRE)) != NULL) {
+		TraceEntry *entry = &traces[idx];
+		if (entry_loop == loop && entry->fn == fn) {
+			return entry->trace;
+		}
+		idx = (idx + 1) & (capacity - 1);
+	}
+	return NULL;
+}
+
+// Adds a trace to a cache table that doesn't contain its loop yet, without
+// checking if the table needs to grow. The entry's loop is stored last, so
+// it's only found once the rest of the entry has been written.
+static void jit_cache_put(TraceEntry *traces, int capacity, int fn,
+		BcIns *loop, CompiledTrace *trace) {
+	int idx = jit_cache_hash(capacity, loop);
+	while (traces[idx].loop != NULL) {
+		idx = (idx + 1) & (capacity - 1);
+	}
+	TraceEntry *entry = &traces[idx];
+	entry->fn = fn;
+	entry->trace = trace;
+	__atomic_store_n(&entry->loop, loop, __ATOMIC_RELEASE);
+}
+
+// Doubles the capacity of the trace cache, re-inserting every entry into a
+// new table. The old table is retired rather than freed.
+static void jit_cache_grow(JitState *jit) {
+	int capacity = jit->traces_capacity * 2;
+	TraceEntry *traces = calloc(capacity, sizeof(TraceEntry));
+	for (int i = 0; i < jit->traces_capacity; i++) {
+		TraceEntry *entry = &jit->traces[i];
+		if (entry->loop != NULL) {
+			jit_cache_put(traces, capacity, entry->fn, entry->loop,
+				entry->trace);
+		}
+	}
+	jit_retire(jit, jit->traces);
+	__atomic_store_n(&jit->traces, traces, __ATOMIC_RELEASE);
+	__atomic_store_n(&jit->traces_capacity, capacity, __ATOMIC_RELEASE);
+}
+
+// Adds a compiled trace for a loop to the cache. The cache takes ownership of
+// the compiled trace. If the loop's already in the cache (because another VM
+// sharing the program compiled it first), then the new trace is freed instead.
+// Returns the trace that's in the cache.
+CompiledTrace * jit_cache_insert(JitState *jit, int fn, BcIns *loop,
+		CompiledTrace *trace) {
+	CompiledTrace *existing = jit_cache_lookup(jit, fn, loop);
+	if (existing != NULL) {
+		jit_compiled_free(trace);
+		return existing;
+	}
+
+	// Keep the load factor below 1/2 so we don't probe for too long
+	if ((jit->traces_count + 1) * 2 > jit->traces_capacity) {
+		jit_cache_grow(jit);
+	}
+	jit_cache_put(jit->traces, jit->traces_capacity, fn, loop, trace);
+	jit->traces_count++;
+	return trace;
+}
+
+// Releases a compiled trace (but not its machine code, which lives in the
+// JIT's executable memory until the VM is freed).
+void jit_compiled_free(CompiledTrace *trace) {
+	if (trace == NULL) {
+		return;
+	}
+	free(trace->exits);
+	free(trace);
+}
+
+
+// ---- Traces ----------------------------------------------------------------
 
 // Create a new JIT trace.
 Trace * jit_trace_new(VM *vm) {
-	Trace *trace = malloc(sizeof(Trace));
+	Arena *arena = &vm->jit_arena;
+	Trace *trace = arena_alloc(arena, sizeof(Trace));
 	trace->vm = vm;
+	trace->arena = arena;
+	trace->loop = NULL;
+	trace->fn = 0;
+	trace->root = NULL;
+	trace->exit = 0;
+	trace->first_exit = 0;
+	trace->pc = NULL;
+	trace->stack = vm->stack;
+	trace->base = 0;
+	trace->depth = 0;
+	trace->call_pc = NULL;
+	trace->slots_count = 0;
+	trace->aborted = false;
 	trace->ir_count = 1;
+	trace->loop_ref = IR_NONE;
 	trace->ir_capacity = 256;
-	trace->ir = malloc(sizeof(IrIns) * trace->ir_capacity);
+	trace->ir = arena_alloc(arena, sizeof(IrIns) * trace->ir_capacity);
 
-	// These arrays have a default value to indicate "not set yet".
-	memset(trace->last_modified, IR_NONE, sizeof(IrRef) * MAX_LOCALS_IN_FN);
-	memset(trace->const_loads, IR_NONE, sizeof(IrRef) * MAX_CONSTS);
+	trace->snaps_count = 0;
+	trace->snaps_capacity = 16;
+	trace->snaps = arena_alloc(arena, sizeof(Snapshot) * trace->snaps_capacity);
+	trace->snap_entries_count = 0;
+	trace->snap_entries_capacity = 64;
+	trace->snap_entries = arena_alloc(arena, sizeof(SnapshotEntry) *
+		trace->snap_entries_capacity);
+	trace->links = NULL;
+	trace->exit_returns = NULL;
+	trace->code = NULL;
+	trace->code_size = 0;
+
+	// Nothing else needs initialising: `last_modified` and `call_state` are
+	// cleared as the trace touches more stack slots, and `cse` is emptied by
+	// `ir_count` being 1
 	return trace;
 }
 
-// Release resources associated with a trace.
+// Release resources associated with a trace, along with everything else
+// allocated while recording and compiling it.
 void jit_trace_free(Trace *trace) {
-	free(trace->ir);
-	free(trace);
+	VM *vm = trace->vm;
+	Arena *arena = trace->arena;
+	if (arena == &vm->jit_arena) {
+		arena_reset(arena);
+		return;
+	}
+
+	// A trace that was handed to the compile thread has an arena of its own.
+	// Give its blocks back to the VM if we can, so they get re-used
+	if (vm->jit_arena.first == NULL) {
+		vm->jit_arena = *arena;
+		arena_reset(&vm->jit_arena);
+	} else {
+		arena_free(arena);
+	}
+	free(arena);
 }
 
 // Pretty print the compiled IR for a trace to the standard output.
@@ -38,33 +241,288 @@ void jit_trace_dump(Trace *trace) {
 	printf("---- Trace ----\n");
 	for (int i = 1; i < trace->ir_count; i++) {
 		IrIns *ins = &trace->ir[i];
-		printf("  %0.4d  %s  %d  %d\n", i, IROP_NAMES[ir_op(*ins)], 
-			ir_arg1(*ins), ir_arg2(*ins));
+		if (ir_op(*ins) == IR_LOOP) {
+			printf("  %04d  %s\n", i, ir_op_name(*ins));
+		} else {
+			printf("  %0.4d  %s  %d  %d\n", i, ir_op_name(*ins),
+				ir_arg1(*ins), ir_arg2(*ins));
+		}
 	}
 }
 
-// Emit an IR instruction that isn't a constant load. Returns the index that can
-// be used to reference the IR instruction.
-static IrRef ir_emit(Trace *trace, IrIns ins) {
+// Append an IR instruction to the end of the trace, without trying to optimise
+// it. Returns the index that can be used to reference the IR instruction.
+static IrRef ir_append(Trace *trace, IrIns ins) {
+	// IR references have to fit into 16 bits, so abort traces that get too long
+	if (trace->ir_count >= MAX_IR_INS) {
+		trace->aborted = true;
+		return IR_NONE;
+	}
+
 	// Check if we need to reallocate the IR array
 	if (trace->ir_count >= trace->ir_capacity) {
+		trace->ir = arena_realloc(trace->arena, trace->ir,
+			sizeof(IrIns) * trace->ir_capacity,
+			sizeof(IrIns) * trace->ir_capacity * 2);
 		trace->ir_capacity *= 2;
-		trace->ir = realloc(trace->ir, sizeof(IrIns) * trace->ir_capacity);
 	}
 
 	// Add the IR instruction
+	trace->cse_bucket[trace->ir_count] = IR_CSE_TABLE_SIZE;
 	trace->ir[trace->ir_count++] = ins;
 	return trace->ir_count - 1;
 }
 
+
+// ---- Optimisation ----------------------------------------------------------
+
+// Instructions are optimised as they're emitted, before they're appended to
+// the trace. Arithmetic on constants is folded into a new constant, and pure
+// instructions (loads and arithmetic) that are identical to an earlier one are
+// replaced by a reference to the earlier instruction. Dead code is removed
+// once the whole trace has been recorded (see `ir_eliminate_dead_code`).
+
+static IrRef ir_load_const(Trace *trace, int const_idx);
+
+// Returns the part of an instruction that identifies what it computes (its
+// opcode and arguments, but not its register).
+static inline uint64_t ir_cse_key(IrIns ins) {
+	return ins & 0x0000ffffffffffff;
+}
+
+// Returns the index of an instruction's bucket in the CSE hash table.
+static inline int ir_cse_hash(IrIns ins) {
+	uint64_t key = ir_cse_key(ins);
+	key ^= key >> 29;
+	key *= 0x9e3779b97f4a7c15;
+	return (int) (key >> 32) & (IR_CSE_TABLE_SIZE - 1);
+}
+
+// Returns true if a bucket in the CSE hash table holds an instruction. The
+// table isn't cleared when a trace is created, so a bucket might hold garbage
+// left over from the previous trace.
+static inline bool ir_cse_used(Trace *trace, int idx) {
+	IrRef ref = trace->cse[idx];
+	return ref != IR_NONE && ref < trace->ir_count &&
+		trace->cse_bucket[ref] == idx;
+}
+
+// Returns a reference to an earlier instruction that's identical to `ins`, or
+// IR_NONE if there isn't one. We never look before the LOOP marker from within
+// the loop body: an instruction in the peeled iteration computes its value
+// once, while an identical one in the loop body might use a PHI whose value
+// changes on every iteration. Constants never change, so constant loads are
+// the exception.
+static IrRef ir_cse_find(Trace *trace, IrIns ins) {
+	uint64_t key = ir_cse_key(ins);
+	int idx = ir_cse_hash(ins);
+	bool invariant = ir_op(ins) == IR_LOAD_CONST;
+	while (ir_cse_used(trace, idx)) {
+		IrRef ref = trace->cse[idx];
+		if ((invariant || ref > trace->loop_ref) &&
+				ir_cse_key(trace->ir[ref]) == key) {
+			return ref;
+		}
+		idx = (idx + 1) & (IR_CSE_TABLE_SIZE - 1);
+	}
+	return IR_NONE;
+}
+
+// Adds an instruction to the CSE hash table. The table can hold every
+// instruction in a trace, so it never fills up.
+static void ir_cse_add(Trace *trace, IrRef ref) {
+	int idx = ir_cse_hash(trace->ir[ref]);
+	while (ir_cse_used(trace, idx)) {
+		idx = (idx + 1) & (IR_CSE_TABLE_SIZE - 1);
+	}
+	trace->cse[idx] = ref;
+	trace->cse_bucket[ref] = (uint16_t) idx;
+}
+
+// Returns true if an instruction doesn't have any side effects, and can
+// therefore be merged with an identical earlier instruction. Field loads
+// aren't pure, since a store to the field could come between them.
+static inline bool ir_is_pure(IrIns ins) {
+	int prefix = ir_op_prefix(ins);
+	return prefix == IROP_PREFIX_LOAD || prefix == IROP_PREFIX_ARITH ||
+		ir_op(ins) == IR_FREF || ir_op(ins) == IR_AREF;
+}
+
+// Returns true if an instruction refers to a constant load.
+static inline bool ir_is_const(Trace *trace, IrRef ref) {
+	return ref != IR_NONE && ir_op(trace->ir[ref]) == IR_LOAD_CONST;
+}
+
+// Returns the number loaded by a constant load instruction.
+static inline double ir_const_value(Trace *trace, IrRef ref) {
+	return v2n(trace->vm->prog->consts[ir_arg32(trace->ir[ref])]);
+}
+
+// Tries to fold an arithmetic instruction on constants into a new constant.
+// Returns a reference to the load for the new constant, or IR_NONE if the
+// instruction can't be folded.
+static IrRef ir_fold(Trace *trace, IrIns ins) {
+	if (ir_op_prefix(ins) != IROP_PREFIX_ARITH) {
+		return IR_NONE;
+	}
+	IrRef left = ir_arg1(ins), right = ir_arg2(ins);
+	if (!ir_is_const(trace, left)) {
+		return IR_NONE;
+	}
+	if (ir_op(ins) != IR_NEG && !ir_is_const(trace, right)) {
+		return IR_NONE;
+	}
+
+	double a = ir_const_value(trace, left);
+	double result;
+	switch (ir_op(ins)) {
+		case IR_ADD: result = a + ir_const_value(trace, right); break;
+		case IR_SUB: result = a - ir_const_value(trace, right); break;
+		case IR_MUL: result = a * ir_const_value(trace, right); break;
+		case IR_DIV: result = a / ir_const_value(trace, right); break;
+		case IR_NEG: result = -a; break;
+		default: return IR_NONE;
+	}
+
+	// Folding adds a new constant, which fails if the constants list is full
+	int const_idx = vm_add_num(trace->vm, result);
+	if (const_idx < 0) {
+		return IR_NONE;
+	}
+	return ir_load_const(trace, const_idx);
+}
+
+// Returns true if an instruction is a type guard.
+static inline bool ir_is_type_guard(IrIns ins) {
+	return ir_op(ins) >= IR_IS_NUM && ir_op(ins) <= IR_IS_PTR;
+}
+
+// Returns true if a type guard always succeeds, because the type of the value
+// it checks is already known. Arithmetic always produces numbers, and constant,
+// primitive and function loads have a fixed type.
+static bool ir_type_known(Trace *trace, IrIns guard) {
+	IrIns ins = trace->ir[ir_arg1(guard)];
+	switch (ir_op(guard)) {
+	case IR_IS_NUM:
+		return ir_op_prefix(ins) == IROP_PREFIX_ARITH ||
+			ir_op(ins) == IR_LOAD_CONST;
+	case IR_IS_PRIM:
+		return ir_op(ins) == IR_LOAD_PRIM;
+	case IR_IS_FN:
+		return ir_op(ins) == IR_LOAD_FN;
+	default:
+		return false;
+	}
+}
+
+// Emit an IR instruction, optimising it if possible. Returns the index that
+// can be used to reference the IR instruction, which might be an existing
+// instruction that computes the same thing.
+static IrRef ir_emit(Trace *trace, IrIns ins) {
+	if (ir_is_pure(ins)) {
+		IrRef folded = ir_fold(trace, ins);
+		if (folded != IR_NONE) {
+			return folded;
+		}
+		IrRef existing = ir_cse_find(trace, ins);
+		if (existing != IR_NONE) {
+			return existing;
+		}
+	} else if (ir_is_type_guard(ins) && ir_type_known(trace, ins)) {
+		return IR_NONE;
+	}
+
+	IrRef ref = ir_append(trace, ins);
+	if (ref != IR_NONE && (ir_is_pure(ins) ||
+			ir_op_prefix(ins) == IROP_PREFIX_GUARD)) {
+		ir_cse_add(trace, ref);
+	}
+	return ref;
+}
+
+// Removes instructions whose results are never used, replacing them with
+// NOPs. An instruction is used if it's referenced by a guard, PHI, store, or
+// snapshot, or by another instruction that's used.
+static void ir_eliminate_dead_code(Trace *trace) {
+	bool *used = arena_calloc(trace->arena, trace->ir_count, sizeof(bool));
+	for (int i = 0; i < trace->snap_entries_count; i++) {
+		used[trace->snap_entries[i].ref] = true;
+	}
+
+	// Iterate in reverse order, since instructions only refer to earlier ones
+	for (IrRef ref = trace->ir_count - 1; ref >= 1; ref--) {
+		IrIns ins = trace->ir[ref];
+		int prefix = ir_op_prefix(ins);
+		if (prefix == IROP_PREFIX_GUARD || prefix == IROP_PREFIX_LOOP ||
+				prefix == IROP_PREFIX_STORE) {
+			used[ref] = true;
+		}
+		if (!used[ref]) {
+			trace->ir[ref] = ir_new2(IR_NOP, IR_NONE, IR_NONE);
+			continue;
+		}
+
+		if (ir_arg1_is_ref(ins)) {
+			used[ir_arg1(ins)] = true;
+		}
+		if (ir_arg2_is_ref(ins)) {
+			used[ir_arg2(ins)] = true;
+		}
+	}
+}
+
+
+// ---- IR Emission -----------------------------------------------------------
+
+static void snap_take(Trace *trace, IrRef guard, BcIns *pc);
+
+// Returns the type guard that checks a value has the same type as `value`.
+static IrOp ir_type_guard(Value value) {
+	if ((value & QUIET_NAN) != QUIET_NAN) {
+		return IR_IS_NUM;
+	} else if ((value & TAG_PTR) == TAG_PTR) {
+		return IR_IS_PTR;
+	} else if ((value & ~((Value) 0xffff)) == TAG_FN) {
+		return IR_IS_FN;
+	} else {
+		return IR_IS_PRIM;
+	}
+}
+
+// Records that the trace touches a stack slot. Entries in `last_modified` and
+// `call_state` aren't initialised until the trace first touches a slot at or
+// past them, so starting a trace costs nothing however many slots it could
+// use.
+static inline void ir_use_slot(Trace *trace, int slot) {
+	while (trace->slots_count <= slot) {
+		trace->last_modified[trace->slots_count] = IR_NONE;
+		trace->call_state[trace->slots_count] = IR_NONE;
+		trace->slots_count++;
+	}
+}
+
 // If a stack variable hasn't been loaded yet, then emits a stack load
 // instruction and returns the IR reference to it. Otherwise returns a reference
-// to the most recent instruction to modify the local.
-static IrRef ir_load_stack(Trace *trace, uint8_t slot) {
+// to the most recent instruction to modify the local. `local` is a slot in the
+// current function's stack frame.
+//
+// The load is followed by a guard that checks the slot holds the same type of
+// value it held while recording. If it doesn't, then we leave the trace and
+// re-execute the instruction we're recording in the interpreter.
+static IrRef ir_load_stack(Trace *trace, uint8_t local) {
+	int slot = trace->base + local;
+	ir_use_slot(trace, slot);
 	if (trace->last_modified[slot] == IR_NONE) {
 		// Emit a stack load instruction
-		IrRef load = ir_emit(trace, ir_new1(IR_LOAD_STACK, slot));
+		IrRef load = ir_emit(trace, ir_new1(IR_LOAD_STACK, (uint32_t) slot));
 		trace->last_modified[slot] = load;
+
+		// Guard the type of the loaded value
+		IrOp type = ir_type_guard(trace->stack[slot]);
+		IrRef guard = ir_emit(trace, ir_new2(type, load, IR_NONE));
+		if (guard != IR_NONE) {
+			snap_take(trace, guard, trace->pc);
+		}
 		return load;
 	} else {
 		// Return the last instruction to modify this local
@@ -74,99 +532,916 @@ static IrRef ir_load_stack(Trace *trace, uint8_t slot) {
 
 // If a constant hasn't been loaded yet, then emits a load instruction and
 // returns the IR reference to it. Otherwise returns a reference to the already
-// existing constant load.
+// existing constant load (which CSE finds for us).
 static IrRef ir_load_const(Trace *trace, int const_idx) {
-	if (trace->const_loads[const_idx] == IR_NONE) {
-		// Emit a load constant instruction
-		IrIns ins = ir_new1(IR_LOAD_CONST, (uint32_t) const_idx);
-		IrRef load = ir_emit(trace, ins);
-		trace->const_loads[const_idx] = load;
-		return load;
-	} else {
-		// Return the index of the constant load instruction
-		return trace->const_loads[const_idx];
+	return ir_emit(trace, ir_new1(IR_LOAD_CONST, (uint32_t) const_idx));
+}
+
+// Loads a stack slot that's used as a number. We can only record arithmetic
+// and order comparisons on numbers, so we abort the trace if the slot holds
+// anything else.
+static IrRef ir_load_num(Trace *trace, uint8_t local) {
+	if (ir_type_guard(trace->stack[trace->base + local]) != IR_IS_NUM) {
+		trace->aborted = true;
+		return IR_NONE;
 	}
+	return ir_load_stack(trace, local);
 }
 
-// Finishing a trace involves optimising the IR, register allocation, and
-// machine code generation.
-void jit_rec_finish(Trace *trace) {
-	// Translate the IR into machine code.
+// Emits a primitive load instruction.
+static IrRef ir_load_prim(Trace *trace, Primitive prim) {
+	return ir_emit(trace, ir_new1(IR_LOAD_PRIM, (uint32_t) prim));
+}
+
+// Records that the trace has modified a local in the current function's stack
+// frame.
+static void ir_set_local(Trace *trace, uint8_t local, IrRef ref) {
+	int slot = trace->base + local;
+	ir_use_slot(trace, slot);
+	trace->last_modified[slot] = ref;
+}
+
+// Returns true if a stack slot has been modified in the given state (either
+// `last_modified` or `call_state`), i.e. it no longer holds the value
+// originally on the stack when we entered the trace.
+static bool ir_state_modified(Trace *trace, IrRef *state, int slot) {
+	IrRef ref = state[slot];
+	if (ref == IR_NONE) {
+		return false;
+	}
+	IrIns ins = trace->ir[ref];
+	return ir_op(ins) != IR_LOAD_STACK || ir_arg32(ins) != (uint32_t) slot;
+}
+
+// Returns true if a stack slot has been modified by the trace so far.
+static inline bool ir_slot_modified(Trace *trace, int slot) {
+	return ir_state_modified(trace, trace->last_modified, slot);
+}
+
+// Appends an entry to the trace's list of snapshot entries.
+static void snap_add_entry(Trace *trace, uint16_t slot, IrRef ref) {
+	if (trace->snap_entries_count >= trace->snap_entries_capacity) {
+		trace->snap_entries = arena_realloc(trace->arena, trace->snap_entries,
+			sizeof(SnapshotEntry) * trace->snap_entries_capacity,
+			sizeof(SnapshotEntry) * trace->snap_entries_capacity * 2);
+		trace->snap_entries_capacity *= 2;
+	}
+	SnapshotEntry *entry = &trace->snap_entries[trace->snap_entries_count++];
+	entry->slot = slot;
+	entry->ref = ref;
+}
+
+// Adds a new, empty snapshot to the trace.
+static Snapshot * snap_new(Trace *trace, IrRef guard, int pc) {
+	if (trace->snaps_count >= trace->snaps_capacity) {
+		trace->snaps = arena_realloc(trace->arena, trace->snaps,
+			sizeof(Snapshot) * trace->snaps_capacity,
+			sizeof(Snapshot) * trace->snaps_capacity * 2);
+		trace->snaps_capacity *= 2;
+	}
+	Snapshot *snap = &trace->snaps[trace->snaps_count++];
+	snap->guard = guard;
+	snap->pc = pc;
+	snap->first_entry = trace->snap_entries_count;
+	snap->entries_count = 0;
+	return snap;
+}
+
+// Takes a snapshot of the stack slots modified by the trace so far, for the
+// given guard instruction. If the guard fails, we resume interpreting at the
+// bytecode instruction `pc`.
+//
+// Inside an inlined function, we instead take a snapshot of the stack from
+// before the outermost call, and resume at that CALL instruction.
+static void snap_take(Trace *trace, IrRef guard, BcIns *pc) {
+	IrRef *state = trace->last_modified;
+	if (trace->depth > 0) {
+		state = trace->call_state;
+		pc = trace->call_pc;
+	}
+	Snapshot *snap = snap_new(trace, guard, (int) (pc - trace->loop));
+
+	// Record every modified slot
+	for (int slot = 0; slot < trace->slots_count; slot++) {
+		if (ir_state_modified(trace, state, slot)) {
+			snap_add_entry(trace, (uint16_t) slot, state[slot]);
+		}
+	}
+	snap->entries_count = trace->snap_entries_count - snap->first_entry;
+}
+
+
+// ---- Loop Optimisation -----------------------------------------------------
+
+// Takes a snapshot for a guard in the loop body, copied from the guard `orig`
+// in the peeled iteration.
+//
+// Traces only write to the stack when they exit, so a snapshot in the loop
+// body has to include every slot modified anywhere in the loop. Slots that
+// were modified before the original guard hold the copy of whatever they held
+// in the peeled iteration. Any other slot still holds its value from the end
+// of the previous iteration, which the loop's PHIs keep in the same register
+// as the slot's final value in the peeled iteration.
+static void snap_copy(Trace *trace, int orig, IrRef guard, IrRef *map) {
+	Snapshot copy = trace->snaps[orig];
+	Snapshot *snap = snap_new(trace, guard, copy.pc);
+	int first_entry = snap->first_entry;
+
+	// Entries in a snapshot are sorted by slot, so merge the original
+	// snapshot's entries with the slots modified by the loop. A slot can be
+	// in the original snapshot without being modified by the end of the
+	// iteration (if it's assigned its own value back), so we keep it anyway
+	int entry = 0;
+	for (int slot = 0; slot < trace->slots_count; slot++) {
+		SnapshotEntry *orig_entry = NULL;
+		while (entry < copy.entries_count &&
+				trace->snap_entries[copy.first_entry + entry].slot < slot) {
+			entry++;
+		}
+		if (entry < copy.entries_count &&
+				trace->snap_entries[copy.first_entry + entry].slot == slot) {
+			orig_entry = &trace->snap_entries[copy.first_entry + entry];
+			entry++;
+		}
+
+		if (orig_entry != NULL) {
+			snap_add_entry(trace, (uint16_t) slot, map[orig_entry->ref]);
+		} else if (ir_slot_modified(trace, slot)) {
+			snap_add_entry(trace, (uint16_t) slot, trace->last_modified[slot]);
+		}
+	}
+
+	// The snapshots array might have been reallocated
+	trace->snaps[trace->snaps_count - 1].entries_count =
+		trace->snap_entries_count - first_entry;
+}
+
+// Emits a PHI for a slot modified by the loop, unless an identical one already
+// exists (which happens when two slots end up with the same value).
+static void ir_emit_phi(Trace *trace, IrRef left, IrRef right) {
+	for (IrRef ref = trace->loop_ref + 1; ref < trace->ir_count; ref++) {
+		IrIns ins = trace->ir[ref];
+		if (ir_op(ins) == IR_PHI && ir_arg1(ins) == left) {
+			return;
+		}
+	}
+	ir_append(trace, ir_new2(IR_PHI, left, right));
+}
+
+// Peels the first iteration of the loop. The recorded IR becomes the peeled
+// iteration, and we append a LOOP marker followed by a copy of the recorded IR
+// as the loop body.
+//
+// While copying, stack loads are replaced by the value the slot had at the end
+// of the peeled iteration. Instructions whose arguments are all unchanged by
+// the copy (constant loads, loads of slots the trace never modifies, and
+// arithmetic on these) are loop invariant, so we don't copy them at all and
+// the loop body refers back to the peeled iteration instead. Invariant guards
+// are dropped too, since they've already been checked once in the peeled
+// iteration. Finally, we emit a PHI for each slot whose value changes between
+// iterations.
+//
+// Fields (and elements) can be changed by the loop, so field loads and stores
+// are always copied, even if they access the same field of the same object.
+static void ir_peel_loop(Trace *trace) {
+	IrRef loop_ref = ir_append(trace, ir_new2(IR_LOOP, IR_NONE, IR_NONE));
+	if (loop_ref == IR_NONE) {
+		return;
+	}
+	trace->loop_ref = loop_ref;
+
+	// Map every instruction in the peeled iteration to its copy in the loop
+	// body
+	IrRef *map = arena_alloc(trace->arena, sizeof(IrRef) * loop_ref);
+	map[IR_NONE] = IR_NONE;
+	int snap = 0;
+	for (IrRef ref = 1; ref < loop_ref; ref++) {
+		IrIns ins = trace->ir[ref];
+		int prefix = ir_op_prefix(ins);
+		if (prefix == IROP_PREFIX_LOAD) {
+			if (ir_op(ins) == IR_LOAD_STACK) {
+				map[ref] = trace->last_modified[ir_arg32(ins)];
+			} else {
+				map[ref] = ref;
+			}
+			continue;
+		}
+
+		IrRef arg1 = ir_arg1_is_ref(ins) ? map[ir_arg1(ins)] : ir_arg1(ins);
+		IrRef arg2 = ir_arg2_is_ref(ins) ? map[ir_arg2(ins)] : ir_arg2(ins);
+		bool invariant = (arg1 == ir_arg1(ins) && arg2 == ir_arg2(ins));
+		if (ir_op(ins) == IR_LOAD_FIELD || ir_op(ins) == IR_STORE_FIELD) {
+			invariant = false;
+		}
+		if (prefix == IROP_PREFIX_GUARD) {
+			map[ref] = IR_NONE;
+			IrIns copy = ir_new2(ir_op(ins), arg1, arg2);
+			if (!invariant && ir_cse_find(trace, copy) == IR_NONE) {
+				IrRef guard = ir_emit(trace, copy);
+				if (guard != IR_NONE) {
+					snap_copy(trace, snap, guard, map);
+				}
+			}
+			snap++;
+		} else if (invariant) {
+			map[ref] = ref;
+		} else {
+			map[ref] = ir_emit(trace, ir_new2(ir_op(ins), arg1, arg2));
+		}
+	}
+
+	// The value of each modified slot at the end of the loop body is carried
+	// into the next iteration
+	for (int slot = 0; slot < trace->slots_count; slot++) {
+		if (!ir_slot_modified(trace, slot)) {
+			continue;
+		}
+		IrRef left = trace->last_modified[slot];
+		IrRef right = map[left];
+		if (left != right) {
+			ir_emit_phi(trace, left, right);
+		}
+	}
+}
+
+// Allocates a link for each of a trace's side exits, which its machine code
+// jumps through (see `TraceExit::link`).
+static void jit_new_links(Trace *trace) {
+	JitState *jit = trace->vm->prog->jit;
+	trace->links = arena_alloc(&jit->links,
+		sizeof(void *) * (trace->snaps_count + 1));
+}
+
+// Initialises the side exits for a trace's snapshots, at the end of a list of
+// exits.
+static void jit_init_exits(Trace *trace, TraceExit *exits) {
+	for (int i = 0; i < trace->snaps_count; i++) {
+		exits[i].pc = trace->snaps[i].pc;
+		exits[i].countdown = JIT_EXIT_THRESHOLD;
+		exits[i].aborts = 0;
+		exits[i].linked = false;
+		exits[i].link = &trace->links[i];
+	}
+}
+
+// Makes room for a side trace's exits at the end of its root trace's list of
+// exits. If the list is full, it's copied into a larger one. The exit counters
+// can be changed by other threads while we're copying them, so they're loaded
+// atomically.
+static void jit_grow_exits(JitState *jit, CompiledTrace *root, int count) {
+	if (root->exits_count + count <= root->exits_capacity) {
+		return;
+	}
+	int capacity = root->exits_capacity * 2;
+	if (capacity < root->exits_count + count) {
+		capacity = root->exits_count + count;
+	}
+	TraceExit *exits = malloc(sizeof(TraceExit) * capacity);
+	for (int i = 0; i < root->exits_count; i++) {
+		TraceExit *exit = &root->exits[i];
+		exits[i] = *exit;
+		exits[i].countdown = __atomic_load_n(&exit->countdown,
+			__ATOMIC_RELAXED);
+		exits[i].aborts = __atomic_load_n(&exit->aborts, __ATOMIC_RELAXED);
+	}
+	jit_retire(jit, root->exits);
+	__atomic_store_n(&root->exits, exits, __ATOMIC_RELEASE);
+	root->exits_capacity = capacity;
+}
+
+// Optimises a side trace. Rather than looping, a side trace writes every stack
+// slot it modified back to the stack when it reaches the end of the loop, and
+// jumps to the start of the root trace, which loads whatever it needs from the
+// stack again. Its exits are added to the root trace's straight away.
+static bool jit_rec_optimise_side(Trace *trace) {
+	for (int slot = 0; slot < trace->slots_count; slot++) {
+		if (ir_slot_modified(trace, slot)) {
+			ir_append(trace, ir_new2(IR_STORE_STACK, (IrRef) slot,
+				trace->last_modified[slot]));
+		}
+	}
+	if (trace->aborted) {
+		return false;
+	}
+	ir_eliminate_dead_code(trace);
+
+	// The exits can't be taken until the side trace is attached, so if it
+	// never is, they're just left unused
+	VM *vm = trace->vm;
+	CompiledTrace *root = trace->root;
+	vm_lock(vm);
+	jit_new_links(trace);
+	jit_grow_exits(vm->prog->jit, root, trace->snaps_count);
+	trace->first_exit = root->exits_count;
+	jit_init_exits(trace, &root->exits[root->exits_count]);
+	root->exits_count += trace->snaps_count;
+	vm_unlock(vm);
+	return true;
+}
+
+// Optimises a trace's IR once recording has finished. Constant folding can
+// add to the VM's constants list, so this always runs on the interpreter's
+// thread. Returns false if the trace can't be compiled.
+bool jit_rec_optimise(Trace *trace) {
+	if (trace->root != NULL) {
+		return jit_rec_optimise_side(trace);
+	}
+
+	// Turn the recorded iteration into a loop
+	ir_peel_loop(trace);
+	if (trace->aborted) {
+		return false;
+	}
+	ir_eliminate_dead_code(trace);
+
+	vm_lock(trace->vm);
+	jit_new_links(trace);
+	vm_unlock(trace->vm);
+	return true;
+}
+
+// Performs register allocation and machine code generation for an optimised
+// trace. Touches nothing but the trace (and its arena), so it can run on the
+// compile thread.
+void jit_rec_assemble(Trace *trace) {
+#ifdef DEBUG_DUMP
 	jit_trace_dump(trace);
-	jit_assemble(trace);
+#endif
+	MCodeChunk chunk = jit_assemble(trace);
+	trace->code = chunk.ins;
+	trace->code_size = chunk.ins_count;
+}
+
+// Attaches an installed side trace to its root trace, by pointing the link of
+// the exit it started from at it.
+static CompiledTrace * jit_rec_install_side(Trace *trace, uint8_t *mcode) {
+	CompiledTrace *root = trace->root;
+	TraceExit *exit = &root->exits[trace->exit];
+	if (exit->linked) {
+		// Another VM sharing the program got there first
+		return root;
+	}
+
+	// A VM on another thread could have checked the root trace's stack slots
+	// fit on its stack and be running the root trace right now, so a side
+	// trace in a shared program can't touch any more slots
+	if (trace->slots_count > root->slots_count) {
+		if (trace->vm->prog->frozen) {
+			return NULL;
+		}
+		root->slots_count = trace->slots_count;
+	}
+	root->side_traces_count++;
+	exit->linked = true;
+	__atomic_store_n(exit->link, (void *) mcode, __ATOMIC_RELEASE);
+	return root;
+}
+
+// Builds the compiled trace for an installed root trace.
+static CompiledTrace * jit_rec_install_root(Trace *trace, uint8_t *mcode) {
+	CompiledTrace *compiled = malloc(sizeof(CompiledTrace));
+	compiled->mcode = (TraceFn) mcode;
+	compiled->entry = mcode + trace->entry;
+	compiled->exits_count = trace->snaps_count;
+	compiled->exits_capacity = trace->snaps_count + 1;
+	compiled->side_traces_count = 0;
+	compiled->slots_count = trace->slots_count;
+	compiled->exits = malloc(sizeof(TraceExit) * compiled->exits_capacity);
+	jit_init_exits(trace, compiled->exits);
+	return compiled;
+}
+
+// Copies an assembled trace into executable memory, and (for a side trace)
+// attaches it to its root trace. Returns the same as `jit_rec_finish`.
+CompiledTrace * jit_rec_install(Trace *trace) {
+	VM *vm = trace->vm;
+	vm_lock(vm);
+	CompiledTrace *compiled = NULL;
+	uint8_t *mcode = mcode_install(&vm->prog->jit->mcode, trace->code,
+		trace->code_size);
+	if (mcode != NULL) {
+		// Each exit returns to the interpreter until it gets a side trace
+		for (int i = 0; i < trace->snaps_count; i++) {
+			trace->links[i] = mcode + trace->exit_returns[i];
+		}
+		if (trace->root != NULL) {
+			compiled = jit_rec_install_side(trace, mcode);
+		} else {
+			compiled = jit_rec_install_root(trace, mcode);
+		}
+	}
+	JitState *jit = vm->prog->jit;
+	if (compiled != NULL && jit->perf_map != NULL) {
+		int loop = (int) (trace->loop - vm->prog->fns[trace->fn].ins);
+		perf_map_add(jit->perf_map, mcode, trace->code_size, trace->fn, loop,
+			trace->root != NULL ? trace->exit : -1);
+	}
+	vm_unlock(vm);
+	return compiled;
+}
+
+// Finishing a trace involves optimising the IR, register allocation, and
+// machine code generation. The machine code is copied into the VM's executable
+// memory. Returns NULL if something went wrong.
+//
+// Finishing a side trace also attaches it to the exit it started from, and
+// returns its root trace.
+CompiledTrace * jit_rec_finish(Trace *trace) {
+	if (!jit_rec_optimise(trace)) {
+		return NULL;
+	}
+	jit_rec_assemble(trace);
+	return jit_rec_install(trace);
+}
+
+
+// ---- Compile Thread --------------------------------------------------------
+
+// Hands an optimised trace to the VM's compile thread, starting the thread if
+// it isn't running yet. The trace is owned by the thread until it's returned
+// by `jit_poll`. Returns false if the trace couldn't be queued (the thread's
+// queue is full, or threads aren't supported), in which case the caller
+// should compile it itself.
+bool jit_submit(VM *vm, Trace *trace) {
+	if (vm->jit_worker == NULL) {
+		vm->jit_worker = jit_worker_new();
+		if (vm->jit_worker == NULL) {
+			return false;
+		}
+	}
+	if (jit_worker_full(vm->jit_worker)) {
+		return false;
+	}
+
+	// The trace takes the VM's arena blocks with it, so that we can record
+	// another trace while this one's being assembled. Pointers into the
+	// blocks stay valid, since only the arena's header is moved
+	Arena *arena = malloc(sizeof(Arena));
+	*arena = *trace->arena;
+	*trace->arena = arena_new();
+	trace->arena = arena;
+	jit_worker_push(vm->jit_worker, trace);
+	return true;
+}
+
+// Returns the next trace the VM's compile thread has finished assembling,
+// ready to be installed, or NULL if there isn't one. If `wait` is true, then
+// blocks until one's ready instead, unless nothing is waiting on the thread at
+// all.
+Trace * jit_poll(VM *vm, bool wait) {
+	if (vm->jit_worker == NULL) {
+		return NULL;
+	}
+	return jit_worker_pop(vm->jit_worker, wait);
+}
+
+// Returns true if a trace for a loop (if `root` is NULL), or a side trace from
+// one of a root trace's exits, is waiting on the VM's compile thread.
+bool jit_is_compiling(VM *vm, int fn, BcIns *loop, CompiledTrace *root,
+		int exit) {
+	return vm->jit_worker != NULL &&
+		jit_worker_has(vm->jit_worker, fn, loop, root, exit);
 }
 
 
 // ---- Stores ----------------------------------------------------------------
 
 void jit_rec_MOV(Trace *trace, BcIns bc)   {
-	// Update the last instruction to modify the destination slot
-	trace->last_modified[bc_arg1(bc)] = trace->last_modified[bc_arg2(bc)];
+	// Update the last instruction to modify the destination slot, loading the
+	// source slot first if we haven't already
+	ir_set_local(trace, bc_arg1(bc), ir_load_stack(trace, bc_arg16(bc)));
 }
 
 void jit_rec_SET_N(Trace *trace, BcIns bc) {
 	// Load the constant
 	IrRef load = ir_load_const(trace, bc_arg16(bc));
-	trace->last_modified[bc_arg1(bc)] = load;
+	ir_set_local(trace, bc_arg1(bc), load);
+}
+
+void jit_rec_SET_P(Trace *trace, BcIns bc) {
+	IrRef load = ir_load_prim(trace, (Primitive) bc_arg16(bc));
+	ir_set_local(trace, bc_arg1(bc), load);
 }
 
-void jit_rec_SET_P(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
 void jit_rec_SET_F(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
 
+// String constants never move, so loading one is just like loading a number.
+void jit_rec_SET_S(Trace *trace, BcIns bc) {
+	IrRef load = ir_load_const(trace, bc_arg16(bc));
+	ir_set_local(trace, bc_arg1(bc), load);
+}
+
 
 // ---- Arithmetic ------------------------------------------------------------
 
 void jit_rec_ADD_LL(Trace *trace, BcIns bc) {
 	// Load the arguments to the add instruction
-	IrRef left = ir_load_stack(trace, bc_arg2(bc));
-	IrRef right = ir_load_stack(trace, bc_arg3(bc));
+	IrRef left = ir_load_num(trace, bc_arg2(bc));
+	IrRef right = ir_load_num(trace, bc_arg3(bc));
 
 	// Emit an add instruction
 	IrRef result = ir_emit(trace, ir_new2(IR_ADD, left, right));
 
 	// Keep track of the last instruction that modified the destination slot
-	trace->last_modified[bc_arg1(bc)] = result;
+	ir_set_local(trace, bc_arg1(bc), result);
 
 	// All the remaining arithmetic instructions are exactly like this...
 }
 
 void jit_rec_ADD_LN(Trace *trace, BcIns bc) { 
-	IrRef left = ir_load_stack(trace, bc_arg2(bc));
+	IrRef left = ir_load_num(trace, bc_arg2(bc));
 	IrRef right = ir_load_const(trace, bc_arg3(bc));
 	IrRef result = ir_emit(trace, ir_new2(IR_ADD, left, right));
-	trace->last_modified[bc_arg1(bc)] = result;
+	ir_set_local(trace, bc_arg1(bc), result);
+}
+
+// Records an arithmetic instruction with two locals as operands.
+static void rec_arith_ll(Trace *trace, IrOp op, BcIns bc) {
+	IrRef left = ir_load_num(trace, bc_arg2(bc));
+	IrRef right = ir_load_num(trace, bc_arg3(bc));
+	IrRef result = ir_emit(trace, ir_new2(op, left, right));
+	ir_set_local(trace, bc_arg1(bc), result);
+}
+
+// Records an arithmetic instruction with a local left operand and constant
+// right operand.
+static void rec_arith_ln(Trace *trace, IrOp op, BcIns bc) {
+	IrRef left = ir_load_num(trace, bc_arg2(bc));
+	IrRef right = ir_load_const(trace, bc_arg3(bc));
+	IrRef result = ir_emit(trace, ir_new2(op, left, right));
+	ir_set_local(trace, bc_arg1(bc), result);
+}
+
+// Records an arithmetic instruction with a constant left operand and local
+// right operand.
+static void rec_arith_nl(Trace *trace, IrOp op, BcIns bc) {
+	IrRef left = ir_load_const(trace, bc_arg2(bc));
+	IrRef right = ir_load_num(trace, bc_arg3(bc));
+	IrRef result = ir_emit(trace, ir_new2(op, left, right));
+	ir_set_local(trace, bc_arg1(bc), result);
+}
+
+void jit_rec_SUB_LL(Trace *trace, BcIns bc) { rec_arith_ll(trace, IR_SUB, bc); }
+void jit_rec_SUB_LN(Trace *trace, BcIns bc) { rec_arith_ln(trace, IR_SUB, bc); }
+void jit_rec_SUB_NL(Trace *trace, BcIns bc) { rec_arith_nl(trace, IR_SUB, bc); }
+void jit_rec_MUL_LL(Trace *trace, BcIns bc) { rec_arith_ll(trace, IR_MUL, bc); }
+void jit_rec_MUL_LN(Trace *trace, BcIns bc) { rec_arith_ln(trace, IR_MUL, bc); }
+void jit_rec_DIV_LL(Trace *trace, BcIns bc) { rec_arith_ll(trace, IR_DIV, bc); }
+void jit_rec_DIV_LN(Trace *trace, BcIns bc) { rec_arith_ln(trace, IR_DIV, bc); }
+void jit_rec_DIV_NL(Trace *trace, BcIns bc) { rec_arith_nl(trace, IR_DIV, bc); }
+
+void jit_rec_NEG(Trace *trace, BcIns bc) {
+	IrRef operand = ir_load_num(trace, bc_arg16(bc));
+	IrRef result = ir_emit(trace, ir_new2(IR_NEG, operand, IR_NONE));
+	ir_set_local(trace, bc_arg1(bc), result);
 }
 
-void jit_rec_SUB_LL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_SUB_LN(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_SUB_NL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_MUL_LL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_MUL_LN(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_DIV_LL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_DIV_LN(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_DIV_NL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_NEG(Trace *trace, BcIns bc)    { UNIMPLEMENTED(); }
+
+// ---- Strings ---------------------------------------------------------------
+
+// Strings can't be created inside a trace yet.
+void jit_rec_CONCAT(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
 
 
 // ---- Relational Operators --------------------------------------------------
 
-void jit_rec_EQ_LL(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_EQ_LN(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_EQ_LP(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_NEQ_LL(Trace *trace, BcIns bc)  { UNIMPLEMENTED(); }
-void jit_rec_NEQ_LN(Trace *trace, BcIns bc)  { UNIMPLEMENTED(); }
-void jit_rec_NEQ_LP(Trace *trace, BcIns bc)  { UNIMPLEMENTED(); }
-void jit_rec_LT_LL(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_LT_LN(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_LE_LL(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_LE_LN(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_GT_LL(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_GT_LN(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_GE_LL(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
-void jit_rec_GE_LN(Trace *trace, BcIns bc)   { UNIMPLEMENTED(); }
+// Every relational instruction is followed by a JMP. The interpreter skips the
+// JMP if the instruction's (inverted) condition holds. In a trace, we follow
+// whichever way the conditional went while recording, and turn the
+// instruction into a guard that asserts it goes the same way next time.
+//
+// If the condition held, we record a guard on `op`; if the guard fails, then
+// we resume at the JMP's target. If it didn't hold, we record a guard on the
+// negated comparison `negated`; if that fails, then we resume straight after
+// the JMP.
+static void rec_guard(Trace *trace, IrOp op, IrOp negated, bool holds,
+		IrRef left, IrRef right) {
+	BcIns *jmp = trace->pc + 1;
+	BcIns *exit;
+	IrIns ins;
+	if (holds) {
+		ins = ir_new2(op, left, right);
+		exit = jmp + 1 + ((int32_t) bc_arg24(*jmp) - JMP_BIAS);
+	} else {
+		ins = ir_new2(negated, left, right);
+		exit = jmp + 1;
+	}
+
+	// If we've already checked exactly the same condition, then it can't
+	// fail this time
+	if (ir_cse_find(trace, ins) != IR_NONE) {
+		return;
+	}
+	IrRef guard = ir_emit(trace, ins);
+	if (guard != IR_NONE) {
+		snap_take(trace, guard, exit);
+	}
+}
+
+// Returns the runtime value of a stack slot at the point we're recording.
+static inline Value rec_slot(Trace *trace, uint8_t local) {
+	return trace->stack[trace->base + local];
+}
+
+// Returns the value of a constant.
+static inline Value rec_const(Trace *trace, uint16_t idx) {
+	return trace->vm->prog->consts[idx];
+}
+
+// Emits a guard, unless an identical one has already been emitted.
+static void rec_check(Trace *trace, IrOp op, IrRef arg1, IrRef arg2) {
+	IrIns ins = ir_new2(op, arg1, arg2);
+	if (ir_cse_find(trace, ins) == IR_NONE) {
+		IrRef guard = ir_emit(trace, ins);
+		if (guard != IR_NONE) {
+			snap_take(trace, guard, trace->pc);
+		}
+	}
+}
+
+// Emits a guard that an object has the same shape it had while recording,
+// unless we've already checked it. Arrays all share one reserved shape, which
+// doesn't fit in an IS_SHAPE, so they get a guard of their own.
+static void rec_shape_guard(Trace *trace, IrRef ref, Object *obj) {
+	if (obj->shape == SHAPE_ARRAY) {
+		rec_check(trace, IR_IS_ARRAY, ref, IR_NONE);
+	} else {
+		rec_check(trace, IR_IS_SHAPE, ref, (IrRef) obj->shape);
+	}
+}
+
+// Two different strings can have the same contents, and a trace only compares
+// bits, so we can't record an equality test on two stack slots if either
+// holds a string. Stack loads are type guarded, but a pointer might point to a
+// string next time around even if it's a struct now, so if both are pointers,
+// we guard on the left one's shape too.
+static bool rec_eq_slots(Trace *trace, Value a, Value b, IrRef left) {
+	if (val_is_str(a) || val_is_str(b)) {
+		trace->aborted = true;
+		return false;
+	}
+	if (val_is_obj(a) && val_is_obj(b)) {
+		rec_shape_guard(trace, left, v2ptr(a));
+	}
+	return true;
+}
+
+// Records an equality test where the right operand is of the given kind (L, N
+// or P). The interpreter's condition is `a != b` for EQ and `a == b` for NEQ.
+// A constant is only ever a number, so it's equal to a value only if it has
+// the same bits.
+#define REC_EQ(name, op, negated, cmp)                                       \
+	void jit_rec_##name##_LL(Trace *trace, BcIns bc) {                       \
+		Value a = rec_slot(trace, bc_arg1(bc));                              \
+		Value b = rec_slot(trace, bc_arg2(bc));                              \
+		IrRef left = ir_load_stack(trace, bc_arg1(bc));                      \
+		IrRef right = ir_load_stack(trace, bc_arg2(bc));                     \
+		if (rec_eq_slots(trace, a, b, left)) {                               \
+			rec_guard(trace, op, negated, a cmp b, left, right);             \
+		}                                                                    \
+	}                                                                        \
+	void jit_rec_##name##_LN(Trace *trace, BcIns bc) {                       \
+		Value a = rec_slot(trace, bc_arg1(bc));                              \
+		Value b = rec_const(trace, bc_arg2(bc));                             \
+		IrRef left = ir_load_stack(trace, bc_arg1(bc));                      \
+		IrRef right = ir_load_const(trace, bc_arg2(bc));                     \
+		rec_guard(trace, op, negated, a cmp b, left, right);                 \
+	}                                                                        \
+	void jit_rec_##name##_LP(Trace *trace, BcIns bc) {                       \
+		Value a = rec_slot(trace, bc_arg1(bc));                              \
+		Value b = TAG_PRIM | bc_arg2(bc);                                    \
+		IrRef left = ir_load_stack(trace, bc_arg1(bc));                      \
+		IrRef right = ir_load_prim(trace, (Primitive) bc_arg2(bc));          \
+		rec_guard(trace, op, negated, a cmp b, left, right);                 \
+	}
+
+REC_EQ(EQ, IR_NEQ, IR_EQ, !=)
+REC_EQ(NEQ, IR_EQ, IR_NEQ, ==)
+
+// Records an order comparison. The interpreter's condition is the inverse of
+// the instruction's name (e.g. `a >= b` for LT).
+#define REC_ORD(name, op, negated, cmp)                                      \
+	void jit_rec_##name##_LL(Trace *trace, BcIns bc) {                       \
+		double a = v2n(rec_slot(trace, bc_arg1(bc)));                        \
+		double b = v2n(rec_slot(trace, bc_arg2(bc)));                        \
+		IrRef left = ir_load_num(trace, bc_arg1(bc));                        \
+		IrRef right = ir_load_num(trace, bc_arg2(bc));                       \
+		rec_guard(trace, op, negated, a cmp b, left, right);                 \
+	}                                                                        \
+	void jit_rec_##name##_LN(Trace *trace, BcIns bc) {                       \
+		double a = v2n(rec_slot(trace, bc_arg1(bc)));                        \
+		double b = v2n(rec_const(trace, bc_arg2(bc)));                       \
+		IrRef left = ir_load_num(trace, bc_arg1(bc));                        \
+		IrRef right = ir_load_const(trace, bc_arg2(bc));                     \
+		rec_guard(trace, op, negated, a cmp b, left, right);                 \
+	}
+
+REC_ORD(LT, IR_GE, IR_ULT, >=)
+REC_ORD(LE, IR_GT, IR_ULE, >)
+REC_ORD(GT, IR_LE, IR_UGT, <=)
+REC_ORD(GE, IR_LT, IR_UGE, <)
 
 
 // ---- Control Flow ----------------------------------------------------------
 
-void jit_rec_CALL(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
-void jit_rec_RET(Trace *trace, BcIns bc)  { UNIMPLEMENTED(); }
+// Function calls are inlined into the trace. We guard that the called slot
+// holds the same function next time, then record the callee's instructions
+// with the trace's frame base moved up to the callee's first argument.
+void jit_rec_CALL(Trace *trace, BcIns bc) {
+	Value callee = rec_slot(trace, bc_arg1(bc));
+	if (trace->depth >= JIT_MAX_INLINE_DEPTH ||
+			ir_type_guard(callee) != IR_IS_FN) {
+		trace->aborted = true;
+		return;
+	}
+
+	// Guard the function we're calling
+	int fn_idx = (int) (callee & 0xffff);
+	IrRef fn = ir_load_stack(trace, bc_arg1(bc));
+	IrRef expected = ir_emit(trace, ir_new1(IR_LOAD_FN, (uint32_t) fn_idx));
+	IrIns ins = ir_new2(IR_EQ, fn, expected);
+	if (ir_cse_find(trace, ins) == IR_NONE) {
+		IrRef guard = ir_emit(trace, ins);
+		if (guard != IR_NONE) {
+			snap_take(trace, guard, trace->pc);
+		}
+	}
+
+	// Remember what the stack looked like before the outermost call
+	if (trace->depth == 0) {
+		memcpy(trace->call_state, trace->last_modified,
+			sizeof(IrRef) * trace->slots_count);
+		trace->call_pc = trace->pc;
+	}
+
+	// Move into the callee's stack frame
+	trace->fns[trace->depth] = fn_idx;
+	trace->bases[trace->depth++] = trace->base;
+	trace->base += bc_arg2(bc);
+
+	// Any arguments the caller didn't pass are nil
+	Function *callee_fn = &trace->vm->prog->fns[fn_idx];
+	for (int i = bc_arg3(bc); i < callee_fn->args_count; i++) {
+		ir_set_local(trace, (uint8_t) i, ir_load_prim(trace, PRIM_NIL));
+	}
+}
+
+// Native functions are written in C, and there are no native function calls
+// from IR (see `ir.h`).
+void jit_rec_CALL_NATIVE(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
+
+// Returning from an inlined function leaves the return value in the first slot
+// of its stack frame, and moves the frame base back to the caller's. We can't
+// return from the function containing the loop.
+void jit_rec_RET(Trace *trace, BcIns bc) {
+	if (trace->depth == 0) {
+		trace->aborted = true;
+		return;
+	}
+	IrRef result;
+	if (bc_arg2(bc)) {
+		result = ir_load_stack(trace, bc_arg1(bc));
+	} else {
+		result = ir_load_prim(trace, PRIM_NIL);
+	}
+	ir_set_local(trace, 0, result);
+	trace->base = trace->bases[--trace->depth];
+}
+
+
+// ---- Structs ---------------------------------------------------------------
+
+// Objects can't be created inside a trace yet.
+void jit_rec_NEW(Trace *trace, BcIns bc) { UNIMPLEMENTED(); }
+
+// Returns the function containing the instruction being recorded.
+static inline Function * rec_fn(Trace *trace) {
+	int fn = trace->depth > 0 ? trace->fns[trace->depth - 1] : trace->fn;
+	return &trace->vm->prog->fns[fn];
+}
+
+// Emits an FREF for a field access, looking the field up in the object's
+// shape through the instruction's inline cache (filling it if necessary). The
+// index we find is only valid for objects with the same shape, so we guard
+// the object's shape first. Aborts the trace if the local isn't an object, or
+// the object doesn't have the field.
+static IrRef rec_fref(Trace *trace, uint8_t local, uint8_t cache) {
+	Value val = rec_slot(trace, local);
+	if (!val_is_struct(val)) {
+		trace->aborted = true;
+		return IR_NONE;
+	}
+	Object *obj = v2ptr(val);
+	int field = obj_field(trace->vm->prog, &rec_fn(trace)->caches[cache], obj);
+	if (field < 0) {
+		trace->aborted = true;
+		return IR_NONE;
+	}
+
+	// Objects never change shape, so we only need to check it once
+	IrRef ref = ir_load_stack(trace, local);
+	rec_shape_guard(trace, ref, obj);
+	return ir_emit(trace, ir_new2(IR_FREF, ref, (IrRef) field));
+}
+
+// A field's value is guarded like a stack load, since the type of the value
+// in the field can change between iterations.
+void jit_rec_GET_FIELD(Trace *trace, BcIns bc) {
+	IrRef fref = rec_fref(trace, bc_arg2(bc), bc_arg3(bc));
+	if (trace->aborted) {
+		return;
+	}
+	IrRef load = ir_emit(trace, ir_new2(IR_LOAD_FIELD, fref, IR_NONE));
+
+	Object *obj = v2ptr(rec_slot(trace, bc_arg2(bc)));
+	Value val = obj->fields[ir_arg2(trace->ir[fref])];
+	IrRef guard = ir_emit(trace, ir_new2(ir_type_guard(val), load, IR_NONE));
+	if (guard != IR_NONE) {
+		snap_take(trace, guard, trace->pc);
+	}
+	ir_set_local(trace, bc_arg1(bc), load);
+}
+
+// Stores are written to the object straight away, rather than when the trace
+// exits. A guard that fails inside an inlined function resumes at the CALL,
+// which would run the store again, so we can only record stores outside of
+// function calls.
+//
+// Pointers stored into an object need the write barrier, which we leave to
+// the interpreter by exiting the trace if the object needs it. The value's
+// type never changes, so stores of anything else never need the check.
+void jit_rec_SET_FIELD(Trace *trace, BcIns bc) {
+	if (trace->depth > 0) {
+		trace->aborted = true;
+		return;
+	}
+	IrRef fref = rec_fref(trace, bc_arg1(bc), bc_arg3(bc));
+	if (trace->aborted) {
+		return;
+	}
+	IrRef value = ir_load_stack(trace, bc_arg2(bc));
+	if (val_is_obj(rec_slot(trace, bc_arg2(bc)))) {
+		IrRef obj = ir_arg1(trace->ir[fref]);
+		IrRef guard = ir_emit(trace, ir_new2(IR_BARRIER, obj, IR_NONE));
+		if (guard != IR_NONE) {
+			snap_take(trace, guard, trace->pc);
+		}
+	}
+	ir_emit(trace, ir_new2(IR_STORE_FIELD, fref, value));
+}
+
+
+// ---- Arrays ----------------------------------------------------------------
+
+// Emits an AREF for an access to an element of an array. The array and index
+// are guarded so that the access is still valid next time around. Aborts the
+// trace if the local isn't an array or the index isn't valid, since the
+// interpreter's about to report the error anyway.
+static IrRef rec_aref(Trace *trace, uint8_t local, uint8_t index_local) {
+	Value val = rec_slot(trace, local);
+	if (!val_is_array(val) ||
+			!array_in_bounds(v2ptr(val), rec_slot(trace, index_local))) {
+		trace->aborted = true;
+		return IR_NONE;
+	}
+	IrRef array = ir_load_stack(trace, local);
+	rec_check(trace, IR_IS_ARRAY, array, IR_NONE);
+
+	// A constant index is already known to be an integer
+	IrRef index = ir_load_stack(trace, index_local);
+	if (!ir_is_const(trace, index)) {
+		rec_check(trace, IR_IS_INT, index, IR_NONE);
+	}
+	rec_check(trace, IR_IN_BOUNDS, array, index);
+	return ir_emit(trace, ir_new2(IR_AREF, array, index));
+}
+
+// Elements are always numbers, so unlike a field, the loaded value doesn't
+// need a type guard.
+void jit_rec_GET_INDEX(Trace *trace, BcIns bc) {
+	IrRef aref = rec_aref(trace, bc_arg2(bc), bc_arg3(bc));
+	if (trace->aborted) {
+		return;
+	}
+	IrRef load = ir_emit(trace, ir_new2(IR_LOAD_FIELD, aref, IR_NONE));
+	ir_set_local(trace, bc_arg1(bc), load);
+}
+
+// Stores are written to the array straight away, so like field stores, we
+// can only record them outside of function calls. Only numbers can be stored,
+// so there's never a write barrier to check.
+void jit_rec_SET_INDEX(Trace *trace, BcIns bc) {
+	if (trace->depth > 0) {
+		trace->aborted = true;
+		return;
+	}
+	IrRef aref = rec_aref(trace, bc_arg1(bc), bc_arg2(bc));
+	if (trace->aborted) {
+		return;
+	}
+	IrRef value = ir_load_num(trace, bc_arg3(bc));
+	if (trace->aborted) {
+		return;
+	}
+	ir_emit(trace, ir_new2(IR_STORE_FIELD, aref, value));
+}
@@ -18,34 +18,329 @@
 
 #include "../vm.h"
 #include "ir.h"
+#include "mcode.h"
+
+#include <stdbool.h>
+#include <stdio.h>
 
 // Threshold number of iterations that loop has to execute before we trigger the
-// JIT compiler.
+// JIT compiler. Can be overridden at compile time (e.g. `-DJIT_THRESHOLD=100`).
+#ifndef JIT_THRESHOLD
 #define JIT_THRESHOLD 50
+#endif
+
+// Every time recording a trace for a loop fails, we wait twice as many
+// iterations before trying again. Once recording has failed this many times,
+// we give up and blacklist the loop.
+#ifndef JIT_MAX_ABORTS
+#define JIT_MAX_ABORTS 4
+#endif
+
+// Threshold number of times a side exit has to be taken before we record a
+// side trace starting from it. Can be overridden at compile time, like
+// JIT_THRESHOLD. Side traces back off and blacklist like loops do.
+#ifndef JIT_EXIT_THRESHOLD
+#define JIT_EXIT_THRESHOLD 10
+#endif
+
+// The maximum number of nested function calls we inline into a trace. We
+// abort the trace if a call goes any deeper than this.
+#ifndef JIT_MAX_INLINE_DEPTH
+#define JIT_MAX_INLINE_DEPTH 4
+#endif
+
+// The maximum number of traces that can be waiting on the compile thread at
+// once (see `worker.h`). Once this many are queued, traces are compiled on the
+// interpreter's thread instead.
+#ifndef JIT_QUEUE_SIZE
+#define JIT_QUEUE_SIZE 16
+#endif
+
+// The maximum number of stack slots a trace can touch, including the stack
+// frames of every function inlined into it.
+#define MAX_TRACE_SLOTS (MAX_LOCALS_IN_FN * (JIT_MAX_INLINE_DEPTH + 1))
 
 // The maximum number of IR instructions that we can emit.
 #define MAX_IR_INS 2048
 
+// The size of the hash table used to find identical IR instructions (must be
+// a power of 2, and larger than MAX_IR_INS so that it never fills up).
+#define IR_CSE_TABLE_SIZE (MAX_IR_INS * 2)
+
+// Compiled machine code for a trace. A trace is called with a pointer to the
+// base of the stack frame for the function containing the loop, and a pointer
+// to the VM's constants list.
+//
+// A trace keeps executing iterations of its loop until one of its guards
+// fails. It then returns the index of the side exit it took (see
+// `CompiledTrace::exits`).
+typedef int (*TraceFn)(Value *stack, Value *consts);
+
+// Information the interpreter needs after a trace takes a side exit. Every
+// guard in a trace has its own side exit.
+//
+// When a side exit gets hot, we record a side trace starting from the
+// bytecode instruction it resumes at, which ends when it gets back to the
+// loop's BC_LOOP instruction. Once it's compiled, the exit's link is pointed
+// at the side trace instead of returning to the interpreter, and the side
+// trace jumps back to the start of the root trace (the trace for the whole
+// loop) when it's done.
+typedef struct {
+	// The bytecode instruction to resume interpreting at, as an offset (in
+	// instructions) from the trace's BC_LOOP instruction.
+	int pc;
+
+	// The number of times left that the exit has to be taken before we record
+	// a side trace from it, and the number of times recording one has failed.
+	// Every VM sharing the program counts down the same exits, so these are
+	// only ever updated atomically.
+	uint16_t countdown;
+	uint8_t aborts;
+
+	// Set once a side trace has been attached to the exit.
+	bool linked;
+
+	// Where the exit's machine code jumps once it's written the modified stack
+	// slots back. This is code that returns to the interpreter until a side
+	// trace is attached, at which point it's atomically swapped for the side
+	// trace, so machine code is never patched while it might be running.
+	void **link;
+} TraceExit;
+
+// A trace that's been compiled to machine code.
+typedef struct {
+	TraceFn mcode;
+
+	// Where a side trace jumps back into the trace once it's done, which skips
+	// any code that only runs when the trace is called (see `Trace::entry`).
+	void *entry;
+
+	// Side exits for each guard in the trace, followed by the side exits of
+	// every side trace attached to it. Exits are numbered the same way in the
+	// machine code, so the interpreter can find the exit taken by any side
+	// trace from the root trace it called.
+	//
+	// When the list is full, it's copied into a larger one, but the old list
+	// isn't freed until the JIT state is (see `JitState::retired`), since
+	// another thread could still be looking at it. Use `jit_exit` to read it.
+	TraceExit *exits;
+	int exits_count, exits_capacity;
+
+	// The number of side traces attached to the trace.
+	int side_traces_count;
+
+	// The number of stack slots the trace (and any of its side traces)
+	// touches, counting from the base of the stack frame it's called with.
+	// The interpreter checks they fit on the stack before calling the trace.
+	int slots_count;
+} CompiledTrace;
+
+// Returns one of a trace's side exits. The list of exits can be replaced by a
+// VM on another thread at any time, so we load it atomically.
+static inline TraceExit * jit_exit(CompiledTrace *trace, int exit) {
+	return &__atomic_load_n(&trace->exits, __ATOMIC_ACQUIRE)[exit];
+}
+
+// An entry in the trace cache.
+typedef struct {
+	// The BC_LOOP instruction that triggered recording of this trace (at the
+	// end of the loop body), or NULL if this entry in the cache is empty.
+	BcIns *loop;
+
+	// The index of the function containing the loop. A function's bytecode
+	// array can be moved when more instructions are appended to it, so we
+	// also check this when looking up a trace to make sure we never confuse
+	// two loops that happened to live at the same address.
+	int fn;
+
+	// The compiled trace.
+	CompiledTrace *trace;
+} TraceEntry;
+
+// State for the JIT compiler that's persisted across calls to `vm_run`. It's
+// part of the VM's program, so it's shared by every VM using the program (see
+// `vm_new_shared`). Everything here is changed while holding the program's
+// lock; the trace cache can be read without it.
+typedef struct jit_state {
+	// Executable memory into which compiled traces are copied.
+	MCodeArea *mcode;
+
+	// Open addressing hash table of compiled traces, keyed by the address of
+	// the BC_LOOP instruction for each trace. The capacity is always a power
+	// of 2. Entries are never removed or replaced, and a larger table is
+	// swapped in when it fills up, so it can be read without locking.
+	TraceEntry *traces;
+	int traces_count, traces_capacity;
+
+	// The links for every trace's side exits (see `TraceExit::link`). Machine
+	// code jumps through these, so they live until the JIT state is freed.
+	Arena links;
+
+	// Memory that's been replaced (trace cache tables and side exit lists)
+	// but that another thread could still be reading, which is freed along
+	// with the JIT state.
+	void **retired;
+	int retired_count, retired_capacity;
+
+	// The map file that installed traces are written to for `perf` (see
+	// `perf.h`), or NULL if it isn't enabled.
+	FILE *perf_map;
+} JitState;
+
+// Creates the JIT compiler's state for a new VM.
+JitState * jit_state_new();
+
+// Releases the JIT compiler's state, including all compiled machine code.
+void jit_state_free(JitState *jit);
+
+// Returns the compiled trace for a loop, or NULL if the loop hasn't been
+// compiled yet.
+CompiledTrace * jit_cache_lookup(JitState *jit, int fn, BcIns *loop);
+
+// Adds a compiled trace for a loop to the cache. The cache takes ownership of
+// the compiled trace. If the loop's already in the cache (because another VM
+// sharing the program compiled it first), then the new trace is freed instead.
+// Returns the trace that's in the cache.
+CompiledTrace * jit_cache_insert(JitState *jit, int fn, BcIns *loop,
+	CompiledTrace *trace);
+
+// A snapshot records how to reconstruct the interpreter's state if a guard
+// fails: which stack slots were modified by the trace before the guard, and
+// which IR instruction holds each slot's value at that point.
+typedef struct {
+	// The guard instruction this snapshot belongs to.
+	IrRef guard;
+
+	// The bytecode instruction to resume at if the guard fails, relative to
+	// the trace's BC_LOOP instruction.
+	int pc;
+
+	// Range of entries in the trace's snapshot entries list that belong to
+	// this snapshot.
+	int first_entry, entries_count;
+} Snapshot;
+
+// A single modified stack slot within a snapshot.
+typedef struct {
+	uint16_t slot;
+	IrRef ref;
+} SnapshotEntry;
+
 // Information required to compile an IR trace.
 typedef struct {
 	// Pointer to the VM.
 	VM *vm;
 
+	// The VM's JIT arena, which everything needed to compile the trace
+	// (including the trace itself) is allocated from. It's reset when the
+	// trace is freed. A trace handed to the compile thread takes the arena's
+	// blocks with it, into an arena of its own.
+	Arena *arena;
+
+	// The BC_LOOP instruction at the end of the loop we're recording. If we
+	// reach any other BC_LOOP before this one, then the trace is aborted (we
+	// don't compile nested loops yet).
+	BcIns *loop;
+
+	// The index of the function containing `loop`.
+	int fn;
+
+	// If this is a side trace, then the root trace for the loop and the side
+	// exit (in the root trace's list of exits) that the side trace starts
+	// from. `root` is NULL for a root trace.
+	CompiledTrace *root;
+	int exit;
+
+	// The index of the trace's first side exit in its root trace's list of
+	// exits (0 for a root trace). A side trace's exits are reserved when the
+	// trace is optimised, so they're numbered the same way no matter when the
+	// trace is installed.
+	int first_exit;
+
+	// The bytecode instruction currently being recorded, and the base of the
+	// stack frame for the function containing it. Guards look at the runtime
+	// values on the stack to determine which way a conditional goes.
+	BcIns *pc;
+	Value *stack;
+
+	// Function calls are inlined into the trace. `base` is the offset of the
+	// current function's stack frame from `stack` (all stack slots in the IR
+	// are relative to `stack`), `depth` is the number of calls we're inside
+	// of, `bases` saves the frame base of each caller, and `fns` holds the
+	// index of the function called at each depth.
+	int base, depth;
+	int bases[JIT_MAX_INLINE_DEPTH];
+	int fns[JIT_MAX_INLINE_DEPTH];
+
+	// The outermost CALL instruction we're inside of, and a copy of
+	// `last_modified` from when we recorded it (only the first `slots_count`
+	// entries are valid, like `last_modified`). If a guard inside an inlined
+	// function fails, we resume at the CALL with the stack as it was before
+	// the call, and let the interpreter execute the whole call again.
+	BcIns *call_pc;
+	IrRef call_state[MAX_TRACE_SLOTS];
+
+	// One more than the highest stack slot the trace touches. Entries in
+	// `last_modified` and `call_state` past this haven't been initialised, so
+	// starting a trace doesn't have to clear them.
+	int slots_count;
+
+	// Set if we encounter something during recording that we can't compile,
+	// like an unsupported bytecode instruction. The interpreter checks this
+	// after recording each instruction, and abandons the trace if it's set.
+	bool aborted;
+
 	// The compiled IR for the trace so far. 
 	IrIns *ir;
 	int ir_count, ir_capacity;
 
+	// The IR_LOOP instruction separating the peeled first iteration of the
+	// loop from the loop body, or IR_NONE if we haven't peeled the loop yet.
+	IrRef loop_ref;
+
+	// Snapshots for each guard in the trace, in the same order as the guards
+	// appear in the IR.
+	Snapshot *snaps;
+	int snaps_count, snaps_capacity;
+	SnapshotEntry *snap_entries;
+	int snap_entries_count, snap_entries_capacity;
+
+	// The link for each side exit (see `TraceExit::link`), allocated from
+	// the JIT state when the trace's optimised, and the position of the code
+	// in each side exit that returns to the interpreter, which is filled in
+	// by `jit_assemble`.
+	void **links;
+	size_t *exit_returns;
+
+	// The assembled machine code for the trace, filled in by
+	// `jit_rec_assemble` and copied into executable memory when the trace is
+	// installed.
+	uint8_t *code;
+	size_t code_size;
+
+	// The position in the machine code that side traces jump back to, after
+	// any registers the calling convention needs preserved have been saved.
+	// Filled in by `jit_assemble`.
+	size_t entry;
+
 	// The most recent instruction to modify a stack variable (an array indexed
-	// by the stack slot of the variable), used to construct SSA form IR.
+	// by the stack slot of the variable), used to construct SSA form IR. Slots
+	// that haven't been modified are IR_NONE.
 	//
-	// We start counting IR references at 1 so that we can initialise this whole
-	// array to 0 (meaning "does not exist") using calloc, rather than having to
-	// iterate over it to set every entry to -1.
-	IrRef last_modified[MAX_LOCALS_IN_FN];
-
-	// Indexing this array by the index of a constant in the VM's constants list
-	// gives an IR reference to the load instruction for that constant.
-	IrRef const_loads[MAX_CONSTS];
+	// Entries are cleared as `slots_count` grows past them, so the cost of
+	// starting a trace doesn't depend on the size of this array.
+	IrRef last_modified[MAX_TRACE_SLOTS];
+
+	// Open addressing hash table of pure instructions and guards emitted so
+	// far, used to eliminate common subexpressions (including repeated
+	// constant loads).
+	//
+	// Neither array is cleared when the trace is created. Instead, a bucket
+	// is only in use if it holds an instruction in the trace whose entry in
+	// `cse_bucket` points back at the bucket. Instructions that aren't in the
+	// table have a `cse_bucket` of IR_CSE_TABLE_SIZE.
+	IrRef cse[IR_CSE_TABLE_SIZE];
+	uint16_t cse_bucket[MAX_IR_INS];
 } Trace;
 
 // Create a new JIT trace.
@@ -58,8 +353,51 @@ void jit_trace_free(Trace *trace);
 void jit_trace_dump(Trace *trace);
 
 // Finishing a trace involves optimising the IR, register allocation, and
-// machine code generation.
-void jit_rec_finish(Trace *trace);
+// machine code generation. The machine code is copied into the VM's executable
+// memory. Returns NULL if something went wrong.
+//
+// Finishing a side trace also attaches it to the exit it started from, and
+// returns its root trace.
+//
+// This is the three functions below, one after the other. Only
+// `jit_rec_assemble` is safe to call off the interpreter's thread.
+CompiledTrace * jit_rec_finish(Trace *trace);
+
+// Optimises a trace's IR once recording has finished. Constant folding can
+// add to the VM's constants list, so this always runs on the interpreter's
+// thread. Returns false if the trace can't be compiled.
+bool jit_rec_optimise(Trace *trace);
+
+// Performs register allocation and machine code generation for an optimised
+// trace. Touches nothing but the trace (and its arena), so it can run on the
+// compile thread.
+void jit_rec_assemble(Trace *trace);
+
+// Copies an assembled trace into executable memory, and (for a side trace)
+// attaches it to its root trace. Returns the same as `jit_rec_finish`.
+CompiledTrace * jit_rec_install(Trace *trace);
+
+// Hands an optimised trace to the VM's compile thread, starting the thread if
+// it isn't running yet. The trace is owned by the thread until it's returned
+// by `jit_poll`. Returns false if the trace couldn't be queued (the thread's
+// queue is full, or threads aren't supported), in which case the caller
+// should compile it itself.
+bool jit_submit(VM *vm, Trace *trace);
+
+// Returns the next trace the VM's compile thread has finished assembling,
+// ready to be installed, or NULL if there isn't one. If `wait` is true, then
+// blocks until one's ready instead, unless nothing is waiting on the thread at
+// all.
+Trace * jit_poll(VM *vm, bool wait);
+
+// Returns true if a trace for a loop (if `root` is NULL), or a side trace from
+// one of a root trace's exits, is waiting on the VM's compile thread.
+bool jit_is_compiling(VM *vm, int fn, BcIns *loop, CompiledTrace *root,
+	int exit);
+
+// Releases a compiled trace (but not its machine code, which lives in the
+// JIT's executable memory until the VM is freed).
+void jit_compiled_free(CompiledTrace *trace);
 
 
 // Trace recording functions. These are called by the interpreter during runtime
@@ -71,6 +409,7 @@ void jit_rec_MOV(Trace *trace, BcIns bc);
 void jit_rec_SET_N(Trace *trace, BcIns bc);
 void jit_rec_SET_P(Trace *trace, BcIns bc);
 void jit_rec_SET_F(Trace *trace, BcIns bc);
+void jit_rec_SET_S(Trace *trace, BcIns bc);
 
 // Arithmetic
 void jit_rec_ADD_LL(Trace *trace, BcIns bc); // Addition
@@ -85,6 +424,9 @@ void jit_rec_DIV_LN(Trace *trace, BcIns bc);
 void jit_rec_DIV_NL(Trace *trace, BcIns bc);
 void jit_rec_NEG(Trace *trace, BcIns bc);    // Negation
 
+// Strings
+void jit_rec_CONCAT(Trace *trace, BcIns bc);
+
 // Relational operators
 void jit_rec_EQ_LL(Trace *trace, BcIns bc);  // Equality
 void jit_rec_EQ_LN(Trace *trace, BcIns bc);
@@ -101,8 +443,18 @@ void jit_rec_GT_LN(Trace *trace, BcIns bc);
 void jit_rec_GE_LL(Trace *trace, BcIns bc);  // Greater than or equal to
 void jit_rec_GE_LN(Trace *trace, BcIns bc);
 
+// Structs
+void jit_rec_NEW(Trace *trace, BcIns bc);
+void jit_rec_GET_FIELD(Trace *trace, BcIns bc);
+void jit_rec_SET_FIELD(Trace *trace, BcIns bc);
+
+// Arrays
+void jit_rec_GET_INDEX(Trace *trace, BcIns bc);
+void jit_rec_SET_INDEX(Trace *trace, BcIns bc);
+
 // Control flow
 void jit_rec_CALL(Trace *trace, BcIns bc);
+void jit_rec_CALL_NATIVE(Trace *trace, BcIns bc);
 void jit_rec_RET(Trace *trace, BcIns bc);
 
 #endif
@@ -18,16 +18,28 @@
 //
 // And the compiled (and optimised) SSA IR:
 //
-//   0: LOAD_CONST  0
-//   1: LOAD_LOCAL  [0]
-//   2: ADD  1  0
-//   3: ---- LOOP ----
-//   4: ADD  2  0
-//   5: PHI  2  4
+//   1: LOAD_STACK  0
+//   2: IS_NUM  1
+//   3: LOAD_CONST  0
+//   4: ADD  1  3
+//   5: ---- LOOP ----
+//   6: ADD  4  3
+//   7: PHI  4  6
 //
-// The result of the LOAD_CONST instruction (loading the 0th constant from the 
-// VM's constants list) is referred to as variable "1"; the result of the ADD
-// instruction is referred to as variable "2". 
+// The result of the LOAD_STACK instruction (loading the local in stack slot 0)
+// is referred to as variable "1". The IS_NUM guard checks that it's a number
+// (see below). The result of the LOAD_CONST instruction (loading the 0th
+// constant from the VM's constants list) is referred to as variable "3", and
+// so on.
+//
+// Instructions before the LOOP marker are a "peeled" copy of the first
+// iteration of the loop. Instructions after it are the loop body that's
+// executed repeatedly. Anything that doesn't change between iterations (like
+// the constant load above) only appears in the peeled iteration, and the loop
+// body refers back to it. A PHI instruction at the end of the loop says that
+// the value of its first argument on the next iteration is given by its second
+// argument (so the ADD at 6 uses the result of the ADD at 6 from the previous
+// iteration, rather than the ADD at 4).
 //
 // ***
 //
@@ -46,33 +58,177 @@
 // language where the type of every variable is determined by whatever it is on
 // the first loop iteration. We know the type of every variable when the IR is
 // compiled.
+//
+// Values on the stack can be of any type though, so the first time we load a
+// stack slot, we emit a type guard that checks the slot still holds whatever
+// type it held while we were recording. Everything computed from the loaded
+// value after that is statically typed, and arithmetic on numbers can be done
+// unboxed in floating point registers. If the guard fails, then we leave the
+// trace and let the interpreter deal with it.
+//
+// ***
+//
+// Fields of objects are accessed in two steps. An FREF computes the address
+// of a field, given the object and the field's index in the object's shape,
+// and a LOAD_FIELD or STORE_FIELD reads or writes that address. The index is
+// only valid for one shape, so an IS_SHAPE guard always checks the object's
+// shape before its first FREF:
+//
+//   1: LOAD_STACK  0
+//   2: IS_PTR  1
+//   3: IS_SHAPE  1  0
+//   4: FREF  1  2
+//   5: LOAD_FIELD  4
+//   6: IS_NUM  5
+//
+// A field's value can change while the trace runs, so its type is guarded
+// like a stack load. FREFs are pure, but loads and stores of fields aren't.
+//
+// Storing a pointer into a field needs the garbage collector's write barrier
+// (see `gc.h`). A BARRIER guard checks the object's barrier flag and leaves
+// the trace if it's set, so the interpreter can run the store (and the
+// barrier) instead. Traces never allocate, so the flag can't change while
+// one's running, and the guard only fails once per object between each
+// garbage collection.
+//
+// ***
+//
+// Elements of arrays are accessed in the same way, except an AREF computes
+// the address from the array and an index that's a number (a reference).
+// Guards check the value is an array, that the index is an integer, and that
+// the index is in bounds before the first AREF:
+//
+//   1: LOAD_STACK  0
+//   2: IS_PTR  1
+//   3: IS_ARRAY  1
+//   4: LOAD_STACK  1
+//   5: IS_NUM  4
+//   6: IS_INT  4
+//   7: IN_BOUNDS  1  4
+//   8: AREF  1  4
+//   9: LOAD_FIELD  8
+//
+// Elements are always numbers, so their loads don't need a type guard. An
+// array's length never changes, so the bounds check is loop invariant if the
+// array and index are.
 
 #ifndef IR_H
 #define IR_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // Various prefixes for opcode types.
 #define IROP_PREFIX_LOAD  0x00
 #define IROP_PREFIX_ARITH 0x01
+#define IROP_PREFIX_STORE 0x02
+#define IROP_PREFIX_GUARD 0x03
+#define IROP_PREFIX_LOOP  0x04
+#define IROP_PREFIX_NOP   0x05
+#define IROP_PREFIX_FIELD 0x06
 
 // All IR opcodes. 
 typedef enum {
 	// Loads (prefix 0x00)
 	IR_LOAD_STACK = 0x0000, // Load a local from the stack
 	IR_LOAD_CONST = 0x0001, // Load a constant from the constants list
+	IR_LOAD_PRIM  = 0x0002, // Load a primitive value (true, false, or nil)
+	IR_LOAD_FN    = 0x0003, // Load a function value, given its index
 
 	// Arithmetic (prefix 0x01)
 	IR_ADD = 0x0100, // Add two numbers together
+	IR_SUB = 0x0101, // Subtract the second number from the first
+	IR_MUL = 0x0102, // Multiply two numbers together
+	IR_DIV = 0x0103, // Divide the first number by the second
+	IR_NEG = 0x0104, // Negate a number (only uses the first argument)
+
+	// Stores (prefix 0x02)
+	IR_STORE_STACK = 0x0200, // Write a value back into a stack slot
+	IR_STORE_FIELD = 0x0201, // Write the second argument to a field (FREF) or
+	                         // element (AREF)
+
+	// Guards (prefix 0x03). A guard asserts that a condition holds, and
+	// leaves the trace through a side exit if it doesn't. The ordered
+	// comparisons fail if either operand is NaN; the unordered ones (prefixed
+	// with U) succeed if either operand is NaN, which makes each one exactly
+	// the negation of an ordered comparison (e.g. ULT is !(a >= b)).
+	IR_EQ  = 0x0300, // Bitwise equality of two values
+	IR_NEQ = 0x0301, // Bitwise inequality of two values
+	IR_LT  = 0x0302,
+	IR_LE  = 0x0303,
+	IR_GT  = 0x0304,
+	IR_GE  = 0x0305,
+	IR_ULT = 0x0306,
+	IR_ULE = 0x0307,
+	IR_UGT = 0x0308,
+	IR_UGE = 0x0309,
+
+	// Type guards, which check the NaN-boxing tag of a value (only use the
+	// first argument)
+	IR_IS_NUM  = 0x030a, // The value is a number
+	IR_IS_PRIM = 0x030b, // The value is a primitive (true, false, or nil)
+	IR_IS_FN   = 0x030c, // The value is a function
+	IR_IS_PTR  = 0x030d, // The value is a pointer
+
+	// The object (a pointer) has the shape given by the second argument,
+	// which is a literal shape index rather than a reference
+	IR_IS_SHAPE = 0x030e,
+
+	// The object (a pointer) doesn't need the write barrier before a pointer
+	// is stored into it (only uses the first argument)
+	IR_BARRIER = 0x030f,
+
+	// Array guards (see above)
+	IR_IS_ARRAY  = 0x0310, // The object (a pointer) is an array
+	IR_IS_INT    = 0x0311, // The number is an integer (or NaN, which is never
+	                       // in bounds)
+	IR_IN_BOUNDS = 0x0312, // The second argument is a valid index into the
+	                       // array given by the first
+
+	// Loops (prefix 0x04)
+	IR_LOOP = 0x0400, // Separates the peeled iteration from the loop body
+	IR_PHI  = 0x0401, // The first argument takes the second's value next time
+
+	// No operation (prefix 0x05), left behind by dead code elimination
+	IR_NOP = 0x0500,
+
+	// Fields (prefix 0x06)
+	IR_FREF = 0x0600,       // The address of a field in an object, given its
+	                        // literal index in the object's shape
+	IR_LOAD_FIELD = 0x0601, // Read a field or element (only uses the first
+	                        // argument)
+	IR_AREF = 0x0602,       // The address of an element in an array, given
+	                        // its index
 } IrOp;
 
-// String representations of each opcode.
-static char * IROP_NAMES[] = {
+// The maximum number of opcodes with the same prefix.
+#define IROP_MAX_PER_PREFIX 32
+
+// String representations of each opcode, indexed first by the opcode's prefix
+// and then by its lowest byte.
+static char * IROP_NAMES[][IROP_MAX_PER_PREFIX] = {
 	// Loads
-	"LOAD_STACK", "LOAD_CONST", 
+	{ "LOAD_STACK", "LOAD_CONST", "LOAD_PRIM", "LOAD_FN" },
 
 	// Arithmetic
-	[0x0100] = "ADD", 
+	{ "ADD", "SUB", "MUL", "DIV", "NEG" },
+
+	// Stores
+	{ "STORE_STACK", "STORE_FIELD" },
+
+	// Guards
+	{ "EQ", "NEQ", "LT", "LE", "GT", "GE", "ULT", "ULE", "UGT", "UGE",
+	  "IS_NUM", "IS_PRIM", "IS_FN", "IS_PTR", "IS_SHAPE",
+	  "BARRIER", "IS_ARRAY", "IS_INT", "IN_BOUNDS" },
+
+	// Loops
+	{ "---- LOOP ----", "PHI" },
+
+	// No operation
+	{ "NOP" },
+
+	// Fields
+	{ "FREF", "LOAD_FIELD", "AREF" },
 };
 
 // An IR instruction is a 64 bit unsigned integer, consisting of 4, 16 bit
@@ -105,7 +261,27 @@ static inline IrIns ir_op(IrIns ins) {
 
 // Returns the prefix for an instruction's opcode.
 static inline uint16_t ir_op_prefix(IrIns ins) {
-	return (uint16_t) (ins & 0x000000000000ff00);
+	return (uint16_t) ((ins & 0x000000000000ff00) >> 8);
+}
+
+// Returns the string representation of an instruction's opcode.
+static inline char * ir_op_name(IrIns ins) {
+	return IROP_NAMES[ir_op_prefix(ins)][ir_op(ins) & 0xff];
+}
+
+// Returns true if an instruction's first argument is a reference to another
+// instruction. Loads don't refer to other instructions, and the first argument
+// to a stack store is a stack slot.
+static inline bool ir_arg1_is_ref(IrIns ins) {
+	return ir_op_prefix(ins) != IROP_PREFIX_LOAD &&
+		ir_op(ins) != IR_STORE_STACK;
+}
+
+// Returns true if an instruction's second argument is a reference to another
+// instruction. Shape guards and FREFs take literal indices instead.
+static inline bool ir_arg2_is_ref(IrIns ins) {
+	return ir_op_prefix(ins) != IROP_PREFIX_LOAD && ir_op(ins) != IR_IS_SHAPE &&
+		ir_op(ins) != IR_FREF;
 }
 
 // Set the opcode for an instruction.
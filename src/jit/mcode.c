@@ -0,0 +1,124 @@
+
+// mcode.c
+// By Ben Anderson
+// November 2018
+
+#include "mcode.h"
+#include "arch.h"
+
+#include <string.h>
+
+#if HY_OS == HY_OS_WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+// Maps some fresh read/write memory from the operating system. Returns NULL on
+// failure.
+static uint8_t * mcode_map(size_t size) {
+#if HY_OS == HY_OS_WINDOWS
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	return mem == MAP_FAILED ? NULL : mem;
+#endif
+}
+
+// Returns memory to the operating system.
+static void mcode_unmap(uint8_t *base, size_t size) {
+#if HY_OS == HY_OS_WINDOWS
+	VirtualFree(base, 0, MEM_RELEASE);
+#else
+	munmap(base, size);
+#endif
+}
+
+// Sets the protection on some whole pages to either read/write (if `writable`
+// is true) or read/execute. Returns false on failure (e.g. if the operating
+// system doesn't allow memory to be made executable).
+static bool mcode_protect(uint8_t *start, size_t size, int writable) {
+#if HY_OS == HY_OS_WINDOWS
+	DWORD old;
+	return VirtualProtect(start, size,
+		writable ? PAGE_READWRITE : PAGE_EXECUTE_READ, &old) != 0;
+#else
+	return mprotect(start, size,
+		writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#endif
+}
+
+// Returns the size of a page of memory on the host.
+static size_t mcode_page_size() {
+#if HY_OS == HY_OS_WINDOWS
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (size_t) info.dwPageSize;
+#else
+	return (size_t) sysconf(_SC_PAGESIZE);
+#endif
+}
+
+// Allocates a new executable memory area large enough to fit `length` bytes of
+// machine code, and puts it on the front of the list. Returns NULL on failure.
+static MCodeArea * mcode_new_area(MCodeArea **areas, size_t length) {
+	// Round the size of the area up to a whole number of pages
+	size_t page = mcode_page_size();
+	size_t size = length > MCODE_AREA_SIZE ? length : MCODE_AREA_SIZE;
+	size = (size + page - 1) & ~(page - 1);
+
+	uint8_t *base = mcode_map(size);
+	if (base == NULL) {
+		return NULL;
+	}
+
+	MCodeArea *area = malloc(sizeof(MCodeArea));
+	area->base = base;
+	area->size = size;
+	area->used = 0;
+	area->prev = *areas;
+	*areas = area;
+	return area;
+}
+
+// Copies a chunk of machine code into executable memory, allocating a new area
+// on the front of the `areas` list if the current one is full. Returns a
+// pointer to the executable copy of the code, or NULL if we couldn't get any
+// executable memory from the operating system (or couldn't make it
+// executable).
+void * mcode_install(MCodeArea **areas, uint8_t *code, size_t length) {
+	// Start on a fresh page, so the pages we make writable don't have any
+	// code on them
+	size_t page = mcode_page_size();
+	size_t size = (length + page - 1) & ~(page - 1);
+	MCodeArea *area = *areas;
+	if (area == NULL || area->used + size > area->size) {
+		area = mcode_new_area(areas, size);
+		if (area == NULL) {
+			return NULL;
+		}
+	}
+	uint8_t *dest = &area->base[area->used];
+	area->used += size;
+
+	if (!mcode_protect(dest, size, 1)) {
+		return NULL;
+	}
+	memcpy(dest, code, length);
+	if (!mcode_protect(dest, size, 0)) {
+		return NULL;
+	}
+	return dest;
+}
+
+// Releases a list of executable memory areas.
+void mcode_free(MCodeArea *areas) {
+	while (areas != NULL) {
+		MCodeArea *prev = areas->prev;
+		mcode_unmap(areas->base, areas->size);
+		free(areas);
+		areas = prev;
+	}
+}
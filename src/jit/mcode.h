@@ -0,0 +1,54 @@
+
+// mcode.h
+// By Ben Anderson
+// November 2018
+
+// Assembled machine code has to end up somewhere the CPU is allowed to execute
+// it. We allocate executable memory straight from the operating system in
+// large areas, and copy each compiled trace into the most recent area.
+//
+// We never leave memory both writable and executable at the same time (W^X).
+// The pages we copy code into are mapped read/write only while we're copying,
+// and are flipped back to read/execute straight afterwards.
+//
+// Each piece of code starts on a fresh page, and installed code is never
+// modified, so installing code never stops code that's already there from
+// executing. That's important once a program's shared between threads, since
+// another thread could be running a trace at any time.
+
+#ifndef MCODE_H
+#define MCODE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The default size of a newly allocated executable memory area. Areas are
+// made larger than this if a single piece of machine code doesn't fit.
+#define MCODE_AREA_SIZE (64 * 1024)
+
+// A region of executable memory. Areas are kept in a linked list so that they
+// can all be released together.
+typedef struct mcode_area {
+	// Base address and total size (in bytes) of the mapped memory.
+	uint8_t *base;
+	size_t size;
+
+	// Number of bytes at the start of the area already used by machine code.
+	size_t used;
+
+	// The area that was allocated before this one, or NULL.
+	struct mcode_area *prev;
+} MCodeArea;
+
+// Copies a chunk of machine code into executable memory, allocating a new area
+// on the front of the `areas` list if the current one is full. Returns a
+// pointer to the executable copy of the code, or NULL if we couldn't get any
+// executable memory from the operating system (or couldn't make it
+// executable).
+void * mcode_install(MCodeArea **areas, uint8_t *code, size_t length);
+
+// Releases a list of executable memory areas.
+void mcode_free(MCodeArea *areas);
+
+#endif
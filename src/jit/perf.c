@@ -0,0 +1,43 @@
+// perf.c
+// By Ben Anderson
+// December 2018
+
+#include "perf.h"
+#include "arch.h"
+
+#if HY_OS == HY_OS_WINDOWS
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+// Writes the path of the current process's map file into `path`.
+void perf_map_path(char *path, size_t size) {
+	snprintf(path, size, "/tmp/perf-%d.map", (int) getpid());
+}
+
+// Opens the current process's map file, appending to it if it already exists
+// (e.g. if another VM in the process opened it first). Returns NULL on failure,
+// with `errno` set.
+FILE * perf_map_open() {
+	char path[64];
+	perf_map_path(path, sizeof(path));
+	return fopen(path, "a");
+}
+
+// Adds a trace's machine code to a map file. `exit` is the root trace's exit a
+// side trace starts from, or -1 for a root trace.
+void perf_map_add(FILE *map, uint8_t *code, size_t size, int fn, int loop,
+		int exit) {
+	fprintf(map, "%llx %llx hy:fn_%d:loop_%04d",
+		(unsigned long long) (uintptr_t) code, (unsigned long long) size, fn,
+		loop);
+	if (exit >= 0) {
+		fprintf(map, ":exit_%d", exit);
+	}
+	fprintf(map, "\n");
+
+	// Flush straight away, so the map's complete even if we crash later on
+	fflush(map);
+}
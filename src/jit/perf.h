@@ -0,0 +1,40 @@
+// perf.h
+// By Ben Anderson
+// December 2018
+
+// Linux's `perf` profiler can't find symbols for machine code that the JIT
+// compiler generates at runtime, so samples in compiled traces just show up as
+// anonymous addresses. Instead, perf looks for a map file at
+// `/tmp/perf-<pid>.map`, with a line for each piece of generated code:
+//
+//     <start address in hex> <size in hex> <symbol name>
+//
+// When the map's enabled (see `vm_open_perf_map`), a line is written for each
+// trace as it's installed. Root traces are named after the function and the
+// BC_LOOP instruction they were recorded from, e.g. `hy:fn_2:loop_0013`, and
+// side traces also get the root trace's exit they start from, e.g.
+// `hy:fn_2:loop_0013:exit_4`.
+//
+// The file's never deleted, since perf reads it after the process has exited.
+
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Writes the path of the current process's map file into `path`.
+void perf_map_path(char *path, size_t size);
+
+// Opens the current process's map file, appending to it if it already exists
+// (e.g. if another VM in the process opened it first). Returns NULL on failure,
+// with `errno` set.
+FILE * perf_map_open();
+
+// Adds a trace's machine code to a map file. `exit` is the root trace's exit a
+// side trace starts from, or -1 for a root trace.
+void perf_map_add(FILE *map, uint8_t *code, size_t size, int fn, int loop,
+	int exit);
+
+#endif
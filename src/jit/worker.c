@@ -0,0 +1,254 @@
+
+// worker.c
+// By Ben Anderson
+// December 2018
+
+#include "worker.h"
+#include "arch.h"
+
+#if HY_OS == HY_OS_WINDOWS
+
+// Traces are always compiled on the interpreter's thread on Windows.
+JitWorker * jit_worker_new() {
+	return NULL;
+}
+
+void jit_worker_free(JitWorker *worker) {}
+void jit_worker_push(JitWorker *worker, Trace *trace) {}
+
+bool jit_worker_full(JitWorker *worker) {
+	return true;
+}
+
+Trace * jit_worker_pop(JitWorker *worker, bool wait) {
+	return NULL;
+}
+
+bool jit_worker_has(JitWorker *worker, int fn, BcIns *loop,
+		CompiledTrace *root, int exit) {
+	return false;
+}
+
+#else
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+// ---- Queues ----------------------------------------------------------------
+
+// A lock-free ring buffer of traces, with a single producer and a single
+// consumer. `head` and `tail` only ever increase, and are wrapped when
+// indexing into `traces`. The producer publishes a trace by storing `tail`
+// after writing the trace into its slot, and the consumer frees the slot by
+// storing `head` after reading it.
+typedef struct {
+	Trace *traces[JIT_QUEUE_SIZE];
+	atomic_size_t head, tail;
+} TraceQueue;
+
+// Initialises an empty queue.
+static void queue_init(TraceQueue *queue) {
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+}
+
+// Adds a trace to the end of a queue. Returns false if the queue is full.
+static bool queue_push(TraceQueue *queue, Trace *trace) {
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&queue->head, memory_order_acquire);
+	if (tail - head >= JIT_QUEUE_SIZE) {
+		return false;
+	}
+	queue->traces[tail % JIT_QUEUE_SIZE] = trace;
+	atomic_store_explicit(&queue->tail, tail + 1, memory_order_release);
+	return true;
+}
+
+// Removes the trace at the front of a queue. Returns NULL if the queue is
+// empty.
+static Trace * queue_pop(TraceQueue *queue) {
+	size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+	if (head == tail) {
+		return NULL;
+	}
+	Trace *trace = queue->traces[head % JIT_QUEUE_SIZE];
+	atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+	return trace;
+}
+
+
+// ---- Compile Thread --------------------------------------------------------
+
+// A compile thread, along with its queues.
+struct jit_worker {
+	pthread_t thread;
+
+	// Traces waiting to be assembled, and traces waiting to be installed.
+	TraceQueue todo, done;
+
+	// Used to sleep until there's something in `todo` (for the compile
+	// thread) or `done` (for the interpreter, when it has to wait).
+	pthread_mutex_t lock;
+	pthread_cond_t todo_ready, done_ready;
+
+	// Set (while holding `lock`) when the compile thread should exit.
+	bool stop;
+
+	// Every trace with the compile thread, in the order they were queued.
+	// Only used by the interpreter's thread.
+	Trace *pending[JIT_QUEUE_SIZE];
+	int pending_count;
+};
+
+// Wakes up a thread waiting on a condition. Signalling while holding the lock
+// means we can't miss a thread that's just about to go to sleep.
+static void worker_signal(JitWorker *worker, pthread_cond_t *cond) {
+	pthread_mutex_lock(&worker->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&worker->lock);
+}
+
+// The compile thread assembles traces until it's told to stop.
+static void * worker_main(void *arg) {
+	JitWorker *worker = arg;
+	while (true) {
+		Trace *trace = queue_pop(&worker->todo);
+		if (trace == NULL) {
+			// Sleep until there's more work
+			pthread_mutex_lock(&worker->lock);
+			while (!worker->stop && atomic_load(&worker->todo.tail) ==
+					atomic_load(&worker->todo.head)) {
+				pthread_cond_wait(&worker->todo_ready, &worker->lock);
+			}
+			bool stop = worker->stop;
+			pthread_mutex_unlock(&worker->lock);
+			if (stop) {
+				return NULL;
+			}
+			continue;
+		}
+
+		// There's always room in `done`, since no more than JIT_QUEUE_SIZE
+		// traces are ever with the thread at once
+		jit_rec_assemble(trace);
+		queue_push(&worker->done, trace);
+		worker_signal(worker, &worker->done_ready);
+	}
+}
+
+// Starts a new compile thread. Returns NULL if threads aren't supported on
+// this platform.
+JitWorker * jit_worker_new() {
+	JitWorker *worker = malloc(sizeof(JitWorker));
+	queue_init(&worker->todo);
+	queue_init(&worker->done);
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->todo_ready, NULL);
+	pthread_cond_init(&worker->done_ready, NULL);
+	worker->stop = false;
+	worker->pending_count = 0;
+
+	// The thread inherits our signal mask, so block every signal while it's
+	// created. Signals (e.g. the profiler's SIGPROF) are then always handled
+	// by the interpreter's thread
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int failed = pthread_create(&worker->thread, NULL, worker_main, worker);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (failed != 0) {
+		pthread_cond_destroy(&worker->todo_ready);
+		pthread_cond_destroy(&worker->done_ready);
+		pthread_mutex_destroy(&worker->lock);
+		free(worker);
+		return NULL;
+	}
+	return worker;
+}
+
+// Stops a compile thread, waiting for it to finish the trace it's working on,
+// and frees any traces still with it.
+void jit_worker_free(JitWorker *worker) {
+	pthread_mutex_lock(&worker->lock);
+	worker->stop = true;
+	pthread_cond_signal(&worker->todo_ready);
+	pthread_mutex_unlock(&worker->lock);
+	pthread_join(worker->thread, NULL);
+
+	pthread_cond_destroy(&worker->todo_ready);
+	pthread_cond_destroy(&worker->done_ready);
+	pthread_mutex_destroy(&worker->lock);
+	for (int i = 0; i < worker->pending_count; i++) {
+		jit_trace_free(worker->pending[i]);
+	}
+	free(worker);
+}
+
+// Returns true if JIT_QUEUE_SIZE traces are already with the compile thread,
+// so no more can be queued.
+bool jit_worker_full(JitWorker *worker) {
+	return worker->pending_count >= JIT_QUEUE_SIZE;
+}
+
+// Queues a trace for the compile thread. There must be room for it (see
+// `jit_worker_full`).
+void jit_worker_push(JitWorker *worker, Trace *trace) {
+	// The queue never fills up, since it's as big as the pending list
+	assert(!jit_worker_full(worker));
+	worker->pending[worker->pending_count++] = trace;
+	queue_push(&worker->todo, trace);
+	worker_signal(worker, &worker->todo_ready);
+}
+
+// Returns the next trace the compile thread has assembled, in the order they
+// were queued, or NULL if none are ready yet. If `wait` is true, then blocks
+// until one's ready instead, unless no traces are with the thread at all.
+Trace * jit_worker_pop(JitWorker *worker, bool wait) {
+	if (worker->pending_count == 0) {
+		return NULL;
+	}
+	Trace *trace = queue_pop(&worker->done);
+	if (trace == NULL && wait) {
+		pthread_mutex_lock(&worker->lock);
+		while ((trace = queue_pop(&worker->done)) == NULL) {
+			pthread_cond_wait(&worker->done_ready, &worker->lock);
+		}
+		pthread_mutex_unlock(&worker->lock);
+	}
+	if (trace == NULL) {
+		return NULL;
+	}
+
+	// Traces come back in the order they were queued, which is the order
+	// they're in on the pending list
+	assert(worker->pending[0] == trace);
+	worker->pending_count--;
+	memmove(&worker->pending[0], &worker->pending[1],
+		sizeof(Trace *) * worker->pending_count);
+	return trace;
+}
+
+// Returns true if a trace for a loop (if `root` is NULL), or a side trace from
+// one of a root trace's exits, is with the compile thread.
+bool jit_worker_has(JitWorker *worker, int fn, BcIns *loop,
+		CompiledTrace *root, int exit) {
+	for (int i = 0; i < worker->pending_count; i++) {
+		Trace *trace = worker->pending[i];
+		if (trace->root == NULL && root == NULL && trace->loop == loop &&
+				trace->fn == fn) {
+			return true;
+		} else if (trace->root != NULL && trace->root == root &&
+				trace->exit == exit) {
+			return true;
+		}
+	}
+	return false;
+}
+
+#endif
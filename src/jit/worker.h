@@ -0,0 +1,58 @@
+
+// worker.h
+// By Ben Anderson
+// December 2018
+
+// The compile thread assembles traces in the background, so the interpreter
+// doesn't stall on register allocation and code generation every time it finds
+// a new hot loop. It's optional (see `VM::jit_thread`).
+//
+// Once a trace has been recorded and optimised, the interpreter queues it for
+// the compile thread and carries on interpreting the loop. The compile thread
+// assembles it and queues it back, and the interpreter installs it into the
+// trace cache the next time it reaches a LOOP instruction.
+//
+// Each VM that compiles on a thread has its own compile thread, and each
+// direction has its own lock-free, single-producer, single-consumer ring
+// buffer. Only the interpreter's thread touches the VM, the trace cache and
+// executable memory; the compile thread only touches the traces it's given.
+// The mutex and condition variables are only used to put a thread to sleep
+// when its queue is empty.
+
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "compiler.h"
+
+#include <stdbool.h>
+
+// A compile thread, along with its queues.
+typedef struct jit_worker JitWorker;
+
+// Starts a new compile thread. Returns NULL if threads aren't supported on
+// this platform.
+JitWorker * jit_worker_new();
+
+// Stops a compile thread, waiting for it to finish the trace it's working on,
+// and frees any traces still with it.
+void jit_worker_free(JitWorker *worker);
+
+// Returns true if JIT_QUEUE_SIZE traces are already with the compile thread,
+// so no more can be queued.
+bool jit_worker_full(JitWorker *worker);
+
+// Queues a trace for the compile thread. There must be room for it (see
+// `jit_worker_full`).
+void jit_worker_push(JitWorker *worker, Trace *trace);
+
+// Returns the next trace the compile thread has assembled, in the order they
+// were queued, or NULL if none are ready yet. If `wait` is true, then blocks
+// until one's ready instead, unless no traces are with the thread at all.
+Trace * jit_worker_pop(JitWorker *worker, bool wait);
+
+// Returns true if a trace for a loop (if `root` is NULL), or a side trace from
+// one of a root trace's exits, is with the compile thread.
+bool jit_worker_has(JitWorker *worker, int fn, BcIns *loop,
+	CompiledTrace *root, int exit);
+
+#endif
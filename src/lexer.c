@@ -5,6 +5,7 @@
 
 #include "lexer.h"
 #include "vm.h"
+#include "jit/arch.h"
 
 #include <string.h>
 #include <errno.h>
@@ -29,6 +30,191 @@ static inline int is_ident_continue(char ch) {
 	return is_ident_start(ch) || is_decimal_digit(ch);
 }
 
+// ---- Vectorised Scanning ---------------------------------------------------
+
+// The lexer spends most of its time skipping over whitespace and finding the
+// end of identifiers and numbers. Rather than testing one character at a time,
+// we classify a whole block of characters at once and get back a bit mask,
+// where bit `i` is set if the `i`th character in the block is in some class.
+// The end of a run of characters is then just the first unset bit.
+//
+// Blocks are always loaded from an address aligned to the block size, so a
+// load never crosses a page boundary and can't fault, even if it reads past the
+// NUL terminator at the end of the source code. Characters in the block before
+// the cursor are masked off.
+
+#if HY_ARCH_SIMD == HY_SIMD_AVX2
+#include <immintrin.h>
+
+#define VEC_SIZE 32
+#define VEC_ALL  0xffffffffu
+#define VEC_TOP  0x80000000u
+
+typedef __m256i Vec;
+#define vec_load(ptr)   _mm256_load_si256((const Vec *) (ptr))
+#define vec_set(ch)     _mm256_set1_epi8((char) (ch))
+#define vec_eq(a, b)    _mm256_cmpeq_epi8((a), (b))
+#define vec_gt(a, b)    _mm256_cmpgt_epi8((a), (b))
+#define vec_or(a, b)    _mm256_or_si256((a), (b))
+#define vec_and(a, b)   _mm256_and_si256((a), (b))
+#define vec_mask(v)     ((uint32_t) _mm256_movemask_epi8(v))
+
+#elif HY_ARCH_SIMD == HY_SIMD_SSE2
+#include <emmintrin.h>
+
+#define VEC_SIZE 16
+#define VEC_ALL  0xffffu
+#define VEC_TOP  0x8000u
+
+typedef __m128i Vec;
+#define vec_load(ptr)   _mm_load_si128((const Vec *) (ptr))
+#define vec_set(ch)     _mm_set1_epi8((char) (ch))
+#define vec_eq(a, b)    _mm_cmpeq_epi8((a), (b))
+#define vec_gt(a, b)    _mm_cmpgt_epi8((a), (b))
+#define vec_or(a, b)    _mm_or_si128((a), (b))
+#define vec_and(a, b)   _mm_and_si128((a), (b))
+#define vec_mask(v)     ((uint32_t) _mm_movemask_epi8(v))
+
+#else
+
+// Without vector instructions we still scan in blocks, but classify each
+// character in the block one at a time
+#define VEC_SIZE 8
+#define VEC_ALL  0xffu
+#define VEC_TOP  0x80u
+
+#endif
+
+#if HY_ARCH_SIMD != HY_SIMD_NONE
+
+// Loading a whole block can read past the end of the source code, which is
+// safe (the load can't cross a page) but upsets AddressSanitizer.
+#if defined(__SANITIZE_ADDRESS__)
+#define VEC_NO_ASAN __attribute__((no_sanitize_address))
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define VEC_NO_ASAN __attribute__((no_sanitize_address))
+#endif
+#endif
+#ifndef VEC_NO_ASAN
+#define VEC_NO_ASAN
+#endif
+
+// Returns the aligned block containing the given character.
+static inline char * vec_block(char *ptr) {
+	return (char *) ((uintptr_t) ptr & ~((uintptr_t) VEC_SIZE - 1));
+}
+
+// Returns a mask of the characters in `v` that lie between `lo` and `hi`
+// (inclusive). Only works for ASCII ranges, since the comparison is signed.
+static inline Vec vec_range(Vec v, char lo, char hi) {
+	return vec_and(vec_gt(v, vec_set(lo - 1)), vec_gt(vec_set(hi + 1), v));
+}
+
+// Classifies whitespace in a block, also setting `lf` and `cr` to masks of the
+// `\n` and `\r` characters in the block.
+VEC_NO_ASAN
+static inline uint32_t vec_whitespace(char *block, uint32_t *lf, uint32_t *cr) {
+	Vec v = vec_load(block);
+	Vec lf_v = vec_eq(v, vec_set('\n'));
+	Vec cr_v = vec_eq(v, vec_set('\r'));
+	Vec space = vec_or(vec_eq(v, vec_set(' ')), vec_eq(v, vec_set('\t')));
+	*lf = vec_mask(lf_v);
+	*cr = vec_mask(cr_v);
+	return vec_mask(vec_or(space, vec_or(lf_v, cr_v)));
+}
+
+// Classifies characters that can continue an identifier in a block.
+VEC_NO_ASAN
+static inline uint32_t vec_ident(char *block) {
+	Vec v = vec_load(block);
+
+	// Setting bit 5 maps upper case letters onto lower case ones, and doesn't
+	// map any other character into `a` to `z`
+	Vec letter = vec_range(vec_or(v, vec_set(0x20)), 'a', 'z');
+	Vec digit = vec_range(v, '0', '9');
+	Vec underscore = vec_eq(v, vec_set('_'));
+	return vec_mask(vec_or(letter, vec_or(digit, underscore)));
+}
+
+// Classifies decimal digits in a block.
+VEC_NO_ASAN
+static inline uint32_t vec_digits(char *block) {
+	return vec_mask(vec_range(vec_load(block), '0', '9'));
+}
+
+#else
+
+// Blocks start at the cursor, since we never read past the NUL terminator.
+static inline char * vec_block(char *ptr) {
+	return ptr;
+}
+
+// Classifies whitespace in a block, also setting `lf` and `cr` to masks of the
+// `\n` and `\r` characters in the block.
+static inline uint32_t vec_whitespace(char *block, uint32_t *lf, uint32_t *cr) {
+	uint32_t mask = 0;
+	*lf = *cr = 0;
+	for (int i = 0; i < VEC_SIZE && is_whitespace(block[i]); i++) {
+		mask |= 1u << i;
+		*lf |= (uint32_t) (block[i] == '\n') << i;
+		*cr |= (uint32_t) (block[i] == '\r') << i;
+	}
+	return mask;
+}
+
+// Classifies characters that can continue an identifier in a block.
+static inline uint32_t vec_ident(char *block) {
+	uint32_t mask = 0;
+	for (int i = 0; i < VEC_SIZE && is_ident_continue(block[i]); i++) {
+		mask |= 1u << i;
+	}
+	return mask;
+}
+
+// Classifies decimal digits in a block.
+static inline uint32_t vec_digits(char *block) {
+	uint32_t mask = 0;
+	for (int i = 0; i < VEC_SIZE && is_decimal_digit(block[i]); i++) {
+		mask |= 1u << i;
+	}
+	return mask;
+}
+
+#endif
+
+// Returns the bits in a block's class mask that belong to the run of
+// characters starting at bit `offset`. If the top bit is set, then the run
+// continues into the next block.
+static inline uint32_t vec_run(uint32_t mask, int offset) {
+	uint32_t from = VEC_ALL & (VEC_ALL << offset);
+	uint32_t outside = ~mask & from;
+	if (outside == 0) {
+		return from;
+	}
+	return from & ((1u << __builtin_ctz(outside)) - 1);
+}
+
+// Returns the number of characters in the run of decimal digits starting at
+// the given character.
+static int scan_digits(char *start) {
+	char *block = vec_block(start);
+	int offset = (int) (start - block);
+	int length = 0;
+	for (;;) {
+		uint32_t span = vec_run(vec_digits(block), offset);
+		length += __builtin_popcount(span);
+		if ((span & VEC_TOP) == 0) {
+			return length;
+		}
+		block += VEC_SIZE;
+		offset = 0;
+	}
+}
+
+
+// ---- Lexer ----------------------------------------------------------------
+
 // Creates a new lexer over the given source code.
 Lexer lex_new(VM *vm, char *path, char *code) {
 	Lexer lxr;
@@ -47,51 +233,94 @@ Lexer lex_new(VM *vm, char *path, char *code) {
 
 // Consume all whitespace up until the first non-whitespace character.
 static void lex_whitespace(Lexer *lxr) {
-	while (is_whitespace(lxr->code[lxr->cursor])) {
-		char ch = lxr->code[lxr->cursor];
-		if (ch == '\n' || ch == '\r') {
-			// Treat `\r\n` as a single newline
-			if (ch == '\r' && lxr->code[lxr->cursor + 1] == '\n') {
-				lxr->cursor++;
-			}
-			lxr->line++;
+	char *start = &lxr->code[lxr->cursor];
+	char *block = vec_block(start);
+	int offset = (int) (start - block);
+	for (;;) {
+		uint32_t lf, cr;
+		uint32_t span = vec_run(vec_whitespace(block, &lf, &cr), offset);
+		lxr->cursor += __builtin_popcount(span);
+
+		// Treat `\r\n` as a single newline, by only counting the `\r`s that
+		// aren't followed by a `\n`. A `\r` in the last character of the block
+		// is followed by the first character in the next block
+		uint32_t before_lf = lf >> 1;
+		if ((cr & span & VEC_TOP) && block[VEC_SIZE] == '\n') {
+			before_lf |= VEC_TOP;
 		}
-		lxr->cursor++;
+		lxr->line += __builtin_popcount(lf & span) +
+			__builtin_popcount(cr & span & ~before_lf);
+
+		if ((span & VEC_TOP) == 0) {
+			return;
+		}
+		block += VEC_SIZE;
+		offset = 0;
 	}
 }
 
+// A reserved language keyword.
+typedef struct {
+	char *name;
+	int length;
+	Tk tk;
+} Keyword;
+
+// A list of reserved keywords and their corresponding token values.
+static Keyword KEYWORDS[] = {
+	{"let", 3, TK_LET}, {"if", 2, TK_IF}, {"else", 4, TK_ELSE},
+	{"elseif", 6, TK_ELSEIF}, {"loop", 4, TK_LOOP}, {"while", 5, TK_WHILE},
+	{"for", 3, TK_FOR}, {"fn", 2, TK_FN}, {"return", 6, TK_RETURN},
+	{"struct", 6, TK_STRUCT}, {"new", 3, TK_NEW},
+	{"true", 4, TK_TRUE}, {"false", 5, TK_FALSE}, {"nil", 3, TK_NIL},
+	{NULL, 0, 0},
+};
+
 // Lex an identifier or a reserved language keyword.
 static void lex_ident(Lexer *lxr) {
 	// Find the end of the identifier
 	char *ident = &lxr->code[lxr->cursor];
-	while (is_ident_continue(lxr->code[lxr->cursor])) {
-		lxr->cursor++;
+	char *block = vec_block(ident);
+	int offset = (int) (ident - block);
+	for (;;) {
+		uint32_t span = vec_run(vec_ident(block), offset);
+		lxr->cursor += __builtin_popcount(span);
+		if ((span & VEC_TOP) == 0) {
+			break;
+		}
+		block += VEC_SIZE;
+		offset = 0;
 	}
 	lxr->tk.length = lxr->cursor - lxr->tk.start;
 
-	// A list of reserved keywords and their corresponding token values
-	static char *keywords[] = {
-		"let", "if", "else", "elseif", "loop", "while", "for", "fn", "true",
-		"false", "nil", NULL,
-	};
-	static Tk keyword_tks[] = {
-		TK_LET, TK_IF, TK_ELSE, TK_ELSEIF, TK_LOOP, TK_WHILE, TK_FOR, TK_FN,
-		TK_TRUE, TK_FALSE, TK_NIL,
-	};
-
 	// Compare the identifier against reserved language keywords
-	for (int i = 0; keywords[i] != NULL; i++) {
-		if (lxr->tk.length == strlen(keywords[i]) &&
-				strncmp(ident, keywords[i], lxr->tk.length) == 0) {
+	for (int i = 0; KEYWORDS[i].name != NULL; i++) {
+		if (lxr->tk.length == KEYWORDS[i].length &&
+				memcmp(ident, KEYWORDS[i].name, lxr->tk.length) == 0) {
 			// Found a matching keyword
-			lxr->tk.type = keyword_tks[i];
+			lxr->tk.type = KEYWORDS[i].tk;
 			return;
 		}
 	}
 
-	// Didn't find a matching keyword, so we have an identifier
+	// Didn't find a matching keyword, so we have an identifier. The
+	// identifier is still in the cache from finding its end, so hashing it
+	// afterwards costs about the same as hashing it in the loop above
 	lxr->tk.type = TK_IDENT;
 	lxr->tk.ident_hash = hash_string(ident, lxr->tk.length);
+
+#ifdef HASH_DEBUG
+	// Check the identifier's hash doesn't collide with a different identifier
+	char *existing = vm_intern_ident(lxr->vm, lxr->tk.ident_hash, ident,
+		lxr->tk.length);
+	if (existing != NULL) {
+		Err *err = err_new("identifier `%.*s` has the same hash as `%s`",
+			lxr->tk.length, ident, existing);
+		err->line = lxr->tk.line;
+		err_file(err, lxr->path);
+		err_trigger(lxr->vm, err);
+	}
+#endif
 }
 
 // Lex an integer with a specific base.
@@ -128,6 +357,24 @@ static void lex_int(Lexer *lxr, int base) {
 
 // Lex a floating point value.
 static void lex_float(Lexer *lxr) {
+	// Most numbers are short integers, which we can convert exactly ourselves
+	// without the overhead of `strtod`. Any integer with at most 15 digits is
+	// less than 2^53, so is exactly representable as a double
+	char *digits = &lxr->code[lxr->cursor];
+	int count = scan_digits(digits);
+	char next = digits[count];
+	if (count <= 15 && next != '.' && next != 'e' && next != 'E') {
+		uint64_t value = 0;
+		for (int i = 0; i < count; i++) {
+			value = value * 10 + (uint64_t) (digits[i] - '0');
+		}
+		lxr->tk.type = TK_NUM;
+		lxr->tk.length = count;
+		lxr->tk.num = (double) value;
+		lxr->cursor += count;
+		return;
+	}
+
 	// To check for a parse error, the standard library requires us to reset
 	// `errno`
 	errno = 0;
@@ -172,6 +419,67 @@ static void lex_num(Lexer *lxr) {
 	}
 }
 
+// Triggers an error at the current token.
+static void lex_trigger_err(Lexer *lxr, char *desc) {
+	Err *err = err_new(desc);
+	err->line = lxr->tk.line;
+	err_file(err, lxr->path);
+	err_trigger(lxr->vm, err);
+}
+
+// Lex a string literal, which is added to the VM's constants. The only escape
+// sequences are `\n`, `\t`, `\\` and `\"`. Strings can span multiple lines.
+static void lex_str(Lexer *lxr) {
+	// Find the closing quote and check every escape sequence first, so we
+	// know how much room the string's characters need, and don't leak them
+	// if there's an error
+	char *start = &lxr->code[lxr->cursor + 1];
+	char *end = start;
+	int lines = 0;
+	while (*end != '"') {
+		if (*end == '\0') {
+			lex_trigger_err(lxr, "unterminated string");
+			return;
+		} else if (*end == '\\') {
+			end++;
+			if (*end != 'n' && *end != 't' && *end != '\\' && *end != '"') {
+				lex_trigger_err(lxr, "invalid escape sequence in string");
+				return;
+			}
+		} else if (*end == '\n') {
+			lines++;
+		}
+		end++;
+	}
+
+	char *chars = malloc((size_t) (end - start) + 1);
+	int length = 0;
+	for (char *ch = start; ch < end; ch++) {
+		if (*ch == '\\') {
+			ch++;
+			switch (*ch) {
+				case 'n': chars[length++] = '\n'; break;
+				case 't': chars[length++] = '\t'; break;
+				default:  chars[length++] = *ch;  break;
+			}
+		} else {
+			chars[length++] = *ch;
+		}
+	}
+	int idx = vm_add_str(lxr->vm, chars, length);
+	free(chars);
+	if (idx < 0) {
+		lex_trigger_err(lxr, "too many constants");
+		return;
+	}
+
+	lxr->tk.type = TK_STR;
+	lxr->tk.length = (int) (end - start) + 2;
+	lxr->tk.str = idx;
+	lxr->cursor += lxr->tk.length;
+	lxr->line += lines;
+}
+
 // Shorthand for multi-character token switch case.
 #define MULTI_CHAR_TK(first, second, tk_type)       \
 	case first:                                     \
@@ -222,6 +530,11 @@ void lex_next(Lexer *lxr) {
 		lex_num(lxr);
 		return;
 
+		// String
+	case '"':
+		lex_str(lxr);
+		return;
+
 		// Multi-character symbols
 	MULTI_CHAR_TK('.', '.', TK_CONCAT)
 
@@ -256,7 +569,8 @@ static char *TK_NAMES[] = {
 	"`+=`", "`-=`", "`*=`", "`/=`", "`%=`",
 	"`==`", "`!=`", "`<=`", "`>=`", "`&&`", "`||`",
 	"`let`", "`if`", "`else`", "`elseif`", "`loop`", "`while`", "`for`",
-	"identifier", "number", "`false`", "`true`", "`nil`",
+	"`fn`", "`return`", "`struct`", "`new`",
+	"identifier", "number", "string", "`false`", "`true`", "`nil`",
 	"end of file",
 };
 
@@ -267,7 +581,7 @@ char * tk_to_string(Tk *tk) {
 		return (char *) tk;
 	} else {
 		// Multi-character token
-		return TK_NAMES[*tk];
+		return TK_NAMES[*tk - TK_CONCAT];
 	}
 }
 
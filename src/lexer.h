@@ -26,7 +26,8 @@ enum multi_tks {
 	TK_EQ, TK_NEQ, TK_LE, TK_GE,
 	TK_AND, TK_OR,
 	TK_LET, TK_IF, TK_ELSE, TK_ELSEIF, TK_LOOP, TK_WHILE, TK_FOR, TK_FN,
-	TK_IDENT, TK_NUM, TK_FALSE, TK_TRUE, TK_NIL,
+	TK_RETURN, TK_STRUCT, TK_NEW,
+	TK_IDENT, TK_NUM, TK_STR, TK_FALSE, TK_TRUE, TK_NIL,
 	TK_EOF,
 };
 
@@ -47,6 +48,9 @@ typedef struct {
 	union {
 		double num;
 		uint64_t ident_hash;
+
+		// The index of a string literal's constant.
+		int str;
 	};
 } TkInfo;
 
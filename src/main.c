@@ -10,10 +10,17 @@
 #include <string.h>
 
 #include "vm.h"
+#include "value.h"
+#include "image.h"
+#include "profile.h"
+#include "str.h"
 
 // Human-readable version string.
 #define HY_VERSION_STRING "0.1.0"
 
+// The file `--profile` writes its samples to, for flamegraph.pl.
+#define PROFILE_PATH "hydrogen.folded"
+
 // Only include if colors are supported
 #if !defined(_WIN32) && !defined(_WIN64)
 #include <unistd.h>
@@ -51,11 +58,23 @@ void print_help() {
 		"\n"
 		"Usage:\n"
 		"  hydrogen [file] [arguments...]\n"
+		"  hydrogen --compile [file] [output]\n"
+		"  hydrogen [options...] [file] [arguments...]\n"
 		"\n"
 		"Options:\n"
 		"  --version, -v   Show Hydrogen's version number\n"
 		"  --help, -h      Show this help text\n"
-		"A REPL is run if no file path is specified.\n"
+		"  --compile, -c   Compile a file to a bytecode image (" IMAGE_EXT ")\n"
+		"  --lazy          Only parse each function when it's first called\n"
+		"  --no-jit        Run everything in the interpreter\n"
+		"  --jit-thread    Compile hot loops on a separate thread\n"
+		"  --profile       Print instruction counts, and write samples to\n"
+		"                  " PROFILE_PATH " (needs a build with PROFILE on)\n"
+		"  --perf-map      Write symbols for compiled loops to\n"
+		"                  /tmp/perf-<pid>.map, for Linux's perf\n"
+		"A REPL is run if no file path is specified. Files ending in " IMAGE_EXT
+		"\n"
+		"are run as bytecode images.\n"
 	);
 }
 
@@ -65,11 +84,94 @@ int run_repl() {
 	return 0;
 }
 
-// Run a file.
-int run_file(char *path) {
+// Returns true if a string ends with the given suffix.
+int ends_with(char *string, char *suffix) {
+	size_t length = strlen(string);
+	size_t suffix_length = strlen(suffix);
+	return length >= suffix_length &&
+		strcmp(&string[length - suffix_length], suffix) == 0;
+}
+
+// Prints a profile's counters once a file has finished running, and writes
+// its samples to PROFILE_PATH.
+void print_profile(VM *vm) {
+	profile_stop(vm->profile);
+	profile_print(vm->profile, stderr);
+	FILE *f = fopen(PROFILE_PATH, "w");
+	if (f == NULL) {
+		fprintf(stderr, "Failed to open `" PROFILE_PATH "`\n");
+		return;
+	}
+	int stacks = profile_write_samples(vm->profile, vm, f);
+	fclose(f);
+	fprintf(stderr, "Wrote %d stacks to `" PROFILE_PATH "`\n", stacks);
+}
+
+// Options for running a file.
+typedef struct {
+	// Only parse each function in a source file when it's called.
+	bool lazy;
+
+	// Run everything in the interpreter, or compile traces on a separate
+	// thread.
+	bool no_jit, jit_thread;
+
+	// Profile the interpreter while it runs.
+	bool profile;
+
+	// Write compiled traces to a map for perf.
+	bool perf_map;
+} RunOptions;
+
+// Run a file, which is either source code or a bytecode image.
+int run_file(char *path, RunOptions *opts) {
 	// Create a new VM and run the file
 	VM vm = vm_new();
-	Err *err = vm_run_file(&vm, path);
+	vm.lazy = opts->lazy;
+	vm.jit = !opts->no_jit;
+	vm.jit_thread = opts->jit_thread;
+	if (opts->perf_map) {
+		Err *err = vm_open_perf_map(&vm);
+		if (err != NULL) {
+			err_print(err, supports_color());
+			err_free(err);
+			vm_free(&vm);
+			return EXIT_FAILURE;
+		}
+	}
+	if (opts->profile) {
+		vm.profile = profile_new();
+		if (!profile_start(vm.profile)) {
+			fprintf(stderr, "Sampling isn't supported on this platform\n");
+		}
+	}
+	Err *err;
+	if (ends_with(path, IMAGE_EXT)) {
+		err = vm_run_image(&vm, path);
+	} else {
+		err = vm_run_file(&vm, path);
+	}
+
+	// There's no way to print anything from Hydrogen code yet, so show the
+	// first local in the file's main function instead, if it ran without an
+	// error. A string is printed as it is, which is the first time a rope's
+	// characters are needed
+	if (err == NULL) {
+		Value first = vm.stack[0];
+		if (val_is_str(first)) {
+			String *str = str_flatten(&vm, first);
+			printf("First stack slot ");
+			fwrite(str->chars, 1, str->length, stdout);
+			printf("\n");
+		} else {
+			printf("First stack slot %g\n", v2n(first));
+		}
+	}
+	if (opts->profile) {
+		print_profile(&vm);
+		profile_free(vm.profile);
+		vm.profile = NULL;
+	}
 
 	// Check for an error
 	if (err != NULL) {
@@ -83,6 +185,36 @@ int run_file(char *path) {
 	}
 }
 
+// Compile a file to a bytecode image. If no output path is given, then the
+// image is written next to the file, with its extension replaced by `.hyc`.
+int compile_file(char *path, char *out) {
+	char *default_out = NULL;
+	if (out == NULL) {
+		size_t length = strlen(path);
+		if (ends_with(path, ".hy")) {
+			length -= 3;
+		}
+		default_out = malloc(length + sizeof(IMAGE_EXT));
+		memcpy(default_out, path, length);
+		strcpy(&default_out[length], IMAGE_EXT);
+		out = default_out;
+	}
+
+	VM vm = vm_new();
+	Err *err = vm_compile_file(&vm, path, out);
+	free(default_out);
+	vm_free(&vm);
+
+	// Check for an error
+	if (err != NULL) {
+		err_print(err, supports_color());
+		err_free(err);
+		return EXIT_FAILURE;
+	} else {
+		return EXIT_SUCCESS;
+	}
+}
+
 int main(int argc, char *argv[]) {
 	// Help message
 	if (argc >= 2 && (strcmp(argv[1], "--help") == 0 ||
@@ -98,9 +230,46 @@ int main(int argc, char *argv[]) {
 		return 0;
 	}
 
+	// Compile a file to a bytecode image
+	if (argc >= 2 && (strcmp(argv[1], "--compile") == 0 ||
+			strcmp(argv[1], "-c") == 0)) {
+		if (argc < 3) {
+			print_help();
+			return EXIT_FAILURE;
+		}
+		return compile_file(argv[2], argc >= 4 ? argv[3] : NULL);
+	}
+
+	// Options for running a file come before its path
+	RunOptions opts = { false, false, false, false, false };
+	int arg = 1;
+	for (; arg < argc; arg++) {
+		if (strcmp(argv[arg], "--lazy") == 0) {
+			opts.lazy = true;
+		} else if (strcmp(argv[arg], "--no-jit") == 0) {
+			opts.no_jit = true;
+		} else if (strcmp(argv[arg], "--jit-thread") == 0) {
+			opts.jit_thread = true;
+		} else if (strcmp(argv[arg], "--profile") == 0) {
+#ifndef PROFILE
+			fprintf(stderr, "Hydrogen was built without the profiler "
+				"(configure with -DPROFILE=ON)\n");
+			return EXIT_FAILURE;
+#endif
+			opts.profile = true;
+		} else if (strcmp(argv[arg], "--perf-map") == 0) {
+			opts.perf_map = true;
+		} else {
+			break;
+		}
+	}
+
 	// Run a file if there's a file path provided
-	if (argc >= 2) {
-		return run_file(argv[1]);
+	if (arg < argc) {
+		return run_file(argv[arg], &opts);
+	} else if (arg > 1) {
+		print_help();
+		return EXIT_FAILURE;
 	} else {
 		return run_repl();
 	}
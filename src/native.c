@@ -0,0 +1,178 @@
+
+// native.c
+// By Ben Anderson
+// December 2018
+
+#include "native.h"
+#include "array.h"
+#include "util.h"
+
+#include <string.h>
+
+// Returns an error if a value isn't an array, or isn't the same length as
+// another array (if `other` isn't NULL).
+static Err * native_check_array(Value val, Array *other) {
+	if (!val_is_array(val)) {
+		return err_new("expected array argument to native function");
+	}
+	if (other != NULL && ((Array *) v2ptr(val))->length != other->length) {
+		return err_new("arrays have different lengths");
+	}
+	return NULL;
+}
+
+// Creates a new array, with every element set to 0.
+//
+//   let a = array(length)
+static Err * native_array(VM *vm, Value *args, Value *top) {
+	if (!val_is_num(args[0])) {
+		return err_new("invalid array length");
+	}
+	double length = v2n(args[0]);
+	if (!(length >= 0.0 && length <= (double) ARRAY_MAX_LENGTH) ||
+			length != (double) (uint64_t) length) {
+		return err_new("invalid array length");
+	}
+	Array *array = array_new(vm, (uint64_t) length, top);
+	if (array == NULL) {
+		return err_new("out of memory");
+	}
+	memset(array->elements, 0, sizeof(double) * array->length);
+	args[0] = ptr2v(array);
+	return NULL;
+}
+
+// Returns the number of elements in an array.
+//
+//   let n = len(a)
+static Err * native_len(VM *vm, Value *args, Value *top) {
+	Err *err = native_check_array(args[0], NULL);
+	if (err != NULL) {
+		return err;
+	}
+	args[0] = n2v((double) ((Array *) v2ptr(args[0]))->length);
+	return NULL;
+}
+
+// Checks the arguments to an element-wise operation on two arrays, and
+// creates the array for its result. The arguments are read again afterwards,
+// since creating the array might move them.
+static Err * native_binary(VM *vm, Value *args, Value *top, Array **result) {
+	Err *err = native_check_array(args[0], NULL);
+	if (err == NULL) {
+		err = native_check_array(args[1], v2ptr(args[0]));
+	}
+	if (err != NULL) {
+		return err;
+	}
+	*result = array_new(vm, ((Array *) v2ptr(args[0]))->length, top);
+	if (*result == NULL) {
+		return err_new("out of memory");
+	}
+	return NULL;
+}
+
+// Adds two arrays of the same length together, element by element.
+//
+//   let c = add(a, b)
+static Err * native_add(VM *vm, Value *args, Value *top) {
+	Array *result;
+	Err *err = native_binary(vm, args, top, &result);
+	if (err != NULL) {
+		return err;
+	}
+	Array *a = v2ptr(args[0]), *b = v2ptr(args[1]);
+	array_add(result->elements, a->elements, b->elements, result->length);
+	args[0] = ptr2v(result);
+	return NULL;
+}
+
+// Multiplies two arrays of the same length together, element by element.
+//
+//   let c = mul(a, b)
+static Err * native_mul(VM *vm, Value *args, Value *top) {
+	Array *result;
+	Err *err = native_binary(vm, args, top, &result);
+	if (err != NULL) {
+		return err;
+	}
+	Array *a = v2ptr(args[0]), *b = v2ptr(args[1]);
+	array_mul(result->elements, a->elements, b->elements, result->length);
+	args[0] = ptr2v(result);
+	return NULL;
+}
+
+// Multiplies every element of an array by a number.
+//
+//   let b = scale(a, 2)
+static Err * native_scale(VM *vm, Value *args, Value *top) {
+	Err *err = native_check_array(args[0], NULL);
+	if (err != NULL) {
+		return err;
+	}
+	if (!val_is_num(args[1])) {
+		return err_new("expected number argument to native function");
+	}
+	Array *result = array_new(vm, ((Array *) v2ptr(args[0]))->length, top);
+	if (result == NULL) {
+		return err_new("out of memory");
+	}
+	Array *a = v2ptr(args[0]);
+	array_scale(result->elements, a->elements, v2n(args[1]), a->length);
+	args[0] = ptr2v(result);
+	return NULL;
+}
+
+// Returns the sum of every element in an array.
+//
+//   let total = sum(a)
+static Err * native_sum(VM *vm, Value *args, Value *top) {
+	Err *err = native_check_array(args[0], NULL);
+	if (err != NULL) {
+		return err;
+	}
+	Array *a = v2ptr(args[0]);
+	args[0] = n2v(array_sum(a->elements, a->length));
+	return NULL;
+}
+
+// Returns the dot product of two arrays of the same length.
+//
+//   let d = dot(a, b)
+static Err * native_dot(VM *vm, Value *args, Value *top) {
+	Err *err = native_check_array(args[0], NULL);
+	if (err == NULL) {
+		err = native_check_array(args[1], v2ptr(args[0]));
+	}
+	if (err != NULL) {
+		return err;
+	}
+	Array *a = v2ptr(args[0]), *b = v2ptr(args[1]);
+	args[0] = n2v(array_dot(a->elements, b->elements, a->length));
+	return NULL;
+}
+
+// Every native function.
+Native NATIVES[] = {
+	{"array", 1, native_array},
+	{"len", 1, native_len},
+	{"add", 2, native_add},
+	{"mul", 2, native_mul},
+	{"scale", 2, native_scale},
+	{"sum", 1, native_sum},
+	{"dot", 2, native_dot},
+};
+
+const int NATIVES_COUNT = sizeof(NATIVES) / sizeof(NATIVES[0]);
+
+// Returns the index of the native function with the given name (hashed with
+// `hash_string`), or -1 if there isn't one. There are only a few native
+// functions, and this only happens when parsing, so a linear search is fine.
+int native_find(uint64_t name) {
+	for (int i = 0; i < NATIVES_COUNT; i++) {
+		if (hash_string(NATIVES[i].name, strlen(NATIVES[i].name)) == name) {
+			return i;
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,45 @@
+
+// native.h
+// By Ben Anderson
+// December 2018
+
+// Native functions are built into the interpreter and written in C. They're
+// found by name after every local, upvalue and top level variable, and are
+// called like any other function:
+//
+//   let a = array(100)
+//   let n = len(a)
+//
+// Each call compiles to a single CALL_NATIVE instruction, which names the
+// native function by its index in NATIVES. The parser checks the number of
+// arguments, so a native function never has to. Calls to native functions
+// aren't compiled into traces; recording one aborts the trace (see `ir.h`).
+
+#ifndef NATIVE_H
+#define NATIVE_H
+
+#include "vm.h"
+
+// A native function. Its arguments are in `args`, and it stores its result in
+// `args[0]`. `top` is the end of the calling function's stack frame. A native
+// function that allocates anything has to do so before reading its arguments,
+// since allocating might run the garbage collector, which moves objects.
+typedef Err * (*NativeFn)(VM *vm, Value *args, Value *top);
+
+// The name of a native function, the number of arguments it takes, and the
+// function itself.
+typedef struct {
+	char *name;
+	int args_count;
+	NativeFn fn;
+} Native;
+
+// Every native function.
+extern Native NATIVES[];
+extern const int NATIVES_COUNT;
+
+// Returns the index of the native function with the given name (hashed with
+// `hash_string`), or -1 if there isn't one.
+int native_find(uint64_t name);
+
+#endif
@@ -0,0 +1,80 @@
+
+// object.c
+// By Ben Anderson
+// December 2018
+
+#include "object.h"
+#include "gc.h"
+#include "str.h"
+#include "array.h"
+
+#include <string.h>
+
+// Creates a new object with the given shape, copying the initial value of
+// each of its fields from `fields`, which has to be on the stack below `top`
+// (the end of the current function's stack frame), since creating the object
+// might run the garbage collector.
+Object * obj_new(VM *vm, int shape, Value *fields, Value *top) {
+	int count = vm->prog->shapes[shape].fields_count;
+	Object *obj = gc_alloc(vm, sizeof(Object) + sizeof(Value) * count, top);
+	obj->shape = (uint32_t) shape;
+	memcpy(obj->fields, fields, sizeof(Value) * count);
+	return obj;
+}
+
+// Returns the size of an object in bytes.
+size_t obj_size(Program *prog, Object *obj) {
+	switch (obj->shape) {
+	case SHAPE_STR:
+		return sizeof(String) + ((String *) obj)->length + 1;
+	case SHAPE_ROPE:
+		return sizeof(Rope);
+	case SHAPE_ARRAY:
+		return sizeof(Array) + sizeof(double) * ((Array *) obj)->length;
+	default:
+		return sizeof(Object) +
+			sizeof(Value) * prog->shapes[obj->shape].fields_count;
+	}
+}
+
+// Returns the number of values an object holds pointers to other objects in,
+// which always start straight after its header (in `Object::fields`).
+int obj_refs(Program *prog, Object *obj) {
+	switch (obj->shape) {
+	case SHAPE_STR:
+	case SHAPE_ARRAY:
+		return 0;
+	case SHAPE_ROPE:
+		return 2;
+	default:
+		return prog->shapes[obj->shape].fields_count;
+	}
+}
+
+// Returns the index of a field in a shape, or -1 if the shape doesn't have a
+// field with that name. Structs don't have many fields, so a linear search is
+// fine (and this only happens when an inline cache misses anyway).
+int shape_find_field(Shape *shape, uint64_t field) {
+	for (int i = 0; i < shape->fields_count; i++) {
+		if (shape->fields[i] == field) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+// Looks up the field named by an inline cache in a shape, and fills the cache
+// with the result if the field exists. Returns the index of the field, or -1
+// if the shape doesn't have it.
+//
+// Shapes never change once they're created, so if a program's shared between
+// VMs, it doesn't matter which VM fills the cache last; the cache always
+// holds a correct entry for some shape.
+int obj_field_miss(Program *prog, InlineCache *cache, uint32_t shape) {
+	int field = shape_find_field(&prog->shapes[shape], cache->field);
+	if (field >= 0) {
+		uint64_t entry = ((uint64_t) field << 32) | (shape + 1);
+		__atomic_store_n(&cache->entry, entry, __ATOMIC_RELAXED);
+	}
+	return field;
+}
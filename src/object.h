@@ -0,0 +1,113 @@
+
+// object.h
+// By Ben Anderson
+// December 2018
+
+// Objects are created from structs:
+//
+//   struct Node { name, child }
+//   let node = new Node(1, nil)
+//   node.child = new Node(2, nil)
+//
+// An object is a small header followed by its fields, which are stored one
+// after the other as an array of values, in the order given by its struct's
+// shape (see `Shape`). Every object created from a struct has the same shape,
+// so once we know an object's shape, a field is just an index into the array.
+//
+// Each GET_FIELD and SET_FIELD instruction has an inline cache, which maps the
+// shape of the last object it accessed to the index of the field in that
+// shape (see `InlineCache`). The interpreter fills the cache the first time
+// the instruction runs, and only looks the field up by name again if an
+// object with a different shape comes along. The JIT compiler turns each
+// access into a guard on the object's shape, followed by a load or store at a
+// fixed offset.
+
+#ifndef OBJECT_H
+#define OBJECT_H
+
+#include "vm.h"
+
+// The header at the start of everything allocated on the heap (structs,
+// strings, see `str.h`, and arrays, see `array.h`).
+//
+// * `next` is the next object in the old generation (see `Heap::old`). Once
+//   an object in the nursery has been copied into the old generation, this
+//   points to the copy instead.
+// * `shape` is the index of the object's shape in the program's list of
+//   shapes, or one of the reserved shapes below for strings.
+// * `gc` holds flags used by the garbage collector (see `gc.h`), and `mark`
+//   the object's mark.
+#define OBJ_HEADER        \
+	struct object *next;  \
+	uint32_t shape;       \
+	uint8_t gc;           \
+	uint8_t mark;
+
+// Shapes reserved for the built-in kinds of object, which never clash with the
+// index of a struct's shape (there can't be more than MAX_STRUCTS of those).
+#define SHAPE_STR   UINT32_MAX       // A flat string (`String`)
+#define SHAPE_ROPE  (UINT32_MAX - 1) // A concatenation of two strings (`Rope`)
+#define SHAPE_ARRAY (UINT32_MAX - 2) // An array of numbers (`Array`)
+
+// An object created from a struct.
+typedef struct object {
+	OBJ_HEADER
+
+	// The object's fields, in the order given by its shape.
+	Value fields[];
+} Object;
+
+// Creates a new object with the given shape, copying the initial value of
+// each of its fields from `fields`, which has to be on the stack below `top`
+// (the end of the current function's stack frame), since creating the object
+// might run the garbage collector.
+Object * obj_new(VM *vm, int shape, Value *fields, Value *top);
+
+// Returns the size of an object in bytes.
+size_t obj_size(Program *prog, Object *obj);
+
+// Returns the number of values an object holds pointers to other objects in,
+// which always start straight after its header (in `Object::fields`).
+int obj_refs(Program *prog, Object *obj);
+
+// Returns the index of a field in a shape, or -1 if the shape doesn't have a
+// field with that name.
+int shape_find_field(Shape *shape, uint64_t field);
+
+// Looks up the field named by an inline cache in a shape, and fills the cache
+// with the result if the field exists. Returns the index of the field, or -1
+// if the shape doesn't have it.
+int obj_field_miss(Program *prog, InlineCache *cache, uint32_t shape);
+
+// Returns the index of the field named by an inline cache in an object, or -1
+// if the object doesn't have it. The cache can be filled by a VM on another
+// thread at any time, so it's read atomically.
+static inline int obj_field(Program *prog, InlineCache *cache, Object *obj) {
+	uint64_t entry = __atomic_load_n(&cache->entry, __ATOMIC_RELAXED);
+	if ((uint32_t) entry == obj->shape + 1) {
+		return (int) (entry >> 32);
+	}
+	return obj_field_miss(prog, cache, obj->shape);
+}
+
+// Returns true if a value is a pointer to an object.
+static inline bool val_is_obj(Value val) {
+	return (val & TAG_PTR) == TAG_PTR;
+}
+
+// Returns true if a value is a pointer to an object created from a struct.
+static inline bool val_is_struct(Value val) {
+	return val_is_obj(val) && ((Object *) v2ptr(val))->shape < SHAPE_ARRAY;
+}
+
+// Returns true if a value is a string (either flat, or a rope).
+static inline bool val_is_str(Value val) {
+	return val_is_obj(val) && ((Object *) v2ptr(val))->shape >= SHAPE_ROPE;
+}
+
+// Returns true if a value is an array.
+static inline bool val_is_array(Value val) {
+	return val_is_obj(val) && ((Object *) v2ptr(val))->shape == SHAPE_ARRAY;
+}
+
+#endif
@@ -47,14 +47,23 @@
 // the next stack slot that is available (i.e. not already taken by a variable
 // defined by a `let` statement) within their scope. When we exit a block, all
 // locals that were created in that block are destroyed.
+//
+// So that resolving a name doesn't require searching the whole locals list,
+// the parser also keeps a hash table from each name to the most recently
+// created local with that name. Each local links to the local it shadows (in
+// an outer function scope), which is restored when the local is destroyed.
 
 #include "parser.h"
 
 #include "lexer.h"
 #include "value.h"
+#include "str.h"
+#include "native.h"
 
 #include <assert.h>
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
 
 // Useful macro to indicate when a piece of code is unreachable.
 #define UNREACHABLE() while(1) { assert(false); }
@@ -65,8 +74,26 @@
 // this local's in the locals array.
 typedef struct {
 	uint64_t name;
+
+	// The index of the previous local with the same name (which this one
+	// shadows) in the locals array, or -1 if there isn't one.
+	int shadowed;
 } Local;
 
+// An entry in the parser's hash table of local names. Entries are never
+// removed, since names are only ever added to the table; when a name has no
+// locals left, `local` is set to -1.
+typedef struct {
+	uint64_t name;
+
+	// The index of the most recently created local with this name in the
+	// locals array, or -1 if there isn't one.
+	int local;
+
+	// False if this entry in the table is empty.
+	bool used;
+} LocalName;
+
 // Each time we encounter a new function definition, we create a new function
 // definition scope (`FnScope`) and put it at the top of the parser's scope
 // stack (represented as a linked list). We emit all bytecode to the top-most
@@ -108,6 +135,15 @@ typedef struct {
 	Local *locals;
 	int locals_count, locals_capacity;
 
+	// Open addressing hash table from a name to the most recent local with
+	// that name. The capacity is always a power of 2.
+	LocalName *local_names;
+	int local_names_count, local_names_capacity;
+
+	// If true, then function bodies are skipped over rather than parsed, and
+	// are left to be parsed when they're first called (see `parse_lazy`).
+	bool lazy;
+
 	// Stores a list of the indexes of all imported packages.
 	int *imported_pkg_indices;
 	int imported_pkg_count, imported_pkg_capacity;
@@ -120,25 +156,41 @@ static Parser psr_new(VM *vm, int pkg, char *path, char *code) {
 	psr.lxr = lex_new(vm, path, code);
 	psr.pkg = pkg;
 	psr.scope = NULL;
+	psr.lazy = false;
 	psr.locals_capacity = 16;
 	psr.locals_count = 0;
-	psr.locals = malloc(sizeof(Local) * psr.locals_capacity);
+	psr.locals = arena_alloc(&vm->parser_arena,
+		sizeof(Local) * psr.locals_capacity);
+	psr.local_names_capacity = 64;
+	psr.local_names_count = 0;
+	psr.local_names = arena_calloc(&vm->parser_arena,
+		(size_t) psr.local_names_capacity, sizeof(LocalName));
 	return psr;
 }
 
-// Free resources allocated by a parser.
+// Free resources allocated by a parser. Everything the parser allocates lives
+// in the VM's parser arena.
 static void psr_free(Parser *psr) {
-	free(psr->locals);
+	arena_reset(&psr->vm->parser_arena);
 }
 
 // Returns a pointer to the package we're parsing.
 static inline Package * psr_pkg(Parser *psr) {
-	return &psr->vm->pkgs[psr->pkg];
+	return &psr->vm->prog->pkgs[psr->pkg];
 }
 
 // Returns a pointer to the function we're currently emitting bytecode to.
 static inline Function * psr_fn(Parser *psr) {
-	return &psr->vm->fns[psr->scope->fn];
+	return &psr->vm->prog->fns[psr->scope->fn];
+}
+
+// Keeps track of the number of stack slots used by the current function, after
+// allocating a new slot.
+static inline void psr_use_slots(Parser *psr) {
+	Function *fn = psr_fn(psr);
+	if (psr->scope->next_slot > fn->frame_size) {
+		fn->frame_size = psr->scope->next_slot;
+	}
 }
 
 // Trigger a new error at the lexer's current token's line number.
@@ -153,13 +205,85 @@ static void psr_trigger_err(Parser *psr, char *fmt, ...) {
 	err_trigger(psr->vm, err);
 }
 
+// Returns the entry for a name in a local names hash table, which is either
+// the entry holding that name, or the empty entry where it should be inserted.
+static LocalName * local_name_find(LocalName *names, int capacity,
+		uint64_t name) {
+	// Names are already hashes, so we can use their bits directly
+	int mask = capacity - 1;
+	int slot = (int) (name & (uint64_t) mask);
+	while (names[slot].used && names[slot].name != name) {
+		slot = (slot + 1) & mask;
+	}
+	return &names[slot];
+}
+
+// Doubles the size of the local names hash table.
+static void psr_grow_local_names(Parser *psr) {
+	int capacity = psr->local_names_capacity * 2;
+	LocalName *names = arena_calloc(&psr->vm->parser_arena, (size_t) capacity,
+		sizeof(LocalName));
+	for (int i = 0; i < psr->local_names_capacity; i++) {
+		LocalName *entry = &psr->local_names[i];
+		if (entry->used) {
+			*local_name_find(names, capacity, entry->name) = *entry;
+		}
+	}
+	psr->local_names = names;
+	psr->local_names_capacity = capacity;
+}
+
+// Returns the stack slot of the local with the given name in the current
+// function scope, or -1 if no such local exists.
+static int psr_find_local(Parser *psr, uint64_t name) {
+	LocalName *entry = local_name_find(psr->local_names,
+		psr->local_names_capacity, name);
+
+	// Locals in outer function scopes aren't accessible (there are no
+	// upvalues yet). Any local this one shadows is further out still
+	if (!entry->used || entry->local < psr->scope->first_local) {
+		return -1;
+	}
+	return entry->local - psr->scope->first_local;
+}
+
 // Creates a new local in the parser's locals list.
 static void psr_new_local(Parser *psr, uint64_t name) {
 	if (psr->locals_count >= psr->locals_capacity) {
+		psr->locals = arena_realloc(&psr->vm->parser_arena, psr->locals,
+			sizeof(Local) * psr->locals_capacity,
+			sizeof(Local) * psr->locals_capacity * 2);
 		psr->locals_capacity *= 2;
-		psr->locals = realloc(psr->locals, sizeof(Local) * psr->locals_capacity);
 	}
-	psr->locals[psr->locals_count++].name = name;
+
+	// Keep the hash table at most half full, so probe sequences stay short
+	if ((psr->local_names_count + 1) * 2 > psr->local_names_capacity) {
+		psr_grow_local_names(psr);
+	}
+	LocalName *entry = local_name_find(psr->local_names,
+		psr->local_names_capacity, name);
+	if (!entry->used) {
+		entry->used = true;
+		entry->name = name;
+		entry->local = -1;
+		psr->local_names_count++;
+	}
+
+	Local *local = &psr->locals[psr->locals_count];
+	local->name = name;
+	local->shadowed = entry->local;
+	entry->local = psr->locals_count++;
+}
+
+// Destroys every local created after the first `count` locals, un-shadowing
+// any locals they hid.
+static void psr_discard_locals(Parser *psr, int count) {
+	while (psr->locals_count > count) {
+		Local *local = &psr->locals[--psr->locals_count];
+		LocalName *entry = local_name_find(psr->local_names,
+			psr->local_names_capacity, local->name);
+		entry->local = local->shadowed;
+	}
 }
 
 
@@ -190,8 +314,9 @@ typedef enum {
 	NODE_NUM,
 	NODE_LOCAL,
 	NODE_PRIM,
+	NODE_STR,
 
-	// Discharged (also includes NODE_PRIM)
+	// Discharged (also includes NODE_PRIM and NODE_STR)
 	NODE_CONST,
 	NODE_RELOC,
 	NODE_NON_RELOC,
@@ -241,7 +366,8 @@ typedef struct {
 		// The value of a primitive (true, false, or nil).
 		Primitive prim;
 
-		// The index of a discharged constant in the VM's constants array.
+		// The index of a discharged constant (or a string constant) in the
+		// VM's constants array.
 		uint16_t const_idx;
 
 		// The bytecode index of a relocatable instruction.
@@ -559,14 +685,17 @@ static void expr_free_node(Parser *psr, Node *node) {
 static void expr_discharge(Parser *psr, Node *node) {
 	switch (node->type) {
 	case NODE_NUM:
+	{
 		// Check we don't exceed the maximum number of allowed constants
-		if (psr->vm->consts_count >= MAX_CONSTS) {
+		int const_idx = vm_add_num(psr->vm, node->num);
+		if (const_idx < 0) {
 			psr_trigger_err(psr, "too many constants");
 			UNREACHABLE();
 		}
 		node->type = NODE_CONST;
-		node->const_idx = (uint16_t) vm_add_num(psr->vm, node->num);
+		node->const_idx = (uint16_t) const_idx;
 		break;
+	}
 
 	case NODE_LOCAL:
 		node->type = NODE_NON_RELOC;
@@ -613,6 +742,12 @@ static void expr_to_slot(Parser *psr, uint8_t dest, Node *node) {
 		break;
 	}
 
+	case NODE_STR: {
+		BcIns ins = bc_new2(BC_SET_S, dest, node->const_idx);
+		fn_emit(psr_fn(psr), ins);
+		break;
+	}
+
 	case NODE_JMP: {
 		// Ensure the true case falls through
 		jmp_ensure_true_falls_through(psr, node);
@@ -658,6 +793,7 @@ static uint8_t expr_to_next_slot(Parser *psr, Node *node) {
 
 	// Advance the next slot counter and store the local
 	psr->scope->next_slot++;
+	psr_use_slots(psr);
 	expr_to_slot(psr, slot, node);
 	return slot;
 }
@@ -707,7 +843,7 @@ static void expr_to_jmp(Parser *psr, Node *node) {
 	expr_discharge(psr, node);
 
 	switch (node->type) {
-	case NODE_RELOC: case NODE_PRIM: case NODE_CONST:
+	case NODE_RELOC: case NODE_PRIM: case NODE_CONST: case NODE_STR:
 		// Dishcarge relocations and constants to stack slots for comparison;
 		// we don't bother trying to fold constants because we likely already
 		// emitted bytecode for the left operand we don't want to have to undo
@@ -757,7 +893,7 @@ static bool expr_fold_arith(Tk binop, Node *left, Node right) {
 // Emit bytecode for a binary arithmetic operation.
 static void expr_emit_arith(Parser *psr, Tk binop, Node *left, Node right) {
 	// Check for valid operand types
-	if (right.type == NODE_PRIM) {
+	if (right.type == NODE_PRIM || right.type == NODE_STR) {
 		psr_trigger_err(psr, "invalid operand to binary operator");
 		UNREACHABLE();
 	}
@@ -843,6 +979,20 @@ static bool expr_fold_rel(Tk binop, Node *left, Node right) {
 			default: UNREACHABLE();
 		}
 
+		// Set the result to be a primitive
+		left->type = NODE_PRIM;
+		left->prim = (Primitive) (result + PRIM_FALSE);
+		return true;
+	} else if (left->type == NODE_STR) { // Only for TK_EQ and TK_NEQ
+		// String constants are interned, so two strings with the same
+		// contents always have the same constant
+		bool result;
+		switch (binop) {
+			case TK_EQ:  result = left->const_idx == right.const_idx; break;
+			case TK_NEQ: result = left->const_idx != right.const_idx; break;
+			default: UNREACHABLE();
+		}
+
 		// Set the result to be a primitive
 		left->type = NODE_PRIM;
 		left->prim = (Primitive) (result + PRIM_FALSE);
@@ -856,7 +1006,8 @@ static bool expr_fold_rel(Tk binop, Node *left, Node right) {
 // Emit bytecode for an order operation.
 static void expr_emit_rel(Parser *psr, Tk binop, Node *left, Node right) {
 	// Check for valid operand types
-	if (binop_is_ord(binop) && right.type == NODE_PRIM) {
+	if (binop_is_ord(binop) &&
+			(right.type == NODE_PRIM || right.type == NODE_STR)) {
 		psr_trigger_err(psr, "invalid operand to binary operator");
 		UNREACHABLE();
 	}
@@ -866,7 +1017,9 @@ static void expr_emit_rel(Parser *psr, Tk binop, Node *left, Node right) {
 		return;
 	}
 
-	// We need to ensure the constant is ALWAYS the right operand
+	// We need to ensure the constant is ALWAYS the right operand. Strings
+	// aren't constants here, since equal strings might have different bits
+	// at runtime; they're compared in stack slots instead
 	Node *result = left;
 	Node l, r;
 	if (node_is_const(left)) {
@@ -920,6 +1073,89 @@ static void expr_emit_rel(Parser *psr, Tk binop, Node *left, Node right) {
 	result->jmp.false_list = -1;
 }
 
+// Returns the characters of a constant operand to a concatenation, converting
+// a number to a string in `num` (in the same way as `str_concat`).
+static char * expr_concat_chars(Parser *psr, Node *node, char num[32],
+		uint32_t *length) {
+	if (node->type == NODE_NUM) {
+		*length = (uint32_t) snprintf(num, 32, "%.14g", node->num);
+		return num;
+	}
+	String *str = v2ptr(psr->vm->prog->consts[node->const_idx]);
+	*length = str->length;
+	return str->chars;
+}
+
+// Attempt to fold a concatenation. Returns true on success and modifies `left`
+// to contain the folded string.
+static bool expr_fold_concat(Parser *psr, Node *left, Node right) {
+	// Only fold if both operands are strings or numbers
+	if ((left->type != NODE_STR && left->type != NODE_NUM) ||
+			(right.type != NODE_STR && right.type != NODE_NUM)) {
+		return false;
+	}
+
+	char left_num[32], right_num[32];
+	uint32_t left_length, right_length;
+	char *left_chars = expr_concat_chars(psr, left, left_num, &left_length);
+	char *right_chars = expr_concat_chars(psr, &right, right_num,
+		&right_length);
+	uint64_t length = (uint64_t) left_length + (uint64_t) right_length;
+	if (length > INT_MAX) {
+		psr_trigger_err(psr, "string is too long");
+		UNREACHABLE();
+	}
+
+	// Adding the new string can move the constants list, so copy both sides
+	// first
+	char *chars = malloc((size_t) length + 1);
+	memcpy(chars, left_chars, left_length);
+	memcpy(&chars[left_length], right_chars, right_length);
+	int const_idx = vm_add_str(psr->vm, chars, (int) length);
+	free(chars);
+	if (const_idx < 0) {
+		psr_trigger_err(psr, "too many constants");
+		UNREACHABLE();
+	}
+	left->type = NODE_STR;
+	left->const_idx = (uint16_t) const_idx;
+	return true;
+}
+
+// Emit bytecode for a concatenation.
+static void expr_emit_concat(Parser *psr, Node *left, Node right) {
+	// Check for valid operand types
+	if (right.type == NODE_PRIM) {
+		psr_trigger_err(psr, "invalid operand to binary operator");
+		UNREACHABLE();
+	}
+
+	// Check if we can fold the concatenation
+	if (expr_fold_concat(psr, left, right)) {
+		return;
+	}
+
+	// Both operands have to be in stack slots
+	Node l = *left, r = right;
+	uint8_t larg = expr_to_any_slot(psr, &l);
+	uint8_t rarg = expr_to_any_slot(psr, &r);
+
+	// See comment under `expr_emit_arith`
+	if (larg > rarg) {
+		expr_free_node(psr, &l);
+		expr_free_node(psr, &r);
+	} else {
+		expr_free_node(psr, &r);
+		expr_free_node(psr, &l);
+	}
+
+	// Generate the relocatable bytecode instruction
+	BcIns ins = bc_new3(BC_CONCAT, 0, larg, rarg);
+	int idx = fn_emit(psr_fn(psr), ins);
+	left->type = NODE_RELOC;
+	left->reloc_idx = idx;
+}
+
 // Emit bytecode for a logical AND operation.
 static void expr_emit_and(Parser *psr, Node *left, Node right) {
 	// Emit code to convert `right` to a jump, if necessary
@@ -978,6 +1214,11 @@ static void expr_emit_binary(Parser *psr, Tk binop, Node *left, Node right) {
 		expr_emit_rel(psr, binop, left, right);
 		break;
 
+		// String operators
+	case TK_CONCAT:
+		expr_emit_concat(psr, left, right);
+		break;
+
 		// Logical operators
 	case TK_AND:
 		expr_emit_and(psr, left, right);
@@ -1001,7 +1242,7 @@ static void expr_emit_binary_left(Parser *psr, Tk binop, Node *left) {
 	if (binop_is_arith(binop)) {
 		if (left->type == NODE_NUM) {
 			return;
-		} else if (left->type == NODE_PRIM) {
+		} else if (left->type == NODE_PRIM || left->type == NODE_STR) {
 			// Invalid operator
 			psr_trigger_err(psr, "invalid operand to binary operator");
 			UNREACHABLE();
@@ -1015,6 +1256,22 @@ static void expr_emit_binary_left(Parser *psr, Tk binop, Node *left) {
 			// Can't give primitives to order operations
 			psr_trigger_err(psr, "invalid operand to binary operator");
 			UNREACHABLE();
+		} else if (left->type == NODE_STR) {
+			// Strings can't be ordered, but we might be able to fold an
+			// equality test
+			if (binop_is_ord(binop)) {
+				psr_trigger_err(psr, "invalid operand to binary operator");
+				UNREACHABLE();
+			}
+			return;
+		}
+	} else if (binop == TK_CONCAT) {
+		if (left->type == NODE_NUM || left->type == NODE_STR) {
+			// We might be able to fold the concatenation
+			return;
+		} else if (left->type == NODE_PRIM) {
+			psr_trigger_err(psr, "invalid operand to binary operator");
+			UNREACHABLE();
 		}
 	} else if (binop == TK_AND || binop == TK_OR) {
 		// Turn the operand into a jump, if necessary
@@ -1032,7 +1289,7 @@ static void expr_emit_neg(Parser *psr, Node *operand) {
 	if (operand->type == NODE_NUM) {
 		operand->num = -operand->num;
 		return;
-	} else if (operand->type == NODE_PRIM) {
+	} else if (operand->type == NODE_PRIM || operand->type == NODE_STR) {
 		// Invalid operand
 		psr_trigger_err(psr, "invalid operand to unary operator");
 		UNREACHABLE();
@@ -1075,20 +1332,13 @@ static void expr_emit_unary(Parser *psr, Tk unop, Node *operand) {
 	}
 }
 
-// Parse a function call postfix operation.
-static void expr_postfix_fn_call(Parser *psr, Node *operand) {
-	// Check we have a valid operand type
-	if (operand->type != NODE_LOCAL) {
-		psr_trigger_err(psr, "cannot call non-local type");
-		UNREACHABLE();
-	}
-
+// Parses the arguments to a function call, starting at the opening
+// parenthesis, putting each one into the next available slot. Returns the
+// number of arguments.
+static int expr_call_args(Parser *psr) {
 	// Skip the opening parenthesis
 	lex_next(&psr->lxr);
 
-	// Keep track of where the first argument was placed on the stack
-	uint8_t first_arg = (uint8_t) psr->scope->next_slot;
-
 	// Keep parsing function call arguments separated by commas
 	int num_args = 0;
 	while (true) {
@@ -1109,6 +1359,20 @@ static void expr_postfix_fn_call(Parser *psr, Node *operand) {
 			lex_next(&psr->lxr);
 		}
 	}
+	return num_args;
+}
+
+// Parse a function call postfix operation.
+static void expr_postfix_fn_call(Parser *psr, Node *operand) {
+	// Check we have a valid operand type
+	if (operand->type != NODE_LOCAL) {
+		psr_trigger_err(psr, "cannot call non-local type");
+		UNREACHABLE();
+	}
+
+	// Keep track of where the first argument was placed on the stack
+	uint8_t first_arg = (uint8_t) psr->scope->next_slot;
+	expr_call_args(psr);
 
 	// Emit a function call instruction
 	uint8_t arg_count = (uint8_t) psr->scope->next_slot - first_arg;
@@ -1123,13 +1387,101 @@ static void expr_postfix_fn_call(Parser *psr, Node *operand) {
 	// now that the call is over, except the fist one which now holds the return
 	// value
 	psr->scope->next_slot = first_arg + 1;
+	psr_use_slots(psr);
+}
+
+// Parse a call to a native function, whose name we've already skipped over.
+static Node expr_native_call(Parser *psr, int native) {
+	// A native function can only be called, not used as a value
+	if (psr->lxr.tk.type != '(') {
+		psr_trigger_err(psr, "native function must be called");
+		UNREACHABLE();
+	}
+
+	// Native functions don't check how many arguments they're given
+	uint8_t first_arg = (uint8_t) psr->scope->next_slot;
+	if (expr_call_args(psr) != NATIVES[native].args_count) {
+		psr_trigger_err(psr, "wrong number of arguments to native function");
+		UNREACHABLE();
+	}
+	uint8_t arg_count = (uint8_t) psr->scope->next_slot - first_arg;
+	BcIns call = bc_new3(BC_CALL_NATIVE, (uint8_t) native, first_arg,
+		arg_count);
+	fn_emit(psr_fn(psr), call);
+
+	// The result is in the first argument slot, like any other function call
+	Node result;
+	result.type = NODE_NON_RELOC;
+	result.slot = first_arg;
+	psr->scope->next_slot = first_arg + 1;
+	psr_use_slots(psr);
+	return result;
+}
+
+// Adds an inline cache for an access to a field to the current function,
+// returning its index.
+static uint8_t psr_new_cache(Parser *psr, uint64_t field) {
+	int cache = fn_new_cache(psr_fn(psr), field);
+	if (cache < 0) {
+		psr_trigger_err(psr, "too many field accesses in function");
+		UNREACHABLE();
+	}
+	return (uint8_t) cache;
+}
+
+// Parse a field access postfix operation.
+static void expr_postfix_field(Parser *psr, Node *operand) {
+	// Skip the `.`
+	lex_next(&psr->lxr);
+
+	// Expect the name of the field
+	lex_expect(&psr->lxr, TK_IDENT);
+	uint8_t cache = psr_new_cache(psr, psr->lxr.tk.ident_hash);
+	lex_next(&psr->lxr);
+
+	// The object has to be in a stack slot, which we can re-use for the
+	// field's value if it's a temporary
+	uint8_t obj = expr_to_any_slot(psr, operand);
+	expr_free_node(psr, operand);
+
+	// The field's value is a relocatable instruction
+	BcIns ins = bc_new3(BC_GET_FIELD, 0, obj, cache);
+	operand->type = NODE_RELOC;
+	operand->reloc_idx = fn_emit(psr_fn(psr), ins);
 }
 
-// Parse a postfix operator (e.g. function calls or array indexation).
+// Parse an array index postfix operation.
+static void expr_postfix_index(Parser *psr, Node *operand) {
+	// Skip the `[`
+	lex_next(&psr->lxr);
+
+	// The array has to be in a stack slot before we parse the index, which
+	// might need temporary slots of its own
+	uint8_t array = expr_to_any_slot(psr, operand);
+	Node index = parse_subexpr(psr, PREC_NONE);
+	uint8_t index_slot = expr_to_any_slot(psr, &index);
+	lex_expect(&psr->lxr, ']');
+	lex_next(&psr->lxr);
+
+	// Free the index before the array, since it's above it on the stack. The
+	// element is a relocatable instruction
+	expr_free_node(psr, &index);
+	expr_free_node(psr, operand);
+	BcIns ins = bc_new3(BC_GET_INDEX, 0, array, index_slot);
+	operand->type = NODE_RELOC;
+	operand->reloc_idx = fn_emit(psr_fn(psr), ins);
+}
+
+// Parse postfix operators (e.g. function calls, field accesses or indexing
+// an array).
 static void expr_postfix(Parser *psr, Node *operand) {
-	switch (psr->lxr.tk.type) {
-		case '(': expr_postfix_fn_call(psr, operand); break;
-		default: return;
+	while (true) {
+		switch (psr->lxr.tk.type) {
+			case '(': expr_postfix_fn_call(psr, operand); break;
+			case '.': expr_postfix_field(psr, operand); break;
+			case '[': expr_postfix_index(psr, operand); break;
+			default: return;
+		}
 	}
 }
 
@@ -1142,16 +1494,19 @@ static Node expr_operand_num(Parser *psr) {
 	return operand;
 }
 
+// Parse a string operand, whose constant was added by the lexer.
+static Node expr_operand_str(Parser *psr) {
+	Node operand;
+	operand.type = NODE_STR;
+	operand.const_idx = (uint16_t) psr->lxr.tk.str;
+	lex_next(&psr->lxr);
+	return operand;
+}
+
 // Parse a local variable in the current scope. Returns true if we could resolve
 // the name.
 static bool expr_operand_local(Parser *psr, Node *result, uint64_t name) {
-	int slot = -1;
-	for (int i = psr->scope->first_local; i < psr->locals_count; i++) {
-		if (psr->locals[i].name == name) {
-			slot = i - psr->scope->first_local;
-			break;
-		}
-	}
+	int slot = psr_find_local(psr, name);
 
 	// Couldn't find the name in the current scope
 	if (slot == -1) {
@@ -1168,7 +1523,7 @@ static bool expr_operand_local(Parser *psr, Node *result, uint64_t name) {
 // The parser searches for symbols in the following order:
 // 1) Local variables in the current scope
 // 2) Upvalues
-// 3) Native functions within the current package
+// 3) Built-in native functions (see `native.h`)
 // 4) Imported package names
 static Node expr_operand_name(Parser *psr) {
 	// Save the identifier's name and skip over the token
@@ -1181,6 +1536,12 @@ static Node expr_operand_name(Parser *psr) {
 		return result;
 	}
 
+	// Check native functions
+	int native = native_find(name);
+	if (native >= 0) {
+		return expr_native_call(psr, native);
+	}
+
 	// Failed to resolve the name to some symbol
 	psr_trigger_err(psr, "variable not defined");
 	UNREACHABLE();
@@ -1231,13 +1592,85 @@ static Node expr_operand_fn(Parser *psr) {
 	return node;
 }
 
+// Allocates a temporary stack slot on top of the stack, without putting
+// anything in it.
+static uint8_t psr_new_temp(Parser *psr) {
+	if (psr->scope->next_slot >= MAX_LOCALS_IN_FN) {
+		psr_trigger_err(psr, "too many locals in function");
+		UNREACHABLE();
+	}
+	uint8_t slot = (uint8_t) psr->scope->next_slot++;
+	psr_use_slots(psr);
+	return slot;
+}
+
+// Parse a `new` expression, which creates an object from a struct. The
+// arguments are assigned to the struct's fields in the order they were
+// defined, and any fields without an argument are nil.
+static Node expr_operand_new(Parser *psr) {
+	// Skip the `new` token
+	lex_next(&psr->lxr);
+
+	// Expect the name of a struct
+	lex_expect(&psr->lxr, TK_IDENT);
+	int shape = vm_find_shape(psr->vm, psr->pkg, psr->lxr.tk.ident_hash);
+	if (shape < 0) {
+		psr_trigger_err(psr, "struct not defined");
+		UNREACHABLE();
+	}
+	int fields_count = psr->vm->prog->shapes[shape].fields_count;
+	lex_next(&psr->lxr);
+
+	// The object is created in a fixed slot, and NEW takes the fields' values
+	// from the slots after it
+	uint8_t dest = psr_new_temp(psr);
+	lex_expect(&psr->lxr, '(');
+	lex_next(&psr->lxr);
+	int args_count = 0;
+	while (psr->lxr.tk.type != ')') {
+		if (args_count >= fields_count) {
+			psr_trigger_err(psr, "too many arguments to struct");
+			UNREACHABLE();
+		}
+		Node arg = parse_subexpr(psr, PREC_NONE);
+		expr_to_next_slot(psr, &arg);
+		args_count++;
+
+		// Expect a comma or closing parenthesis
+		if (psr->lxr.tk.type != ',') {
+			lex_expect(&psr->lxr, ')');
+		} else {
+			lex_next(&psr->lxr);
+		}
+	}
+	lex_next(&psr->lxr);
+
+	// Any fields that weren't given an argument are nil
+	for (int i = args_count; i < fields_count; i++) {
+		Node nil;
+		nil.type = NODE_PRIM;
+		nil.prim = PRIM_NIL;
+		expr_to_next_slot(psr, &nil);
+	}
+	fn_emit(psr_fn(psr), bc_new2(BC_NEW, dest, (uint16_t) shape));
+
+	// Remove the fields' values from the stack, leaving the object
+	psr->scope->next_slot = dest + 1;
+	Node node;
+	node.type = NODE_NON_RELOC;
+	node.slot = dest;
+	return node;
+}
+
 // Parse an operand to a binary or unary operation.
 static Node expr_operand(Parser *psr) {
 	switch (psr->lxr.tk.type) {
 	case TK_NUM:   return expr_operand_num(psr);
+	case TK_STR:   return expr_operand_str(psr);
 	case TK_IDENT: return expr_operand_name(psr);
 	case '(':      return expr_operand_subexpr(psr);
 	case TK_FN:    return expr_operand_fn(psr);
+	case TK_NEW:   return expr_operand_new(psr);
 	case TK_TRUE: case TK_FALSE: case TK_NIL: return expr_operand_prim(psr);
 	default:
 		// We always call `expr_operand` expecting there to actually be an
@@ -1317,13 +1750,7 @@ static void parse_assign(Parser *psr) {
 	lex_next(&psr->lxr);
 
 	// Check the variable exists
-	int dest = -1;
-	for (int i = psr->scope->first_local; i < psr->locals_count; i++) {
-		if (psr->locals[i].name == name) {
-			dest = i - psr->scope->first_local;
-			break;
-		}
-	}
+	int dest = psr_find_local(psr, name);
 
 	// Assignment destination doesn't exist
 	if (dest == -1) {
@@ -1361,17 +1788,137 @@ static void parse_assign(Parser *psr) {
 	}
 }
 
+// Parse an assignment to a field of an object or an element of an array, like
+// `a.b.c = 3` or `a.b[i] = 3`.
+static void parse_field_assign(Parser *psr) {
+	int next_slot = psr->scope->next_slot;
+
+	// Load everything in the chain except the last field or element, which is
+	// the one we're assigning to
+	Node obj = expr_operand_name(psr);
+	uint8_t obj_slot, cache = 0, index_slot = 0;
+	bool is_index;
+	while (true) {
+		obj_slot = expr_to_any_slot(psr, &obj);
+		is_index = psr->lxr.tk.type == '[';
+		Node index;
+		if (is_index) {
+			// Skip the `[`, and parse the index
+			lex_next(&psr->lxr);
+			index = parse_subexpr(psr, PREC_NONE);
+			index_slot = expr_to_any_slot(psr, &index);
+			lex_expect(&psr->lxr, ']');
+			lex_next(&psr->lxr);
+		} else {
+			// Skip the `.`, and expect the name of the field
+			lex_next(&psr->lxr);
+			lex_expect(&psr->lxr, TK_IDENT);
+			cache = psr_new_cache(psr, psr->lxr.tk.ident_hash);
+			lex_next(&psr->lxr);
+		}
+		if (psr->lxr.tk.type != '.' && psr->lxr.tk.type != '[') {
+			break;
+		}
+
+		// Free the index before the object, since it's above it on the stack
+		BcIns ins;
+		if (is_index) {
+			expr_free_node(psr, &index);
+			ins = bc_new3(BC_GET_INDEX, 0, obj_slot, index_slot);
+		} else {
+			ins = bc_new3(BC_GET_FIELD, 0, obj_slot, cache);
+		}
+		expr_free_node(psr, &obj);
+		obj.type = NODE_RELOC;
+		obj.reloc_idx = fn_emit(psr_fn(psr), ins);
+	}
+
+	// Check for an augmented assignment
+	Tk augmented_tk;
+	switch (psr->lxr.tk.type) {
+		case TK_ADD_ASSIGN: augmented_tk = '+'; break;
+		case TK_SUB_ASSIGN: augmented_tk = '-'; break;
+		case TK_MUL_ASSIGN: augmented_tk = '*'; break;
+		case TK_DIV_ASSIGN: augmented_tk = '/'; break;
+		default: augmented_tk = '\0'; break;
+	}
+	lex_next(&psr->lxr);
+
+	// An augmented assignment loads the field (or element) before the
+	// expression is evaluated, and uses the same inline cache (or index) to
+	// store it again
+	Node field;
+	if (augmented_tk != '\0') {
+		BcIns ins = is_index ?
+			bc_new3(BC_GET_INDEX, 0, obj_slot, index_slot) :
+			bc_new3(BC_GET_FIELD, 0, obj_slot, cache);
+		field.type = NODE_RELOC;
+		field.reloc_idx = fn_emit(psr_fn(psr), ins);
+		expr_to_next_slot(psr, &field);
+	}
+
+	// Expect an expression
+	Node result = parse_expr(psr);
+	if (augmented_tk != '\0') {
+		expr_emit_arith(psr, augmented_tk, &field, result);
+		result = field;
+	}
+
+	// Store the result into the field or element
+	uint8_t src = expr_to_any_slot(psr, &result);
+	if (is_index) {
+		fn_emit(psr_fn(psr), bc_new3(BC_SET_INDEX, obj_slot, index_slot, src));
+	} else {
+		fn_emit(psr_fn(psr), bc_new3(BC_SET_FIELD, obj_slot, src, cache));
+	}
+
+	// Get rid of all the temporaries we used
+	psr->scope->next_slot = next_slot;
+}
+
+// Skips over the `[`, the index, and the `]` of an array index, when looking
+// ahead past the target of an assignment.
+static void psr_skip_index(Parser *psr) {
+	int depth = 0;
+	do {
+		switch (psr->lxr.tk.type) {
+			case '[': depth++; break;
+			case ']': depth--; break;
+			case TK_EOF: return;
+		}
+		lex_next(&psr->lxr);
+	} while (depth > 0);
+}
+
 // Parse an assignment or expression statement (we're not sure which one it is
 // at this point).
 static void parse_assign_or_expr(Parser *psr) {
-	// Get the token after the identifier
+	// Get the token after the identifier, and any field accesses or array
+	// indices following it
 	SavedLexer saved = lex_save(&psr->lxr);
 	lex_next(&psr->lxr);
+	bool fields = false;
+	while (psr->lxr.tk.type == '.' || psr->lxr.tk.type == '[') {
+		if (psr->lxr.tk.type == '[') {
+			psr_skip_index(psr);
+		} else {
+			lex_next(&psr->lxr);
+			if (psr->lxr.tk.type != TK_IDENT) {
+				break;
+			}
+			lex_next(&psr->lxr);
+		}
+		fields = true;
+	}
 	Tk after = psr->lxr.tk.type;
 	lex_restore(&psr->lxr, saved);
 
 	// Inspect the token
-	if (after == '=' || (after >= TK_ADD_ASSIGN && after <= TK_MOD_ASSIGN)) {
+	bool assign = after == '=' ||
+		(after >= TK_ADD_ASSIGN && after <= TK_MOD_ASSIGN);
+	if (assign && fields) {
+		parse_field_assign(psr);
+	} else if (assign) {
 		parse_assign(psr);
 	} else {
 		// Throw away the result of the expression since we don't use it
@@ -1379,6 +1926,66 @@ static void parse_assign_or_expr(Parser *psr) {
 	}
 }
 
+// Parse a struct definition, which lists the names of its fields:
+//
+//   struct Point { x, y }
+//
+// Fields can be separated by commas or newlines.
+static void parse_struct(Parser *psr) {
+	// Skip the `struct` token
+	lex_next(&psr->lxr);
+
+	// Expect the name of the struct, which can't already be taken
+	lex_expect(&psr->lxr, TK_IDENT);
+	uint64_t name = psr->lxr.tk.ident_hash;
+	if (vm_find_shape(psr->vm, psr->pkg, name) >= 0) {
+		psr_trigger_err(psr, "struct already defined");
+		UNREACHABLE();
+	}
+	lex_next(&psr->lxr);
+
+	// Parse the fields before creating the struct, so we don't leave a
+	// partially defined struct behind if there's an error
+	uint64_t fields[MAX_FIELDS];
+	int fields_count = 0;
+	lex_expect(&psr->lxr, '{');
+	lex_next(&psr->lxr);
+	while (psr->lxr.tk.type == TK_IDENT) {
+		uint64_t field = psr->lxr.tk.ident_hash;
+		for (int i = 0; i < fields_count; i++) {
+			if (fields[i] == field) {
+				psr_trigger_err(psr, "duplicate field in struct");
+				UNREACHABLE();
+			}
+		}
+		if (fields_count >= MAX_FIELDS) {
+			psr_trigger_err(psr, "too many fields in struct");
+			UNREACHABLE();
+		}
+		fields[fields_count++] = field;
+		lex_next(&psr->lxr);
+
+		// Skip the comma if there is one
+		if (psr->lxr.tk.type == ',') {
+			lex_next(&psr->lxr);
+		}
+	}
+	lex_expect(&psr->lxr, '}');
+
+	// Create the struct's shape
+	int idx = vm_new_shape(psr->vm, psr->pkg, name);
+	if (idx < 0) {
+		psr_trigger_err(psr, "too many structs");
+		UNREACHABLE();
+	}
+	Shape *shape = &psr->vm->prog->shapes[idx];
+	shape->fields_count = fields_count;
+	shape->fields_capacity = fields_count;
+	shape->fields = malloc(sizeof(uint64_t) * fields_count);
+	memcpy(shape->fields, fields, sizeof(uint64_t) * fields_count);
+	lex_next(&psr->lxr);
+}
+
 // Parse a `let` assignment statement.
 static void parse_let(Parser *psr) {
 	// Skip the `let` token
@@ -1389,11 +1996,9 @@ static void parse_let(Parser *psr) {
 	uint64_t name = psr->lxr.tk.ident_hash;
 
 	// Ensure another local with the same name doesn't already exist
-	for (int i = psr->scope->first_local; i < psr->locals_count; i++) {
-		if (psr->locals[i].name == name) {
-			psr_trigger_err(psr, "variable already defined");
-			UNREACHABLE();
-		}
+	if (psr_find_local(psr, name) != -1) {
+		psr_trigger_err(psr, "variable already defined");
+		UNREACHABLE();
 	}
 	lex_next(&psr->lxr);
 
@@ -1518,12 +2123,28 @@ static void parse_while(Parser *psr) {
 	jmp_list_patch(psr, condition.jmp.false_list, false_case);
 }
 
-// Parse a function definition, starting from the arguments. Returns the index
-// of the new function in the VM's functions list.
-static int parse_fn_args_body(Parser *psr) {
-	// Create a new function
-	int fn_idx = vm_new_fn(psr->vm, psr->pkg);
+// Skips over a block without parsing it, starting from its opening `{` and
+// stopping after its closing `}`.
+static void psr_skip_block(Parser *psr) {
+	int depth = 0;
+	do {
+		switch (psr->lxr.tk.type) {
+			case '{': depth++; break;
+			case '}': depth--; break;
 
+			// Trigger an error for the missing closing brace
+		case TK_EOF:
+			lex_expect(&psr->lxr, '}');
+			break;
+		}
+		lex_next(&psr->lxr);
+	} while (depth > 0);
+}
+
+// Parse the arguments and body of a function definition into an existing
+// function. If `skip_body` is true, then the body is skipped over and no
+// bytecode is emitted.
+static void parse_fn_def(Parser *psr, int fn_idx, bool skip_body) {
 	// Create the new function scope
 	FnScope scope;
 	scope.fn = fn_idx;
@@ -1540,6 +2161,7 @@ static int parse_fn_args_body(Parser *psr) {
 		uint64_t arg_name = psr->lxr.tk.ident_hash;
 		psr_new_local(psr, arg_name);
 		scope.next_slot++;
+		psr_use_slots(psr);
 		lex_next(&psr->lxr);
 
 		// Expect a comma or closing parenthesis
@@ -1552,22 +2174,46 @@ static int parse_fn_args_body(Parser *psr) {
 	}
 	lex_expect(&psr->lxr, ')');
 	lex_next(&psr->lxr);
+	psr->vm->prog->fns[fn_idx].args_count = scope.next_slot;
 
 	// Parse the contents of the function definition
 	lex_expect(&psr->lxr, '{');
-	lex_next(&psr->lxr);
-	parse_block(psr);
-	lex_expect(&psr->lxr, '}');
-	lex_next(&psr->lxr);
+	if (skip_body) {
+		psr_skip_block(psr);
+	} else {
+		lex_next(&psr->lxr);
+		parse_block(psr);
+		lex_expect(&psr->lxr, '}');
+		lex_next(&psr->lxr);
 
-	// Add the final RET instruction
-	fn_emit(psr_fn(psr), bc_new3(BC_RET, 0, 0, 0));
+		// Add the final RET instruction
+		fn_emit(psr_fn(psr), bc_new3(BC_RET, 0, 0, 0));
+	}
 
 	// Get rid of the function definition arguments on the parser's locals list
-	psr->locals_count = scope.first_local;
+	psr_discard_locals(psr, scope.first_local);
 
 	// Return to the outer function scope
 	psr->scope = scope.outer_scope;
+}
+
+// Parse a function definition, starting from the arguments. Returns the index
+// of the new function in the VM's functions list.
+//
+// When parsing lazily, we only parse the arguments (so that callers know how
+// many there are) and remember where they start, so we can come back to the
+// function in `parse_fn_body`. Functions can't reference locals in their
+// enclosing function, so the body can be parsed on its own later.
+static int parse_fn_args_body(Parser *psr) {
+	int fn_idx = vm_new_fn(psr->vm, psr->pkg);
+	if (psr->lazy) {
+		Function *fn = &psr->vm->prog->fns[fn_idx];
+		fn->src_path = psr->lxr.path;
+		fn->src_code = psr->lxr.code;
+		fn->src_start = psr->lxr.tk.start;
+		fn->src_line = psr->lxr.tk.line;
+	}
+	parse_fn_def(psr, fn_idx, psr->lazy);
 	return fn_idx;
 }
 
@@ -1587,9 +2233,29 @@ static void parse_fn(Parser *psr) {
 	// Create a new local in the outer scope containing the new function
 	psr_new_local(psr, fn_name);
 	uint8_t slot = (uint8_t) psr->scope->next_slot++;
+	psr_use_slots(psr);
 	fn_emit(psr_fn(psr), bc_new2(BC_SET_F, slot, (uint16_t) fn_idx));
 }
 
+// Parse a `return` statement.
+static void parse_return(Parser *psr) {
+	// Skip the `return` token
+	lex_next(&psr->lxr);
+
+	// A `return` at the end of a block doesn't return a value (which gives
+	// the caller nil)
+	if (psr->lxr.tk.type == '}') {
+		fn_emit(psr_fn(psr), bc_new3(BC_RET, 0, 0, 0));
+		return;
+	}
+
+	// Put the return value into a slot
+	Node result = parse_expr(psr);
+	uint8_t slot = expr_to_any_slot(psr, &result);
+	fn_emit(psr_fn(psr), bc_new3(BC_RET, slot, 1, 0));
+	expr_free_node(psr, &result);
+}
+
 // Parse a block (a sequence of statements).
 static void parse_block(Parser *psr) {
 	// Save the initial number of locals and the next slot, so we can discard
@@ -1601,13 +2267,15 @@ static void parse_block(Parser *psr) {
 	bool have_statement = true;
 	while (have_statement) {
 		switch (psr->lxr.tk.type) {
-			case TK_LET:   parse_let(psr); break;
-			case TK_IDENT: parse_assign_or_expr(psr); break;
-			case '(':      parse_expr(psr); break;
-			case TK_IF:    parse_if(psr); break;
-			case TK_LOOP:  parse_loop(psr); break;
-			case TK_WHILE: parse_while(psr); break;
-			case TK_FN:    parse_fn(psr); break;
+			case TK_LET:    parse_let(psr); break;
+			case TK_IDENT:  parse_assign_or_expr(psr); break;
+			case '(':       parse_expr(psr); break;
+			case TK_IF:     parse_if(psr); break;
+			case TK_LOOP:   parse_loop(psr); break;
+			case TK_WHILE:  parse_while(psr); break;
+			case TK_FN:     parse_fn(psr); break;
+			case TK_RETURN: parse_return(psr); break;
+			case TK_STRUCT: parse_struct(psr); break;
 
 			// Couldn't find a statement to parse
 		default:
@@ -1617,7 +2285,7 @@ static void parse_block(Parser *psr) {
 	}
 
 	// Discard all locals created in this block
-	psr->locals_count = locals_count;
+	psr_discard_locals(psr, locals_count);
 	psr->scope->next_slot = next_slot;
 }
 
@@ -1663,3 +2331,48 @@ Err * parse(VM *vm, int pkg, char *path, char *code) {
 	psr_free(&psr);
 	return vm->err;
 }
+
+// Parses the source code like `parse`, except the bodies of functions defined
+// in the code aren't parsed until `parse_fn_body` is called on them, which
+// happens when they're first called. Both `path` and `code` must outlive the
+// VM's functions.
+Err * parse_lazy(VM *vm, int pkg, char *path, char *code) {
+	Parser psr = psr_new(vm, pkg, path, code);
+	psr.lazy = true;
+
+	vm->err = NULL;
+	if (!setjmp(vm->guard)) {
+		parse_code(&psr);
+	}
+
+	psr_free(&psr);
+	return vm->err;
+}
+
+// Parses the body of a function created by `parse_lazy`, whose bytecode is
+// NULL. Functions defined inside it are parsed lazily too, and the new
+// bytecode has its superinstructions fused.
+Err * parse_fn_body(VM *vm, int fn_idx) {
+	Function *fn = &vm->prog->fns[fn_idx];
+	assert(fn->ins == NULL && fn->src_code != NULL);
+	Parser psr = psr_new(vm, fn->pkg, fn->src_path, fn->src_code);
+	psr.lazy = true;
+
+	// Move the lexer back to the function's arguments list
+	SavedLexer start = lex_save(&psr.lxr);
+	start.cursor = fn->src_start;
+	start.line = fn->src_line;
+	lex_restore(&psr.lxr, start);
+
+	vm->err = NULL;
+	if (!setjmp(vm->guard)) {
+		lex_next(&psr.lxr);
+		parse_fn_def(&psr, fn_idx, false);
+	}
+
+	psr_free(&psr);
+	if (vm->err == NULL) {
+		fn_fuse(&vm->prog->fns[fn_idx]);
+	}
+	return vm->err;
+}
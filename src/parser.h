@@ -20,4 +20,15 @@
 // code get created on the VM and associated with the given package.
 Err * parse(VM *vm, int pkg, char *path, char *code);
 
+// Parses the source code like `parse`, except the bodies of functions defined
+// in the code aren't parsed until `parse_fn_body` is called on them, which
+// happens when they're first called. Both `path` and `code` must outlive the
+// VM's functions.
+Err * parse_lazy(VM *vm, int pkg, char *path, char *code);
+
+// Parses the body of a function created by `parse_lazy`, whose bytecode is
+// NULL. Functions defined inside it are parsed lazily too, and the new
+// bytecode has its superinstructions fused.
+Err * parse_fn_body(VM *vm, int fn);
+
 #endif
@@ -0,0 +1,224 @@
+
+// profile.c
+// By Ben Anderson
+// December 2018
+
+#include "profile.h"
+#include "jit/arch.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if HY_OS != HY_OS_WINDOWS
+#include <sys/time.h>
+#endif
+
+// Creates a new profile with every counter zeroed.
+Profile * profile_new() {
+	Profile *profile = malloc(sizeof(Profile));
+	memset(profile, 0, sizeof(Profile));
+	profile->fn = -1;
+	return profile;
+}
+
+// Frees a profile.
+void profile_free(Profile *profile) {
+	free(profile->fns);
+	free(profile->samples);
+	free(profile);
+}
+
+// Makes room for a function's counter.
+void profile_grow_fns(Profile *profile, int fn) {
+	int capacity = profile->fns_capacity == 0 ? 16 : profile->fns_capacity;
+	while (capacity <= fn) {
+		capacity *= 2;
+	}
+	profile->fns = realloc(profile->fns, sizeof(uint64_t) * capacity);
+	memset(&profile->fns[profile->fns_capacity], 0,
+		sizeof(uint64_t) * (capacity - profile->fns_capacity));
+	profile->fns_capacity = capacity;
+}
+
+
+// ---- Sampling --------------------------------------------------------------
+
+#if HY_OS == HY_OS_WINDOWS
+
+// There's no SIGPROF on Windows.
+bool profile_start(Profile *profile) {
+	return false;
+}
+
+void profile_stop(Profile *profile) {}
+
+#else
+
+// The profile that's sampling, if any. Signal handlers don't get any
+// arguments, so this has to be global.
+static Profile *sampling = NULL;
+
+// Records where the interpreter is. Only touches memory that was allocated
+// before the timer was started.
+static void profile_sample(int signal) {
+	Profile *profile = sampling;
+	if (profile == NULL || profile->fn < 0) {
+		return;
+	}
+	if (profile->samples_count >= PROFILE_MAX_SAMPLES) {
+		profile->samples_dropped++;
+		return;
+	}
+	Sample *sample = &profile->samples[profile->samples_count];
+	sample->fn = profile->fn;
+	sample->ins = profile->ins;
+	sample->trace = profile->in_trace != 0;
+	profile->samples_count++;
+}
+
+// Starts sampling into a profile. Returns false if sampling isn't supported
+// on this platform, or another profile is already sampling.
+bool profile_start(Profile *profile) {
+	if (sampling != NULL) {
+		return false;
+	}
+	if (profile->samples == NULL) {
+		profile->samples = malloc(sizeof(Sample) * PROFILE_MAX_SAMPLES);
+	}
+	sampling = profile;
+
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = profile_sample;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	if (sigaction(SIGPROF, &action, NULL) != 0) {
+		sampling = NULL;
+		return false;
+	}
+
+	struct itimerval timer;
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = PROFILE_INTERVAL;
+	timer.it_value = timer.it_interval;
+	if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+		signal(SIGPROF, SIG_DFL);
+		sampling = NULL;
+		return false;
+	}
+	return true;
+}
+
+// Stops sampling.
+void profile_stop(Profile *profile) {
+	if (sampling != profile) {
+		return;
+	}
+	struct itimerval timer;
+	memset(&timer, 0, sizeof(timer));
+	setitimer(ITIMER_PROF, &timer, NULL);
+	signal(SIGPROF, SIG_IGN);
+	sampling = NULL;
+}
+
+#endif
+
+
+// ---- Output ----------------------------------------------------------------
+
+// Prints the count for one counter next to its share of a total.
+static void profile_print_count(FILE *f, char *name, uint64_t count,
+		uint64_t total) {
+	double percent = total == 0 ? 0.0 : 100.0 * (double) count / total;
+	fprintf(f, "  %-12s %14llu  %5.1f%%\n", name, (unsigned long long) count,
+		percent);
+}
+
+// Prints a summary of a profile's counters.
+void profile_print(Profile *profile, FILE *f) {
+	uint64_t total = 0;
+	for (int i = 0; i < BC_OPS_COUNT; i++) {
+		total += profile->ops[i];
+	}
+
+	fprintf(f, "---- Instructions ----\n");
+	for (int i = 0; i < BC_OPS_COUNT; i++) {
+		if (profile->ops[i] > 0) {
+			profile_print_count(f, BCOP_NAMES[i], profile->ops[i], total);
+		}
+	}
+	profile_print_count(f, "total", total, total);
+
+	fprintf(f, "---- Functions ----\n");
+	for (int i = 0; i < profile->fns_capacity; i++) {
+		if (profile->fns[i] > 0) {
+			char name[32];
+			snprintf(name, sizeof(name), "fn_%d", i);
+			profile_print_count(f, name, profile->fns[i], total);
+		}
+	}
+
+	fprintf(f, "---- Traces ----\n");
+	fprintf(f, "  entries      %14llu\n",
+		(unsigned long long) profile->trace_entries);
+	fprintf(f, "  exits        %14llu\n",
+		(unsigned long long) profile->trace_exits);
+	fprintf(f, "  compiled     %14llu\n",
+		(unsigned long long) profile->traces_compiled);
+	fprintf(f, "  aborted      %14llu\n",
+		(unsigned long long) profile->traces_aborted);
+	fprintf(f, "  failed       %14llu\n",
+		(unsigned long long) profile->traces_failed);
+
+	fprintf(f, "---- Samples ----\n");
+	fprintf(f, "  taken        %14llu\n",
+		(unsigned long long) profile->samples_count);
+	fprintf(f, "  dropped      %14llu\n",
+		(unsigned long long) profile->samples_dropped);
+}
+
+// Orders samples by function, then instruction, then whether they were in a
+// trace, so identical samples end up next to each other.
+static int profile_compare_samples(const void *a, const void *b) {
+	const Sample *left = a;
+	const Sample *right = b;
+	if (left->fn != right->fn) {
+		return left->fn < right->fn ? -1 : 1;
+	} else if (left->ins != right->ins) {
+		return left->ins < right->ins ? -1 : 1;
+	} else {
+		return (int) left->trace - (int) right->trace;
+	}
+}
+
+// Writes a profile's samples, in the folded stacks format. Each function and
+// instruction is looked up on the VM's program to find its opcode. Returns the
+// number of distinct stacks written.
+int profile_write_samples(Profile *profile, VM *vm, FILE *f) {
+	int count = (int) profile->samples_count;
+	qsort(profile->samples, (size_t) count, sizeof(Sample),
+		profile_compare_samples);
+
+	int stacks = 0;
+	for (int i = 0; i < count;) {
+		Sample *sample = &profile->samples[i];
+		int same = 1;
+		while (i + same < count &&
+				profile_compare_samples(sample, &sample[same]) == 0) {
+			same++;
+		}
+
+		char *op = "?";
+		if (sample->fn < vm->prog->fns_count) {
+			Function *fn = &vm->prog->fns[sample->fn];
+			if (sample->ins < fn->ins_count) {
+				op = BCOP_NAMES[bc_op(fn->ins[sample->ins])];
+			}
+		}
+		fprintf(f, "fn_%d;%04d_%s%s %d\n", sample->fn, sample->ins, op,
+			sample->trace ? ";trace" : "", same);
+		stacks++;
+		i += same;
+	}
+	return stacks;
+}
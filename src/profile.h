@@ -0,0 +1,114 @@
+
+// profile.h
+// By Ben Anderson
+// December 2018
+
+// The profiler counts what the interpreter does, and samples where it spends
+// its time. Counting slows down every dispatch, so the interpreter only calls
+// into the profiler when Hydrogen's built with PROFILE defined (configure with
+// `-DPROFILE=ON`). `hydrogen --profile` then prints the results.
+//
+// The counters record how many times each opcode was dispatched, how many
+// instructions were interpreted in each function, and how many times traces
+// were entered, exited, aborted and compiled. Instructions run by a compiled
+// trace aren't dispatched, so they aren't counted; only the trace entry is.
+//
+// The sampler sets up a SIGPROF timer, which interrupts the interpreter every
+// PROFILE_INTERVAL microseconds of CPU time. The signal handler records the
+// function and instruction the interpreter was at, and whether it was inside
+// a trace. Samples are written in the "folded stacks" format read by
+// flamegraph.pl, e.g. `fn_2;0013_ADDLL 41`. Only one profile can be sampling
+// at a time, since signals are delivered to the whole process.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "vm.h"
+#include "bytecode.h"
+
+#include <stdio.h>
+#include <signal.h>
+
+// The number of microseconds of CPU time between samples.
+#ifndef PROFILE_INTERVAL
+#define PROFILE_INTERVAL 1000
+#endif
+
+// The maximum number of samples taken by a profile. The signal handler can't
+// allocate memory, so the samples list is allocated up front. Samples past
+// the maximum are dropped.
+#define PROFILE_MAX_SAMPLES (1 << 20)
+
+// Where the interpreter was when a sample was taken.
+typedef struct {
+	int fn;
+	int ins;
+	bool trace;
+} Sample;
+
+// Everything the profiler records while a VM runs.
+typedef struct profile {
+	// The number of times each opcode was dispatched.
+	uint64_t ops[BC_OPS_COUNT];
+
+	// The number of instructions dispatched in each function, indexed by
+	// function. Grows as functions are created.
+	uint64_t *fns;
+	int fns_capacity;
+
+	// The number of times a compiled trace was entered from the interpreter,
+	// and returned to it through a side exit (which might belong to a side
+	// trace rather than the trace that was entered).
+	uint64_t trace_entries, trace_exits;
+
+	// The number of traces (both root and side traces) whose recording was
+	// aborted, that failed to compile, and that were compiled.
+	uint64_t traces_aborted, traces_failed, traces_compiled;
+
+	// The function and instruction the interpreter is at, and whether it's
+	// running a trace, published for the signal handler.
+	volatile sig_atomic_t fn, ins, in_trace;
+
+	// The samples taken so far, and the number that didn't fit.
+	Sample *samples;
+	volatile sig_atomic_t samples_count;
+	uint64_t samples_dropped;
+} Profile;
+
+// Creates a new profile with every counter zeroed.
+Profile * profile_new();
+
+// Frees a profile.
+void profile_free(Profile *profile);
+
+// Starts sampling into a profile. Returns false if sampling isn't supported
+// on this platform, or another profile is already sampling.
+bool profile_start(Profile *profile);
+
+// Stops sampling.
+void profile_stop(Profile *profile);
+
+// Makes room for a function's counter.
+void profile_grow_fns(Profile *profile, int fn);
+
+// Counts an instruction that's about to be dispatched, and publishes where
+// the interpreter is for the sampler.
+static inline void profile_ins(Profile *profile, int fn, int ins, BcOp op) {
+	if (fn >= profile->fns_capacity) {
+		profile_grow_fns(profile, fn);
+	}
+	profile->ops[op]++;
+	profile->fns[fn]++;
+	profile->fn = fn;
+	profile->ins = ins;
+}
+
+// Prints a summary of a profile's counters.
+void profile_print(Profile *profile, FILE *f);
+
+// Writes a profile's samples, in the folded stacks format. Each function and
+// instruction is looked up on the VM's program to find its opcode. Returns the
+// number of distinct stacks written.
+int profile_write_samples(Profile *profile, VM *vm, FILE *f);
+
+#endif
@@ -0,0 +1,288 @@
+
+// str.c
+// By Ben Anderson
+// December 2018
+
+#include "str.h"
+#include "gc.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+
+// Creates a string constant for a program, which isn't allocated on any VM's
+// heap. The caller adds it to the program's intern table.
+String * str_new_const(char *chars, uint32_t length, uint64_t hash) {
+	String *str = malloc(sizeof(String) + length + 1);
+	str->next = NULL;
+	str->shape = SHAPE_STR;
+	str->gc = GC_OLD | GC_STATIC;
+	str->mark = 0;
+	str->length = length;
+	str->interned = true;
+	str->hash = hash;
+	str->chain = NULL;
+	memcpy(str->chars, chars, length);
+	str->chars[length] = '\0';
+	return str;
+}
+
+// Allocates a flat string on a VM's heap, whose characters the caller has to
+// fill in. Never runs the garbage collector.
+static String * str_alloc(VM *vm, uint32_t length) {
+	String *str = (String *) gc_alloc_old(vm, sizeof(String) + length + 1);
+	str->shape = SHAPE_STR;
+	str->length = length;
+	str->interned = false;
+	str->hash = 0;
+	str->chain = NULL;
+	str->chars[length] = '\0';
+	return str;
+}
+
+
+// ---- Intern Tables ---------------------------------------------------------
+
+// Returns the string in a table with the given contents, or NULL if there
+// isn't one.
+String * str_table_find(StrTable *table, char *chars, uint32_t length,
+		uint64_t hash) {
+	if (table->capacity == 0) {
+		return NULL;
+	}
+	String *str = table->buckets[hash & (uint64_t) (table->capacity - 1)];
+	while (str != NULL) {
+		if (str->hash == hash && str->length == length &&
+				memcmp(str->chars, chars, length) == 0) {
+			return str;
+		}
+		str = str->chain;
+	}
+	return NULL;
+}
+
+// Doubles the number of buckets in a table, re-inserting every string.
+static void str_table_grow(StrTable *table) {
+	int capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+	String **buckets = calloc((size_t) capacity, sizeof(String *));
+	for (int i = 0; i < table->capacity; i++) {
+		String *str = table->buckets[i];
+		while (str != NULL) {
+			String *chain = str->chain;
+			String **bucket = &buckets[str->hash & (uint64_t) (capacity - 1)];
+			str->chain = *bucket;
+			*bucket = str;
+			str = chain;
+		}
+	}
+	free(table->buckets);
+	table->buckets = buckets;
+	table->capacity = capacity;
+}
+
+// Adds a string to a table, which mustn't already have a string with the same
+// contents.
+void str_table_insert(StrTable *table, String *str) {
+	// Keep at most one string per bucket on average, so chains stay short
+	if (table->count >= table->capacity) {
+		str_table_grow(table);
+	}
+	String **bucket =
+		&table->buckets[str->hash & (uint64_t) (table->capacity - 1)];
+	str->chain = *bucket;
+	*bucket = str;
+	table->count++;
+}
+
+// Removes a string from a table.
+void str_table_remove(StrTable *table, String *str) {
+	String **link =
+		&table->buckets[str->hash & (uint64_t) (table->capacity - 1)];
+	while (*link != str) {
+		link = &(*link)->chain;
+	}
+	*link = str->chain;
+	str->chain = NULL;
+	table->count--;
+}
+
+// Frees every string in a table (used for a program's string constants), and
+// the table itself.
+void str_table_free(StrTable *table) {
+	for (int i = 0; i < table->capacity; i++) {
+		String *str = table->buckets[i];
+		while (str != NULL) {
+			String *chain = str->chain;
+			free(str);
+			str = chain;
+		}
+	}
+	free(table->buckets);
+	table->buckets = NULL;
+	table->count = 0;
+	table->capacity = 0;
+}
+
+// Returns the interned string with the given contents, creating it on the
+// VM's heap if neither the program's constants nor the heap have it yet.
+// Never runs the garbage collector.
+static String * str_intern(VM *vm, char *chars, uint32_t length) {
+	uint64_t hash = hash_string(chars, length);
+	String *str = str_table_find(&vm->prog->strs, chars, length, hash);
+	if (str != NULL) {
+		return str;
+	}
+
+	// A string on the heap might not have been marked by the current major
+	// collection (and be about to be swept), even though it's reachable
+	// again now. Strings don't point to anything, so we can just mark it
+	Heap *heap = vm->heap;
+	str = str_table_find(&heap->strs, chars, length, hash);
+	if (str != NULL) {
+		str->mark = heap->mark;
+		return str;
+	}
+
+	str = str_alloc(vm, length);
+	memcpy(str->chars, chars, length);
+	str->hash = hash;
+	str->interned = true;
+	str_table_insert(&heap->strs, str);
+	return str;
+}
+
+
+// ---- Concatenation ---------------------------------------------------------
+
+// Copies the characters of a string (either flat or a rope) to `dest`, which
+// has to have room for all of them. Ropes can be nested arbitrarily deeply, so
+// rather than recursing, we keep the parts left to copy on our own stack.
+static void str_copy(Value str, char *dest) {
+	Value small[64];
+	Value *stack = small;
+	int count = 0, capacity = 64;
+	stack[count++] = str;
+	while (count > 0) {
+		Object *obj = v2ptr(stack[--count]);
+		if (obj->shape == SHAPE_STR) {
+			String *flat = (String *) obj;
+			memcpy(dest, flat->chars, flat->length);
+			dest += flat->length;
+			continue;
+		}
+
+		// Push the second part first, so the first part is copied first
+		Rope *rope = (Rope *) obj;
+		if (count + 2 > capacity) {
+			capacity *= 2;
+			if (stack == small) {
+				stack = malloc(sizeof(Value) * capacity);
+				memcpy(stack, small, sizeof(small));
+			} else {
+				stack = realloc(stack, sizeof(Value) * capacity);
+			}
+		}
+		if (rope->parts[1] != VAL_NIL) {
+			stack[count++] = rope->parts[1];
+		}
+		stack[count++] = rope->parts[0];
+	}
+	if (stack != small) {
+		free(stack);
+	}
+}
+
+// Concatenates two values with `..`, storing the result in `dest`. Numbers are
+// converted to strings first. `left` and `right` have to be on the stack below
+// `top` (the end of the current function's stack frame), since this might run
+// the garbage collector. Returns an error if either value isn't a string or a
+// number.
+Err * str_concat(VM *vm, Value *dest, Value *left, Value *right, Value *top) {
+	// Anything we allocate after this point never runs the garbage collector,
+	// so the operands can't move once we've read them
+	gc_reserve(vm, sizeof(Rope), top);
+	Value parts[2] = { *left, *right };
+	char nums[2][32];
+	uint32_t lengths[2];
+	for (int i = 0; i < 2; i++) {
+		if (val_is_str(parts[i])) {
+			lengths[i] = str_length(parts[i]);
+		} else if (val_is_num(parts[i])) {
+			lengths[i] = (uint32_t) snprintf(nums[i], sizeof(nums[i]), "%.14g",
+				v2n(parts[i]));
+		} else {
+			return err_new("attempt to concatenate non-string value");
+		}
+	}
+	uint64_t length = (uint64_t) lengths[0] + (uint64_t) lengths[1];
+	if (length > UINT32_MAX) {
+		return err_new("string is too long");
+	}
+
+	// Short strings are copied into a new flat string, which is interned
+	if (length <= STR_SHORT) {
+		char chars[STR_SHORT];
+		char *cursor = chars;
+		for (int i = 0; i < 2; i++) {
+			if (val_is_str(parts[i])) {
+				str_copy(parts[i], cursor);
+			} else {
+				memcpy(cursor, nums[i], lengths[i]);
+			}
+			cursor += lengths[i];
+		}
+		*dest = ptr2v(str_intern(vm, chars, (uint32_t) length));
+		return NULL;
+	}
+
+	// Otherwise create a rope. Allocate it before any numbers are converted
+	// to strings of their own, so it's covered by the space reserved above
+	Rope *rope = (Rope *) gc_alloc(vm, sizeof(Rope), top);
+	rope->shape = SHAPE_ROPE;
+	rope->length = (uint32_t) length;
+	for (int i = 0; i < 2; i++) {
+		if (val_is_num(parts[i])) {
+			parts[i] = ptr2v(str_intern(vm, nums[i], lengths[i]));
+		}
+		rope->parts[i] = parts[i];
+	}
+	*dest = ptr2v(rope);
+	return NULL;
+}
+
+// Returns the flat version of a string, flattening it if it's a rope. Never
+// runs the garbage collector.
+String * str_flatten(VM *vm, Value str) {
+	Object *obj = v2ptr(str);
+	if (obj->shape == SHAPE_STR) {
+		return (String *) obj;
+	}
+	Rope *rope = (Rope *) obj;
+	if (rope->parts[1] == VAL_NIL) {
+		return v2ptr(rope->parts[0]);
+	}
+
+	// Ropes are always longer than STR_SHORT, so the flat copy isn't interned.
+	// Replacing the rope's parts with the copy lets them be collected
+	String *flat = str_alloc(vm, rope->length);
+	str_copy(str, flat->chars);
+	flat->hash = hash_string(flat->chars, flat->length);
+	rope->parts[0] = ptr2v(flat);
+	rope->parts[1] = VAL_NIL;
+	gc_barrier(vm->heap, (Object *) rope, rope->parts[0]);
+	return flat;
+}
+
+// Returns true if two strings have the same contents. Two different interned
+// strings never have the same contents.
+bool str_equal(VM *vm, Value a, Value b) {
+	if (str_length(a) != str_length(b)) {
+		return false;
+	}
+	String *x = str_flatten(vm, a);
+	String *y = str_flatten(vm, b);
+	if (x->interned && y->interned) {
+		return x == y;
+	}
+	return x->hash == y->hash && memcmp(x->chars, y->chars, x->length) == 0;
+}
@@ -0,0 +1,121 @@
+
+// str.h
+// By Ben Anderson
+// December 2018
+
+// Strings are immutable, and come in two forms:
+//
+// * A flat string (`String`) is a header followed by its characters. Short
+//   strings are interned, so there's only ever one flat string with the same
+//   contents; two interned strings are equal only if they're the same object,
+//   which is all an EQ_LL has to check.
+//
+// * A rope (`Rope`) is the concatenation of two other strings, which is how
+//   `..` builds a long string in constant time, without copying either side.
+//   Building a string piece by piece in a loop creates a chain of ropes,
+//   which is only copied into a flat string when its characters are actually
+//   needed (e.g. to print it, or to compare it with another string). The
+//   rope keeps the flat string, so it's only ever flattened once.
+//
+// String constants are interned on the program (see `Program::strs`), and
+// live until the program's freed. Strings created at runtime are interned on
+// the VM's heap (see `Heap::strs`), if the program doesn't already have a
+// constant with the same contents. Flat strings are allocated straight into
+// the old generation, since the intern table points to them and they never
+// point to anything themselves. Ropes are allocated in the nursery, like
+// structs.
+
+#ifndef STR_H
+#define STR_H
+
+#include "vm.h"
+#include "object.h"
+
+// Strings up to this long (in bytes) are interned. Concatenating two strings
+// into one this short creates a new flat string rather than a rope, since
+// copying the characters costs about the same as creating the rope.
+#define STR_SHORT 40
+
+// A flat string.
+typedef struct str {
+	OBJ_HEADER
+
+	// The string's length in bytes, not including the NUL terminator.
+	uint32_t length;
+
+	// True if the string is in an intern table.
+	bool interned;
+
+	// The hash of the string's characters (see `hash_string`), and the next
+	// string in the same bucket of its intern table.
+	uint64_t hash;
+	struct str *chain;
+
+	// The string's characters, followed by a NUL terminator.
+	char chars[];
+} String;
+
+// The concatenation of two strings.
+typedef struct {
+	OBJ_HEADER
+
+	// The two strings, each of which is either flat or another rope. Once
+	// the rope's been flattened, the first is the flat copy and the second is
+	// nil. These come straight after the header, so the garbage collector
+	// scans them in the same way as an object's fields.
+	Value parts[2];
+
+	// The total length of both strings in bytes.
+	uint32_t length;
+} Rope;
+
+// Creates a string constant for a program, which isn't allocated on any VM's
+// heap. The caller adds it to the program's intern table.
+String * str_new_const(char *chars, uint32_t length, uint64_t hash);
+
+// Returns the string in a table with the given contents, or NULL if there
+// isn't one.
+String * str_table_find(StrTable *table, char *chars, uint32_t length,
+	uint64_t hash);
+
+// Adds a string to a table, which mustn't already have a string with the same
+// contents.
+void str_table_insert(StrTable *table, String *str);
+
+// Removes a string from a table.
+void str_table_remove(StrTable *table, String *str);
+
+// Frees every string in a table (used for a program's string constants), and
+// the table itself.
+void str_table_free(StrTable *table);
+
+// Concatenates two values with `..`, storing the result in `dest`. Numbers are
+// converted to strings first. `left` and `right` have to be on the stack below
+// `top` (the end of the current function's stack frame), since this might run
+// the garbage collector. Returns an error if either value isn't a string or a
+// number.
+Err * str_concat(VM *vm, Value *dest, Value *left, Value *right, Value *top);
+
+// Returns the length of a string (either flat or a rope).
+static inline uint32_t str_length(Value str) {
+	Object *obj = (Object *) v2ptr(str);
+	if (obj->shape == SHAPE_STR) {
+		return ((String *) obj)->length;
+	}
+	return ((Rope *) obj)->length;
+}
+
+// Returns the flat version of a string, flattening it if it's a rope. Never
+// runs the garbage collector.
+String * str_flatten(VM *vm, Value str);
+
+// Returns true if two strings have the same contents.
+bool str_equal(VM *vm, Value a, Value b);
+
+// Returns true if two values are equal. Everything except strings is equal
+// only if it has the same bits, which includes two interned strings.
+static inline bool val_equal(VM *vm, Value a, Value b) {
+	return a == b || (val_is_str(a) && val_is_str(b) && str_equal(vm, a, b));
+}
+
+#endif
@@ -4,9 +4,21 @@
 // July 2018
 
 #include "util.h"
+#include "jit/arch.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
+
+#if HY_OS == HY_OS_WINDOWS
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#endif
 
 // Return the position of the last occurrence of the given character, or
 // `NOT_FOUND` if the character can't be found.
@@ -61,45 +73,236 @@ uint64_t extract_pkg_name(char *path) {
 	return hash_string(start, actual_length);
 }
 
-// Reads the contents of a file as a string. Returns NULL if the file couldn't
-// be read. The returned string must be freed.
-char * read_file(char *path) {
-	FILE *f = fopen(path, "r");
+#if HY_OS != HY_OS_WINDOWS
+// Returns the size of a file mapping for a file of the given length, which
+// includes a whole extra page past the end of the file for the NUL padding.
+static size_t file_map_size(size_t length) {
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	return (length + page - 1) / page * page + page;
+}
+#endif
+
+// Maps the contents of a file into (read only) memory, followed by at least
+// FILE_PADDING NUL bytes, so it can be used as a string. Sets `length` to the
+// length of the file. Returns NULL and sets `errno` if the file couldn't be
+// read. The contents must be released with `free_file`.
+//
+// We reserve enough zeroed memory for the file plus an extra page, then map
+// the file over the start of it. Any bytes in the file's last page past the
+// end of the file are zeroed by the OS, and the extra page is always zero, so
+// there's never a copy of the file's contents.
+char * read_file(char *path, size_t *length) {
+#if HY_OS == HY_OS_WINDOWS
+	// Just read the whole file on Windows
+	FILE *f = fopen(path, "rb");
 	if (f == NULL) {
 		return NULL;
 	}
-
-	// Get the length of the file
-	// TODO: proper error handling; so many of these functions set errno
-	fseek(f, 0, SEEK_END);
-	size_t length = (size_t) ftell(f);
+	if (fseek(f, 0, SEEK_END) != 0) {
+		fclose(f);
+		return NULL;
+	}
+	long size = ftell(f);
+	if (size < 0) {
+		fclose(f);
+		return NULL;
+	}
 	rewind(f);
 
-	// Read its contents
-	char *contents = malloc(length + 1);
-	fread(contents, sizeof(char), length, f);
+	*length = (size_t) size;
+	char *contents = calloc(*length + FILE_PADDING, 1);
+	if (fread(contents, 1, *length, f) != *length) {
+		free(contents);
+		fclose(f);
+		errno = EIO;
+		return NULL;
+	}
 	fclose(f);
-	contents[length] = '\0';
 	return contents;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return NULL;
+	}
+	if (!S_ISREG(info.st_mode)) {
+		close(fd);
+		errno = S_ISDIR(info.st_mode) ? EISDIR : EINVAL;
+		return NULL;
+	}
+	*length = (size_t) info.st_size;
+
+	// Reserve zeroed memory for the file and its padding
+	size_t size = file_map_size(*length);
+	char *contents = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+	if (contents == MAP_FAILED) {
+		int saved = errno;
+		close(fd);
+		errno = saved;
+		return NULL;
+	}
+
+	// Map the file over the start of it (there's nothing to map if the file
+	// is empty)
+	if (*length > 0) {
+		void *mapped = mmap(contents, *length, PROT_READ,
+			MAP_PRIVATE | MAP_FIXED, fd, 0);
+		if (mapped == MAP_FAILED) {
+			int saved = errno;
+			munmap(contents, size);
+			close(fd);
+			errno = saved;
+			return NULL;
+		}
+	}
+	close(fd);
+	return contents;
+#endif
 }
 
-// Magic prime number for FNV hashing.
-#define FNV_64_PRIME ((uint64_t) 0x100000001b3ULL)
+// Releases the contents of a file read by `read_file`.
+void free_file(char *contents, size_t length) {
+#if HY_OS == HY_OS_WINDOWS
+	free(contents);
+#else
+	munmap(contents, file_map_size(length));
+#endif
+}
 
-// Computes the FNV hash of a string.
-uint64_t hash_string(char *string, size_t length) {
-	// Convert to an unsigned string
-	unsigned char *str = (unsigned char *) string;
+// A mutual exclusion lock, which only one thread can hold at a time.
+struct mutex {
+#if HY_OS == HY_OS_WINDOWS
+	CRITICAL_SECTION section;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
 
-	// Hash each byte of the string
-	uint64_t hash = 0;
-	for (size_t i = 0; i < length; i++) {
-		// Multiply by the magic prime, modulo 2^64 from integer overflow
-		hash *= FNV_64_PRIME;
+// Creates a new, unlocked mutex.
+Mutex * mutex_new() {
+	Mutex *mutex = malloc(sizeof(Mutex));
+#if HY_OS == HY_OS_WINDOWS
+	InitializeCriticalSection(&mutex->section);
+#else
+	pthread_mutex_init(&mutex->mutex, NULL);
+#endif
+	return mutex;
+}
 
-		// XOR the lowest byte of the hash with the current octet
-		hash ^= (uint64_t) *str++;
+// Frees a mutex, which mustn't be locked.
+void mutex_free(Mutex *mutex) {
+	if (mutex == NULL) {
+		return;
 	}
+#if HY_OS == HY_OS_WINDOWS
+	DeleteCriticalSection(&mutex->section);
+#else
+	pthread_mutex_destroy(&mutex->mutex);
+#endif
+	free(mutex);
+}
+
+// Waits until no other thread holds a mutex, then takes it.
+void mutex_lock(Mutex *mutex) {
+#if HY_OS == HY_OS_WINDOWS
+	EnterCriticalSection(&mutex->section);
+#else
+	pthread_mutex_lock(&mutex->mutex);
+#endif
+}
+
+// Releases a mutex taken by `mutex_lock`.
+void mutex_unlock(Mutex *mutex) {
+#if HY_OS == HY_OS_WINDOWS
+	LeaveCriticalSection(&mutex->section);
+#else
+	pthread_mutex_unlock(&mutex->mutex);
+#endif
+}
+
+// The hash below is a cut down version of wyhash; see:
+// * https://github.com/wangyi-fudan/wyhash
+// It reads 8 bytes at a time and mixes them with a single 64x64 -> 128 bit
+// multiply, which is much faster than FNV's multiply per byte, and has far
+// better avalanche behaviour.
+#define HASH_P0 ((uint64_t) 0xa0761d6478bd642fULL)
+#define HASH_P1 ((uint64_t) 0xe7037ed1a0b428dbULL)
+#define HASH_P2 ((uint64_t) 0x8ebc6af09c88c6e3ULL)
+
+// Multiplies two 64 bit integers and folds the 128 bit result back into 64
+// bits.
+static inline uint64_t hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+	__uint128_t result = (__uint128_t) a * b;
+	return (uint64_t) result ^ (uint64_t) (result >> 64);
+#else
+	uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+	uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+	uint64_t lo_lo = a_lo * b_lo, hi_lo = a_hi * b_lo;
+	uint64_t lo_hi = a_lo * b_hi, hi_hi = a_hi * b_hi;
+	uint64_t cross = (lo_lo >> 32) + (uint32_t) hi_lo + lo_hi;
+	uint64_t hi = hi_hi + (hi_lo >> 32) + (cross >> 32);
+	uint64_t lo = (cross << 32) | (uint32_t) lo_lo;
+	return lo ^ hi;
+#endif
+}
+
+// Reads an unaligned 8 byte word from a string.
+static inline uint64_t hash_read64(unsigned char *str) {
+	uint64_t word;
+	memcpy(&word, str, sizeof(word));
+	return word;
+}
 
-	return hash;
+// Reads an unaligned 4 byte word from a string.
+static inline uint64_t hash_read32(unsigned char *str) {
+	uint32_t word;
+	memcpy(&word, str, sizeof(word));
+	return word;
+}
+
+// Computes the hash of a string. Never reads outside the string.
+uint64_t hash_string(char *string, size_t length) {
+	unsigned char *str = (unsigned char *) string;
+	uint64_t seed = HASH_P0;
+	uint64_t a, b;
+	if (length <= 16) {
+		if (length >= 4) {
+			// Read the first and last 4 bytes, along with the 4 bytes either
+			// side of the middle for strings that are at least 8 bytes long;
+			// these overlap for strings shorter than 16 bytes
+			size_t middle = (length >> 3) << 2;
+			a = (hash_read32(str) << 32) | hash_read32(str + middle);
+			b = (hash_read32(str + length - 4) << 32) |
+				hash_read32(str + length - 4 - middle);
+		} else if (length > 0) {
+			// Read the first, middle and last bytes
+			a = ((uint64_t) str[0] << 16) | ((uint64_t) str[length >> 1] << 8) |
+				(uint64_t) str[length - 1];
+			b = 0;
+		} else {
+			a = b = 0;
+		}
+	} else {
+		// Mix in 16 bytes at a time, leaving between 1 and 16 bytes which
+		// are read from the end of the string
+		size_t left = length;
+		while (left > 16) {
+			seed = hash_mix(hash_read64(str) ^ HASH_P1,
+				hash_read64(str + 8) ^ seed);
+			str += 16;
+			left -= 16;
+		}
+		a = hash_read64(str + left - 16);
+		b = hash_read64(str + left - 8);
+	}
+	return hash_mix(HASH_P1 ^ (uint64_t) length,
+		hash_mix(a ^ HASH_P1, b ^ seed ^ HASH_P2));
 }
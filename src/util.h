@@ -9,15 +9,41 @@
 #include <stdlib.h>
 #include <stdint.h>
 
-// Reads the contents of a file as a string. Returns NULL if the file couldn't
-// be read. The returned string must be freed.
-char * read_file(char *path);
+// The number of NUL bytes guaranteed to follow the contents of a file read by
+// `read_file`, so a lexer can safely read a little way past the end of the
+// file without checking for it.
+#define FILE_PADDING 64
+
+// Maps the contents of a file into (read only) memory, followed by at least
+// FILE_PADDING NUL bytes, so it can be used as a string. Sets `length` to the
+// length of the file. Returns NULL and sets `errno` if the file couldn't be
+// read. The contents must be released with `free_file`.
+char * read_file(char *path, size_t *length);
+
+// Releases the contents of a file read by `read_file`.
+void free_file(char *contents, size_t length);
 
 // Extracts the name of a package from its file path and returns its hash.
 // Returns !0 if a valid package name could not be extracted from the path.
 uint64_t extract_pkg_name(char *path);
 
-// Computes the FNV hash of a string.
+// A mutual exclusion lock, which only one thread can hold at a time.
+typedef struct mutex Mutex;
+
+// Creates a new, unlocked mutex.
+Mutex * mutex_new();
+
+// Frees a mutex, which mustn't be locked.
+void mutex_free(Mutex *mutex);
+
+// Waits until no other thread holds a mutex, then takes it.
+void mutex_lock(Mutex *mutex);
+
+// Releases a mutex taken by `mutex_lock`.
+void mutex_unlock(Mutex *mutex);
+
+// Computes the hash of a string. Identifiers are only ever compared by their
+// hashes (see `Package`).
 uint64_t hash_string(char *string, size_t length);
 
 #endif
@@ -35,6 +35,9 @@ typedef enum {
 
 #define VAL_NIL    (TAG_PRIM | PRIM_NIL)
 
+// The bits of a pointer value that hold the pointer itself.
+#define PTR_MASK   ((uint64_t) 0x0000ffffffffffff)
+
 // Converts a value into a floating point number.
 static inline double v2n(Value val) {
 	// Use a union to perform to bitwise conversion
@@ -57,10 +60,15 @@ static inline Value n2v(double num) {
 	return convert.val;
 }
 
+// Returns true if a value is a number.
+static inline bool val_is_num(Value val) {
+	return (val & QUIET_NAN) != QUIET_NAN;
+}
+
 // Converts a value to a pointer.
 static inline void * v2ptr(Value val) {
 	// Get the first 48 bits storing the pointer value
-	return (void *) (val & 0xffffffffffffffff);
+	return (void *) (val & PTR_MASK);
 }
 
 // Converts a pointer to a value.
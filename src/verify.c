@@ -0,0 +1,148 @@
+
+// verify.c
+// By Ben Anderson
+// December 2018
+
+#include "verify.h"
+#include "parser.h"
+#include "value.h"
+#include "native.h"
+
+// Everything an instruction's operands are checked against.
+typedef struct {
+	Function *fn;
+	int consts_count, fns_count;
+	Shape *shapes;
+	int shapes_count;
+} Verifier;
+
+// Returns true if a stack slot lies within the function's frame.
+static inline bool is_slot(Verifier *v, int slot) {
+	return slot < v->fn->frame_size;
+}
+
+// Returns true if a constant index refers to a constant.
+static inline bool is_const(Verifier *v, int idx) {
+	return idx < v->consts_count;
+}
+
+// Returns true if a primitive value is false, true or nil.
+static inline bool is_prim(int prim) {
+	return prim == PRIM_NIL || prim == PRIM_FALSE || prim == PRIM_TRUE;
+}
+
+// Returns true if the instruction at `idx` is a jump whose target lies inside
+// the function. The jump offset is relative to the instruction after the jump.
+static bool is_jmp(Verifier *v, int idx, BcOp op) {
+	if (idx >= v->fn->ins_count || bc_op(v->fn->ins[idx]) != op) {
+		return false;
+	}
+	int64_t target = (int64_t) idx + 1 +
+		(int64_t) bc_arg24(v->fn->ins[idx]) - JMP_BIAS;
+	return target >= 0 && target < v->fn->ins_count;
+}
+
+// Checks the operands of a single instruction.
+static bool ins_verify(Verifier *v, int idx) {
+	BcIns ins = v->fn->ins[idx];
+	int a = bc_arg1(ins), b = bc_arg2(ins), c = bc_arg3(ins);
+	int d = bc_arg16(ins);
+	BcOp op = bc_op(ins);
+	switch (op) {
+		// Stores
+	case BC_MOV: case BC_NEG:
+		return is_slot(v, a) && is_slot(v, d);
+	case BC_SET_N: case BC_SET_S:
+		return is_slot(v, a) && is_const(v, d);
+	case BC_SET_P:
+		return is_slot(v, a) && is_prim(d);
+	case BC_SET_F:
+		return is_slot(v, a) && d < v->fns_count;
+
+		// Arithmetic
+	case BC_ADD_LL: case BC_SUB_LL: case BC_MUL_LL: case BC_DIV_LL:
+	case BC_CONCAT:
+		return is_slot(v, a) && is_slot(v, b) && is_slot(v, c);
+	case BC_ADD_LN: case BC_SUB_LN: case BC_MUL_LN: case BC_DIV_LN:
+		return is_slot(v, a) && is_slot(v, b) && is_const(v, c);
+	case BC_SUB_NL: case BC_DIV_NL:
+		return is_slot(v, a) && is_const(v, b) && is_slot(v, c);
+
+		// Relational operators are always followed by a JMP, whether or not
+		// they've been fused with it
+	case BC_EQ_LL: case BC_NEQ_LL: case BC_LT_LL: case BC_LE_LL:
+	case BC_GT_LL: case BC_GE_LL:
+	case BC_EQ_LL_JMP: case BC_NEQ_LL_JMP: case BC_LT_LL_JMP:
+	case BC_LE_LL_JMP: case BC_GT_LL_JMP: case BC_GE_LL_JMP:
+		return is_slot(v, a) && is_slot(v, b) && is_jmp(v, idx + 1, BC_JMP);
+	case BC_EQ_LN: case BC_NEQ_LN: case BC_LT_LN: case BC_LE_LN:
+	case BC_GT_LN: case BC_GE_LN:
+	case BC_EQ_LN_JMP: case BC_NEQ_LN_JMP: case BC_LT_LN_JMP:
+	case BC_LE_LN_JMP: case BC_GT_LN_JMP: case BC_GE_LN_JMP:
+		return is_slot(v, a) && is_const(v, b) && is_jmp(v, idx + 1, BC_JMP);
+	case BC_EQ_LP: case BC_NEQ_LP: case BC_EQ_LP_JMP: case BC_NEQ_LP_JMP:
+		return is_slot(v, a) && is_prim(b) && is_jmp(v, idx + 1, BC_JMP);
+
+		// Structs. NEW takes the object's fields from the slots after its
+		// destination, so they all have to be in the frame
+	case BC_NEW:
+		return d < v->shapes_count &&
+			is_slot(v, a + v->shapes[d].fields_count);
+	case BC_GET_FIELD: case BC_SET_FIELD:
+		return is_slot(v, a) && is_slot(v, b) && c < v->fn->caches_count;
+
+		// Arrays
+	case BC_GET_INDEX: case BC_SET_INDEX:
+		return is_slot(v, a) && is_slot(v, b) && is_slot(v, c);
+
+		// Control flow. The callee's frame starts at the first argument, and
+		// its return value is left there, so that slot must exist even if
+		// there aren't any arguments. Native functions don't check how many
+		// arguments they're given, so that has to match exactly
+	case BC_JMP: case BC_LOOP:
+		return is_jmp(v, idx, op);
+	case BC_CALL:
+		return is_slot(v, a) && is_slot(v, b) && b + c <= v->fn->frame_size;
+	case BC_CALL_NATIVE:
+		return a < NATIVES_COUNT && c == NATIVES[a].args_count &&
+			is_slot(v, b) && b + c <= v->fn->frame_size;
+	case BC_RET:
+		return b == 0 || is_slot(v, a);
+	case BC_ADD_LN_LOOP:
+		return is_slot(v, a) && is_slot(v, b) && is_const(v, c) &&
+			is_jmp(v, idx + 1, BC_LOOP);
+
+	default:
+		return false;
+	}
+}
+
+// Verifies a function's bytecode against the number of constants and functions
+// that exist, and the shapes of the structs that exist. Returns the index of
+// the first invalid instruction, or -1 if the function is valid.
+int fn_verify(Function *fn, int consts_count, int fns_count, Shape *shapes,
+		int shapes_count) {
+	if (fn->ins == NULL) {
+		// Not parsed yet
+		return -1;
+	}
+
+	Verifier v;
+	v.fn = fn;
+	v.consts_count = consts_count;
+	v.fns_count = fns_count;
+	v.shapes = shapes;
+	v.shapes_count = shapes_count;
+	for (int i = 0; i < fn->ins_count; i++) {
+		if (!ins_verify(&v, i)) {
+			return i;
+		}
+	}
+
+	// The last instruction has to leave the function or jump somewhere else
+	BcOp last = fn->ins_count > 0 ? bc_op(fn->ins[fn->ins_count - 1]) : BC_MOV;
+	if (last != BC_RET && last != BC_JMP && last != BC_LOOP) {
+		return fn->ins_count > 0 ? fn->ins_count - 1 : 0;
+	}
+	return -1;
+}
@@ -0,0 +1,39 @@
+
+// verify.h
+// By Ben Anderson
+// December 2018
+
+// The interpreter and the JIT compiler trust every operand in the bytecode
+// they execute: stack slots are used to index the current stack frame,
+// constant indices to index the constants list, and jump offsets to move the
+// instruction pointer, all without any bounds checks. So we verify each
+// function's bytecode once, straight after it's parsed or loaded from a
+// bytecode image, and never have to check it again.
+//
+// A function is valid if:
+//
+// * Every opcode is a real opcode
+// * Every stack slot lies within the function's frame (whose size is also
+//   used to make sure the stack has room for the function when it's called)
+// * Every constant, primitive, function and shape index refers to something
+//   that exists, and every field access to one of its function's inline caches
+// * Every jump lands on an instruction inside the function
+// * Every relational operator is followed by a JMP, and every ADD_LN_LOOP by
+//   a LOOP, since they're executed together
+// * Execution can't run off the end of the function
+//
+// A function that hasn't been parsed yet (see `parse_lazy`) has no bytecode,
+// and is trivially valid.
+
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include "vm.h"
+
+// Verifies a function's bytecode against the number of constants and functions
+// that exist, and the shapes of the structs that exist. Returns the index of
+// the first invalid instruction, or -1 if the function is valid.
+int fn_verify(Function *fn, int consts_count, int fns_count, Shape *shapes,
+	int shapes_count);
+
+#endif
@@ -8,93 +8,460 @@
 #include "err.h"
 #include "util.h"
 #include "value.h"
+#include "image.h"
+#include "verify.h"
+#include "profile.h"
+#include "object.h"
+#include "gc.h"
+#include "str.h"
+#include "array.h"
+#include "native.h"
 
 #include "jit/compiler.h"
+#include "jit/worker.h"
+#include "jit/perf.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <assert.h>
+#include <errno.h>
+
+// Creates an empty program.
+static Program * prog_new() {
+	Program *prog = malloc(sizeof(Program));
+	prog->pkgs_capacity = 4;
+	prog->pkgs_count = 0;
+	prog->pkgs = malloc(sizeof(Package) * prog->pkgs_capacity);
+
+	prog->fns_capacity = 16;
+	prog->fns_count = 0;
+	prog->fns = malloc(sizeof(Function) * prog->fns_capacity);
+
+	prog->shapes = NULL;
+	prog->shapes_count = 0;
+	prog->shapes_capacity = 0;
+
+	prog->consts_capacity = 16;
+	prog->consts_count = 0;
+	prog->consts = malloc(sizeof(Value) * prog->consts_capacity);
+	prog->consts_index_capacity = 32;
+	prog->consts_index = malloc(sizeof(int) * prog->consts_index_capacity);
+	memset(prog->consts_index, -1, sizeof(int) * prog->consts_index_capacity);
+	prog->strs.buckets = NULL;
+	prog->strs.count = 0;
+	prog->strs.capacity = 0;
+
+	prog->idents = NULL;
+	prog->idents_count = 0;
+	prog->idents_capacity = 0;
+
+	prog->sources = NULL;
+	prog->sources_count = 0;
+	prog->sources_capacity = 0;
+	prog->image = NULL;
+	prog->image_size = 0;
+
+	prog->jit = jit_state_new();
+	prog->frozen = false;
+	prog->lock = NULL;
+	prog->refs = 1;
+	return prog;
+}
 
-// Creates a new virtual machine instance.
-VM vm_new() {
-	VM vm;
-	vm.pkgs_capacity = 4;
-	vm.pkgs_count = 0;
-	vm.pkgs = malloc(sizeof(Package) * vm.pkgs_capacity);
-
-	vm.fns_capacity = 16;
-	vm.fns_count = 0;
-	vm.fns = malloc(sizeof(Function) * vm.fns_capacity);
+// Frees a program, once no VMs are using it.
+static void prog_free(Program *prog) {
+	for (int i = 0; i < prog->fns_count; i++) {
+		if (prog->fns[i].ins_capacity > 0) {
+			free(prog->fns[i].ins);
+		}
+		free(prog->fns[i].loops);
+		free(prog->fns[i].caches);
+	}
+	for (int i = 0; i < prog->shapes_count; i++) {
+		free(prog->shapes[i].fields);
+	}
+	free(prog->pkgs);
+	free(prog->fns);
+	free(prog->shapes);
+	free(prog->consts);
+	free(prog->consts_index);
+	str_table_free(&prog->strs);
+	for (int i = 0; i < prog->idents_capacity; i++) {
+		free(prog->idents[i].name);
+	}
+	free(prog->idents);
+	jit_state_free(prog->jit);
+	for (int i = 0; i < prog->sources_count; i++) {
+		free(prog->sources[i].path);
+		free_file(prog->sources[i].code, prog->sources[i].length);
+	}
+	free(prog->sources);
+	image_free(prog);
+	mutex_free(prog->lock);
+	free(prog);
+}
 
-	vm.consts_capacity = 16;
-	vm.consts_count = 0;
-	vm.consts = malloc(sizeof(Value) * vm.consts_capacity);
+// Creates a new VM running a program.
+static VM vm_new_with(Program *prog) {
+	VM vm;
+	vm.prog = prog;
+	vm.err = NULL;
 
-	vm.stack_size = 1024;
+	vm.stack_size = INITIAL_STACK_SIZE;
 	vm.stack = malloc(sizeof(Value) * vm.stack_size);
+	for (int i = 0; i < vm.stack_size; i++) {
+		vm.stack[i] = VAL_NIL;
+	}
+	vm.heap = gc_new();
+
+	vm.frames_capacity = 16;
+	vm.frames_count = 0;
+	vm.frames = malloc(sizeof(CallFrame) * vm.frames_capacity);
+
+	vm.hot = NULL;
+	vm.hot_capacity = 0;
+	vm.parser_arena = arena_new();
+	vm.jit_arena = arena_new();
+	vm.lazy = false;
+	vm.jit = true;
+	vm.jit_thread = false;
+	vm.jit_worker = NULL;
+	vm.profile = NULL;
 	return vm;
 }
 
-// Frees all the resources allocated by a virtual machine.
+// Creates a new virtual machine instance.
+VM vm_new() {
+	return vm_new_with(prog_new());
+}
+
+// Creates a new VM that shares the frozen program loaded onto another VM. The
+// new VM has its own stack and hot loop counters, and can run on a different
+// thread to any other VM using the program. Compiled traces are shared, so a
+// loop only has to be compiled once.
+VM vm_new_shared(VM *vm) {
+	assert(vm->prog->frozen);
+	vm_lock(vm);
+	vm->prog->refs++;
+	vm_unlock(vm);
+	return vm_new_with(vm->prog);
+}
+
+// Frees all the resources allocated by a virtual machine. The VM's program is
+// freed along with the last VM using it.
 void vm_free(VM *vm) {
-	for (int i = 0; i < vm->fns_count; i++) {
-		free(vm->fns[i].ins);
+	// Stop the compile thread first, since it frees any traces it still has
+	// into the JIT arena
+	if (vm->jit_worker != NULL) {
+		jit_worker_free(vm->jit_worker);
 	}
-	free(vm->pkgs);
-	free(vm->fns);
-	free(vm->consts);
 	free(vm->stack);
+	free(vm->frames);
+	gc_free(vm->heap);
+	for (int i = 0; i < vm->hot_capacity; i++) {
+		free(vm->hot[i].loops);
+	}
+	free(vm->hot);
+	arena_free(&vm->parser_arena);
+	arena_free(&vm->jit_arena);
+
+	vm_lock(vm);
+	bool last = --vm->prog->refs == 0;
+	vm_unlock(vm);
+	if (last) {
+		prog_free(vm->prog);
+	}
+}
+
+// Takes the program's lock if it's frozen (and so might be shared with VMs
+// running on other threads). Unfrozen programs are only used by one VM.
+void vm_lock(VM *vm) {
+	if (vm->prog->frozen) {
+		mutex_lock(vm->prog->lock);
+	}
+}
+
+// Releases the lock taken by `vm_lock`.
+void vm_unlock(VM *vm) {
+	if (vm->prog->frozen) {
+		mutex_unlock(vm->prog->lock);
+	}
+}
+
+// Writes a symbol for every trace compiled from now on to the map file that
+// Linux's `perf` reads (see `jit/perf.h`), so samples in compiled code can be
+// attributed to the loops they came from. Applies to every VM sharing the
+// program.
+Err * vm_open_perf_map(VM *vm) {
+	JitState *jit = vm->prog->jit;
+	Err *err = NULL;
+	vm_lock(vm);
+	if (jit->perf_map == NULL) {
+		jit->perf_map = perf_map_open();
+		if (jit->perf_map == NULL) {
+			char path[64];
+			perf_map_path(path, sizeof(path));
+			err = err_new("failed to open perf map `%s`: %s", path,
+				strerror(errno));
+		}
+	}
+	vm_unlock(vm);
+	return err;
 }
 
 // Creates a new package on the VM and returns its index.
 int vm_new_pkg(VM *vm, uint64_t name) {
-	if (vm->pkgs_count >= vm->pkgs_capacity) {
-		vm->pkgs_capacity *= 2;
-		vm->pkgs = realloc(vm->pkgs, sizeof(Package) * vm->pkgs_capacity);
+	Program *prog = vm->prog;
+	if (prog->pkgs_count >= prog->pkgs_capacity) {
+		prog->pkgs_capacity *= 2;
+		prog->pkgs = realloc(prog->pkgs, sizeof(Package) * prog->pkgs_capacity);
 	}
 
-	Package *pkg = &vm->pkgs[vm->pkgs_count++];
+	Package *pkg = &prog->pkgs[prog->pkgs_count++];
 	pkg->name = name;
-	pkg->main_fn = vm_new_fn(vm, vm->pkgs_count - 1);
-	return vm->pkgs_count - 1;
+	pkg->main_fn = vm_new_fn(vm, prog->pkgs_count - 1);
+	return prog->pkgs_count - 1;
 }
 
 // Creates a new function on the VM and returns its index.
 int vm_new_fn(VM *vm, int pkg_idx) {
-	if (vm->fns_count >= vm->fns_capacity) {
-		vm->fns_capacity *= 2;
-		vm->fns = realloc(vm->fns, sizeof(Function) * vm->fns_capacity);
+	Program *prog = vm->prog;
+	if (prog->fns_count >= prog->fns_capacity) {
+		prog->fns_capacity *= 2;
+		prog->fns = realloc(prog->fns, sizeof(Function) * prog->fns_capacity);
 	}
 
-	Function *fn = &vm->fns[vm->fns_count++];
+	Function *fn = &prog->fns[prog->fns_count++];
 	fn->pkg = pkg_idx;
+	fn->args_count = 0;
+	fn->frame_size = 0;
 	fn->ins = NULL; // Lazily instatiate the bytecode array
 	fn->ins_count = 0;
 	fn->ins_capacity = 0;
-	return vm->fns_count - 1;
+	fn->loops = NULL; // Lazily instantiated too
+	fn->loops_count = 0;
+	fn->loops_capacity = 0;
+	fn->caches = NULL; // And so are the inline caches
+	fn->caches_count = 0;
+	fn->caches_capacity = 0;
+	fn->src_path = NULL;
+	fn->src_code = NULL;
+	fn->src_start = 0;
+	fn->src_line = 0;
+	return prog->fns_count - 1;
 }
 
-// Adds a constant number to the VM's constants list, returning its index.
-int vm_add_num(VM *vm, double num) {
-	uint64_t converted = n2v(num);
+// Creates a new struct with no fields on the VM and returns the index of its
+// shape. Returns -1 if there are too many structs.
+int vm_new_shape(VM *vm, int pkg, uint64_t name) {
+	Program *prog = vm->prog;
+	if (prog->shapes_count >= MAX_STRUCTS) {
+		return -1;
+	}
+	if (prog->shapes_count >= prog->shapes_capacity) {
+		prog->shapes_capacity = prog->shapes_capacity == 0 ? 8 :
+			prog->shapes_capacity * 2;
+		prog->shapes = realloc(prog->shapes,
+			sizeof(Shape) * prog->shapes_capacity);
+	}
 
-	// Check if the constant already exists
-	for (int i = 0; i < vm->consts_count; i++) {
-		if (vm->consts[i] == converted) {
+	Shape *shape = &prog->shapes[prog->shapes_count++];
+	shape->pkg = pkg;
+	shape->name = name;
+	shape->fields = NULL;
+	shape->fields_count = 0;
+	shape->fields_capacity = 0;
+	return prog->shapes_count - 1;
+}
+
+// Returns the index of the shape for the struct called `name` in a package,
+// or -1 if the package doesn't define one.
+int vm_find_shape(VM *vm, int pkg, uint64_t name) {
+	Program *prog = vm->prog;
+	for (int i = 0; i < prog->shapes_count; i++) {
+		if (prog->shapes[i].pkg == pkg && prog->shapes[i].name == name) {
 			return i;
 		}
 	}
+	return -1;
+}
+
+// Hashes the bits of a value, for the constants index. This is the finaliser
+// from MurmurHash3, which mixes every bit of the input into the low bits that
+// we use to index the table.
+static inline uint64_t const_hash(Value value) {
+	uint64_t hash = value;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Returns the slot in the constants index that either holds the given value, or
+// is empty and is where the value should go.
+static int const_index_find(Program *prog, Value value) {
+	int mask = prog->consts_index_capacity - 1;
+	int slot = (int) (const_hash(value) & (uint64_t) mask);
+	while (prog->consts_index[slot] >= 0 &&
+			prog->consts[prog->consts_index[slot]] != value) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Doubles the size of the constants index, re-inserting every constant.
+static void const_index_grow(Program *prog) {
+	free(prog->consts_index);
+	prog->consts_index_capacity *= 2;
+	prog->consts_index = malloc(sizeof(int) * prog->consts_index_capacity);
+	memset(prog->consts_index, -1, sizeof(int) * prog->consts_index_capacity);
+	for (int i = 0; i < prog->consts_count; i++) {
+		prog->consts_index[const_index_find(prog, prog->consts[i])] = i;
+	}
+}
+
+// Adds a constant to a program's constants list if it isn't already there.
+static int prog_add_const(Program *prog, Value value) {
+	// Check if the constant already exists
+	int slot = const_index_find(prog, value);
+	if (prog->consts_index[slot] >= 0) {
+		return prog->consts_index[slot];
+	}
+
+	// Bytecode instructions refer to constants using 16 bit indices
+	if (prog->consts_count >= MAX_CONSTS) {
+		return -1;
+	}
 
 	// Resize the constants array if necessary
-	if (vm->consts_count >= vm->consts_capacity) {
-		vm->consts_capacity *= 2;
-		vm->consts = realloc(vm->consts, sizeof(Value) * vm->consts_capacity);
+	if (prog->consts_count >= prog->consts_capacity) {
+		prog->consts_capacity *= 2;
+		prog->consts = realloc(prog->consts,
+			sizeof(Value) * prog->consts_capacity);
+	}
+	int idx = prog->consts_count++;
+	prog->consts[idx] = value;
+	prog->consts_index[slot] = idx;
+
+	// Keep the index at most half full, so probe sequences stay short
+	if (prog->consts_count * 2 > prog->consts_index_capacity) {
+		const_index_grow(prog);
+	}
+	return idx;
+}
+
+// Adds a constant to the VM's constants list if it isn't already there, and
+// returns its index. Constants are compared by their bits, so this works for
+// any kind of value. Returns -1 if the constants list is full.
+int vm_add_const(VM *vm, Value value) {
+	vm_lock(vm);
+	int idx = prog_add_const(vm->prog, value);
+	vm_unlock(vm);
+	return idx;
+}
+
+// Adds a constant number to the VM's constants list, returning its index.
+// Returns -1 if the constants list is full.
+int vm_add_num(VM *vm, double num) {
+	return vm_add_const(vm, n2v(num));
+}
+
+// Adds a constant string to the VM's constants list if it isn't already
+// there, returning its index. Returns -1 if the constants list is full.
+//
+// If the VM's already created a string with the same contents at runtime
+// (e.g. in an earlier line of the REPL), then it's no longer interned, since
+// the constant takes its place in the intern table.
+int vm_add_str(VM *vm, char *chars, int length) {
+	Program *prog = vm->prog;
+	uint64_t hash = hash_string(chars, (size_t) length);
+	String *str = str_table_find(&prog->strs, chars, (uint32_t) length, hash);
+	if (str == NULL) {
+		if (prog->consts_count >= MAX_CONSTS) {
+			return -1;
+		}
+		str = str_new_const(chars, (uint32_t) length, hash);
+		str_table_insert(&prog->strs, str);
+
+		Heap *heap = vm->heap;
+		String *old = str_table_find(&heap->strs, chars, (uint32_t) length,
+			hash);
+		if (old != NULL) {
+			str_table_remove(&heap->strs, old);
+			old->interned = false;
+		}
+	}
+	return vm_add_const(vm, ptr2v(str));
+}
+
+// Returns the slot in the identifier intern table for a hash, which is either
+// the slot holding that hash, or the empty slot where it should be inserted.
+static int ident_find(Ident *idents, int capacity, uint64_t hash) {
+	int mask = capacity - 1;
+	int slot = (int) (hash & (uint64_t) mask);
+	while (idents[slot].name != NULL && idents[slot].hash != hash) {
+		slot = (slot + 1) & mask;
+	}
+	return slot;
+}
+
+// Doubles the size of the identifier intern table.
+static void ident_grow(Program *prog) {
+	int capacity = prog->idents_capacity == 0 ? 64 : prog->idents_capacity * 2;
+	Ident *idents = calloc((size_t) capacity, sizeof(Ident));
+	for (int i = 0; i < prog->idents_capacity; i++) {
+		Ident *ident = &prog->idents[i];
+		if (ident->name != NULL) {
+			idents[ident_find(idents, capacity, ident->hash)] = *ident;
+		}
+	}
+	free(prog->idents);
+	prog->idents = idents;
+	prog->idents_capacity = capacity;
+}
+
+// Records the string an identifier hash came from. If a different identifier
+// with the same hash has already been interned, returns that identifier
+// (without interning the new one). Otherwise returns NULL.
+char * vm_intern_ident(VM *vm, uint64_t hash, char *name, int length) {
+	// Keep the table at most half full, so probe sequences stay short
+	Program *prog = vm->prog;
+	if ((prog->idents_count + 1) * 2 > prog->idents_capacity) {
+		ident_grow(prog);
+	}
+
+	Ident *ident = &prog->idents[ident_find(prog->idents,
+		prog->idents_capacity, hash)];
+	if (ident->name != NULL) {
+		bool same = strncmp(ident->name, name, (size_t) length) == 0 &&
+			ident->name[length] == '\0';
+		return same ? NULL : ident->name;
 	}
 
-	// Add the converted number to the constants list if it doesn't already
-	// exist
-	vm->consts[vm->consts_count++] = converted;
-	return vm->consts_count - 1;
+	ident->hash = hash;
+	ident->name = malloc((size_t) length + 1);
+	memcpy(ident->name, name, (size_t) length);
+	ident->name[length] = '\0';
+	prog->idents_count++;
+	return NULL;
+}
+
+// Adds a hot loop counter for the BC_LOOP instruction at index `ins` to a
+// function. Counters must be added in order of instruction index.
+static void fn_new_loop(Function *fn, int ins) {
+	if (fn->loops == NULL) {
+		fn->loops_capacity = 4;
+		fn->loops = malloc(sizeof(HotLoop) * fn->loops_capacity);
+	} else if (fn->loops_count >= fn->loops_capacity) {
+		fn->loops_capacity *= 2;
+		fn->loops = realloc(fn->loops, sizeof(HotLoop) * fn->loops_capacity);
+	}
+	HotLoop *hot = &fn->loops[fn->loops_count++];
+	hot->ins = ins;
+	hot->countdown = JIT_THRESHOLD;
+	hot->aborts = 0;
 }
 
 // Emits a bytecode instruction to a function.
@@ -103,6 +470,12 @@ int fn_emit(Function *fn, BcIns ins) {
 		// Lazily instantiate the bytecode array
 		fn->ins_capacity = 32;
 		fn->ins = malloc(sizeof(BcIns) * fn->ins_capacity);
+	} else if (fn->ins_capacity == 0) {
+		// The bytecode lives in a mapped image, so copy it onto the heap
+		fn->ins_capacity = fn->ins_count * 2;
+		BcIns *copy = malloc(sizeof(BcIns) * fn->ins_capacity);
+		memcpy(copy, fn->ins, sizeof(BcIns) * fn->ins_count);
+		fn->ins = copy;
 	} else if (fn->ins_count >= fn->ins_capacity) {
 		// Increase the capacity of the bytecode array
 		fn->ins_capacity *= 2;
@@ -110,9 +483,120 @@ int fn_emit(Function *fn, BcIns ins) {
 	}
 
 	fn->ins[fn->ins_count++] = ins;
+
+	// Give each loop its own hot loop counter. Instructions are only ever
+	// appended, so the counters stay sorted by instruction index
+	if (bc_op(ins) == BC_LOOP) {
+		fn_new_loop(fn, fn->ins_count - 1);
+	}
 	return fn->ins_count - 1;
 }
 
+// Adds an empty inline cache for an access to the field `field` to a function,
+// returning its index. Returns -1 if the function has too many caches, since
+// GET_FIELD and SET_FIELD refer to their caches with an 8 bit index.
+int fn_new_cache(Function *fn, uint64_t field) {
+	if (fn->caches_count >= MAX_CACHES_IN_FN) {
+		return -1;
+	}
+	if (fn->caches_count >= fn->caches_capacity) {
+		fn->caches_capacity = fn->caches_capacity == 0 ? 8 :
+			fn->caches_capacity * 2;
+		fn->caches = realloc(fn->caches,
+			sizeof(InlineCache) * fn->caches_capacity);
+	}
+	InlineCache *cache = &fn->caches[fn->caches_count++];
+	cache->field = field;
+	cache->entry = 0;
+	return fn->caches_count - 1;
+}
+
+// Creates a hot loop counter for every BC_LOOP instruction in a function whose
+// bytecode wasn't emitted with `fn_emit` (i.e. was loaded from an image).
+void fn_init_loops(Function *fn) {
+	for (int i = 0; i < fn->ins_count; i++) {
+		if (bc_op(fn->ins[i]) == BC_LOOP) {
+			fn_new_loop(fn, i);
+		}
+	}
+}
+
+// Returns the VM's hot loop counter for a BC_LOOP instruction in a function.
+// Each VM counts its own loop iterations, so that VMs sharing a program never
+// write to the same counters. The counters are copied from the function the
+// first time one of its loops is reached.
+HotLoop * vm_hot_loop(VM *vm, int fn_idx, BcIns *loop) {
+	if (fn_idx >= vm->hot_capacity) {
+		int capacity = vm->hot_capacity == 0 ? 16 : vm->hot_capacity;
+		while (capacity <= fn_idx) {
+			capacity *= 2;
+		}
+		vm->hot = realloc(vm->hot, sizeof(HotLoops) * capacity);
+		memset(&vm->hot[vm->hot_capacity], 0,
+			sizeof(HotLoops) * (capacity - vm->hot_capacity));
+		vm->hot_capacity = capacity;
+	}
+
+	// Copy any counters for loops that have been added to the function since
+	// (more code can be appended to a package's main function)
+	Function *fn = &vm->prog->fns[fn_idx];
+	HotLoops *hot = &vm->hot[fn_idx];
+	if (hot->loops_count < fn->loops_count) {
+		hot->loops = realloc(hot->loops, sizeof(HotLoop) * fn->loops_count);
+		memcpy(&hot->loops[hot->loops_count], &fn->loops[hot->loops_count],
+			sizeof(HotLoop) * (fn->loops_count - hot->loops_count));
+		hot->loops_count = fn->loops_count;
+	}
+
+	// Binary search the counters, which are sorted by instruction index
+	int idx = (int) (loop - fn->ins);
+	int low = 0;
+	int high = hot->loops_count - 1;
+	while (low <= high) {
+		int mid = (low + high) / 2;
+		if (hot->loops[mid].ins < idx) {
+			low = mid + 1;
+		} else if (hot->loops[mid].ins > idx) {
+			high = mid - 1;
+		} else {
+			return &hot->loops[mid];
+		}
+	}
+	return NULL;
+}
+
+// Fuses common pairs of instructions in a function into superinstructions, so
+// the interpreter only needs to dispatch once for both instructions. This is a
+// peephole pass run over the bytecode once it's been parsed.
+//
+// Only the opcode of the first instruction in a pair is changed. The second
+// instruction stays where it is, so we don't have to re-patch any jumps, and
+// anything that jumps straight to the second instruction still works.
+void fn_fuse(Function *fn) {
+	fn_fuse_from(fn, 0);
+}
+
+// Fuses superinstructions in a function's bytecode from `first_ins` onwards,
+// after more code has been appended to it. The last instruction from before
+// is included, in case it pairs with the first new one.
+void fn_fuse_from(Function *fn, int first_ins) {
+	int start = first_ins > 0 ? first_ins - 1 : 0;
+	for (int i = start; i + 1 < fn->ins_count; i++) {
+		BcIns *ins = &fn->ins[i];
+		BcOp op = bc_op(ins[0]);
+		BcOp next = bc_op(ins[1]);
+		if (op >= BC_EQ_LL && op <= BC_GE_LN && next == BC_JMP) {
+			// Compare-and-branch
+			bc_set_op(ins, (BcOp) (BC_EQ_LL_JMP + (op - BC_EQ_LL)));
+			i++;
+		} else if (op == BC_ADD_LN && next == BC_LOOP) {
+			// Increment-and-loop
+			bc_set_op(ins, BC_ADD_LN_LOOP);
+			i++;
+		}
+	}
+}
+
 // Dumps the bytecode for a function to the standard output.
 void fn_dump(Function *fn) {
 	printf("---- Function ----\n");
@@ -137,24 +621,18 @@ void fn_dump(Function *fn) {
 Err * err_new(char *fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
-	char *desc = malloc(sizeof(char) * ERR_MAX_DESC_LEN);
-	vsnprintf(desc, ERR_MAX_DESC_LEN, fmt, args);
+	Err *err = err_vnew(fmt, args);
 	va_end(args);
-
-	Err *err = malloc(sizeof(Err));
-	err->desc = desc;
-	err->line = -1;
-	err->file = NULL;
 	return err;
 }
 
 // Creates a new error from a vararg list.
 Err * err_vnew(char *fmt, va_list args) {
-	char *desc = malloc(sizeof(char) * ERR_MAX_DESC_LEN);
-	vsnprintf(desc, ERR_MAX_DESC_LEN, fmt, args);
-
-	Err *err = malloc(sizeof(Err));
-	err->desc = desc;
+	// Errors outlive the VM's arenas, so are allocated on the heap, with the
+	// description stored directly after the error in the same allocation
+	Err *err = malloc(sizeof(Err) + sizeof(char) * ERR_MAX_DESC_LEN);
+	err->desc = (char *) (err + 1);
+	vsnprintf(err->desc, ERR_MAX_DESC_LEN, fmt, args);
 	err->line = -1;
 	err->file = NULL;
 	return err;
@@ -165,7 +643,6 @@ void err_free(Err *err) {
 	if (err == NULL) {
 		return;
 	}
-	free(err->desc);
 	free(err->file);
 	free(err);
 }
@@ -219,6 +696,206 @@ void err_print(Err *err, bool use_color) {
 // Forward declaration.
 static Err * vm_run(VM *vm, int fn_idx, int ins_idx);
 
+// Called when we fail to record or compile a trace for a loop. We back off
+// exponentially before trying to record the loop again, and blacklist the loop
+// if it keeps failing.
+static void vm_trace_failed(VM *vm, int fn_idx, BcIns *loop) {
+	HotLoop *hot = vm_hot_loop(vm, fn_idx, loop);
+	hot->aborts++;
+	if (hot->aborts < JIT_MAX_ABORTS) {
+		uint32_t backoff = (uint32_t) JIT_THRESHOLD << hot->aborts;
+		hot->countdown = backoff > UINT16_MAX ? UINT16_MAX : backoff;
+		return;
+	}
+
+	// Blacklist the loop by turning it into a regular JMP, so we never do hot
+	// loop detection on it again. If the preceding instruction was fused with
+	// the LOOP, then un-fuse it too. A frozen program's bytecode is shared
+	// with other threads and can't be modified, so the loop is left alone and
+	// its counter stops triggering recording instead
+	if (vm->prog->frozen) {
+		return;
+	}
+	Function *fn = &vm->prog->fns[fn_idx];
+	bc_set_op(loop, BC_JMP);
+	if (loop > fn->ins && bc_op(loop[-1]) == BC_ADD_LN_LOOP) {
+		bc_set_op(&loop[-1], BC_ADD_LN);
+	}
+}
+
+// Called when recording a side trace from one of a root trace's side exits
+// fails. Like loops, we back off before trying the exit again, and give up on
+// it if it keeps failing (the exit then just returns to the interpreter). The
+// counters are shared by every VM using the root trace, so they're updated
+// atomically (a lost update only changes how long we back off for).
+static void vm_side_trace_failed(CompiledTrace *root, int exit) {
+	TraceExit *side = jit_exit(root, exit);
+	uint8_t aborts = __atomic_load_n(&side->aborts, __ATOMIC_RELAXED) + 1;
+	uint32_t backoff = (uint32_t) JIT_EXIT_THRESHOLD << aborts;
+	__atomic_store_n(&side->aborts, aborts, __ATOMIC_RELAXED);
+	__atomic_store_n(&side->countdown,
+		(uint16_t) (backoff > UINT16_MAX ? UINT16_MAX : backoff),
+		__ATOMIC_RELAXED);
+}
+
+// Called once we've finished compiling a trace. A root trace is added to the
+// trace cache, while a side trace has already been attached to its root trace.
+// `compiled` is NULL if compiling the trace failed. Frees the trace.
+static void vm_trace_compiled(VM *vm, Trace *trace, CompiledTrace *compiled) {
+#ifdef PROFILE
+	if (vm->profile != NULL && compiled != NULL) {
+		vm->profile->traces_compiled++;
+	} else if (vm->profile != NULL) {
+		vm->profile->traces_failed++;
+	}
+#endif
+	if (trace->root != NULL) {
+		if (compiled == NULL) {
+			vm_side_trace_failed(trace->root, trace->exit);
+		}
+	} else if (compiled != NULL) {
+		// Another VM sharing the program might have compiled the same loop
+		// first, in which case ours is thrown away
+		vm_lock(vm);
+		jit_cache_insert(vm->prog->jit, trace->fn, trace->loop, compiled);
+		vm_unlock(vm);
+	} else {
+		vm_trace_failed(vm, trace->fn, trace->loop);
+	}
+	jit_trace_free(trace);
+}
+
+// Installs every trace the compile thread has finished assembling. If `wait`
+// is true, then waits for every trace it's still working on too.
+static void vm_install_traces(VM *vm, bool wait) {
+	Trace *trace;
+	while ((trace = jit_poll(vm, wait)) != NULL) {
+		vm_trace_compiled(vm, trace, jit_rec_install(trace));
+	}
+}
+
+// Makes sure there are at least `slots` stack slots available above `stk`,
+// doubling the size of the stack until there are. Growing the stack can move
+// it, so we rebase every pointer into it: the call frames, the trace we're
+// recording (if any), and `stk` itself. Returns false if the stack would
+// exceed its maximum size, or we run out of memory.
+static bool vm_ensure_stack(VM *vm, Value **stk, int slots, Trace *trace) {
+	int needed = (int) (*stk - vm->stack) + slots;
+	if (needed <= vm->stack_size) {
+		return true;
+	}
+	if (needed > MAX_STACK_SIZE) {
+		return false;
+	}
+
+	int size = vm->stack_size;
+	while (size < needed) {
+		size *= 2;
+	}
+
+	// Allocate the new stack and rebase everything onto it before freeing the
+	// old one, since the old pointers can't be used once it's freed
+	Value *stack = malloc(sizeof(Value) * size);
+	if (stack == NULL) {
+		return false;
+	}
+	memcpy(stack, vm->stack, sizeof(Value) * vm->stack_size);
+	for (int i = vm->stack_size; i < size; i++) {
+		stack[i] = VAL_NIL; // The garbage collector scans the stack
+	}
+	for (int i = 0; i < vm->frames_count; i++) {
+		vm->frames[i].stack = stack + (vm->frames[i].stack - vm->stack);
+	}
+	if (trace != NULL) {
+		trace->stack = stack + (trace->stack - vm->stack);
+	}
+	*stk = stack + (*stk - vm->stack);
+
+	free(vm->stack);
+	vm->stack = stack;
+	vm->stack_size = size;
+	return true;
+}
+
+// Fuses superinstructions after some code has been parsed into a package: in
+// the bytecode appended to its main function from `first_ins` onwards, and in
+// every function created from `first_fn` onwards. Everything else has already
+// been fused.
+static void vm_fuse(VM *vm, int main_fn, int first_ins, int first_fn) {
+	fn_fuse_from(&vm->prog->fns[main_fn], first_ins);
+	for (int i = first_fn; i < vm->prog->fns_count; i++) {
+		if (i != main_fn) {
+			fn_fuse(&vm->prog->fns[i]);
+		}
+	}
+}
+
+// Verifies the bytecode for a single function (see `verify.h`).
+static Err * vm_verify_fn(VM *vm, int fn_idx) {
+	Program *prog = vm->prog;
+	int bad = fn_verify(&prog->fns[fn_idx], prog->consts_count,
+		prog->fns_count, prog->shapes, prog->shapes_count);
+	if (bad >= 0) {
+		return err_new("invalid bytecode at instruction %d in function %d",
+			bad, fn_idx);
+	}
+	return NULL;
+}
+
+// Verifies the bytecode for a package's main function, and every function that
+// was created from `first_fn` onwards, after some code has been parsed into the
+// package. Each function is only verified once, since its bytecode doesn't
+// change after it's been parsed (except for the main function, which more
+// code can be appended to).
+static Err * vm_verify(VM *vm, int main_fn, int first_fn) {
+	Err *err = vm_verify_fn(vm, main_fn);
+	for (int i = first_fn; i < vm->prog->fns_count && err == NULL; i++) {
+		if (i != main_fn) {
+			err = vm_verify_fn(vm, i);
+		}
+	}
+	return err;
+}
+
+// Returns an error if the program loaded onto a VM has been frozen, since no
+// more code can be loaded onto it.
+static Err * vm_check_frozen(VM *vm) {
+	if (vm->prog->frozen) {
+		return err_new("can't load code into a frozen program");
+	}
+	return NULL;
+}
+
+// Freezes the program loaded onto a VM so that it can be shared with other VMs.
+// Any functions that haven't been parsed yet (see `VM::lazy`) are parsed now.
+// No more code can be loaded onto the program afterwards.
+Err * vm_freeze(VM *vm) {
+	Program *prog = vm->prog;
+	if (prog->frozen) {
+		return NULL;
+	}
+	for (int i = 0; i < prog->fns_count; i++) {
+		if (prog->fns[i].ins == NULL && prog->fns[i].src_code != NULL) {
+			int first_fn = prog->fns_count;
+			Err *err = parse_fn_body(vm, i);
+			if (err == NULL) {
+				err = vm_verify(vm, i, first_fn);
+			}
+			if (err != NULL) {
+				return err;
+			}
+		}
+	}
+
+	// The JIT compiler adds constants while other VMs are reading them, so
+	// make sure the list never has to move
+	prog->consts_capacity = MAX_CONSTS;
+	prog->consts = realloc(prog->consts, sizeof(Value) * MAX_CONSTS);
+	prog->lock = mutex_new();
+	prog->frozen = true;
+	return NULL;
+}
+
 // Executes some code. The code is run within the package's "main" function,
 // and can access any variables, functions, imports, etc. that were created by
 // a previous piece of code run on this package. This functionality is used to
@@ -231,15 +908,104 @@ static Err * vm_run(VM *vm, int fn_idx, int ins_idx);
 // be freed using `hy_free_err`.
 Err * vm_run_string(VM *vm, int pkg, char *code) {
 	// TODO: save and restore VM state in case of error
+	Err *err = vm_check_frozen(vm);
+	if (err != NULL) {
+		return err;
+	}
 
 	// Parse the source code
-	Err *err = parse(vm, pkg, NULL, code);
+	int main_fn = vm->prog->pkgs[pkg].main_fn;
+	int first_ins = vm->prog->fns[main_fn].ins_count;
+	int first_fn = vm->prog->fns_count;
+	err = parse(vm, pkg, NULL, code);
+	if (err != NULL) {
+		return err;
+	}
+	vm_fuse(vm, main_fn, first_ins, first_fn);
+	err = vm_verify(vm, main_fn, first_fn);
 	if (err != NULL) {
 		return err;
 	}
 
 	// Run the code
-	return vm_run(vm, vm->pkgs[pkg].main_fn, 0);
+	return vm_run(vm, vm->prog->pkgs[pkg].main_fn, 0);
+}
+
+// Keeps a file's contents in memory until the VM is freed, since some of its
+// functions haven't been parsed yet.
+static void vm_keep_source(VM *vm, char *path, char *code, size_t length) {
+	if (vm->prog->sources_count >= vm->prog->sources_capacity) {
+		vm->prog->sources_capacity = vm->prog->sources_capacity == 0 ? 4 :
+			vm->prog->sources_capacity * 2;
+		vm->prog->sources = realloc(vm->prog->sources,
+			sizeof(SourceFile) * vm->prog->sources_capacity);
+	}
+	SourceFile *source = &vm->prog->sources[vm->prog->sources_count++];
+	source->path = malloc(sizeof(char) * (strlen(path) + 1));
+	strcpy(source->path, path);
+	source->code = code;
+	source->length = length;
+}
+
+// Parses a file into a new package, which is named based off the name of the
+// file. Sets `pkg` to the index of the new package. If `lazy` is true, then
+// function bodies aren't parsed until they're first called.
+static Err * vm_parse_file(VM *vm, char *path, bool lazy, int *pkg) {
+	Err *err = vm_check_frozen(vm);
+	if (err != NULL) {
+		return err;
+	}
+
+	// Extract the package name from the file path
+	uint64_t name = extract_pkg_name(path);
+	if (name == ~((uint64_t) 0)) {
+		err = err_new("invalid package name from file path `%s`", path);
+		err_file(err, path);
+		return err;
+	}
+
+	// Map the file contents into memory
+	size_t length;
+	char *code = read_file(path, &length);
+	if (code == NULL) {
+		err = err_new("failed to open file `%s`: %s", path,
+			strerror(errno));
+		err_file(err, path);
+		return err;
+	}
+
+	// Parse the source code
+	int first_fn = vm->prog->fns_count;
+	*pkg = vm_new_pkg(vm, name);
+	if (lazy) {
+		// Function stubs point into the file's contents and its path, so keep
+		// both around
+		vm_keep_source(vm, path, code, length);
+		path = vm->prog->sources[vm->prog->sources_count - 1].path;
+		err = parse_lazy(vm, *pkg, path, code);
+	} else {
+		err = parse(vm, *pkg, path, code);
+		free_file(code, length);
+	}
+	if (err != NULL) {
+		return err;
+	}
+	int main_fn = vm->prog->pkgs[*pkg].main_fn;
+	vm_fuse(vm, main_fn, 0, first_fn);
+	return vm_verify(vm, main_fn, first_fn);
+}
+
+// Parses a file into a new package without running it, setting `pkg` to the
+// index of the new package. This is used to load a program before freezing it
+// (see `vm_freeze`), so that its packages can be run on other VMs.
+Err * vm_load_file(VM *vm, char *path, int *pkg) {
+	return vm_parse_file(vm, path, vm->lazy, pkg);
+}
+
+// Runs a package's main function, which must have been loaded already (e.g. by
+// `vm_load_file`). Any VM sharing the package's program can run it.
+Err * vm_run_pkg(VM *vm, int pkg) {
+	return vm_run(vm, vm->prog->pkgs[pkg].main_fn, 0);
 }
 
 // Executes a file. A new package is created for the file and is named based off
@@ -253,33 +1019,40 @@ Err * vm_run_string(VM *vm, int pkg, char *code) {
 // freed.
 Err * vm_run_file(VM *vm, char *path) {
 	// TODO: save and restore VM state in case of error
-
-	// Extract the package name from the file path
-	uint64_t name = extract_pkg_name(path);
-	if (name == ~((uint64_t) 0)) {
-		Err *err = err_new("invalid package name from file path `%s`", path);
-		err_file(err, path);
+	int pkg;
+	Err *err = vm_parse_file(vm, path, vm->lazy, &pkg);
+	if (err != NULL) {
 		return err;
 	}
 
-	// Read the file contents
-	char *code = read_file(path);
-	if (code == NULL) {
-		Err *err = err_new("failed to open file `%s`", path);
-		err_file(err, path);
+	// Run the code
+	return vm_run(vm, vm->prog->pkgs[pkg].main_fn, 0);
+}
+
+// Parses a file without running it, and writes the result to a bytecode image
+// at `out`, which can be run later with `vm_run_image`.
+//
+// The bytecode is written after superinstructions have been fused, so loading
+// the image doesn't have to modify it. Every function is parsed, even if the
+// VM is lazy, since an image can't contain unparsed functions.
+Err * vm_compile_file(VM *vm, char *path, char *out) {
+	int pkg;
+	Err *err = vm_parse_file(vm, path, false, &pkg);
+	if (err != NULL) {
 		return err;
 	}
+	return image_write(vm, pkg, out);
+}
 
-	// Parse the source code
-	int pkg = vm_new_pkg(vm, name);
-	Err *err = parse(vm, pkg, path, code);
-	free(code);
+// Executes a bytecode image written by `vm_compile_file`, without having to
+// lex or parse anything. The VM must not have any code loaded onto it yet.
+Err * vm_run_image(VM *vm, char *path) {
+	int pkg;
+	Err *err = image_load(vm, path, &pkg);
 	if (err != NULL) {
 		return err;
 	}
-
-	// Run the code
-	return vm_run(vm, vm->pkgs[pkg].main_fn, 0);
+	return vm_run(vm, vm->prog->pkgs[pkg].main_fn, 0);
 }
 
 // Executes some bytecode, starting at a particular instruction within a
@@ -289,39 +1062,75 @@ static Err * vm_run(VM *vm, int fn_idx, int ins_idx) {
 	// trace
 	static void *interpreter_dispatch[] = {
 		// Stores
-		&&op_MOV, &&op_SET_N, &&op_SET_P, &&op_SET_F,
+		&&op_MOV, &&op_SET_N, &&op_SET_P, &&op_SET_F, &&op_SET_S,
 
 		// Arithmetic operators
 		&&op_ADD_LL, &&op_ADD_LN, &&op_SUB_LL, &&op_SUB_LN, &&op_SUB_NL,
 		&&op_MUL_LL, &&op_MUL_LN, &&op_DIV_LL, &&op_DIV_LN, &&op_DIV_NL,
 		&&op_NEG,
 
+		// Strings
+		&&op_CONCAT,
+
 		// Relational operators
 		&&op_EQ_LL, &&op_EQ_LN, &&op_EQ_LP, &&op_NEQ_LL, &&op_NEQ_LN,
 		&&op_NEQ_LP, &&op_LT_LL, &&op_LT_LN, &&op_LE_LL, &&op_LE_LN,
 		&&op_GT_LL, &&op_GT_LN, &&op_GE_LL, &&op_GE_LN,
 
+		// Structs
+		&&op_NEW, &&op_GET_FIELD, &&op_SET_FIELD,
+
+		// Arrays
+		&&op_GET_INDEX, &&op_SET_INDEX,
+
 		// Control flow
-		&&op_JMP, &&op_LOOP, &&op_CALL, &&op_RET,
+		&&op_JMP, &&op_LOOP, &&op_CALL, &&op_CALL_NATIVE,
+		&&op_RET,
+
+		// Superinstructions
+		&&op_EQ_LL_JMP, &&op_EQ_LN_JMP, &&op_EQ_LP_JMP,
+		&&op_NEQ_LL_JMP, &&op_NEQ_LN_JMP, &&op_NEQ_LP_JMP,
+		&&op_LT_LL_JMP, &&op_LT_LN_JMP, &&op_LE_LL_JMP,
+		&&op_LE_LN_JMP, &&op_GT_LL_JMP, &&op_GT_LN_JMP,
+		&&op_GE_LL_JMP, &&op_GE_LN_JMP,
+		&&op_ADD_LN_LOOP,
 	};
 
 	// Dispatch table for when we're running a JIT trace
 	static void *jit_dispatch[] = {
 		// Stores
-		&&jit_MOV, &&jit_SET_N, &&jit_SET_P, &&jit_SET_F,
+		&&jit_MOV, &&jit_SET_N, &&jit_SET_P, &&jit_SET_F, &&jit_SET_S,
 
 		// Arithmetic operators
 		&&jit_ADD_LL, &&jit_ADD_LN, &&jit_SUB_LL, &&jit_SUB_LN, &&jit_SUB_NL,
 		&&jit_MUL_LL, &&jit_MUL_LN, &&jit_DIV_LL, &&jit_DIV_LN, &&jit_DIV_NL,
 		&&jit_NEG,
 
+		// Strings
+		&&jit_CONCAT,
+
 		// Relational operators
 		&&jit_EQ_LL, &&jit_EQ_LN, &&jit_EQ_LP, &&jit_NEQ_LL, &&jit_NEQ_LN,
 		&&jit_NEQ_LP, &&jit_LT_LL, &&jit_LT_LN, &&jit_LE_LL, &&jit_LE_LN,
 		&&jit_GT_LL, &&jit_GT_LN, &&jit_GE_LL, &&jit_GE_LN,
 
+		// Structs
+		&&jit_NEW, &&jit_GET_FIELD, &&jit_SET_FIELD,
+
+		// Arrays
+		&&jit_GET_INDEX, &&jit_SET_INDEX,
+
 		// Control flow
-		&&jit_JMP, &&jit_LOOP, &&jit_CALL, &&jit_RET,
+		&&jit_JMP, &&jit_LOOP, &&jit_CALL, &&jit_CALL_NATIVE,
+		&&jit_RET,
+
+		// Superinstructions
+		&&jit_EQ_LL_JMP, &&jit_EQ_LN_JMP, &&jit_EQ_LP_JMP,
+		&&jit_NEQ_LL_JMP, &&jit_NEQ_LN_JMP, &&jit_NEQ_LP_JMP,
+		&&jit_LT_LL_JMP, &&jit_LT_LN_JMP, &&jit_LE_LL_JMP,
+		&&jit_LE_LN_JMP, &&jit_GT_LL_JMP, &&jit_GT_LN_JMP,
+		&&jit_GE_LL_JMP, &&jit_GE_LN_JMP,
+		&&jit_ADD_LN_LOOP,
 	};
 
 	// The current dispatch table. This determines whether we jump to the normal
@@ -330,33 +1139,59 @@ static Err * vm_run(VM *vm, int fn_idx, int ins_idx) {
 	// when we want to end it.
 	void **dispatch = interpreter_dispatch;
 
-	// Loop iteration table, which keeps track of how many iterations each loop
-	// has completed so far. When the number of iterations hits the threshold, 
-	// we start a JIT trace
-	#define ITER_TABLE_SIZE 1024
-	uint8_t loop_iter_count[ITER_TABLE_SIZE] = {0};
-
 	// Information about the current JIT trace that we're recording.
 	Trace *trace = NULL;
 
 	// Move some variables into the function's local scope
-	Value *k = vm->consts;
+	Value *k = vm->prog->consts;
 	Value *stk = vm->stack;
 
 	// Move some important state information into local variables for easy
 	// access
-	Function *fn = &vm->fns[fn_idx]; // Currently executing function
+	Function *fn = &vm->prog->fns[fn_idx]; // Currently executing function
 	BcIns *ip = &fn->ins[ins_idx];   // Current instruction
 	Err *err = NULL;                 // Most recent error
+	vm->frames_count = 0;
+	if (!vm_ensure_stack(vm, &stk, fn->frame_size, NULL)) {
+		return err_new("stack overflow");
+	}
+#ifdef DEBUG_DUMP
 	fn_dump(fn);
+#endif
 
-	// Some helpful macros to reduce repetition
-#define OPCODE(mnemonic)                 \
+	// Some helpful macros to reduce repetition. Recording an instruction can
+	// add constants to the VM (when the JIT folds arithmetic on constants),
+	// which might move the constants list
+//
+// Superinstructions are recorded using the recorder for the first instruction
+// in the pair they replace
+#define OPCODE_REC(mnemonic, recorder)   \
 	jit_##mnemonic:                      \
-		jit_rec_##mnemonic(trace, *ip); \
+		trace->pc = ip;                  \
+		jit_rec_##recorder(trace, *ip);  \
+		k = vm->prog->consts;            \
+		if (trace->aborted) {            \
+			goto jit_abort;              \
+		}                                \
 	op_##mnemonic:
+#define OPCODE(mnemonic) OPCODE_REC(mnemonic, mnemonic)
+
+	// When profiling, every instruction is counted just before it's
+	// dispatched
+#ifdef PROFILE
+#define DISPATCH()                                                   \
+	do {                                                             \
+		if (vm->profile != NULL) {                                   \
+			profile_ins(vm->profile, fn_idx, (int) (ip - fn->ins),   \
+				bc_op(*ip));                                         \
+		}                                                            \
+		goto *dispatch[bc_op(*ip)];                                  \
+	} while (0)
+#define NEXT() do { ip++; DISPATCH(); } while (0)
+#else
 #define DISPATCH() goto *dispatch[bc_op(*ip)]
 #define NEXT() goto *dispatch[bc_op(*(++ip))]
+#endif
 
 	// Execute the first instruction
 	DISPATCH();
@@ -376,6 +1211,9 @@ OPCODE(SET_P)
 OPCODE(SET_F)
 	stk[bc_arg1(*ip)] = TAG_FN | bc_arg16(*ip);
 	NEXT();
+OPCODE(SET_S)
+	stk[bc_arg1(*ip)] = k[bc_arg16(*ip)];
+	NEXT();
 
 
 	// ---- Arithmetic Operations ---------------------------------------------
@@ -413,22 +1251,56 @@ OPCODE(NEG)
 	NEXT();
 
 
+	// ---- Strings -----------------------------------------------------------
+
+	// Concatenating might create a rope, which can run the garbage collector
+OPCODE(CONCAT)
+	err = str_concat(vm, &stk[bc_arg1(*ip)], &stk[bc_arg2(*ip)],
+		&stk[bc_arg3(*ip)], stk + fn->frame_size);
+	if (err != NULL) {
+		goto finish;
+	}
+	NEXT();
+
+
 	// ---- Relational Operators ----------------------------------------------
 
+	// A relational operator fused with its following JMP. If the (inverted)
+	// condition holds, we skip the JMP; otherwise we go straight to its target
+	// without dispatching on the JMP first
+#define BRANCH(condition)                               \
+	if (condition) {                                    \
+		ip += 2;                                        \
+	} else {                                            \
+		ip += (int32_t) bc_arg24(ip[1]) - JMP_BIAS + 2; \
+	}                                                   \
+	DISPATCH();
+
 #define BC_EQ(name, op)                                               \
 	OPCODE(name##_LL)                                                 \
-		if (stk[bc_arg1(*ip)] op stk[bc_arg2(*ip)]) { ip++; }         \
+		if (val_equal(vm, stk[bc_arg1(*ip)], stk[bc_arg2(*ip)]) op    \
+				true) { ip++; }                                       \
 		NEXT();                                                       \
 	OPCODE(name##_LN)                                                 \
 		if (stk[bc_arg1(*ip)] op k[bc_arg2(*ip)]) { ip++; }           \
 		NEXT();                                                       \
 	OPCODE(name##_LP)                                                 \
 		if (stk[bc_arg1(*ip)] op (TAG_PRIM | bc_arg2(*ip))) { ip++; } \
-		NEXT();
+		NEXT();                                                       \
+	OPCODE_REC(name##_LL_JMP, name##_LL)                              \
+		BRANCH(val_equal(vm, stk[bc_arg1(*ip)], stk[bc_arg2(*ip)]) op \
+			true);                                                    \
+	OPCODE_REC(name##_LN_JMP, name##_LN)                              \
+		BRANCH(stk[bc_arg1(*ip)] op k[bc_arg2(*ip)]);                 \
+	OPCODE_REC(name##_LP_JMP, name##_LP)                              \
+		BRANCH(stk[bc_arg1(*ip)] op (TAG_PRIM | bc_arg2(*ip)));
 
 	// We invert the condition because we want to skip the following JMP only
 	// if the condition turns out to be false - we want to take the JMP if the
-	// condition is true
+	// condition is true. Two slots might hold different strings with the same
+	// contents, but constants and primitives are only equal to values with
+	// the same bits (the parser never uses a string as the constant in an
+	// EQ_LN)
 	BC_EQ(EQ, !=)
 	BC_EQ(NEQ, ==)
 
@@ -438,7 +1310,11 @@ OPCODE(NEG)
 		NEXT();                                                         \
 	OPCODE(name##_LN)                                                   \
 		if (v2n(stk[bc_arg1(*ip)]) op v2n(k[bc_arg2(*ip)])) { ip++; }   \
-		NEXT();
+		NEXT();                                                         \
+	OPCODE_REC(name##_LL_JMP, name##_LL)                                \
+		BRANCH(v2n(stk[bc_arg1(*ip)]) op v2n(stk[bc_arg2(*ip)]));       \
+	OPCODE_REC(name##_LN_JMP, name##_LN)                                \
+		BRANCH(v2n(stk[bc_arg1(*ip)]) op v2n(k[bc_arg2(*ip)]));
 
 	// Invert the conditions, for the reason given above
 	BC_ORD(LT, >=)
@@ -447,33 +1323,246 @@ OPCODE(NEG)
 	BC_ORD(GE, <)
 
 
+	// ---- Structs -----------------------------------------------------------
+
+	// The new object's fields are taken from the slots after its destination,
+	// where the parser put the arguments to `new`. Creating it might run the
+	// garbage collector, which scans the stack up to the end of this frame
+OPCODE(NEW) {
+	Object *obj = obj_new(vm, bc_arg16(*ip), &stk[bc_arg1(*ip) + 1],
+		stk + fn->frame_size);
+	stk[bc_arg1(*ip)] = ptr2v(obj);
+	NEXT();
+}
+
+	// Field accesses look up the field's index through the instruction's
+	// inline cache, which only has to search the object's shape if the last
+	// object accessed had a different shape
+OPCODE(GET_FIELD) {
+	Value val = stk[bc_arg2(*ip)];
+	if (!val_is_struct(val)) {
+		err = err_new("attempt to access field of non-struct value");
+		goto finish;
+	}
+	Object *obj = v2ptr(val);
+	int field = obj_field(vm->prog, &fn->caches[bc_arg3(*ip)], obj);
+	if (field < 0) {
+		err = err_new("struct has no such field");
+		goto finish;
+	}
+	stk[bc_arg1(*ip)] = obj->fields[field];
+	NEXT();
+}
+OPCODE(SET_FIELD) {
+	Value val = stk[bc_arg1(*ip)];
+	if (!val_is_struct(val)) {
+		err = err_new("attempt to access field of non-struct value");
+		goto finish;
+	}
+	Object *obj = v2ptr(val);
+	int field = obj_field(vm->prog, &fn->caches[bc_arg3(*ip)], obj);
+	if (field < 0) {
+		err = err_new("struct has no such field");
+		goto finish;
+	}
+	obj->fields[field] = stk[bc_arg2(*ip)];
+	gc_barrier(vm->heap, obj, obj->fields[field]);
+	NEXT();
+}
+
+
+	// ---- Arrays ------------------------------------------------------------
+
+	// Elements are stored unboxed, so an element is always a number, and
+	// storing one never needs the write barrier
+OPCODE(GET_INDEX) {
+	Value val = stk[bc_arg2(*ip)];
+	if (!val_is_array(val)) {
+		err = err_new("attempt to index non-array value");
+		goto finish;
+	}
+	Array *array = v2ptr(val);
+	Value index = stk[bc_arg3(*ip)];
+	if (!array_in_bounds(array, index)) {
+		err = array_index_err(index);
+		goto finish;
+	}
+	stk[bc_arg1(*ip)] = n2v(array->elements[(uint64_t) v2n(index)]);
+	NEXT();
+}
+OPCODE(SET_INDEX) {
+	Value val = stk[bc_arg1(*ip)];
+	if (!val_is_array(val)) {
+		err = err_new("attempt to index non-array value");
+		goto finish;
+	}
+	Array *array = v2ptr(val);
+	Value index = stk[bc_arg2(*ip)];
+	if (!array_in_bounds(array, index)) {
+		err = array_index_err(index);
+		goto finish;
+	}
+	Value elem = stk[bc_arg3(*ip)];
+	if (!val_is_num(elem)) {
+		err = err_new("attempt to store non-number value in array");
+		goto finish;
+	}
+	array->elements[(uint64_t) v2n(index)] = v2n(elem);
+	NEXT();
+}
+
+
 	// ---- Control Flow ------------------------------------------------------
 
-	// Halt the JIT trace when we reach the end of the loop we're JITing
-jit_LOOP:
-	jit_rec_finish(trace);
+	// Halt the JIT trace when we reach the end of the loop we're JITing. If the
+	// trace compiled successfully, then we add it to the trace cache and start
+	// executing it straight away
+jit_LOOP: {
+	if (ip != trace->loop || trace->depth > 0) {
+		// We've hit the end of a nested loop (or a loop inside a function
+		// called by the trace), which we can't compile yet
+		goto jit_abort;
+	}
+	CompiledTrace *compiled = NULL;
+	bool optimised = jit_rec_optimise(trace);
+	k = vm->prog->consts; // Constant folding can move the constants list
+	if (optimised) {
+		if (vm->jit_thread && jit_submit(vm, trace)) {
+			// Keep interpreting the loop while the compile thread assembles
+			// the trace; it's installed at a later LOOP once it's done
+			trace = NULL;
+			dispatch = interpreter_dispatch;
+			DISPATCH();
+		}
+		jit_rec_assemble(trace);
+		compiled = jit_rec_install(trace);
+	}
+	vm_trace_compiled(vm, trace, compiled);
+	trace = NULL;
+	dispatch = interpreter_dispatch;
+	DISPATCH();
+}
+
+	// An ADD_LN fused with the following LOOP. We record the addition, then
+	// carry on to the LOOP, which finishes the trace
+jit_ADD_LN_LOOP:
+	trace->pc = ip;
+	jit_rec_ADD_LN(trace, *ip);
+	k = vm->prog->consts;
+	if (trace->aborted) {
+		goto jit_abort;
+	}
+	stk[bc_arg1(*ip)] = n2v(v2n(stk[bc_arg2(*ip)]) + v2n(k[bc_arg3(*ip)]));
+	ip++;
+	goto jit_LOOP;
+
+	// If we encounter something we can't compile while recording a trace, then
+	// throw the trace away and continue executing the current instruction with
+	// the normal interpreter
+jit_abort:
+#ifdef PROFILE
+	if (vm->profile != NULL) {
+		vm->profile->traces_aborted++;
+	}
+#endif
+	if (trace->root != NULL) {
+		vm_side_trace_failed(trace->root, trace->exit);
+	} else {
+		vm_trace_failed(vm, trace->fn, trace->loop);
+	}
+	jit_trace_free(trace);
+	trace = NULL;
 	dispatch = interpreter_dispatch;
-	goto finish; // TODO
-
-	// Hot loop detection is pretty simple. If a loop is executed more than 50
-	// times, start a JIT trace. We keep track of loop iteration counts using
-	// the instruction pointer as an index to a table. We reduce the resolution
-	// of the table by bit-shifting the IP left by 2, and modulo-ing the pointer
-	// by the size of the table. We don't really care about the high collision
-	// rate this might cause.
+	DISPATCH();
+
+	// An ADD_LN fused with the following LOOP
+op_ADD_LN_LOOP:
+	stk[bc_arg1(*ip)] = n2v(v2n(stk[bc_arg2(*ip)]) + v2n(k[bc_arg3(*ip)]));
+	ip++;
+	// Fall through to the LOOP...
+
+	// Hot loop detection is pretty simple. Each loop has its own counter,
+	// which counts down the number of iterations left before we start
+	// recording a trace for it. The counters are persisted across calls to
+	// `vm_run`.
 op_LOOP: {
-	size_t idx = (((uintptr_t) ip) >> 2) & (ITER_TABLE_SIZE - 1);
-	loop_iter_count[idx]++;
-	if (loop_iter_count[idx] >= JIT_THRESHOLD) {
-		// Reset the iteration count
-		loop_iter_count[idx] = 0;
+	if (!vm->jit) {
+		goto op_JMP;
+	}
+
+	// Install any traces the compile thread has finished with
+	if (vm->jit_worker != NULL) {
+		vm_install_traces(vm, false);
+	}
 
-		// Create a new trace (we only ever create one trace at the moment, so
-		// don't worry about freeing any previous trace)
-		trace = jit_trace_new(vm);
+	// Check if we've already compiled a trace for this loop
+	CompiledTrace *compiled = jit_cache_lookup(vm->prog->jit, fn_idx, ip);
+	if (compiled != NULL &&
+			!vm_ensure_stack(vm, &stk, compiled->slots_count, trace)) {
+		// The frames of the functions inlined into the trace don't fit on the
+		// stack, so interpret this iteration instead
+		goto op_JMP;
+	} else if (compiled != NULL) {
+		// The trace runs the loop until one of its guards fails. It then
+		// writes the modified locals back to the stack and tells us which
+		// side exit it took, so we can resume interpreting from there
+#ifdef PROFILE
+		if (vm->profile != NULL) {
+			vm->profile->trace_entries++;
+			vm->profile->in_trace = 1;
+		}
+#endif
+		int exit = compiled->mcode(stk, k);
+#ifdef PROFILE
+		if (vm->profile != NULL) {
+			vm->profile->trace_exits++;
+			vm->profile->in_trace = 0;
+		}
+#endif
+		TraceExit *side = jit_exit(compiled, exit);
+		BcIns *loop = ip;
+		ip += side->pc;
+
+		// If the exit is taken often enough, then record a side trace from
+		// where we resume, which ends when we get back to this loop. Every VM
+		// sharing the program counts down the same exit
+		uint8_t aborts = __atomic_load_n(&side->aborts, __ATOMIC_RELAXED);
+		if (aborts < JIT_MAX_ABORTS && __atomic_sub_fetch(&side->countdown, 1,
+				__ATOMIC_RELAXED) == 0) {
+			// Reset the count, in case the exit is still being compiled
+			__atomic_store_n(&side->countdown, JIT_EXIT_THRESHOLD,
+				__ATOMIC_RELAXED);
+			if (!jit_is_compiling(vm, fn_idx, loop, compiled, exit)) {
+				trace = jit_trace_new(vm);
+				trace->loop = loop;
+				trace->fn = fn_idx;
+				trace->stack = stk;
+				trace->root = compiled;
+				trace->exit = exit;
+				dispatch = jit_dispatch;
+			}
+		}
+		DISPATCH();
+	}
 
-		// Start the JIT trace by swapping out the dispatch table
-		dispatch = jit_dispatch;
+	HotLoop *hot = vm_hot_loop(vm, fn_idx, ip);
+	if (--hot->countdown == 0) {
+		// Reset the iteration count, in case we need to try again
+		hot->countdown = JIT_THRESHOLD;
+
+		// Create a new trace, which ends when we get back to this instruction
+		// (unless the compile thread is still working on the last one, or
+		// the loop's been blacklisted in a frozen program)
+		if (hot->aborts < JIT_MAX_ABORTS &&
+				!jit_is_compiling(vm, fn_idx, ip, NULL, 0)) {
+			trace = jit_trace_new(vm);
+			trace->loop = ip;
+			trace->fn = fn_idx;
+			trace->stack = stk;
+
+			// Start the JIT trace by swapping out the dispatch table
+			dispatch = jit_dispatch;
+		}
 	}
 }
 
@@ -485,12 +1574,90 @@ op_JMP:
 	ip += (int32_t) bc_arg24(*ip) - JMP_BIAS;
 	NEXT();
 
-OPCODE(CALL) // TODO
-OPCODE(RET)  // TODO
-	// Fall through to finish for now...
+	// Calling a function pushes a new frame onto the call stack, then moves the
+	// stack base up to the first argument, so the callee's arguments are its
+	// first locals
+OPCODE(CALL) {
+	Value callee = stk[bc_arg1(*ip)];
+	if ((callee & ~((Value) 0xffff)) != TAG_FN) {
+		err = err_new("attempt to call non-function value");
+		goto finish;
+	}
+
+	// Save the caller's state
+	if (vm->frames_count >= vm->frames_capacity) {
+		vm->frames_capacity *= 2;
+		vm->frames = realloc(vm->frames,
+			sizeof(CallFrame) * vm->frames_capacity);
+	}
+	CallFrame *frame = &vm->frames[vm->frames_count++];
+	frame->fn = fn_idx;
+	frame->ip = ip;
+	frame->stack = stk;
+
+	// Parse the callee if this is the first time it's been called (parsing it
+	// can add constants and functions, which might move both lists)
+	fn_idx = (int) (callee & 0xffff);
+	if (vm->prog->fns[fn_idx].ins == NULL) {
+		err = parse_fn_body(vm, fn_idx);
+		if (err == NULL) {
+			err = vm_verify_fn(vm, fn_idx);
+		}
+		if (err != NULL) {
+			goto finish;
+		}
+		k = vm->prog->consts;
+	}
+
+	// Make sure the callee's locals fit on the stack
+	fn = &vm->prog->fns[fn_idx];
+	stk += bc_arg2(*ip);
+	if (!vm_ensure_stack(vm, &stk, fn->frame_size, trace)) {
+		err = err_new("stack overflow");
+		goto finish;
+	}
+
+	// Any arguments the caller didn't pass are nil
+	for (int i = bc_arg3(*ip); i < fn->args_count; i++) {
+		stk[i] = VAL_NIL;
+	}
+	ip = fn->ins;
+	DISPATCH();
+}
+
+	// A native function leaves its result in the slot of its first argument,
+	// like any other function. It might allocate, which can run the garbage
+	// collector, which scans the stack up to the end of this frame
+OPCODE(CALL_NATIVE) {
+	Native *native = &NATIVES[bc_arg1(*ip)];
+	err = native->fn(vm, &stk[bc_arg2(*ip)], stk + fn->frame_size);
+	if (err != NULL) {
+		goto finish;
+	}
+	NEXT();
+}
+
+	// Returning leaves the return value in the first slot of the callee's
+	// frame, which is where the caller expects the result of the call to be
+OPCODE(RET) {
+	Value result = bc_arg2(*ip) ? stk[bc_arg1(*ip)] : VAL_NIL;
+	if (vm->frames_count == 0) {
+		// Returning from the function we started executing
+		goto finish;
+	}
+	stk[0] = result;
+
+	// Restore the caller's state
+	CallFrame *frame = &vm->frames[--vm->frames_count];
+	fn_idx = frame->fn;
+	fn = &vm->prog->fns[fn_idx];
+	ip = frame->ip;
+	stk = frame->stack;
+	NEXT();
+}
 
 finish:
-	// Termination
-	printf("First stack slot %g\n", v2n(stk[0]));
+	// Don't leave traces on the compile thread between calls into the VM
+	vm_install_traces(vm, true);
 	return err;
 }
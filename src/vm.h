@@ -15,10 +15,19 @@
 
 #include "bytecode.h"
 #include "value.h"
+#include "arena.h"
 
 // Limits.
 #define MAX_LOCALS_IN_FN  255
 #define MAX_CONSTS        USHRT_MAX
+#define MAX_STRUCTS       USHRT_MAX
+#define MAX_FIELDS        128
+#define MAX_CACHES_IN_FN  256
+
+// The runtime stack starts off small and doubles in size whenever a function
+// call needs more room, up to a maximum size (both measured in stack slots).
+#define INITIAL_STACK_SIZE 256
+#define MAX_STACK_SIZE     (1 << 20)
 
 // A package contains a collection of function definitions.
 typedef struct {
@@ -29,10 +38,12 @@ typedef struct {
 	// 2) Copy out the name into a new heap allocated string. This means quite
 	//    a lot of heap allocations
 	// 3) Hash the string and ignore the fact that there might be collisions.
-	//    The FNV hashing algorithm we use is strong enough that collisions are
-	//    only going to occur if people deliberately name their variables after
+	//    The 64 bit hash we use is strong enough that collisions are only
+	//    going to occur if people deliberately name their variables after
 	//    known collisions
-	// I went with the hashing option because it's the easiest for me.
+	// I went with the hashing option because it's the easiest for me. Build
+	// with HASH_DEBUG to have the lexer check for collisions anyway (see
+	// `vm_intern_ident`).
 	//
 	// If the package is anonymous (i.e. doesn't have a name and can't be
 	// imported), then this is set to !0.
@@ -43,6 +54,40 @@ typedef struct {
 	int main_fn;
 } Package;
 
+// Hot loop detection state for a BC_LOOP instruction. This is kept across
+// calls to `vm_run`, so a loop that's run a few times every call still gets
+// compiled eventually.
+//
+// Each function keeps a fresh counter for each of its loops, and each VM
+// copies them the first time it runs one (see `vm_hot_loop`), so VMs sharing
+// a program never count iterations in the same place.
+typedef struct {
+	// The index of the BC_LOOP instruction in its function's bytecode.
+	int ins;
+
+	// The number of iterations left before we start recording a trace.
+	uint16_t countdown;
+
+	// The number of times recording a trace for this loop has failed.
+	uint8_t aborts;
+} HotLoop;
+
+// An inline cache for a GET_FIELD or SET_FIELD instruction, which remembers
+// where the field was found the last time the instruction ran. Every struct
+// has a fixed layout, described by its shape, so if the next object has the
+// same shape as the last one, then the field is at the same offset and we
+// don't have to look it up again.
+typedef struct {
+	// The name of the field being accessed.
+	uint64_t field;
+
+	// The shape the field was last found in, plus 1 (so 0 means the cache is
+	// empty), in the lowest 32 bits, and the index of the field in that shape
+	// in the highest 32 bits. Both halves are kept in one word so that VMs
+	// sharing a program can fill the cache atomically (see `obj_field`).
+	uint64_t entry;
+} InlineCache;
+
 // A function definition stores a list of parsed bytecode instructions.
 typedef struct {
 	// The index of the package that this function is associated with.
@@ -52,15 +97,55 @@ typedef struct {
 	// supported).
 	int args_count;
 
+	// The number of stack slots the function uses (for its arguments, named
+	// locals and temporaries), which the stack must have room for when the
+	// function is called.
+	int frame_size;
+
 	// Note that we can't have more than INT_MAX bytecode instructions, since we
 	// need to occasionally refer to instructions using signed indices.
+	//
+	// If the function was loaded from a bytecode image, then `ins` points into
+	// the image and `ins_capacity` is 0. It's copied onto the heap if we ever
+	// need to append to it.
 	BcIns *ins;
 	int ins_count, ins_capacity;
+
+	// Initial hot loop counters for every BC_LOOP instruction in the
+	// function, sorted by instruction index.
+	HotLoop *loops;
+	int loops_count, loops_capacity;
+
+	// An inline cache for every GET_FIELD and SET_FIELD instruction in the
+	// function, indexed by the instruction's last argument.
+	InlineCache *caches;
+	int caches_count, caches_capacity;
+
+	// If the function was parsed lazily (see `parse_lazy`), then `ins` is NULL
+	// until the function is first called. In the meantime, we keep the source
+	// code the function was defined in, and the position and line of the `(`
+	// that starts its arguments list, so we can come back and parse it.
+	char *src_path, *src_code;
+	int src_start, src_line;
 } Function;
 
 // Emits a bytecode instruction to a function.
 int fn_emit(Function *fn, BcIns ins);
 
+// Adds an empty inline cache for an access to the field `field` to a function,
+// returning its index. Returns -1 if the function has too many caches.
+int fn_new_cache(Function *fn, uint64_t field);
+
+// Creates a hot loop counter for every BC_LOOP instruction in a function whose
+// bytecode wasn't emitted with `fn_emit` (i.e. was loaded from an image).
+void fn_init_loops(Function *fn);
+
+// Fuses common pairs of instructions in a function into superinstructions.
+void fn_fuse(Function *fn);
+
+// Fuses superinstructions in a function's bytecode from `first_ins` onwards.
+void fn_fuse_from(Function *fn, int first_ins);
+
 // Dumps the bytecode for a function to the standard output.
 void fn_dump(Function *fn);
 
@@ -94,8 +179,83 @@ void err_file(Err *err, char *path);
 // terminal color codes will be printed alongside the error information.
 void err_print(Err *err, bool use_color);
 
-// Hydrogen has no global state; everything that's needed is stored in this
-// struct. You can create multiple VMs and they'll all function independently.
+// An identifier interned on the VM to detect hash collisions.
+typedef struct {
+	uint64_t hash;
+
+	// Heap allocated, NUL terminated copy of the identifier, or NULL if this
+	// slot in the intern table is empty.
+	char *name;
+} Ident;
+
+// A source code file kept in memory until the VM is freed, because some of its
+// functions haven't been parsed yet.
+typedef struct {
+	// Heap allocated copy of the file's path.
+	char *path;
+
+	// The file's contents, read by `read_file`.
+	char *code;
+	size_t length;
+} SourceFile;
+
+// A shape describes the layout of every object created from a struct: the
+// object's fields are stored one after the other, in the order they're named
+// in the struct's definition. Each struct has its own shape, which is
+// identified by its index in the program's list of shapes.
+typedef struct {
+	// The package the struct was defined in, and the struct's name.
+	int pkg;
+	uint64_t name;
+
+	// The name of each field, in order.
+	uint64_t *fields;
+	int fields_count, fields_capacity;
+} Shape;
+
+// Forward declaration for strings (see `str.h`).
+struct str;
+
+// A hash table of interned strings, chained through `String::chain`. Every
+// string in a table has different contents. The capacity is always a power
+// of 2.
+typedef struct {
+	struct str **buckets;
+	int count, capacity;
+} StrTable;
+
+// Information about a function call that we need to return to the caller.
+typedef struct {
+	// The calling function, and the CALL instruction within it.
+	int fn;
+	BcIns *ip;
+
+	// The base of the caller's stack frame.
+	Value *stack;
+} CallFrame;
+
+// Forward declarations for the JIT compiler's state and compile thread (see
+// `jit/compiler.h` and `jit/worker.h`).
+struct jit_state;
+struct jit_worker;
+
+// Forward declaration for the profiler (see `profile.h`).
+struct profile;
+
+// Forward declaration for the garbage collected heap (see `gc.h`).
+struct heap;
+
+// A lock that can be held by one thread at a time (see `util.h`).
+struct mutex;
+
+// A program is everything that's loaded onto a VM: packages, functions and
+// their bytecode, constants and compiled traces. It can be shared between
+// several VMs (see `vm_new_shared`), each running on its own thread, so the
+// code only has to be parsed and compiled once.
+//
+// Once it's shared, a program is frozen: no more code can be loaded onto it,
+// and new constants and traces (from the JIT compiler) are only added while
+// holding `lock`. Anything read without the lock never moves.
 typedef struct {
 	// We keep a list of all loaded packages so that if a piece of code attempts
 	// to import a package we've already loaded, we don't have to re-load that
@@ -111,36 +271,195 @@ typedef struct {
 	Function *fns;
 	int fns_count, fns_capacity;
 
-	// Global list of constants that we can reference by index.
+	// The shape of every struct defined by the program, which bytecode refers
+	// to by index.
+	Shape *shapes;
+	int shapes_count, shapes_capacity;
+
+	// Global list of constants that we can reference by index. A frozen
+	// program's list is allocated at its maximum size, so it never moves.
 	Value *consts;
 	int consts_count, consts_capacity;
 
+	// Open addressing hash table from the bits of each constant to its index
+	// in the constants list (or -1 for an empty slot), so we can find an
+	// existing constant without searching the whole list. The capacity is
+	// always a power of 2.
+	int *consts_index;
+	int consts_index_capacity;
+
+	// Every string constant (see `vm_add_str`). String constants aren't
+	// allocated on any VM's heap, since they're shared by every VM running
+	// the program; they're freed along with the program instead.
+	StrTable strs;
+
+	// Open addressing hash table of every identifier lexed so far, keyed by
+	// its hash. Only used to detect hash collisions when built with
+	// HASH_DEBUG, so it isn't allocated until the first identifier is
+	// interned. The capacity is always a power of 2.
+	Ident *idents;
+	int idents_count, idents_capacity;
+
+	// Source files with functions that haven't been parsed yet (see
+	// `VM::lazy`), which are kept in memory until the program is freed.
+	SourceFile *sources;
+	int sources_count, sources_capacity;
+
+	// The bytecode image mapped into memory that the functions' bytecode was
+	// loaded from, or NULL if the code was parsed (see `image.h`).
+	void *image;
+	size_t image_size;
+
+	// State for the JIT compiler, including the cache of compiled traces.
+	struct jit_state *jit;
+
+	// Set by `vm_freeze`, once the program can be shared.
+	bool frozen;
+
+	// Held while changing a frozen program. NULL until the program's frozen.
+	struct mutex *lock;
+
+	// The number of VMs using the program. The last one frees it.
+	int refs;
+} Program;
+
+// A VM's own copy of the hot loop counters for one of the program's functions.
+typedef struct {
+	HotLoop *loops;
+	int loops_count;
+} HotLoops;
+
+// Hydrogen has no global state; everything that's needed is stored in this
+// struct. You can create multiple VMs and they'll all function independently,
+// or have several VMs share the same program (one per thread).
+typedef struct {
+	// The code loaded onto the VM.
+	Program *prog;
+
 	// The most recent error. This is set just before a longjmp back to the
 	// protecting setjmp call.
 	Err *err;
 	jmp_buf guard;
 
 	// Memory used for the runtime stack. This is persisted across calls to
-	// `hy_run...` so that we can implement the REPL.
+	// `hy_run...` so that we can implement the REPL. The stack is grown when
+	// a function is called, which can move it.
 	Value *stack;
 	int stack_size;
+
+	// The heap that objects created by the VM are allocated on. Objects
+	// aren't shared with other VMs.
+	struct heap *heap;
+
+	// Stack of function calls that haven't returned yet. The callee's stack
+	// frame starts at the caller's first argument slot, so arguments don't
+	// need to be copied.
+	CallFrame *frames;
+	int frames_count, frames_capacity;
+
+	// Hot loop counters for each function in the program, indexed by function.
+	// A function's counters are copied from it when one of its loops is first
+	// run.
+	HotLoops *hot;
+	int hot_capacity;
+
+	// Scratch memory for the parser, which is reset after each call to
+	// `parse`, and for the JIT compiler, which is reset after each trace is
+	// compiled (or aborted). Nothing allocated from these outlives the
+	// parse or the trace (see `arena.h`).
+	Arena parser_arena;
+	Arena jit_arena;
+
+	// If true, then function bodies in files are only parsed when they're
+	// first called, rather than all at once before the file is run. The files
+	// are kept in memory until the program is freed.
+	bool lazy;
+
+	// If false, then hot loops are never traced or compiled, and everything
+	// is run by the interpreter. True by default.
+	bool jit;
+
+	// If true, then traces are assembled on a separate compile thread (see
+	// `jit/worker.h`) while the interpreter carries on running the loop.
+	// Falls back to compiling traces on this thread if threads aren't
+	// supported. The thread is started when it's first needed.
+	bool jit_thread;
+	struct jit_worker *jit_worker;
+
+	// Counters and samples for `hydrogen --profile`, or NULL if the VM isn't
+	// being profiled. Only updated when built with PROFILE (see `profile.h`).
+	struct profile *profile;
 } VM;
 
 // Creates a new virtual machine instance.
 VM vm_new();
 
-// Frees all the resources allocated by a virtual machine.
+// Frees all the resources allocated by a virtual machine. The VM's program is
+// freed along with the last VM using it.
 void vm_free(VM *vm);
 
+// Freezes the program loaded onto a VM so that it can be shared with other VMs.
+// Any functions that haven't been parsed yet (see `VM::lazy`) are parsed now.
+// No more code can be loaded onto the program afterwards.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_freeze(VM *vm);
+
+// Creates a new VM that shares the frozen program loaded onto another VM. The
+// new VM has its own stack and hot loop counters, and can run on a different
+// thread to any other VM using the program. Compiled traces are shared, so a
+// loop only has to be compiled once.
+VM vm_new_shared(VM *vm);
+
+// Takes the program's lock if it's frozen (and so might be shared with VMs
+// running on other threads). Unfrozen programs are only used by one VM.
+void vm_lock(VM *vm);
+
+// Releases the lock taken by `vm_lock`.
+void vm_unlock(VM *vm);
+
+// Returns the VM's hot loop counter for a BC_LOOP instruction in a function.
+HotLoop * vm_hot_loop(VM *vm, int fn, BcIns *loop);
+
+// Writes a symbol for every trace compiled from now on to the map file that
+// Linux's `perf` reads (see `jit/perf.h`), so samples in compiled code can be
+// attributed to the loops they came from. Applies to every VM sharing the
+// program.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_open_perf_map(VM *vm);
+
 // Creates a new package on the VM and returns its index.
 int vm_new_pkg(VM *vm, uint64_t name);
 
 // Creates a new function on the VM and returns its index.
 int vm_new_fn(VM *vm, int pkg);
 
+// Creates a new struct with no fields on the VM and returns the index of its
+// shape. Returns -1 if there are too many structs.
+int vm_new_shape(VM *vm, int pkg, uint64_t name);
+
+// Returns the index of the shape for the struct called `name` in a package,
+// or -1 if the package doesn't define one.
+int vm_find_shape(VM *vm, int pkg, uint64_t name);
+
+// Adds a constant to the VM's constants list if it isn't already there, and
+// returns its index. Returns -1 if the constants list is full.
+int vm_add_const(VM *vm, Value value);
+
 // Adds a constant number to the VM's constants list, returning its index.
+// Returns -1 if the constants list is full.
 int vm_add_num(VM *vm, double num);
 
+// Adds a constant string to the VM's constants list if it isn't already
+// there, returning its index. Returns -1 if the constants list is full.
+int vm_add_str(VM *vm, char *chars, int length);
+
+// Records the string an identifier hash came from. If a different identifier
+// with the same hash has already been interned, returns that identifier
+// (without interning the new one). Otherwise returns NULL.
+char * vm_intern_ident(VM *vm, uint64_t hash, char *name, int length);
+
 // Triggers a longjmp back to the most recent setjmp protection.
 void err_trigger(VM *vm, Err *err);
 
@@ -165,4 +484,29 @@ Err * vm_run_string(VM *vm, int pkg, char *code);
 // If an error occurs, then the return value will be non-NULL.
 Err * vm_run_file(VM *vm, char *path);
 
+// Parses a file without running it, and writes the result to a bytecode image
+// at `out`, which can be run later with `vm_run_image`.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_compile_file(VM *vm, char *path, char *out);
+
+// Executes a bytecode image written by `vm_compile_file`, without having to
+// lex or parse anything. The VM must not have any code loaded onto it yet.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_run_image(VM *vm, char *path);
+
+// Loads a file without running it, like `vm_run_file`, setting `pkg` to the
+// index of the file's package. The code can then be run (by this VM or any
+// other VM sharing its program) with `vm_run_pkg`.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_load_file(VM *vm, char *path, int *pkg);
+
+// Executes the main function of a package that's already been loaded, from
+// the start. This is how VMs sharing a frozen program run its code.
+//
+// If an error occurs, then the return value will be non-NULL.
+Err * vm_run_pkg(VM *vm, int pkg);
+
 #endif
@@ -0,0 +1,75 @@
+// test_arena.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+#include <cstdint>
+#include <cstring>
+
+extern "C" {
+	#include <arena.h>
+}
+
+TEST(Arena, Alignment) {
+	Arena arena = arena_new();
+	for (size_t size = 1; size < 100; size++) {
+		void *ptr = arena_alloc(&arena, size);
+		ASSERT_EQ((uintptr_t) ptr % ARENA_ALIGN, 0u);
+		memset(ptr, 0xff, size);
+	}
+
+	// Large allocations get a block to themselves
+	uint8_t *big = (uint8_t *) arena_calloc(&arena, ARENA_BLOCK_SIZE * 2, 1);
+	ASSERT_EQ(big[0], 0);
+	ASSERT_EQ(big[ARENA_BLOCK_SIZE * 2 - 1], 0);
+	arena_free(&arena);
+	ASSERT_TRUE(arena.first == NULL);
+}
+
+TEST(Arena, Realloc) {
+	Arena arena = arena_new();
+
+	// The most recent allocation grows in place
+	int *array = (int *) arena_alloc(&arena, sizeof(int) * 4);
+	for (int i = 0; i < 4; i++) {
+		array[i] = i;
+	}
+	int *grown = (int *) arena_realloc(&arena, array, sizeof(int) * 4,
+		sizeof(int) * 64);
+	ASSERT_EQ(grown, array);
+
+	// Anything else is copied
+	arena_alloc(&arena, 1);
+	int *moved = (int *) arena_realloc(&arena, grown, sizeof(int) * 64,
+		sizeof(int) * 128);
+	ASSERT_NE(moved, grown);
+	for (int i = 0; i < 4; i++) {
+		ASSERT_EQ(moved[i], i);
+	}
+
+	// Growing past the end of a block moves the allocation into a new one
+	int *huge = (int *) arena_realloc(&arena, moved, sizeof(int) * 128,
+		ARENA_BLOCK_SIZE * 2);
+	for (int i = 0; i < 4; i++) {
+		ASSERT_EQ(huge[i], i);
+	}
+	arena_free(&arena);
+}
+
+TEST(Arena, ResetReusesBlocks) {
+	Arena arena = arena_new();
+	void *first = arena_alloc(&arena, 100);
+	arena_alloc(&arena, ARENA_BLOCK_SIZE);
+	arena_alloc(&arena, 100);
+	ArenaBlock *last = arena.current;
+
+	// The same sequence of allocations after a reset uses the same memory,
+	// without adding any new blocks
+	arena_reset(&arena);
+	ASSERT_EQ(arena_alloc(&arena, 100), first);
+	arena_alloc(&arena, ARENA_BLOCK_SIZE);
+	arena_alloc(&arena, 100);
+	ASSERT_EQ(arena.current, last);
+	ASSERT_TRUE(last->next == NULL);
+	arena_free(&arena);
+}
@@ -0,0 +1,216 @@
+// test_array.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+
+#include "test_run.h"
+
+extern "C" {
+	#include <gc.h>
+	#include <array.h>
+}
+
+// Runs some code that's expected to trigger an error, and checks its
+// description.
+static void expect_err(const char *code, const char *desc) {
+	VM vm;
+	Err *err = run(&vm, code);
+	ASSERT_TRUE(err != NULL) << code;
+	ASSERT_STREQ(err->desc, desc) << code;
+	err_free(err);
+	vm_free(&vm);
+}
+
+// Fills an array with small integers, so every sum and product is exact no
+// matter what order the kernels add things up in.
+static void fill(double *elements, int length, int seed) {
+	for (int i = 0; i < length; i++) {
+		elements[i] = (double) ((i * 7 + seed) % 13) - 6.0;
+	}
+}
+
+TEST(Arrays, Kernels) {
+	// Cover every combination of whole vectors and left over elements
+	for (int length = 0; length < 40; length++) {
+		double a[40], b[40], dest[40];
+		fill(a, length, 1);
+		fill(b, length, 5);
+
+		array_add(dest, a, b, (uint64_t) length);
+		for (int i = 0; i < length; i++) {
+			ASSERT_EQ(dest[i], a[i] + b[i]);
+		}
+		array_mul(dest, a, b, (uint64_t) length);
+		for (int i = 0; i < length; i++) {
+			ASSERT_EQ(dest[i], a[i] * b[i]);
+		}
+		array_scale(dest, a, 1.5, (uint64_t) length);
+		for (int i = 0; i < length; i++) {
+			ASSERT_EQ(dest[i], a[i] * 1.5);
+		}
+
+		double sum = 0.0, dot = 0.0;
+		for (int i = 0; i < length; i++) {
+			sum += a[i];
+			dot += a[i] * b[i];
+		}
+		ASSERT_EQ(array_sum(a, (uint64_t) length), sum);
+		ASSERT_EQ(array_dot(a, b, (uint64_t) length), dot);
+	}
+}
+
+TEST(Arrays, KernelsInPlace) {
+	// The destination can be one of the sources
+	double a[37], expected[37];
+	fill(a, 37, 3);
+	for (int i = 0; i < 37; i++) {
+		expected[i] = (a[i] + a[i]) * 2.0;
+	}
+	array_add(a, a, a, 37);
+	array_scale(a, a, 2.0, 37);
+	for (int i = 0; i < 37; i++) {
+		ASSERT_EQ(a[i], expected[i]);
+	}
+}
+
+TEST(Arrays, Natives) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = array(100)\n"
+		"let b = array(100)\n"
+		"let i = 0\n"
+		"while i < 100 {\n"
+		"  a[i] = i\n"
+		"  b[i] = 2\n"
+		"  i += 1\n"
+		"}\n"
+		"let c = add(a, b)\n"
+		"let d = scale(mul(a, b), 0.5)\n"
+		"let e = c[99] + d[99]\n"
+		"let total = sum(a)\n"
+		"let product = dot(a, b)\n"
+		"let n = len(c)\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[5]), 101.0 + 99.0);
+	ASSERT_EQ(v2n(vm.stack[6]), 4950.0);
+	ASSERT_EQ(v2n(vm.stack[7]), 9900.0);
+	ASSERT_EQ(v2n(vm.stack[8]), 100.0);
+
+	// New arrays are zeroed
+	Array *b = (Array *) v2ptr(vm.stack[1]);
+	ASSERT_EQ(b->shape, SHAPE_ARRAY);
+	ASSERT_EQ(b->length, 100u);
+	vm_free(&vm);
+}
+
+TEST(Arrays, AugmentedAssignment) {
+	VM vm;
+	Err *err = run(&vm,
+		"let total = 0\n"
+		"struct Box { values }\n"
+		"let box = new Box(array(3))\n"
+		"box.values[1] = 5\n"
+		"box.values[1] *= 3\n"
+		"let a = array(2)\n"
+		"a[0] += 7\n"
+		"a[a[0] - 6] = box.values[1]\n"
+		"total = a[0] + a[1]\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 22.0);
+	vm_free(&vm);
+}
+
+TEST(Arrays, Errors) {
+	expect_err("let a = array(-1)\n", "invalid array length");
+	expect_err("let a = array(1.5)\n", "invalid array length");
+	expect_err("let a = array(nil)\n", "invalid array length");
+	expect_err("let a = array(2)\nlet b = a[2]\n",
+		"array index out of bounds");
+	expect_err("let a = array(2)\nlet b = a[0.5]\n", "invalid array index");
+	expect_err("let a = array(2)\nlet b = a[-1]\n", "invalid array index");
+	expect_err("let a = array(2)\nlet b = a[nil]\n", "invalid array index");
+	expect_err("let a = 3\nlet b = a[0]\n",
+		"attempt to index non-array value");
+	expect_err("let a = array(2)\na[0] = nil\n",
+		"attempt to store non-number value in array");
+	expect_err("let a = add(array(2), array(3))\n",
+		"arrays have different lengths");
+	expect_err("let a = sum(3)\n",
+		"expected array argument to native function");
+	expect_err("let a = scale(array(2), nil)\n",
+		"expected number argument to native function");
+}
+
+TEST(Arrays, LargeArraysAreCollected) {
+	// Each array is too big for the nursery, so it goes straight into the old
+	// generation, and nothing else is ever allocated
+	VM vm;
+	Err *err = run(&vm,
+		"let total = 0\n"
+		"let i = 0\n"
+		"while i < 2000 {\n"
+		"  let a = array(10000)\n"
+		"  a[9999] = i\n"
+		"  total += a[9999]\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 1999.0 * 2000.0 / 2.0);
+	ASSERT_GT(vm.heap->major_count, 0u);
+	ASSERT_LT(vm.heap->old_bytes, 4u * GC_MIN_THRESHOLD);
+	vm_free(&vm);
+}
+
+TEST(Arrays, CompiledLoopsMatchInterpreter) {
+	// The sieve's inner loop runs inside a trace, along with the guards on
+	// every index
+	const char *code =
+		"let count = 0\n"
+		"let n = 5000\n"
+		"let composite = array(n)\n"
+		"let i = 2\n"
+		"while i < n {\n"
+		"  if composite[i] == 0 {\n"
+		"    count += 1\n"
+		"    let j = i * 2\n"
+		"    while j < n {\n"
+		"      composite[j] = 1\n"
+		"      j += i\n"
+		"    }\n"
+		"  }\n"
+		"  i += 1\n"
+		"}\n";
+	double results[2];
+	for (int jit = 0; jit < 2; jit++) {
+		VM vm;
+		Err *err = run(&vm, code, jit);
+		ASSERT_TRUE(err == NULL);
+		results[jit] = v2n(vm.stack[0]);
+		vm_free(&vm);
+	}
+	ASSERT_EQ(results[0], 669.0);
+	ASSERT_EQ(results[1], results[0]);
+}
+
+TEST(Arrays, CompiledOutOfBounds) {
+	// The bounds guard fails on the last iteration, and the interpreter
+	// reports the error
+	VM vm;
+	Err *err = run(&vm,
+		"let a = array(1000)\n"
+		"let i = 0\n"
+		"while i < 2000 {\n"
+		"  a[i] = i\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err != NULL);
+	ASSERT_STREQ(err->desc, "array index out of bounds");
+	ASSERT_EQ(v2n(vm.stack[1]), 1000.0);
+	err_free(err);
+	vm_free(&vm);
+}
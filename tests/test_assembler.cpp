@@ -0,0 +1,402 @@
+// test_assembler.cpp
+// By Ben Anderson
+// November 2018
+
+#include <gtest/gtest.h>
+#include <cmath>
+#include <cstring>
+
+extern "C" {
+	#include <parser.h>
+	#include <jit/compiler.h>
+	#include <jit/assembler.h>
+}
+
+// Stack slots used by the mock assembler to count loop iterations.
+#define COUNTER_SLOT 253
+#define LIMIT_SLOT   254
+
+// Returned by `MockAssembler::run` when the loop exits through the iteration
+// counter.
+#define DONE (-1)
+
+// Records a bytecode trace, compiles it to machine code, and runs the machine
+// code over the VM's stack, allowing us to easily assert the contents of stack
+// slots after executing the trace.
+//
+// Compiled traces keep looping until a guard fails, so the mock assembler
+// appends a counter to the end of the trace that exits the loop after a given
+// number of iterations.
+class MockAssembler {
+public:
+	VM vm;
+	Trace *trace;
+	CompiledTrace *compiled;
+	BcIns *bytecode;
+	size_t length;
+
+	// Creates a new mock assembler.
+	MockAssembler() {
+		vm = vm_new();
+		trace = jit_trace_new(&vm);
+		compiled = NULL;
+		bytecode = NULL;
+		length = 0;
+
+		// Every stack slot holds the number 0 while recording, unless a test
+		// says otherwise (a new VM's stack is filled with nil)
+		memset(vm.stack, 0, sizeof(Value) * vm.stack_size);
+	}
+
+	// Free all resources allocated by the mock assembler.
+	~MockAssembler() {
+		jit_compiled_free(compiled);
+		jit_trace_free(trace);
+		free(bytecode);
+		vm_free(&vm);
+	}
+
+	// Records a single bytecode instruction into the trace.
+	void record(BcIns ins) {
+		switch (bc_op(ins)) {
+		case BC_MOV: jit_rec_MOV(trace, ins); break;
+		case BC_SET_N: jit_rec_SET_N(trace, ins); break;
+		case BC_ADD_LL: jit_rec_ADD_LL(trace, ins); break;
+		case BC_ADD_LN: jit_rec_ADD_LN(trace, ins); break;
+		case BC_SUB_LL: jit_rec_SUB_LL(trace, ins); break;
+		case BC_SUB_LN: jit_rec_SUB_LN(trace, ins); break;
+		case BC_SUB_NL: jit_rec_SUB_NL(trace, ins); break;
+		case BC_MUL_LL: jit_rec_MUL_LL(trace, ins); break;
+		case BC_MUL_LN: jit_rec_MUL_LN(trace, ins); break;
+		case BC_DIV_LL: jit_rec_DIV_LL(trace, ins); break;
+		case BC_DIV_LN: jit_rec_DIV_LN(trace, ins); break;
+		case BC_DIV_NL: jit_rec_DIV_NL(trace, ins); break;
+		case BC_NEG: jit_rec_NEG(trace, ins); break;
+		case BC_LT_LL: jit_rec_LT_LL(trace, ins); break;
+		case BC_LT_LN: jit_rec_LT_LN(trace, ins); break;
+		case BC_EQ_LP: jit_rec_EQ_LP(trace, ins); break;
+		default: FAIL() << "instruction not supported by the mock assembler";
+		}
+	}
+
+	// Records a bytecode trace and compiles it. The trace is treated as the
+	// body of a loop whose BC_LOOP instruction lies just past the end of the
+	// bytecode (after the iteration counter), and JMPs are skipped like in
+	// the interpreter.
+	void compile(BcIns *ins, size_t count) {
+		// Append the iteration counter, which is recorded with the limit set
+		// to 1 so that it guards that the counter is less than the limit
+		uint16_t one = vm_add_num(&vm, 1.0);
+		length = count;
+		bytecode = (BcIns *) malloc(sizeof(BcIns) * (length + 4));
+		memcpy(bytecode, ins, sizeof(BcIns) * length);
+		bytecode[length] = bc_new3(BC_ADD_LN, COUNTER_SLOT, COUNTER_SLOT,
+			(uint8_t) one);
+		bytecode[length + 1] = bc_new3(BC_LT_LL, COUNTER_SLOT, LIMIT_SLOT, 0);
+		bytecode[length + 2] = bc_new1(BC_JMP, JMP_BIAS);
+		bytecode[length + 3] = bc_new1(BC_LOOP, JMP_BIAS);
+		vm.stack[COUNTER_SLOT] = n2v(0.0);
+		vm.stack[LIMIT_SLOT] = n2v(1.0);
+
+		trace->loop = &bytecode[length + 3];
+		for (size_t i = 0; i < length + 3; i++) {
+			if (bc_op(bytecode[i]) == BC_JMP) {
+				continue;
+			}
+			trace->pc = &bytecode[i];
+			record(bytecode[i]);
+		}
+		ASSERT_FALSE(trace->aborted);
+		compiled = jit_rec_finish(trace);
+		ASSERT_TRUE(compiled != NULL);
+	}
+
+	// Executes the compiled trace for at most the given number of iterations.
+	// Returns DONE if we finished all the iterations, or the index of the
+	// instruction in the original bytecode at which the interpreter would
+	// resume if a guard failed before then.
+	int run(int iterations = 1) {
+		vm.stack[COUNTER_SLOT] = n2v(0.0);
+		vm.stack[LIMIT_SLOT] = n2v((double) iterations);
+		int exit = compiled->mcode(vm.stack, vm.prog->consts);
+		EXPECT_TRUE(exit >= 0 && exit < compiled->exits_count);
+		int pc = compiled->exits[exit].pc;
+		if (pc == 0) {
+			return DONE;
+		}
+		return (int) (length + 3) + pc;
+	}
+
+	// Sets the value of a stack slot to a number.
+	void set(int slot, double num) {
+		vm.stack[slot] = n2v(num);
+	}
+
+	// Returns the value of a stack slot as a number.
+	double get(int slot) {
+		return v2n(vm.stack[slot]);
+	}
+};
+
+// Creates a new bytecode instruction.
+#define BC3(op, a, b, c) bc_new3(op, a, b, c)
+#define BC2(op, a, b) bc_new2(op, a, b)
+#define BC1(op, a) bc_new1(op, a)
+
+// Compiles a list of bytecode instructions, storing the mock assembler in a
+// variable called `mock`.
+#define COUNT_INS(...) (sizeof((uint32_t[]) {__VA_ARGS__}) / sizeof(uint32_t))
+#define COMPILE(...)                                      \
+	BcIns arr[] = {__VA_ARGS__};                          \
+	mock.compile(arr, COUNT_INS(__VA_ARGS__));
+
+TEST(Assembler, AddNumber) {
+	// a = a + 1
+	MockAssembler mock;
+	vm_add_num(&mock.vm, 1.0);
+	COMPILE(
+		BC3(BC_ADD_LN, 0, 0, 0),
+	);
+
+	mock.set(0, 3.0);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 4.0);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 5.0);
+	ASSERT_EQ(mock.run(10), DONE);
+	ASSERT_EQ(mock.get(0), 15.0);
+}
+
+TEST(Assembler, Arithmetic) {
+	// a = (b - a) * c
+	// b = 10 / a
+	MockAssembler mock;
+	vm_add_num(&mock.vm, 10.0);
+	COMPILE(
+		BC3(BC_SUB_LL, 3, 1, 0),
+		BC3(BC_MUL_LL, 0, 3, 2),
+		BC3(BC_DIV_NL, 1, 0, 0),
+	);
+
+	mock.set(0, 1.0);
+	mock.set(1, 3.0);
+	mock.set(2, 5.0);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 10.0);
+	ASSERT_EQ(mock.get(1), 1.0);
+	ASSERT_EQ(mock.get(2), 5.0);
+	ASSERT_EQ(mock.get(3), 2.0);
+
+	mock.set(0, 1.0);
+	mock.set(1, 3.0);
+	ASSERT_EQ(mock.run(2), DONE);
+	ASSERT_EQ(mock.get(0), -45.0);
+	ASSERT_EQ(mock.get(1), 10.0 / -45.0);
+	ASSERT_EQ(mock.get(3), -9.0);
+}
+
+TEST(Assembler, NonCommutativeOperandOrder) {
+	// a = b - a
+	// b = b / a
+	MockAssembler mock;
+	COMPILE(
+		BC3(BC_SUB_LL, 0, 1, 0),
+		BC3(BC_DIV_LL, 1, 1, 0),
+	);
+
+	mock.set(0, 2.0);
+	mock.set(1, 8.0);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 6.0);
+	ASSERT_EQ(mock.get(1), 8.0 / 6.0);
+}
+
+TEST(Assembler, NegationAndMoves) {
+	// b = -a
+	// c = b
+	// a = 2
+	MockAssembler mock;
+	vm_add_num(&mock.vm, 2.0);
+	COMPILE(
+		BC2(BC_NEG, 1, 0),
+		BC2(BC_MOV, 2, 1),
+		BC2(BC_SET_N, 0, 0),
+	);
+
+	mock.set(0, 3.0);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 2.0);
+	ASSERT_EQ(mock.get(1), -3.0);
+	ASSERT_EQ(mock.get(2), -3.0);
+
+	ASSERT_EQ(mock.run(3), DONE);
+	ASSERT_EQ(mock.get(0), 2.0);
+	ASSERT_EQ(mock.get(1), -2.0);
+	ASSERT_EQ(mock.get(2), -2.0);
+}
+
+TEST(Assembler, SwapLocals) {
+	// c = a
+	// a = b
+	// b = c
+	MockAssembler mock;
+	COMPILE(
+		BC2(BC_MOV, 2, 0),
+		BC2(BC_MOV, 0, 1),
+		BC2(BC_MOV, 1, 2),
+	);
+
+	mock.set(0, 1.0);
+	mock.set(1, 2.0);
+	ASSERT_EQ(mock.run(3), DONE);
+	ASSERT_EQ(mock.get(0), 2.0);
+	ASSERT_EQ(mock.get(1), 1.0);
+	ASSERT_EQ(mock.get(2), 1.0);
+	ASSERT_EQ(mock.run(4), DONE);
+	ASSERT_EQ(mock.get(0), 2.0);
+	ASSERT_EQ(mock.get(1), 1.0);
+	ASSERT_EQ(mock.get(2), 1.0);
+}
+
+TEST(Assembler, HighRegisters) {
+	// Keep enough values live across the loop that we need xmm8 and above,
+	// which require REX/VEX register extensions
+	MockAssembler mock;
+	COMPILE(
+		BC3(BC_ADD_LL, 10, 0, 0),
+		BC3(BC_ADD_LL, 11, 1, 1),
+		BC3(BC_ADD_LL, 0, 10, 0),
+		BC3(BC_ADD_LL, 1, 11, 1),
+	);
+
+	mock.set(0, 1.0);
+	mock.set(1, 2.0);
+	ASSERT_EQ(mock.run(2), DONE);
+	ASSERT_EQ(mock.get(0), 9.0);
+	ASSERT_EQ(mock.get(1), 18.0);
+	ASSERT_EQ(mock.get(10), 6.0);
+	ASSERT_EQ(mock.get(11), 12.0);
+}
+
+TEST(Assembler, Spilling) {
+	// Keep more values live across the loop than there are registers, so
+	// some of them have to be spilled. Each local is added to the next one:
+	//   a = a + b
+	//   b = b + c
+	//   ...
+	MockAssembler mock;
+	const int count = 20;
+	BcIns arr[count];
+	for (int i = 0; i < count; i++) {
+		arr[i] = BC3(BC_ADD_LL, (uint8_t) i, (uint8_t) i,
+			(uint8_t) ((i + 1) % count));
+	}
+	mock.compile(arr, count);
+
+	double expected[count];
+	for (int i = 0; i < count; i++) {
+		expected[i] = (double) i;
+		mock.set(i, (double) i);
+	}
+	for (int iteration = 0; iteration < 5; iteration++) {
+		for (int i = 0; i < count; i++) {
+			expected[i] += expected[(i + 1) % count];
+		}
+	}
+
+	ASSERT_EQ(mock.run(5), DONE);
+	for (int i = 0; i < count; i++) {
+		ASSERT_EQ(mock.get(i), expected[i]);
+	}
+}
+
+TEST(Assembler, SideExit) {
+	// a = a + 1
+	// if a < 10 { b = b + 1 }, recorded with a < 10
+	MockAssembler mock;
+	vm_add_num(&mock.vm, 1.0);
+	vm_add_num(&mock.vm, 10.0);
+	mock.set(0, 0.0);
+	mock.set(1, 0.0);
+	COMPILE(
+		BC3(BC_ADD_LN, 0, 0, 0),
+		BC3(BC_LT_LN, 0, 1, 0),
+		BC1(BC_JMP, JMP_BIAS),
+		BC3(BC_ADD_LN, 1, 1, 0),
+	);
+
+	// Stay on the trace
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 1.0);
+	ASSERT_EQ(mock.get(1), 1.0);
+
+	// Leave the trace in the peeled iteration, writing back only the locals
+	// modified before the guard
+	mock.set(0, 9.0);
+	ASSERT_EQ(mock.run(5), 3);
+	ASSERT_EQ(mock.get(0), 10.0);
+	ASSERT_EQ(mock.get(1), 1.0);
+
+	// Leave the trace from the loop body, which writes back every local
+	// modified by the loop
+	mock.set(0, 0.0);
+	mock.set(1, 0.0);
+	ASSERT_EQ(mock.run(100), 3);
+	ASSERT_EQ(mock.get(0), 10.0);
+	ASSERT_EQ(mock.get(1), 9.0);
+
+	// The interpreter takes the JMP for NaN too, so we stay on the trace
+	mock.set(0, NAN);
+	ASSERT_EQ(mock.run(), DONE);
+}
+
+TEST(Assembler, PrimitiveGuard) {
+	// if a == nil { exit loop }
+	MockAssembler mock;
+	mock.vm.stack[0] = TAG_PRIM | PRIM_FALSE;
+	COMPILE(
+		BC3(BC_EQ_LP, 0, PRIM_NIL, 0),
+		BC1(BC_JMP, JMP_BIAS + 1),
+	);
+
+	ASSERT_EQ(mock.run(3), DONE);
+	mock.vm.stack[0] = TAG_PRIM | PRIM_NIL;
+	ASSERT_EQ(mock.run(), 3);
+}
+
+TEST(Assembler, TypeGuard) {
+	// a = a + 1, recorded with a number in a
+	MockAssembler mock;
+	vm_add_num(&mock.vm, 1.0);
+	mock.set(0, 0.0);
+	COMPILE(
+		BC3(BC_ADD_LN, 0, 0, 0),
+	);
+	ASSERT_EQ(mock.run(), DONE);
+	ASSERT_EQ(mock.get(0), 1.0);
+
+	// If a isn't a number, we leave the trace before the addition
+	mock.vm.stack[0] = TAG_PRIM | PRIM_NIL;
+	ASSERT_EQ(mock.run(), 0);
+	ASSERT_EQ(mock.vm.stack[0], TAG_PRIM | PRIM_NIL);
+	mock.vm.stack[0] = TAG_FN | 1;
+	ASSERT_EQ(mock.run(), 0);
+}
+
+TEST(TraceCache, InsertAndLookup) {
+	VM vm = vm_new();
+	BcIns loops[64];
+	CompiledTrace *traces[64];
+	for (int i = 0; i < 64; i++) {
+		traces[i] = (CompiledTrace *) calloc(1, sizeof(CompiledTrace));
+		jit_cache_insert(vm.prog->jit, 0, &loops[i], traces[i]);
+	}
+	for (int i = 0; i < 64; i++) {
+		ASSERT_EQ(jit_cache_lookup(vm.prog->jit, 0, &loops[i]), traces[i]);
+
+		// A loop at the same address in a different function isn't the same
+		// loop
+		ASSERT_TRUE(jit_cache_lookup(vm.prog->jit, 1, &loops[i]) == NULL);
+	}
+	vm_free(&vm);
+}
@@ -4,9 +4,18 @@
 // October 2018
 
 #include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
 
 extern "C" {
+	#include <parser.h>
+	#include <util.h>
 	#include <jit/compiler.h>
+	#include <jit/perf.h>
+	#include <array.h>
 }
 
 // Compiles a bytecode trace into IR and iterates over the output, allowing us
@@ -18,11 +27,19 @@ public:
 	Trace *trace;
 	size_t cur_ins;
 
-	// Compiles a bytecode trace into IR.
-	MockCompiler(BcIns *bytecode, size_t trace_length) {
+	// Creates a mock compiler with an empty trace.
+	MockCompiler() {
 		vm = vm_new();
 		cur_ins = 1; // Start from 1 as per ir.h
 		trace = jit_trace_new(&vm);
+
+		// Every stack slot holds the number 0 unless a test says otherwise,
+		// which determines the type guards emitted for stack loads
+		memset(vm.stack, 0, sizeof(Value) * vm.stack_size);
+	}
+
+	// Compiles a bytecode trace into IR.
+	MockCompiler(BcIns *bytecode, size_t trace_length) : MockCompiler() {
 		compile(bytecode, trace_length);
 	}
 
@@ -32,9 +49,16 @@ public:
 		vm_free(&vm);
 	}
 
-	// Compile a bytecode trace into IR.
+	// Compile a bytecode trace into IR. The trace is treated as the body of a
+	// loop whose BC_LOOP instruction lies just past the end of the bytecode.
+	// JMPs are skipped, since the interpreter doesn't record them either.
 	void compile(BcIns *bytecode, size_t bytecode_length) {
+		trace->loop = &bytecode[bytecode_length];
 		for (size_t i = 0; i < bytecode_length; i++) {
+			if (bc_op(bytecode[i]) == BC_JMP) {
+				continue;
+			}
+			trace->pc = &bytecode[i];
 			compile_ins(bytecode[i]);
 		}
 	}
@@ -77,8 +101,18 @@ public:
 		case BC_GE_LL: jit_rec_GE_LL(trace, ins); break;
 		case BC_GE_LN: jit_rec_GE_LN(trace, ins); break;
 
+		// Structs
+		case BC_NEW: jit_rec_NEW(trace, ins); break;
+		case BC_GET_FIELD: jit_rec_GET_FIELD(trace, ins); break;
+		case BC_SET_FIELD: jit_rec_SET_FIELD(trace, ins); break;
+
+		// Arrays
+		case BC_GET_INDEX: jit_rec_GET_INDEX(trace, ins); break;
+		case BC_SET_INDEX: jit_rec_SET_INDEX(trace, ins); break;
+
 		// Control flow
 		case BC_CALL: jit_rec_CALL(trace, ins); break;
+		case BC_CALL_NATIVE: jit_rec_CALL_NATIVE(trace, ins); break;
 		case BC_RET: jit_rec_RET(trace, ins); break;
 
 		// Instruction not allowed in a trace
@@ -86,6 +120,14 @@ public:
 		}
 	}
 
+	// Peels the loop and assembles the trace, leaving the optimised IR behind
+	// for us to assert.
+	void finish() {
+		CompiledTrace *compiled = jit_rec_finish(trace);
+		ASSERT_TRUE(compiled != NULL);
+		jit_compiled_free(compiled);
+	}
+
 	// Dump the compiled IR to the standard output.
 	void dump() {
 		jit_trace_dump(trace);
@@ -126,8 +168,10 @@ TEST(Arithmetic, AddLocals) {
 	);
 
 	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
 	INS(IR_LOAD_STACK, 1, 0);
-	INS(IR_ADD, 1, 2);
+	INS(IR_IS_NUM, 3, 0);
+	INS(IR_ADD, 1, 3);
 }
 
 TEST(Arithmetic, AddNumbers) {
@@ -137,8 +181,9 @@ TEST(Arithmetic, AddNumbers) {
 	);
 
 	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
 	INS(IR_LOAD_CONST, 0, 0);
-	INS(IR_ADD, 1, 2);
+	INS(IR_ADD, 1, 3);
 }
 
 TEST(Arithmetic, NumReuse) {
@@ -149,9 +194,10 @@ TEST(Arithmetic, NumReuse) {
 	);
 
 	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
 	INS(IR_LOAD_CONST, 0, 0);
-	INS(IR_ADD, 1, 2);
-	INS(IR_ADD, 3, 2);
+	INS(IR_ADD, 1, 3);
+	INS(IR_ADD, 4, 3);
 }
 
 TEST(Arithemtic, LocalReuse) {
@@ -162,10 +208,11 @@ TEST(Arithemtic, LocalReuse) {
 	);
 
 	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
 	INS(IR_LOAD_CONST, 0, 0);
-	INS(IR_ADD, 1, 2);
+	INS(IR_ADD, 1, 3);
 	INS(IR_LOAD_CONST, 1, 0);
-	INS(IR_ADD, 3, 4);
+	INS(IR_ADD, 4, 5);
 }
 
 TEST(Arithmetic, MultipleLocals) {
@@ -176,9 +223,647 @@ TEST(Arithmetic, MultipleLocals) {
 	);
 
 	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
 	INS(IR_LOAD_CONST, 0, 0);
-	INS(IR_ADD, 1, 2);
+	INS(IR_ADD, 1, 3);
 	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 5, 0);
 	INS(IR_LOAD_CONST, 1, 0);
-	INS(IR_ADD, 4, 5);
+	INS(IR_ADD, 5, 7);
+}
+
+TEST(Guards, FollowsRecordedBranch) {
+	// while a < 10 and a >= 10 { ... }, recorded with a = 3
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 10.0);
+	mock.vm.stack[0] = n2v(3.0);
+	BcIns arr[] = {
+		BC3(BC_LT_LN, 0, 0, 0),
+		BC1(BC_JMP, JMP_BIAS + 4),
+		BC3(BC_GE_LN, 0, 0, 0),
+		BC1(BC_JMP, JMP_BIAS + 1),
+	};
+	mock.compile(arr, 4);
+
+	// The first JMP was taken while recording, so we guard that it's taken
+	// again; the second wasn't
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_ULT, 1, 3);
+	INS(IR_LT, 1, 3);
+
+	// If the type guard fails, we re-execute the first comparison in the
+	// interpreter. If the first comparison's guard fails, we resume just
+	// after its JMP, and if the second fails, at its JMP's target (all
+	// relative to the BC_LOOP instruction just past the end of the trace)
+	ASSERT_EQ(mock.trace->snaps_count, 3);
+	ASSERT_EQ(mock.trace->snaps[0].guard, 2);
+	ASSERT_EQ(mock.trace->snaps[0].pc, -4);
+	ASSERT_EQ(mock.trace->snaps[1].guard, 4);
+	ASSERT_EQ(mock.trace->snaps[1].pc, -2);
+	ASSERT_EQ(mock.trace->snaps[2].guard, 5);
+	ASSERT_EQ(mock.trace->snaps[2].pc, 1);
+}
+
+TEST(Guards, TypeGuards) {
+	// b = a c = d == nil, recorded with a function in a and nil in d
+	MockCompiler mock;
+	mock.vm.stack[0] = TAG_FN | 2;
+	mock.vm.stack[3] = TAG_PRIM | PRIM_NIL;
+	BcIns arr[] = {
+		BC2(BC_MOV, 1, 0),
+		BC3(BC_EQ_LP, 3, PRIM_NIL, 0),
+		BC1(BC_JMP, JMP_BIAS + 1),
+	};
+	mock.compile(arr, 3);
+
+	// The first load of each slot checks its type, so the guard fails if the
+	// slot holds something else when we enter the trace
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_FN, 1, 0);
+	INS(IR_LOAD_STACK, 3, 0);
+	INS(IR_IS_PRIM, 3, 0);
+	INS(IR_LOAD_PRIM, PRIM_NIL, 0);
+	INS(IR_EQ, 3, 5);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Guards, ArithmeticOnNonNumberAborts) {
+	// a = a + 1, recorded with nil in a
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 1.0);
+	mock.vm.stack[0] = TAG_PRIM | PRIM_NIL;
+	BcIns arr[] = {
+		BC3(BC_ADD_LN, 0, 0, 0),
+	};
+	mock.compile(arr, 1);
+	ASSERT_TRUE(mock.trace->aborted);
+}
+
+TEST(Loop, Phis) {
+	// let a = 0 let b = 3 while true { b = b * 2 a = a + b }
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 2.0);
+	BcIns arr[] = {
+		BC3(BC_MUL_LN, 1, 1, 0),
+		BC3(BC_ADD_LL, 0, 0, 1),
+	};
+	mock.compile(arr, 2);
+	mock.finish();
+
+	// The loop body uses the values from the previous iteration rather than
+	// reloading them from the stack, and there's a PHI for each modified slot.
+	// The values are already known to be numbers, so there are no type guards
+	// in the loop body
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_MUL, 1, 3);
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 5, 0);
+	INS(IR_ADD, 5, 4);
+	INS(IR_LOOP, 0, 0);
+	INS(IR_MUL, 4, 3);
+	INS(IR_ADD, 7, 9);
+	INS(IR_PHI, 7, 10);
+	INS(IR_PHI, 4, 9);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Loop, InvariantCode) {
+	// let a = 0 let b = 3 while true { c = b * 2 a = a + c }
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 2.0);
+	BcIns arr[] = {
+		BC3(BC_MUL_LN, 2, 1, 0),
+		BC3(BC_ADD_LL, 0, 0, 2),
+	};
+	mock.compile(arr, 2);
+	mock.finish();
+
+	// The multiplication doesn't change between iterations, so it only
+	// appears in the peeled iteration
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_MUL, 1, 3);
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 5, 0);
+	INS(IR_ADD, 5, 4);
+	INS(IR_LOOP, 0, 0);
+	INS(IR_ADD, 7, 4);
+	INS(IR_PHI, 7, 9);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Optimisation, ConstantFolding) {
+	// a = 2 b = a + 3 c = -b
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 2.0);
+	vm_add_num(&mock.vm, 3.0);
+	BcIns arr[] = {
+		BC2(BC_SET_N, 0, 0),
+		BC3(BC_ADD_LN, 1, 0, 1),
+		BC2(BC_NEG, 2, 1),
+	};
+	mock.compile(arr, 3);
+
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_LOAD_CONST, 1, 0);
+	INS(IR_LOAD_CONST, 2, 0);
+	INS(IR_LOAD_CONST, 3, 0);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+	ASSERT_EQ(v2n(mock.vm.prog->consts[2]), 5.0);
+	ASSERT_EQ(v2n(mock.vm.prog->consts[3]), -5.0);
+}
+
+TEST(Optimisation, CommonSubexpressions) {
+	// c = a * b d = a * b e = c + d
+	MOCK(
+		BC3(BC_MUL_LL, 2, 0, 1),
+		BC3(BC_MUL_LL, 3, 0, 1),
+		BC3(BC_ADD_LL, 4, 2, 3),
+	);
+
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 3, 0);
+	INS(IR_MUL, 1, 3);
+	INS(IR_ADD, 5, 5);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Optimisation, FreshTraceState) {
+	MOCK(
+		BC3(BC_MUL_LL, 2, 0, 1),
+		BC3(BC_ADD_LN, 3, 3, 0),
+	);
+
+	// A new trace re-uses the memory of the last one, but none of its state
+	Trace *old = mock.trace;
+	jit_trace_free(mock.trace);
+	mock.trace = jit_trace_new(&mock.vm);
+	ASSERT_EQ(mock.trace, old);
+	ASSERT_EQ(mock.trace->slots_count, 0);
+	BcIns second[] = {
+		BC3(BC_ADD_LN, 3, 3, 0),
+		BC3(BC_MUL_LL, 2, 0, 1),
+	};
+	mock.compile(second, 2);
+
+	INS(IR_LOAD_STACK, 3, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_ADD, 1, 3);
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 5, 0);
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 7, 0);
+	INS(IR_MUL, 5, 7);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+	ASSERT_EQ(mock.trace->slots_count, 4);
+	ASSERT_EQ(mock.trace->last_modified[2], 9);
+	ASSERT_EQ(mock.trace->last_modified[3], 4);
+}
+
+TEST(Optimisation, DeadCode) {
+	// while true { c = a * b c = 1 a = a + 1 }
+	MockCompiler mock;
+	vm_add_num(&mock.vm, 1.0);
+	BcIns arr[] = {
+		BC3(BC_MUL_LL, 2, 0, 1),
+		BC2(BC_SET_N, 2, 0),
+		BC3(BC_ADD_LN, 0, 0, 0),
+	};
+	mock.compile(arr, 3);
+	mock.finish();
+
+	// The multiplication (and its copy in the loop body) is overwritten
+	// before anything can see it. The stack loads are still checked by their
+	// type guards
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_NUM, 1, 0);
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 3, 0);
+	INS(IR_NOP, 0, 0);
+	INS(IR_LOAD_CONST, 0, 0);
+	INS(IR_ADD, 1, 6);
+	INS(IR_LOOP, 0, 0);
+	INS(IR_NOP, 0, 0);
+	INS(IR_ADD, 7, 6);
+	INS(IR_PHI, 7, 10);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Optimisation, FoldingGrowsConstants) {
+	// Folding `b * 3` in the peeled loop adds a new constant. We pad the
+	// program with extra constants so that, for one of these runs, the
+	// constants list is full when the trace is optimised and has to move
+	for (int extra = 0; extra < 16; extra++) {
+		std::string code =
+			"let a = 0\n"
+			"let b = 2\n"
+			"let c = 0\n"
+			"let i = 0\n";
+		for (int j = 0; j < extra; j++) {
+			code += "let x" + std::to_string(j) + " = " +
+				std::to_string(1000 + j) + "\n";
+		}
+		code +=
+			"while i < 1000 {\n"
+			"  c = b * 3\n"
+			"  b = 7\n"
+			"  a = a + c\n"
+			"  i += 1\n"
+			"}\n";
+
+		VM vm = vm_new();
+		int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+		Err *err = vm_run_string(&vm, pkg, (char *) code.c_str());
+		ASSERT_TRUE(err == NULL);
+		ASSERT_EQ(v2n(vm.stack[0]), 6.0 + 999.0 * 21.0) << extra;
+		vm_free(&vm);
+	}
+}
+
+TEST(Calls, InlineCall) {
+	// a(b), where a = fn(x, y) { let z = x + x return z }
+	MockCompiler mock;
+	int pkg = vm_new_pkg(&mock.vm, hash_string("test", 4));
+	int fn_idx = vm_new_fn(&mock.vm, pkg);
+	mock.vm.prog->fns[fn_idx].args_count = 2;
+	mock.vm.stack[0] = TAG_FN | fn_idx;
+	BcIns arr[] = {
+		BC3(BC_CALL, 0, 1, 1),
+		BC3(BC_ADD_LL, 2, 0, 0),
+		BC3(BC_RET, 2, 1, 0),
+	};
+	mock.compile(arr, 3);
+
+	// We guard the function we're calling, then record its body in a stack
+	// frame starting at the first argument's slot
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_FN, 1, 0);
+	INS(IR_LOAD_FN, fn_idx, 0);
+	INS(IR_EQ, 1, 3);
+	INS(IR_LOAD_PRIM, PRIM_NIL, 0);
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 6, 0);
+	INS(IR_ADD, 6, 6);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+
+	// The missing argument is nil, and the return value ends up in the first
+	// argument's slot
+	ASSERT_EQ(mock.trace->depth, 0);
+	ASSERT_EQ(mock.trace->last_modified[2], 5);
+	ASSERT_EQ(mock.trace->last_modified[1], 8);
+
+	// A guard inside the call resumes at the CALL, with the stack as it was
+	// before the call
+	ASSERT_EQ(mock.trace->snaps_count, 3);
+	ASSERT_EQ(mock.trace->snaps[2].guard, 7);
+	ASSERT_EQ(mock.trace->snaps[2].pc, -3);
+	ASSERT_EQ(mock.trace->snaps[2].entries_count, 0);
+}
+
+TEST(Calls, CallInLoop) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"let add = fn(x, y) {\n"
+		"  return x + y\n"
+		"}\n"
+		"let i = 0\n"
+		"while i < 1000 {\n"
+		"  a = add(a, 3)\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 3000.0);
+	vm_free(&vm);
+}
+
+TEST(Calls, DeepRecursion) {
+	// Recursing this deep needs a much larger stack than we start with
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"let sum = fn(f, n) {\n"
+		"  if n == 0 {\n"
+		"    return 0\n"
+		"  }\n"
+		"  return n + f(f, n - 1)\n"
+		"}\n"
+		"a = sum(sum, 10000)\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 50005000.0);
+	ASSERT_GT(vm.stack_size, INITIAL_STACK_SIZE);
+	vm_free(&vm);
+}
+
+TEST(Structs, FieldsInLoop) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"struct Counter { count, step }\n"
+		"let c = new Counter(0, 2)\n"
+		"let i = 0\n"
+		"while i < 1000 {\n"
+		"  c.count = c.count + c.step\n"
+		"  i += 1\n"
+		"}\n"
+		"a = c.count\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 2000.0);
+	vm_free(&vm);
+}
+
+TEST(Arrays, ElementGuards) {
+	// b = a[i] c = a[i], recorded with an array of 4 elements in a and 2 in i
+	MockCompiler mock;
+	Array *array = array_new(&mock.vm, 4, mock.vm.stack + 4);
+	mock.vm.stack[0] = ptr2v(array);
+	mock.vm.stack[1] = n2v(2.0);
+	BcIns arr[] = {
+		BC3(BC_GET_INDEX, 2, 0, 1),
+		BC3(BC_GET_INDEX, 3, 0, 1),
+	};
+	mock.compile(arr, 2);
+
+	// The guards and the element's address are only emitted once, but the
+	// element is loaded again, since a store could have changed it
+	INS(IR_LOAD_STACK, 0, 0);
+	INS(IR_IS_PTR, 1, 0);
+	INS(IR_IS_ARRAY, 1, 0);
+	INS(IR_LOAD_STACK, 1, 0);
+	INS(IR_IS_NUM, 4, 0);
+	INS(IR_IS_INT, 4, 0);
+	INS(IR_IN_BOUNDS, 1, 4);
+	INS(IR_AREF, 1, 4);
+	INS(IR_LOAD_FIELD, 8, 0);
+	INS(IR_LOAD_FIELD, 8, 0);
+	ASSERT_EQ(mock.cur_ins, mock.trace->ir_count);
+}
+
+TEST(Arrays, InvalidAccessAborts) {
+	// b = a[i], recorded with i past the end of the array
+	MockCompiler mock;
+	Array *array = array_new(&mock.vm, 4, mock.vm.stack + 4);
+	mock.vm.stack[0] = ptr2v(array);
+	mock.vm.stack[1] = n2v(4.0);
+	BcIns arr[] = {
+		BC3(BC_GET_INDEX, 2, 0, 1),
+	};
+	mock.compile(arr, 1);
+	ASSERT_TRUE(mock.trace->aborted);
+}
+
+TEST(Arrays, ElementsInLoop) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"let sums = array(1000)\n"
+		"let i = 1\n"
+		"while i < 1000 {\n"
+		"  sums[i] = sums[i - 1] + i\n"
+		"  i += 1\n"
+		"}\n"
+		"a = sums[999]\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 999.0 * 1000.0 / 2.0);
+	vm_free(&vm);
+}
+
+TEST(HotLoops, BlacklistAbortingLoop) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+
+	// Recording always aborts on the SET_F, so we should back off a few times
+	// and then give up on the loop entirely
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let i = 0\n"
+		"while i < 2000 {\n"
+		"  let f = fn() {}\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+
+	int main_fn = vm.prog->pkgs[pkg].main_fn;
+	Function *fn = &vm.prog->fns[main_fn];
+	ASSERT_EQ(fn->loops_count, 1);
+	HotLoop *hot = vm_hot_loop(&vm, main_fn, &fn->ins[fn->loops[0].ins]);
+	ASSERT_EQ(hot->aborts, JIT_MAX_ABORTS);
+	ASSERT_EQ(bc_op(fn->ins[hot->ins]), BC_JMP);
+	ASSERT_EQ(bc_op(fn->ins[hot->ins - 1]), BC_ADD_LN);
+	vm_free(&vm);
+}
+
+TEST(SideTraces, BranchyLoop) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+
+	// Both branches of each `if` are taken over and over again, so the exits
+	// for the branches the root trace didn't record get side traces, and so
+	// does the exit from the first side trace
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"let t = 0\n"
+		"let u = 0\n"
+		"let i = 0\n"
+		"while i < 3000 {\n"
+		"  if t == 0 {\n"
+		"    t = 1\n"
+		"    a = a + 1\n"
+		"  } else {\n"
+		"    t = 0\n"
+		"    a = a + 2\n"
+		"    if u == 0 { u = 1 } else { u = 0\n a = a + 4 }\n"
+		"  }\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 7500.0);
+
+	int main_fn = vm.prog->pkgs[pkg].main_fn;
+	Function *fn = &vm.prog->fns[main_fn];
+	ASSERT_EQ(fn->loops_count, 1);
+	CompiledTrace *root = jit_cache_lookup(vm.prog->jit, main_fn,
+		&fn->ins[fn->loops[0].ins]);
+	ASSERT_TRUE(root != NULL);
+	ASSERT_GE(root->side_traces_count, 2);
+	vm_free(&vm);
+}
+
+TEST(SideTraces, SlotAssignedBack) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+
+	// `x` is modified before the `if`, but holds its loaded value again by the
+	// end of each iteration. The exit from the `if` in the loop body still has
+	// to write back the modified `x`, and the current values of the slots
+	// after it
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let x = 5\n"
+		"let a = 0\n"
+		"let i = 0\n"
+		"while i < 1000 {\n"
+		"  let t = x\n"
+		"  x = x + 1\n"
+		"  a = a + 1\n"
+		"  if i == 700 { a = a + 100 }\n"
+		"  x = t\n"
+		"  i += 1\n"
+		"}\n"
+		"x = a\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 1100.0);
+	vm_free(&vm);
+}
+
+TEST(CompileThread, BranchyLoop) {
+	VM vm = vm_new();
+	vm.jit_thread = true;
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+
+	// The same loop as above, with its root and side traces compiled on the
+	// compile thread while the interpreter keeps running it. How many side
+	// traces get attached depends on how quickly the thread gets to them
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"let t = 0\n"
+		"let u = 0\n"
+		"let i = 0\n"
+		"while i < 30000 {\n"
+		"  if t == 0 {\n"
+		"    t = 1\n"
+		"    a = a + 1\n"
+		"  } else {\n"
+		"    t = 0\n"
+		"    a = a + 2\n"
+		"    if u == 0 { u = 1 } else { u = 0\n a = a + 4 }\n"
+		"  }\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 75000.0);
+	ASSERT_TRUE(vm.jit_worker != NULL);
+
+	// Every trace handed to the compile thread is installed by the time
+	// `vm_run_string` returns
+	ASSERT_TRUE(jit_poll(&vm, false) == NULL);
+	int main_fn = vm.prog->pkgs[pkg].main_fn;
+	Function *fn = &vm.prog->fns[main_fn];
+	ASSERT_EQ(fn->loops_count, 1);
+	CompiledTrace *root = jit_cache_lookup(vm.prog->jit, main_fn,
+		&fn->ins[fn->loops[0].ins]);
+	ASSERT_TRUE(root != NULL);
+	vm_free(&vm);
+}
+
+TEST(SharedProgram, Threads) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = parse(&vm, pkg, NULL, (char *)
+		"let a = 0\n"
+		"let i = 0\n"
+		"while i < 20000 {\n"
+		"  if i < 10000 { a = a + 1 } else { a = a + 2 }\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_TRUE(vm_freeze(&vm) == NULL);
+
+	// No more code can be loaded once the program's frozen
+	err = vm_run_string(&vm, pkg, (char *) "let b = 1\n");
+	ASSERT_TRUE(err != NULL);
+	err_free(err);
+
+	// Run the package on several VMs at once, half of which compile their
+	// traces on a compile thread
+	const int count = 4;
+	std::vector<VM> vms;
+	for (int i = 0; i < count; i++) {
+		vms.push_back(vm_new_shared(&vm));
+		vms[i].jit_thread = i % 2 == 1;
+	}
+	std::vector<Err *> errs(count, NULL);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < count; i++) {
+		threads.push_back(std::thread([&vms, &errs, pkg, i]() {
+			errs[i] = vm_run_pkg(&vms[i], pkg);
+		}));
+	}
+	for (int i = 0; i < count; i++) {
+		threads[i].join();
+		ASSERT_TRUE(errs[i] == NULL);
+		ASSERT_EQ(v2n(vms[i].stack[0]), 30000.0);
+	}
+
+	// Every VM uses the same trace for the loop
+	int main_fn = vm.prog->pkgs[pkg].main_fn;
+	Function *fn = &vm.prog->fns[main_fn];
+	ASSERT_EQ(fn->loops_count, 1);
+	ASSERT_TRUE(jit_cache_lookup(vm.prog->jit, main_fn,
+		&fn->ins[fn->loops[0].ins]) != NULL);
+	ASSERT_EQ(vm.prog->jit->traces_count, 1);
+
+	// The program's freed along with the last VM using it
+	vm_free(&vm);
+	for (int i = 0; i < count; i++) {
+		vm_free(&vms[i]);
+	}
+}
+
+TEST(PerfMap, NamesTraces) {
+	VM vm = vm_new();
+	ASSERT_TRUE(vm_open_perf_map(&vm) == NULL);
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = vm_run_string(&vm, pkg,
+		(char *) "let a = 0\n"
+		"while a < 1000 {\n"
+		"  a = a + 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+
+	int main_fn = vm.prog->pkgs[pkg].main_fn;
+	Function *fn = &vm.prog->fns[main_fn];
+	CompiledTrace *root = jit_cache_lookup(vm.prog->jit, main_fn,
+		&fn->ins[fn->loops[0].ins]);
+	ASSERT_TRUE(root != NULL);
+	uintptr_t mcode = (uintptr_t) root->mcode;
+	int loop = fn->loops[0].ins;
+	vm_free(&vm);
+
+	// The map has a line for the trace, starting at its machine code
+	char path[64];
+	perf_map_path(path, sizeof(path));
+	FILE *f = fopen(path, "r");
+	ASSERT_TRUE(f != NULL);
+	char line[256];
+	ASSERT_TRUE(fgets(line, sizeof(line), f) != NULL);
+	fclose(f);
+	remove(path);
+
+	char expected[64];
+	snprintf(expected, sizeof(expected), "%llx ", (unsigned long long) mcode);
+	ASSERT_EQ(std::string(line).find(expected), 0u);
+	snprintf(expected, sizeof(expected), " hy:fn_%d:loop_%04d\n", main_fn,
+		loop);
+	ASSERT_NE(std::string(line).find(expected), std::string::npos);
 }
@@ -0,0 +1,131 @@
+// test_gc.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+
+#include "test_run.h"
+
+extern "C" {
+	#include <gc.h>
+	#include <object.h>
+}
+
+TEST(GC, DeadObjectsStayInNursery) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = 0\n"
+		"struct Box { value }\n"
+		"let i = 0\n"
+		"while i < 100000 {\n"
+		"  let box = new Box(i)\n"
+		"  a = box.value\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 99999.0);
+	ASSERT_GT(vm.heap->minor_count, 0u);
+	ASSERT_LT(vm.heap->old_bytes, 1024u);
+	vm_free(&vm);
+}
+
+TEST(GC, SurvivorsArePromoted) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = 0\n"
+		"struct Node { value, next }\n"
+		"let list = nil\n"
+		"let i = 0\n"
+		"while i < 50000 {\n"
+		"  list = new Node(i, list)\n"
+		"  i += 1\n"
+		"}\n"
+		"while list != nil {\n"
+		"  a += list.value\n"
+		"  list = list.next\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 49999.0 * 50000.0 / 2.0);
+	ASSERT_GT(vm.heap->minor_count, 0u);
+	vm_free(&vm);
+}
+
+TEST(GC, MajorCollectionsFreeOldObjects) {
+	// Each list survives a few minor collections before it's dropped
+	VM vm;
+	Err *err = run(&vm,
+		"let a = 0\n"
+		"struct Node { value, next }\n"
+		"let j = 0\n"
+		"while j < 200 {\n"
+		"  let list = nil\n"
+		"  let i = 0\n"
+		"  while i < 5000 {\n"
+		"    list = new Node(i, list)\n"
+		"    i += 1\n"
+		"  }\n"
+		"  a += list.value\n"
+		"  j += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 4999.0 * 200.0);
+	ASSERT_GT(vm.heap->major_count, 0u);
+	ASSERT_LT(vm.heap->old_bytes, 4u * GC_MIN_THRESHOLD);
+
+	// Only the last list is still on the stack
+	gc_full(&vm, stack_top(&vm));
+	ASSERT_LE(vm.heap->old_bytes, 2u * 5000u * (sizeof(Object) + 16));
+	vm_free(&vm);
+}
+
+TEST(GC, WriteBarrier) {
+	// The box is promoted by the first minor collection, and then only points
+	// into the nursery
+	const char *code =
+		"let a = 0\n"
+		"struct Box { value }\n"
+		"let root = new Box(nil)\n"
+		"let i = 0\n"
+		"while i < 100000 {\n"
+		"  root.value = new Box(i)\n"
+		"  i += 1\n"
+		"}\n"
+		"a = root.value.value\n";
+	VM vm;
+	ASSERT_TRUE(run(&vm, code, false) == NULL);
+	ASSERT_EQ(v2n(vm.stack[0]), 99999.0);
+	vm_free(&vm);
+}
+
+TEST(GC, CompiledWriteBarrier) {
+	// Both boxes are old by the time the second loop is compiled, so the
+	// trace has to leave for the interpreter to run the barrier
+	VM vm;
+	Err *err = run(&vm,
+		"struct Box { value }\n"
+		"let a = new Box(nil)\n"
+		"let b = new Box(nil)\n"
+		"let i = 0\n"
+		"while i < 20000 {\n"
+		"  let garbage = new Box(i)\n"
+		"  i += 1\n"
+		"}\n"
+		"i = 0\n"
+		"while i < 1000 {\n"
+		"  a.value = b\n"
+		"  b.value = a\n"
+		"  i += 1\n"
+		"}\n"
+		"b = nil\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	Object *a = (Object *) v2ptr(vm.stack[0]);
+	ASSERT_TRUE(a->gc & GC_OLD);
+	gc_full(&vm, stack_top(&vm));
+	Object *b = (Object *) v2ptr(a->fields[0]);
+	ASSERT_EQ(v2ptr(b->fields[0]), a);
+	vm_free(&vm);
+}
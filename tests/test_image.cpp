@@ -0,0 +1,197 @@
+// test_image.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <unistd.h>
+
+extern "C" {
+	#include <vm.h>
+	#include <image.h>
+	#include <parser.h>
+	#include <util.h>
+	#include <object.h>
+	#include <str.h>
+}
+
+// Path to the image written by the tests.
+#define IMAGE_PATH ((char *) "test_image" IMAGE_EXT)
+
+TEST(Image, RoundTrip) {
+	// Parse some code with a nested function and a loop
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = parse(&vm, pkg, NULL, (char *)
+		"let a = 0\n"
+		"let add = fn(x, y) {\n"
+		"  return x + y\n"
+		"}\n"
+		"struct Point { x, y }\n"
+		"let p = new Point(1, 2)\n"
+		"while a < 100 {\n"
+		"  a = add(a, p.x)\n"
+		"}\n"
+		"let s = \"hello\" .. a\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_TRUE(image_write(&vm, pkg, IMAGE_PATH) == NULL);
+
+	// Load it into another VM
+	VM loaded = vm_new();
+	int entry;
+	ASSERT_TRUE(image_load(&loaded, IMAGE_PATH, &entry) == NULL);
+	ASSERT_EQ(entry, pkg);
+	ASSERT_EQ(loaded.prog->pkgs_count, vm.prog->pkgs_count);
+	ASSERT_EQ(loaded.prog->pkgs[entry].name, hash_string("test", 4));
+	ASSERT_EQ(loaded.prog->pkgs[entry].main_fn, vm.prog->pkgs[pkg].main_fn);
+
+	ASSERT_EQ(loaded.prog->consts_count, vm.prog->consts_count);
+	for (int i = 0; i < vm.prog->consts_count; i++) {
+		// String constants are recreated with the same contents
+		Value expected = vm.prog->consts[i];
+		Value loaded_const = loaded.prog->consts[i];
+		if (val_is_str(expected)) {
+			ASSERT_TRUE(val_is_str(loaded_const));
+			ASSERT_STREQ(((String *) v2ptr(loaded_const))->chars,
+				((String *) v2ptr(expected))->chars);
+		} else {
+			ASSERT_EQ(loaded_const, expected);
+		}
+	}
+
+	// The loaded structs have the same fields
+	ASSERT_EQ(loaded.prog->shapes_count, vm.prog->shapes_count);
+	for (int i = 0; i < vm.prog->shapes_count; i++) {
+		Shape *expected = &vm.prog->shapes[i];
+		Shape *shape = &loaded.prog->shapes[i];
+		ASSERT_EQ(shape->name, expected->name);
+		ASSERT_EQ(shape->fields_count, expected->fields_count);
+		ASSERT_EQ(memcmp(shape->fields, expected->fields,
+			sizeof(uint64_t) * shape->fields_count), 0);
+	}
+
+	// The loaded functions are the same, and have their hot loop counters
+	// recreated
+	ASSERT_EQ(loaded.prog->fns_count, vm.prog->fns_count);
+	for (int i = 0; i < vm.prog->fns_count; i++) {
+		Function *expected = &vm.prog->fns[i];
+		Function *fn = &loaded.prog->fns[i];
+		ASSERT_EQ(fn->pkg, expected->pkg);
+		ASSERT_EQ(fn->args_count, expected->args_count);
+		ASSERT_EQ(fn->frame_size, expected->frame_size);
+		ASSERT_EQ(fn->ins_count, expected->ins_count);
+		ASSERT_EQ(memcmp(fn->ins, expected->ins,
+			sizeof(BcIns) * fn->ins_count), 0);
+		ASSERT_EQ(fn->caches_count, expected->caches_count);
+		for (int j = 0; j < fn->caches_count; j++) {
+			ASSERT_EQ(fn->caches[j].field, expected->caches[j].field);
+		}
+		ASSERT_EQ(fn->loops_count, expected->loops_count);
+		for (int j = 0; j < fn->loops_count; j++) {
+			ASSERT_EQ(fn->loops[j].ins, expected->loops[j].ins);
+		}
+	}
+
+	// Appending to a function copies its bytecode out of the image
+	Function *main_fn = &loaded.prog->fns[loaded.prog->pkgs[entry].main_fn];
+	fn_emit(main_fn, bc_new3(BC_RET, 0, 0, 0));
+	ASSERT_GT(main_fn->ins_capacity, 0);
+	ASSERT_EQ(main_fn->ins_count,
+		vm.prog->fns[vm.prog->pkgs[pkg].main_fn].ins_count + 1);
+
+	vm_free(&loaded);
+	vm_free(&vm);
+	remove(IMAGE_PATH);
+}
+
+TEST(Image, RejectsInvalidImages) {
+	// Not an image at all
+	FILE *f = fopen(IMAGE_PATH, "wb");
+	fprintf(f, "let a = 3 this is definitely not bytecode");
+	fclose(f);
+
+	VM vm = vm_new();
+	int entry;
+	Err *err = image_load(&vm, IMAGE_PATH, &entry);
+	ASSERT_TRUE(err != NULL);
+	err_free(err);
+
+	// A truncated image
+	VM original = vm_new();
+	int pkg = vm_new_pkg(&original, hash_string("test", 4));
+	ASSERT_TRUE(parse(&original, pkg, NULL, (char *) "let a = 3") == NULL);
+	ASSERT_TRUE(image_write(&original, pkg, IMAGE_PATH) == NULL);
+	vm_free(&original);
+
+	f = fopen(IMAGE_PATH, "r+b");
+	fseek(f, 0, SEEK_END);
+	long length = ftell(f);
+	fclose(f);
+	ASSERT_EQ(truncate(IMAGE_PATH, length - 4), 0);
+
+	err = image_load(&vm, IMAGE_PATH, &entry);
+	ASSERT_TRUE(err != NULL);
+	err_free(err);
+	ASSERT_EQ(vm.prog->fns_count, 0);
+
+	vm_free(&vm);
+	remove(IMAGE_PATH);
+}
+
+TEST(Image, RejectsInvalidBytecode) {
+	VM original = vm_new();
+	int pkg = vm_new_pkg(&original, hash_string("test", 4));
+	ASSERT_TRUE(parse(&original, pkg, NULL, (char *) "let a = 3") == NULL);
+	ASSERT_TRUE(image_write(&original, pkg, IMAGE_PATH) == NULL);
+	vm_free(&original);
+
+	// Point the constant in the first instruction past the end of the
+	// constants list
+	FILE *f = fopen(IMAGE_PATH, "r+b");
+	fseek(f, -8, SEEK_END);
+	BcIns set = bc_new2(BC_SET_N, 0, 1);
+	fwrite(&set, sizeof(BcIns), 1, f);
+	fclose(f);
+
+	VM vm = vm_new();
+	int entry;
+	Err *err = image_load(&vm, IMAGE_PATH, &entry);
+	ASSERT_TRUE(err != NULL);
+	ASSERT_EQ(vm.prog->fns_count, 0);
+	err_free(err);
+
+	vm_free(&vm);
+	remove(IMAGE_PATH);
+}
+
+TEST(Image, RejectsCorruptBytecodeOffsets) {
+	VM original = vm_new();
+	int pkg = vm_new_pkg(&original, hash_string("test", 4));
+	ASSERT_TRUE(parse(&original, pkg, NULL, (char *) "let a = 3") == NULL);
+	ASSERT_TRUE(image_write(&original, pkg, IMAGE_PATH) == NULL);
+	vm_free(&original);
+
+	// Point the first function's bytecode far past the end of the image. The
+	// header is 40 bytes, with the number of constants and packages at
+	// offsets 8 and 12; each constant is 8 bytes and each package 16, and the
+	// bytecode offset lies 16 bytes into a function
+	FILE *f = fopen(IMAGE_PATH, "r+b");
+	uint32_t counts[2];
+	fseek(f, 8, SEEK_SET);
+	ASSERT_EQ(fread(counts, sizeof(uint32_t), 2, f), 2u);
+	fseek(f, 40 + 8 * counts[0] + 16 * counts[1] + 16, SEEK_SET);
+	uint64_t offset = (uint64_t) 1 << 40;
+	fwrite(&offset, sizeof(uint64_t), 1, f);
+	fclose(f);
+
+	VM vm = vm_new();
+	int entry;
+	Err *err = image_load(&vm, IMAGE_PATH, &entry);
+	ASSERT_TRUE(err != NULL);
+	ASSERT_EQ(vm.prog->fns_count, 0);
+	err_free(err);
+
+	vm_free(&vm);
+	remove(IMAGE_PATH);
+}
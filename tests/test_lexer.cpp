@@ -4,10 +4,19 @@
 // July 2018
 
 #include <gtest/gtest.h>
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
 
 extern "C" {
 	#include <vm.h>
 	#include <lexer.h>
+	#include <util.h>
+	#include <str.h>
 }
 
 // Stores all the information needed to test the lexer.
@@ -54,6 +63,35 @@ TEST(Lexer, MultiCharSymbols) {
 	mock_free(&mock);
 }
 
+// Returns the string constant lexed by the current token.
+static String * tk_str(MockLexer *mock) {
+	return (String *) v2ptr(mock->vm.prog->consts[mock->lxr.tk.str]);
+}
+
+TEST(Lexer, Strings) {
+	MockLexer mock = mock_new(
+		"\"hello\" \"\" \"a\\n\\t\\\\\\\"\" \"hello\"\n\"b\nc\" +");
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STR);
+	ASSERT_STREQ(tk_str(&mock)->chars, "hello");
+	int hello = mock.lxr.tk.str;
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STR);
+	ASSERT_EQ(tk_str(&mock)->length, 0u);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STR);
+	ASSERT_STREQ(tk_str(&mock)->chars, "a\n\t\\\"");
+
+	// The same string is only added to the constants once
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STR);
+	ASSERT_EQ(mock.lxr.tk.str, hello);
+
+	// Strings can span lines
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STR);
+	ASSERT_EQ(mock.lxr.tk.line, 2);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, '+');
+	ASSERT_EQ(mock.lxr.tk.line, 3);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
+	mock_free(&mock);
+}
+
 TEST(Lexer, Empty) {
 	MockLexer mock = mock_new("");
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
@@ -113,13 +151,15 @@ TEST(Lexer, Identifiers) {
 }
 
 TEST(Lexer, Keywords) {
-	MockLexer mock = mock_new("if elseif else while for loop");
+	MockLexer mock = mock_new("if elseif else while for loop struct new");
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_IF);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_ELSEIF);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_ELSE);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_WHILE);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_FOR);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_LOOP);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_STRUCT);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_NEW);
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
 	mock_free(&mock);
 }
@@ -178,3 +218,109 @@ TEST(Lexer, Floats) {
 	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
 	mock_free(&mock);
 }
+
+TEST(Lexer, MappedFile) {
+	// A file that exactly fills a page has no room for a NUL terminator in its
+	// last page, so the padding has to come from somewhere else
+	size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	FILE *f = fopen("test_lexer.hy", "wb");
+	fputs("a ", f);
+	for (size_t i = 2; i < page; i++) {
+		fputc(' ', f);
+	}
+	fclose(f);
+
+	size_t length;
+	char *code = read_file((char *) "test_lexer.hy", &length);
+	ASSERT_TRUE(code != NULL);
+	ASSERT_EQ(length, page);
+	for (size_t i = 0; i < FILE_PADDING; i++) {
+		ASSERT_EQ(code[length + i], '\0');
+	}
+
+	MockLexer mock = mock_new(code);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_IDENT);
+	lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
+	mock_free(&mock);
+	free_file(code, length);
+	remove("test_lexer.hy");
+
+	// Missing files report why they couldn't be read
+	errno = 0;
+	ASSERT_TRUE(read_file((char *) "test_lexer_missing.hy", &length) == NULL);
+	ASSERT_EQ(errno, ENOENT);
+}
+
+TEST(Lexer, LongTokens) {
+	// Tokens and whitespace that span several blocks of the vectorised scanner,
+	// starting at every possible alignment within a block
+	std::string ident(100, 'a');
+	ident += "_Z9";
+	for (int shift = 0; shift < 64; shift++) {
+		std::string code(shift, ' ');
+		code += ident + "\r\n\r\r\n" + std::string(70, '\t') + "\n" +
+			"12345678901234 1234567890123456789 " + ident + "x";
+		MockLexer mock = mock_new(code.c_str());
+
+		lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_IDENT);
+		ASSERT_EQ(mock.lxr.tk.start, shift);
+		ASSERT_EQ(mock.lxr.tk.length, (int) ident.length());
+		ASSERT_EQ(mock.lxr.tk.ident_hash,
+			hash_string((char *) ident.c_str(), ident.length()));
+		uint64_t hash = mock.lxr.tk.ident_hash;
+
+		lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_NUM);
+		ASSERT_EQ(mock.lxr.tk.line, 5);
+		ASSERT_EQ(mock.lxr.tk.num, 12345678901234.0);
+		lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_NUM);
+		ASSERT_EQ(mock.lxr.tk.num, 1234567890123456789.0);
+		lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_IDENT);
+		ASSERT_EQ(mock.lxr.tk.length, (int) ident.length() + 1);
+		ASSERT_NE(mock.lxr.tk.ident_hash, hash);
+		lex_next(&mock.lxr); ASSERT_EQ(mock.lxr.tk.type, TK_EOF);
+		mock_free(&mock);
+	}
+}
+
+TEST(Lexer, IdentifierHashes) {
+	// Every string of up to 3 identifier characters, plus longer strings that
+	// differ in a single character, should have a different hash
+	const char *chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0";
+	size_t count = strlen(chars);
+	std::vector<uint64_t> hashes;
+	for (size_t i = 0; i < count; i++) {
+		for (size_t j = 0; j <= count; j++) {
+			for (size_t k = 0; k <= count; k++) {
+				char str[3] = { chars[i], chars[j % count], chars[k % count] };
+				size_t length = j == count ? 1 : (k == count ? 2 : 3);
+				if (j == count && k != count) {
+					continue;
+				}
+				hashes.push_back(hash_string(str, length));
+			}
+		}
+	}
+	std::string base(40, '#');
+	for (size_t i = 0; i < base.length(); i++) {
+		std::string changed = base;
+		changed[i] = 'y';
+		hashes.push_back(hash_string((char *) changed.c_str(), changed.length()));
+		hashes.push_back(hash_string((char *) base.c_str(), i + 1));
+	}
+	size_t total = hashes.size();
+	std::sort(hashes.begin(), hashes.end());
+	ASSERT_EQ(std::unique(hashes.begin(), hashes.end()) - hashes.begin(),
+		(long) total);
+
+	// The intern table only reports different identifiers with the same hash
+	VM vm = vm_new();
+	ASSERT_TRUE(vm_intern_ident(&vm, 1, (char *) "hello", 5) == NULL);
+	ASSERT_TRUE(vm_intern_ident(&vm, 1, (char *) "hello", 5) == NULL);
+	ASSERT_STREQ(vm_intern_ident(&vm, 1, (char *) "hell", 4), "hello");
+	ASSERT_STREQ(vm_intern_ident(&vm, 1, (char *) "world", 5), "hello");
+	for (uint64_t i = 2; i < 1000; i++) {
+		ASSERT_TRUE(vm_intern_ident(&vm, i << 32, (char *) "a", 1) == NULL);
+	}
+	ASSERT_EQ(vm.prog->idents_count, 999);
+	vm_free(&vm);
+}
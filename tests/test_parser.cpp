@@ -4,6 +4,7 @@
 // July 2018
 
 #include <gtest/gtest.h>
+#include <string>
 
 extern "C" {
 	#include <vm.h>
@@ -11,6 +12,7 @@ extern "C" {
 	#include <bytecode.h>
 	#include <value.h>
 	#include <util.h>
+	#include <str.h>
 }
 
 // Parses a piece of source code and iterates over the emitted bytecode,
@@ -20,8 +22,9 @@ public:
 	VM vm;
 	size_t cur_fn, cur_ins;
 
-	// Create a new mock parser object.
-	MockParser(const char *code) {
+	// Create a new mock parser object. If `lazy` is true, then function bodies
+	// are left unparsed (see `parse_lazy`).
+	MockParser(const char *code, bool lazy = false) {
 		vm = vm_new();
 		cur_fn = 0;
 		cur_ins = 0;
@@ -30,7 +33,12 @@ public:
 		int pkg = vm_new_pkg(&vm, hash_string("test", 4));
 
 		// Parse the source code
-		Err *err = parse(&vm, pkg, NULL, (char *) code);
+		Err *err;
+		if (lazy) {
+			err = parse_lazy(&vm, pkg, NULL, (char *) code);
+		} else {
+			err = parse(&vm, pkg, NULL, (char *) code);
+		}
 		if (err != NULL) {
 			ADD_FAILURE() << err->desc << " at line " << err->line;
 		}
@@ -43,13 +51,13 @@ public:
 
 	// Dump all parsed functions to the standard output.
 	void dump() {
-		fn_dump(&vm.fns[cur_fn]);
+		fn_dump(&vm.prog->fns[cur_fn]);
 	}
 
 	// Increment the current instruction counter and return the next instruction
 	// to assert.
 	BcIns next() {
-		return vm.fns[cur_fn].ins[cur_ins++];
+		return vm.prog->fns[cur_fn].ins[cur_ins++];
 	}
 };
 
@@ -60,7 +68,7 @@ public:
 
 // Asserts the current bytecode instruction's opcode and arguments.
 #define INS(opcode, a, b, c) {                                          \
-		ASSERT_TRUE(mock.cur_ins < mock.vm.fns[mock.cur_fn].ins_count); \
+		ASSERT_TRUE(mock.cur_ins < mock.vm.prog->fns[mock.cur_fn].ins_count); \
 		BcIns ins = mock.next();                                        \
 		ASSERT_EQ(bc_op(ins), opcode);                                  \
 		ASSERT_EQ(bc_arg1(ins), a);                                     \
@@ -70,7 +78,7 @@ public:
 
 // Asserts the current instruction as an extended, 2 argument instruction.
 #define INS2(opcode, a, d) {                                            \
-		ASSERT_TRUE(mock.cur_ins < mock.vm.fns[mock.cur_fn].ins_count); \
+		ASSERT_TRUE(mock.cur_ins < mock.vm.prog->fns[mock.cur_fn].ins_count); \
 		BcIns ins = mock.next();                                        \
 		ASSERT_EQ(bc_op(ins), opcode);                                  \
 		ASSERT_EQ(bc_arg1(ins), a);                                     \
@@ -79,7 +87,7 @@ public:
 
 // Asserts the current instruction is a JMP, with the given offset.
 #define JMP(offset) {                                                   \
-		ASSERT_TRUE(mock.cur_ins < mock.vm.fns[mock.cur_fn].ins_count); \
+		ASSERT_TRUE(mock.cur_ins < mock.vm.prog->fns[mock.cur_fn].ins_count); \
 		BcIns ins = mock.next();                                        \
 		ASSERT_EQ(bc_op(ins), BC_JMP);                                  \
 		ASSERT_EQ(bc_arg24(ins), JMP_BIAS + offset - 1);                \
@@ -87,7 +95,7 @@ public:
 
 // Asserts the current instruction is a LOOP, with the given offset.
 #define LOOP(offset) {                                                   \
-		ASSERT_TRUE(mock.cur_ins < mock.vm.fns[mock.cur_fn].ins_count); \
+		ASSERT_TRUE(mock.cur_ins < mock.vm.prog->fns[mock.cur_fn].ins_count); \
 		BcIns ins = mock.next();                                        \
 		ASSERT_EQ(bc_op(ins), BC_LOOP);                                 \
 		ASSERT_EQ(bc_arg24(ins), JMP_BIAS + offset - 1);                \
@@ -850,6 +858,24 @@ TEST(Loop, While) {
 	INS(BC_RET, 0, 0, 0); // After
 }
 
+TEST(Loop, Superinstructions) {
+	MockParser mock(
+		"let a = 0\n"
+		"while a < 100 {\n"
+		"  a += 1\n"
+		"}\n"
+	);
+	fn_fuse(&mock.vm.prog->fns[0]);
+
+	// Only the opcode of the first instruction in each pair changes
+	INS2(BC_SET_N, 0, 0);
+	INS2(BC_GE_LN_JMP, 0, 1);
+	JMP(3);
+	INS(BC_ADD_LN_LOOP, 0, 0, 2);
+	LOOP(-3);
+	INS(BC_RET, 0, 0, 0);
+}
+
 TEST(Fn, FnDef) {
 	MockParser mock(
 		"let a = 3\n"
@@ -1042,3 +1068,283 @@ TEST(Fn, CallMultipleArgs) {
 	INS2(BC_MOV, 3, 0);
 	INS(BC_RET, 0, 0, 0);
 }
+
+TEST(Fn, Return) {
+	MockParser mock(
+		"let a = fn(a, b) {\n"
+		"  return a + b\n"
+		"}\n"
+		"let b = a(3)"
+	);
+
+	INS2(BC_SET_F, 0, 1);
+	INS2(BC_SET_N, 1, 0);
+	INS(BC_CALL, 0, 1, 1);
+	INS(BC_RET, 0, 0, 0);
+
+	FN(1);
+	INS(BC_ADD_LL, 2, 0, 1);
+	INS(BC_RET, 2, 1, 0);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Fn, ShadowedLocals) {
+	MockParser mock(
+		"let a = 3\n"
+		"let f = fn(b) {\n"
+		"  let a = b\n"
+		"  if b {\n"
+		"    let c = a\n"
+		"  }\n"
+		"  let c = b\n"
+		"}\n"
+		"let c = a\n"
+	);
+
+	INS2(BC_SET_N, 0, 0);
+	INS2(BC_SET_F, 1, 1);
+	INS(BC_MOV, 2, 0, 0);
+	INS(BC_RET, 0, 0, 0);
+
+	// Inside the function, `a` refers to the new local rather than the one in
+	// the outer function, and `c` can be redefined once its block has ended
+	FN(1);
+	INS(BC_MOV, 1, 0, 0);
+	mock.next(); // Condition
+	mock.next();
+	INS(BC_MOV, 2, 1, 0);
+	INS(BC_MOV, 2, 0, 0);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Fn, LazyBodies) {
+	MockParser mock(
+		"fn add(a, b) {\n"
+		"  fn twice(c) { return c + c }\n"
+		"  return a + b\n"
+		"}\n"
+		"let c = add(1, 2)\n",
+		true
+	);
+
+	// Only the arguments are parsed until the function is first called
+	ASSERT_EQ(mock.vm.prog->fns_count, 2);
+	ASSERT_TRUE(mock.vm.prog->fns[1].ins == NULL);
+	ASSERT_EQ(mock.vm.prog->fns[1].args_count, 2);
+	INS2(BC_SET_F, 0, 1);
+
+	// Functions defined inside are parsed lazily too
+	ASSERT_TRUE(parse_fn_body(&mock.vm, 1) == NULL);
+	ASSERT_EQ(mock.vm.prog->fns_count, 3);
+	ASSERT_TRUE(mock.vm.prog->fns[2].ins == NULL);
+	ASSERT_EQ(mock.vm.prog->fns[2].args_count, 1);
+	FN(1);
+	INS2(BC_SET_F, 2, 2);
+	INS(BC_ADD_LL, 3, 0, 1);
+	INS(BC_RET, 3, 1, 0);
+	INS(BC_RET, 0, 0, 0);
+
+	ASSERT_TRUE(parse_fn_body(&mock.vm, 2) == NULL);
+	FN(2);
+	INS(BC_ADD_LL, 1, 0, 0);
+	INS(BC_RET, 1, 1, 0);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Fn, LazyBodyError) {
+	// Errors in a function's body aren't found until it's parsed
+	MockParser mock(
+		"let a = 3\n"
+		"fn f() {\n"
+		"  let b =\n"
+		"}\n",
+		true
+	);
+	Err *err = parse_fn_body(&mock.vm, 1);
+	ASSERT_TRUE(err != NULL);
+	ASSERT_EQ(err->line, 4);
+	err_free(err);
+}
+
+TEST(Fn, ManyLocals) {
+	// Every local resolves to its own slot, even with lots of them in scope
+	std::string code;
+	for (int i = 0; i < MAX_LOCALS_IN_FN - 1; i++) {
+		code += "let a" + std::to_string(i) + " = 1\n";
+	}
+	code += "let last = a123\n";
+	MockParser mock(code.c_str());
+	mock.cur_ins = MAX_LOCALS_IN_FN - 1;
+	INS(BC_MOV, MAX_LOCALS_IN_FN - 1, 123, 0);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Constants, Deduplication) {
+	// Every number is only added to the constants list once
+	std::string code = "let a = 0.5\n";
+	for (int i = 0; i < 5000; i++) {
+		code += "a = " + std::to_string(i % 2500) + ".5\n";
+	}
+	MockParser mock(code.c_str());
+	ASSERT_EQ(mock.vm.prog->consts_count, 2500);
+	for (int i = 0; i < 2500; i++) {
+		ASSERT_EQ(vm_add_num(&mock.vm, i + 0.5), i);
+	}
+}
+
+TEST(Constants, TooManyConstants) {
+	std::string code = "let a = 0\n";
+	for (int i = 0; i <= MAX_CONSTS; i++) {
+		code += "a = " + std::to_string(i) + ".5\n";
+	}
+
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = parse(&vm, pkg, NULL, (char *) code.c_str());
+	ASSERT_TRUE(err != NULL);
+	ASSERT_STREQ(err->desc, "too many constants");
+	ASSERT_EQ(vm.prog->consts_count, MAX_CONSTS);
+	err_free(err);
+	vm_free(&vm);
+}
+
+TEST(Strings, Concatenation) {
+	MockParser mock(
+		"let a = \"a\"\n"
+		"let b = a .. \"b\" .. 1\n"
+		"let c = \"x\" .. 2 .. \"y\"\n"
+		"if a == \"a\" {}\n"
+	);
+
+	// Constants are folded, and everything else is concatenated from slots
+	INS2(BC_SET_S, 0, 0);
+	INS2(BC_SET_S, 1, 1);
+	INS(BC_CONCAT, 1, 0, 1);
+	INS2(BC_SET_N, 2, 2);
+	INS(BC_CONCAT, 1, 1, 2);
+	INS2(BC_SET_S, 2, 6);
+	String *folded = (String *) v2ptr(mock.vm.prog->consts[6]);
+	ASSERT_STREQ(folded->chars, "x2y");
+
+	// Strings are compared in slots, never as constants
+	INS2(BC_SET_S, 3, 0);
+	INS2(BC_NEQ_LL, 0, 3);
+	JMP(1);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Strings, Errors) {
+	const char *cases[][2] = {
+		{"let a = \"a\" + 1", "invalid operand to binary operator"},
+		{"let a = 1 * \"a\"", "invalid operand to binary operator"},
+		{"let a = \"a\" < \"b\"", "invalid operand to binary operator"},
+		{"let a = -\"a\"", "invalid operand to unary operator"},
+		{"let a = \"a\" .. nil", "invalid operand to binary operator"},
+		{"let a = \"a", "unterminated string"},
+		{"let a = \"\\q\"", "invalid escape sequence in string"},
+	};
+	for (auto &c : cases) {
+		VM vm = vm_new();
+		int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+		Err *err = parse(&vm, pkg, NULL, (char *) c[0]);
+		ASSERT_TRUE(err != NULL) << c[0];
+		ASSERT_STREQ(err->desc, c[1]);
+		err_free(err);
+		vm_free(&vm);
+	}
+}
+
+TEST(Structs, NewAndFields) {
+	MockParser mock(
+		"struct Point { x, y }\n"
+		"let p = new Point(3, 4)\n"
+		"let a = p.y\n"
+		"p.x = a\n"
+		"p.y += 1\n"
+		"let q = new Point()\n"
+	);
+
+	// Fields are initialised from the slots after the new object, and missing
+	// arguments are nil. Each field access gets its own inline cache, except
+	// the load and store in an augmented assignment
+	INS2(BC_SET_N, 1, 0);
+	INS2(BC_SET_N, 2, 1);
+	INS2(BC_NEW, 0, 0);
+	INS(BC_GET_FIELD, 1, 0, 0);
+	INS(BC_SET_FIELD, 0, 1, 1);
+	INS(BC_GET_FIELD, 2, 0, 2);
+	INS(BC_ADD_LN, 2, 2, 2);
+	INS(BC_SET_FIELD, 0, 2, 2);
+	INS2(BC_SET_P, 3, PRIM_NIL);
+	INS2(BC_SET_P, 4, PRIM_NIL);
+	INS2(BC_NEW, 2, 0);
+	INS(BC_RET, 0, 0, 0);
+	ASSERT_EQ(mock.vm.prog->fns[0].caches_count, 3);
+}
+
+TEST(Structs, Errors) {
+	const char *cases[][2] = {
+		{"struct A { x, x }", "duplicate field in struct"},
+		{"struct A { x }\nstruct A { y }", "struct already defined"},
+		{"let a = new B()", "struct not defined"},
+		{"struct A { x }\nlet a = new A(1, 2)", "too many arguments to struct"},
+	};
+	for (auto &c : cases) {
+		VM vm = vm_new();
+		int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+		Err *err = parse(&vm, pkg, NULL, (char *) c[0]);
+		ASSERT_TRUE(err != NULL) << c[0];
+		ASSERT_STREQ(err->desc, c[1]);
+		err_free(err);
+		vm_free(&vm);
+	}
+}
+
+TEST(Arrays, IndexAndNatives) {
+	MockParser mock(
+		"let a = array(4)\n"
+		"let i = 1\n"
+		"let b = a[i]\n"
+		"a[i + 1] = b\n"
+		"a[0] += 2\n"
+		"let n = len(a) + sum(a)\n"
+	);
+
+	// A native function's result is left in its first argument's slot, like
+	// any other call
+	INS2(BC_SET_N, 0, 0);
+	INS(BC_CALL_NATIVE, 0, 0, 1);
+	INS2(BC_SET_N, 1, 1);
+	INS(BC_GET_INDEX, 2, 0, 1);
+	INS(BC_ADD_LN, 3, 1, 1);
+	INS(BC_SET_INDEX, 0, 3, 2);
+
+	// An augmented assignment loads and stores the same element
+	INS2(BC_SET_N, 3, 2);
+	INS(BC_GET_INDEX, 4, 0, 3);
+	INS(BC_ADD_LN, 4, 4, 3);
+	INS(BC_SET_INDEX, 0, 3, 4);
+	INS2(BC_MOV, 3, 0);
+	INS(BC_CALL_NATIVE, 1, 3, 1);
+	INS2(BC_MOV, 4, 0);
+	INS(BC_CALL_NATIVE, 5, 4, 1);
+	INS(BC_ADD_LL, 3, 3, 4);
+	INS(BC_RET, 0, 0, 0);
+}
+
+TEST(Arrays, Errors) {
+	const char *cases[][2] = {
+		{"let a = len", "native function must be called"},
+		{"let a = len(1, 2)", "wrong number of arguments to native function"},
+		{"let a = dot(1)", "wrong number of arguments to native function"},
+	};
+	for (auto &c : cases) {
+		VM vm = vm_new();
+		int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+		Err *err = parse(&vm, pkg, NULL, (char *) c[0]);
+		ASSERT_TRUE(err != NULL) << c[0];
+		ASSERT_STREQ(err->desc, c[1]);
+		err_free(err);
+		vm_free(&vm);
+	}
+}
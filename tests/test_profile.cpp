@@ -0,0 +1,58 @@
+// test_profile.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+#include <cstdio>
+#include <cstring>
+
+extern "C" {
+	#include <profile.h>
+	#include <parser.h>
+	#include <util.h>
+}
+
+TEST(Profile, Counters) {
+	Profile *profile = profile_new();
+	profile_ins(profile, 0, 0, BC_MOV);
+	profile_ins(profile, 0, 1, BC_MOV);
+	profile_ins(profile, 40, 0, BC_RET);
+	ASSERT_EQ(profile->ops[BC_MOV], 2u);
+	ASSERT_EQ(profile->ops[BC_RET], 1u);
+	ASSERT_EQ(profile->fns[0], 2u);
+	ASSERT_EQ(profile->fns[40], 1u);
+	ASSERT_GT(profile->fns_capacity, 40);
+	ASSERT_EQ(profile->fn, 40);
+	profile_free(profile);
+}
+
+TEST(Profile, FoldedSamples) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = parse(&vm, pkg, NULL, (char *) "let a = 1\nlet b = a + 2\n");
+	ASSERT_TRUE(err == NULL);
+
+	// Identical samples are folded into a single stack with a count
+	Profile *profile = profile_new();
+	Sample samples[] = {
+		{ 0, 1, false }, { 0, 0, false }, { 0, 1, false }, { 0, 1, true },
+	};
+	profile->samples = (Sample *) malloc(sizeof(samples));
+	memcpy(profile->samples, samples, sizeof(samples));
+	profile->samples_count = 4;
+
+	char out[256];
+	FILE *f = tmpfile();
+	ASSERT_EQ(profile_write_samples(profile, &vm, f), 3);
+	rewind(f);
+	size_t length = fread(out, 1, sizeof(out) - 1, f);
+	out[length] = '\0';
+	fclose(f);
+	ASSERT_STREQ(out,
+		"fn_0;0000_SETN 1\n"
+		"fn_0;0001_ADDLN 2\n"
+		"fn_0;0001_ADDLN;trace 1\n");
+
+	profile_free(profile);
+	vm_free(&vm);
+}
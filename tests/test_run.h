@@ -0,0 +1,29 @@
+// test_run.h
+// By Ben Anderson
+// December 2018
+
+#ifndef TEST_RUN_H
+#define TEST_RUN_H
+
+// Helpers shared by the tests that run whole programs on a VM.
+
+extern "C" {
+	#include <vm.h>
+	#include <util.h>
+}
+
+// Runs some code on a new VM, returning the error it triggers (if any).
+static inline Err * run(VM *vm, const char *code, bool jit = true) {
+	*vm = vm_new();
+	vm->jit = jit;
+	int pkg = vm_new_pkg(vm, hash_string("test", 4));
+	return vm_run_string(vm, pkg, (char *) code);
+}
+
+// Returns the end of the package's main function's stack frame, for running a
+// collection after the code's finished.
+static inline Value * stack_top(VM *vm) {
+	return vm->stack + vm->prog->fns[vm->prog->pkgs[0].main_fn].frame_size;
+}
+
+#endif
@@ -0,0 +1,113 @@
+// test_str.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+#include <string>
+
+#include "test_run.h"
+
+extern "C" {
+	#include <gc.h>
+	#include <str.h>
+}
+
+TEST(Strings, ShortResultsAreInterned) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = \"hello\" .. \" \"\n"
+		"let b = a .. \"world\"\n"
+		"let c = \"hello world\"\n"
+		"let d = \"n = \" .. 1.5\n"
+	);
+	ASSERT_TRUE(err == NULL);
+
+	// A concatenation with the same contents as a constant is the constant
+	ASSERT_EQ(vm.stack[1], vm.stack[2]);
+	String *str = (String *) v2ptr(vm.stack[3]);
+	ASSERT_EQ(str->shape, SHAPE_STR);
+	ASSERT_STREQ(str->chars, "n = 1.5");
+	vm_free(&vm);
+}
+
+TEST(Strings, RopesAreFlattened) {
+	for (int jit = 0; jit < 2; jit++) {
+		VM vm;
+		Err *err = run(&vm,
+			"let log = \"\"\n"
+			"let i = 0\n"
+			"while i < 10000 {\n"
+			"  log = log .. i .. \",\"\n"
+			"  i += 1\n"
+			"}\n"
+			"let same = log == log .. \"\"\n", jit);
+		ASSERT_TRUE(err == NULL);
+		ASSERT_EQ(((Object *) v2ptr(vm.stack[0]))->shape, SHAPE_ROPE);
+
+		// Build the expected contents ourselves
+		std::string expected;
+		for (int i = 0; i < 10000; i++) {
+			expected += std::to_string(i) + ",";
+		}
+		ASSERT_EQ(str_length(vm.stack[0]), expected.length());
+		String *flat = str_flatten(&vm, vm.stack[0]);
+		ASSERT_EQ(std::string(flat->chars, flat->length), expected);
+		ASSERT_EQ(str_flatten(&vm, vm.stack[0]), flat);
+		ASSERT_EQ(vm.stack[2], (TAG_PRIM | PRIM_TRUE));
+		vm_free(&vm);
+	}
+}
+
+TEST(Strings, Equality) {
+	VM vm;
+	Err *err = run(&vm,
+		"let long = \"this string is much too long to be interned\"\n"
+		"let tail = \" to be interned\"\n"
+		"let a = \"this string is much too long\" .. tail\n"
+		"let b = long == a\n"
+		"let c = a != \"this string is much too long to be interned!\"\n"
+		"let ab = \"ab\"\n"
+		"let d = ab .. \"c\" == \"abc\"\n"
+	);
+	ASSERT_TRUE(err == NULL);
+
+	// Long strings are compared by their contents
+	ASSERT_NE(vm.stack[0], vm.stack[2]);
+	ASSERT_EQ(vm.stack[3], (TAG_PRIM | PRIM_TRUE));
+	ASSERT_EQ(vm.stack[4], (TAG_PRIM | PRIM_TRUE));
+	ASSERT_EQ(vm.stack[6], (TAG_PRIM | PRIM_TRUE));
+	vm_free(&vm);
+}
+
+TEST(Strings, UnreachableStringsAreUninterned) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = nil\n"
+		"let i = 0\n"
+		"while i < 1000 {\n"
+		"  a = \"s\" .. i\n"
+		"  i += 1\n"
+		"}\n"
+	);
+	ASSERT_TRUE(err == NULL);
+	ASSERT_GE(vm.heap->strs.count, 1);
+
+	// Only the last string's still on the stack
+	gc_full(&vm, stack_top(&vm));
+	ASSERT_EQ(vm.heap->strs.count, 1);
+	String *str = (String *) v2ptr(vm.stack[0]);
+	ASSERT_STREQ(str->chars, "s999");
+	vm_free(&vm);
+}
+
+TEST(Strings, Errors) {
+	VM vm;
+	Err *err = run(&vm,
+		"let a = nil\n"
+		"let b = \"a\" .. a\n"
+	);
+	ASSERT_TRUE(err != NULL);
+	ASSERT_STREQ(err->desc, "attempt to concatenate non-string value");
+	err_free(err);
+	vm_free(&vm);
+}
@@ -0,0 +1,118 @@
+// test_verify.cpp
+// By Ben Anderson
+// December 2018
+
+#include <gtest/gtest.h>
+#include <vector>
+
+extern "C" {
+	#include <vm.h>
+	#include <verify.h>
+	#include <parser.h>
+	#include <bytecode.h>
+	#include <value.h>
+	#include <util.h>
+}
+
+TEST(Verify, ParsedCode) {
+	VM vm = vm_new();
+	int pkg = vm_new_pkg(&vm, hash_string("test", 4));
+	Err *err = parse(&vm, pkg, NULL, (char *)
+		"let a = 0\n"
+		"let b = a == 3 || a < 2\n"
+		"fn add(x, y) {\n"
+		"  if x > y { return x - y } else { return nil }\n"
+		"}\n"
+		"while a < 100 {\n"
+		"  a = add(a, 1.5) + 1\n"
+		"  if a == nil { a = -a }\n"
+		"}\n"
+		"loop { a = a / 2 }\n"
+		"struct Point { x, y }\n"
+		"let p = new Point(1, 2)\n"
+		"p.x += p.y\n"
+		"let v = array(3)\n"
+		"v[1] += dot(v, v)\n"
+	);
+	ASSERT_TRUE(err == NULL);
+
+	// Everything the parser emits is valid, both before and after fusing
+	// superinstructions
+	for (int i = 0; i < vm.prog->fns_count; i++) {
+		Program *prog = vm.prog;
+		ASSERT_EQ(fn_verify(&prog->fns[i], prog->consts_count,
+			prog->fns_count, prog->shapes, prog->shapes_count), -1);
+		fn_fuse(&prog->fns[i]);
+		ASSERT_EQ(fn_verify(&prog->fns[i], prog->consts_count,
+			prog->fns_count, prog->shapes, prog->shapes_count), -1);
+	}
+	vm_free(&vm);
+}
+
+// Returns the index of the first invalid instruction in some bytecode, for a
+// function with 4 stack slots, 2 constants, 2 functions, 1 struct with 2
+// fields, and 2 inline caches.
+static int verify(std::vector<BcIns> ins) {
+	Function fn;
+	fn.frame_size = 4;
+	fn.ins = ins.data();
+	fn.ins_count = (int) ins.size();
+	fn.caches_count = 2;
+	Shape shape;
+	shape.fields_count = 2;
+	return fn_verify(&fn, 2, 2, &shape, 1);
+}
+
+TEST(Verify, Operands) {
+	BcIns ret = bc_new3(BC_RET, 0, 0, 0);
+	ASSERT_EQ(verify({bc_new2(BC_MOV, 3, 2), ret}), -1);
+	ASSERT_EQ(verify({bc_new2(BC_MOV, 4, 2), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_MOV, 3, 4), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_SET_N, 0, 1), ret}), -1);
+	ASSERT_EQ(verify({bc_new2(BC_SET_N, 0, 2), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_SET_P, 0, PRIM_TRUE), ret}), -1);
+	ASSERT_EQ(verify({bc_new2(BC_SET_P, 0, 7), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_SET_F, 0, 2), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_ADD_LN, 0, 1, 1), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_SUB_NL, 0, 2, 1), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_CALL, 0, 1, 3), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_CALL, 0, 1, 4), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_NEW, 1, 0), ret}), -1);
+	ASSERT_EQ(verify({bc_new2(BC_NEW, 2, 0), ret}), 0);
+	ASSERT_EQ(verify({bc_new2(BC_NEW, 0, 1), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_GET_FIELD, 0, 1, 1), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_GET_FIELD, 0, 1, 2), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_SET_FIELD, 4, 1, 0), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_GET_INDEX, 0, 1, 2), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_SET_INDEX, 0, 1, 4), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_CALL_NATIVE, 0, 3, 1), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_CALL_NATIVE, 2, 2, 2), ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_CALL_NATIVE, 2, 3, 2), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_CALL_NATIVE, 0, 1, 0), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_CALL_NATIVE, 200, 1, 1), ret}), 0);
+	ASSERT_EQ(verify({bc_new3(BC_RET, 9, 0, 0)}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_RET, 9, 1, 0)}), 0);
+	ASSERT_EQ(verify({(BcIns) 0xff}), 0);
+}
+
+TEST(Verify, ControlFlow) {
+	BcIns ret = bc_new3(BC_RET, 0, 0, 0);
+	BcIns jmp_back = bc_new1(BC_JMP, JMP_BIAS - 3);
+	BcIns jmp_next = bc_new1(BC_JMP, JMP_BIAS);
+
+	// Jump targets have to be inside the function
+	ASSERT_EQ(verify({ret, ret, jmp_back}), -1);
+	ASSERT_EQ(verify({ret, jmp_back}), 1);
+	ASSERT_EQ(verify({jmp_next, ret}), -1);
+	ASSERT_EQ(verify({ret, jmp_next}), 1);
+
+	// Relational operators have to be followed by a JMP
+	ASSERT_EQ(verify({bc_new3(BC_LT_LL, 0, 1, 0), jmp_next, ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_LT_LL_JMP, 0, 1, 0), jmp_next, ret}), -1);
+	ASSERT_EQ(verify({bc_new3(BC_LT_LL, 0, 1, 0), ret}), 0);
+	ASSERT_EQ(verify({ret, bc_new3(BC_EQ_LP, 0, PRIM_NIL, 0)}), 1);
+
+	// We can't run off the end of the function
+	ASSERT_EQ(verify({bc_new2(BC_MOV, 0, 1)}), 0);
+	ASSERT_EQ(verify({ret, bc_new2(BC_MOV, 0, 1)}), 1);
+}